@@ -0,0 +1,384 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <iostream>
+#include <sstream>
+
+#include "Assembler.h"
+
+//
+//  Static analysis of an assembled image
+//
+//  Builds the control flow graph from JMP/BRH/CAL/RET, the call graph and the maximum static call depth,
+//  finds unreachable code and lists the MMIO ports (data memory 240-255) every function reads or writes.
+//  Register values are tracked with constant propagation so "LDI r15 write_char / STR r15 r1" is resolved
+//  to port 247. The blocks of every function are collected with a walk from its entry, so code that several
+//  functions share (e.g. a common tail they jump into) is walked once per function, at most functions x blocks.
+//  Everything else is linear in the size of the image.
+//
+//  A program is rejected when
+//      - a jump, branch or call targets an address outside the image
+//      - the call depth can exceed the 16 entry hardware call stack, or is unbounded because of recursion
+//
+
+static constexpr int HARDWARE_CALL_STACK_DEPTH = 16;
+static constexpr uint8_t MMIO_BASE_ADDRESS = 240;
+
+struct basic_block {
+    uint16_t start = 0;
+    uint16_t end = 0; //one past the last instruction
+    std::vector<size_t> successors; //intra-procedural, a CAL falls through to its return site
+    std::vector<uint16_t> calls;
+};
+
+struct analysis_function {
+    uint16_t entry = 0;
+    std::string name;
+    std::vector<size_t> blocks;
+    std::vector<size_t> callees; //indices into program_analysis::functions
+    std::set<uint8_t> mmio_reads;
+    std::set<uint8_t> mmio_writes;
+    bool has_unresolved_memory_access = false; //LOD/STR through a register whose value is not known
+    int max_call_depth = 0; //frames pushed below this function, -1 if unbounded
+};
+
+struct program_analysis {
+    std::vector<basic_block> blocks;
+    std::vector<analysis_function> functions; //functions[0] is the program entry
+    int max_call_depth = 0; //-1 if unbounded (recursion)
+    std::vector<uint16_t> unreachable;
+    std::vector<std::string> errors;
+    std::vector<std::string> warnings;
+
+    bool is_accepted() const { return errors.empty(); }
+};
+
+static int8_t sign_extend_offset(uint8_t offset) {
+    return (offset & 0x8) ? (int8_t)(offset | 0xF0) : (int8_t)offset;
+}
+
+static program_analysis analyze_program(const std::vector<uint16_t>& image, const std::unordered_map<uint16_t, std::string>& names = {}) {
+    program_analysis analysis;
+    size_t size = image.size();
+    if (size == 0) return analysis;
+
+    auto name_of = [&names](uint16_t address) {
+        auto name = names.find(address);
+        return (name == names.end()) ? "@" + std::to_string(address) : name->second;
+    };
+
+    //
+    //  Basic blocks
+    //
+    std::vector<bool> is_leader(size + 1, false);
+    std::vector<bool> is_function_entry(size, false);
+    is_leader[0] = true;
+    is_function_entry[0] = true;
+
+    for (uint16_t pc = 0; pc < size; pc++) {
+        decoded_instruction ins = decode_instruction(image[pc]);
+        bool is_control = (ins.opcode == 1 || (ins.opcode >= 10 && ins.opcode <= 13));
+        if (is_control) is_leader[pc + 1] = true;
+
+        if (ins.opcode == 10 || ins.opcode == 11 || ins.opcode == 12) {
+            if (ins.addr >= size) {
+                analysis.errors.push_back("Instruction " + std::to_string(pc) + " targets address " + std::to_string(ins.addr) + " outside the " + std::to_string(size) + " word image");
+                continue;
+            }
+            is_leader[ins.addr] = true;
+            if (ins.opcode == 12) is_function_entry[ins.addr] = true;
+        }
+    }
+
+    std::vector<size_t> block_of(size, 0);
+    for (uint16_t pc = 0; pc < size; pc++) {
+        if (is_leader[pc]) {
+            basic_block block;
+            block.start = pc;
+            analysis.blocks.push_back(block);
+        }
+        analysis.blocks.back().end = pc + 1;
+        block_of[pc] = analysis.blocks.size() - 1;
+    }
+
+    for (basic_block& block : analysis.blocks) {
+        uint16_t last = block.end - 1;
+        decoded_instruction ins = decode_instruction(image[last]);
+        bool falls_through = !(ins.opcode == 1 || ins.opcode == 10 || ins.opcode == 13);
+
+        if ((ins.opcode == 10 || ins.opcode == 11) && ins.addr < size) {
+            block.successors.push_back(block_of[ins.addr]);
+        }
+        if (ins.opcode == 12 && ins.addr < size) {
+            block.calls.push_back(ins.addr);
+        }
+        if (falls_through) {
+            if (block.end < size) {
+                block.successors.push_back(block_of[block.end]);
+            }
+            else {
+                analysis.warnings.push_back("Execution can run off the end of the image after instruction " + std::to_string(last));
+            }
+        }
+    }
+
+    //
+    //  Functions and call graph
+    //
+    std::unordered_map<uint16_t, size_t> function_index;
+    for (uint16_t pc = 0; pc < size; pc++) {
+        if (!is_function_entry[pc]) continue;
+        function_index[pc] = analysis.functions.size();
+        analysis_function function;
+        function.entry = pc;
+        function.name = (pc == 0 && !names.contains(0)) ? "main" : name_of(pc);
+        analysis.functions.push_back(function);
+    }
+
+    std::vector<size_t> visited_by(analysis.blocks.size(), SIZE_MAX);
+    std::vector<bool> is_reachable(analysis.blocks.size(), false);
+    for (size_t f = 0; f < analysis.functions.size(); f++) {
+        analysis_function& function = analysis.functions[f];
+        std::vector<size_t> worklist = { block_of[function.entry] };
+        visited_by[worklist[0]] = f;
+        std::set<size_t> callees;
+        while (!worklist.empty()) {
+            size_t block = worklist.back();
+            worklist.pop_back();
+            function.blocks.push_back(block);
+            for (uint16_t call : analysis.blocks[block].calls) callees.insert(function_index[call]);
+            for (size_t successor : analysis.blocks[block].successors) {
+                if (visited_by[successor] != f) {
+                    visited_by[successor] = f;
+                    worklist.push_back(successor);
+                }
+            }
+        }
+        function.callees.assign(callees.begin(), callees.end());
+    }
+
+    //reachability from the entry through calls
+    std::vector<bool> function_reachable(analysis.functions.size(), false);
+    std::vector<size_t> function_worklist = { 0 };
+    function_reachable[0] = true;
+    while (!function_worklist.empty()) {
+        size_t f = function_worklist.back();
+        function_worklist.pop_back();
+        for (size_t block : analysis.functions[f].blocks) is_reachable[block] = true;
+        for (size_t callee : analysis.functions[f].callees) {
+            if (!function_reachable[callee]) {
+                function_reachable[callee] = true;
+                function_worklist.push_back(callee);
+            }
+        }
+    }
+    for (size_t block = 0; block < analysis.blocks.size(); block++) {
+        if (is_reachable[block]) continue;
+        for (uint16_t pc = analysis.blocks[block].start; pc < analysis.blocks[block].end; pc++) analysis.unreachable.push_back(pc);
+    }
+
+    //maximum call depth, iterative DFS with cycle detection
+    enum { UNVISITED, ON_STACK, DONE };
+    std::vector<int> state(analysis.functions.size(), UNVISITED);
+    for (size_t root = 0; root < analysis.functions.size(); root++) {
+        if (state[root] != UNVISITED) continue;
+        std::vector<std::pair<size_t, size_t>> stack = { { root, 0 } };
+        state[root] = ON_STACK;
+        while (!stack.empty()) {
+            auto& [f, next_callee] = stack.back();
+            analysis_function& function = analysis.functions[f];
+            if (next_callee < function.callees.size()) {
+                size_t callee = function.callees[next_callee++];
+                if (state[callee] == UNVISITED) {
+                    state[callee] = ON_STACK;
+                    stack.push_back({ callee, 0 });
+                }
+                else if (state[callee] == ON_STACK) {
+                    function.max_call_depth = -1;
+                }
+                continue;
+            }
+
+            //all callees are done
+            for (size_t callee : function.callees) {
+                int callee_depth = analysis.functions[callee].max_call_depth;
+                if (callee_depth < 0 || function.max_call_depth < 0) {
+                    function.max_call_depth = -1;
+                }
+                else {
+                    function.max_call_depth = std::max(function.max_call_depth, callee_depth + 1);
+                }
+            }
+            state[f] = DONE;
+            stack.pop_back();
+        }
+    }
+    analysis.max_call_depth = analysis.functions[0].max_call_depth;
+
+    if (analysis.max_call_depth < 0) {
+        analysis.errors.push_back("The call depth is unbounded (recursive calls)");
+    }
+    else if (analysis.max_call_depth > HARDWARE_CALL_STACK_DEPTH) {
+        analysis.errors.push_back("The call depth can reach " + std::to_string(analysis.max_call_depth) + ", the hardware call stack holds " + std::to_string(HARDWARE_CALL_STACK_DEPTH));
+    }
+
+    //
+    //  Constant propagation of register values to resolve the MMIO ports
+    //
+    enum : uint8_t { UNDEFINED, CONSTANT, VARYING };
+    struct reg_value {
+        uint8_t kind = UNDEFINED;
+        uint8_t value = 0;
+        bool operator==(const reg_value&) const = default;
+    };
+    struct reg_state {
+        reg_value regs[16];
+    };
+
+    auto merge = [](reg_value a, reg_value b) -> reg_value {
+        if (a.kind == UNDEFINED) return b;
+        if (b.kind == UNDEFINED) return a;
+        if (a.kind == CONSTANT && b.kind == CONSTANT && a.value == b.value) return a;
+        return { VARYING, 0 };
+    };
+
+    auto constant = [](uint8_t value) { return reg_value{ CONSTANT, value }; };
+    const reg_value varying = { VARYING, 0 };
+
+    std::vector<reg_state> block_in(analysis.blocks.size());
+    std::vector<bool> in_worklist(analysis.blocks.size(), false);
+    std::vector<size_t> worklist;
+
+    auto push_state = [&](size_t block, const reg_state& state) {
+        bool changed = false;
+        for (int r = 0; r < 16; r++) {
+            reg_value merged = merge(block_in[block].regs[r], state.regs[r]);
+            if (!(merged == block_in[block].regs[r])) {
+                block_in[block].regs[r] = merged;
+                changed = true;
+            }
+        }
+        if (changed && !in_worklist[block]) {
+            in_worklist[block] = true;
+            worklist.push_back(block);
+        }
+    };
+
+    //registers are 0 at reset, nothing is known on entry to a called function
+    reg_state reset_state;
+    for (int r = 0; r < 16; r++) reset_state.regs[r] = constant(0);
+    reg_state unknown_state;
+    for (int r = 0; r < 16; r++) unknown_state.regs[r] = varying;
+    unknown_state.regs[0] = constant(0);
+
+    push_state(block_of[0], reset_state);
+    for (size_t f = 1; f < analysis.functions.size(); f++) push_state(block_of[analysis.functions[f].entry], unknown_state);
+
+    auto transfer = [&](const decoded_instruction& ins, reg_state& state) {
+        reg_value* regs = state.regs;
+        reg_value a = regs[ins.regA];
+        reg_value b = regs[ins.regB];
+        bool both_constant = (a.kind == CONSTANT && b.kind == CONSTANT);
+        reg_value result = varying;
+        uint8_t target = 0;
+
+        switch (ins.opcode) {
+        case 2: target = ins.regC; if (both_constant) result = constant(a.value + b.value); break;
+        case 3: target = ins.regC; if (both_constant) result = constant(a.value - b.value); break;
+        case 4: target = ins.regC; if (both_constant) result = constant(~(a.value | b.value)); break;
+        case 5: target = ins.regC; if (both_constant) result = constant(a.value & b.value); break;
+        case 6: target = ins.regC; if (both_constant) result = constant(a.value ^ b.value); break;
+        case 7: target = ins.regC; if (a.kind == CONSTANT) result = constant(a.value >> 1); break;
+        case 8: target = ins.regA; result = constant(ins.imm); break;
+        case 9: target = ins.regA; if (a.kind == CONSTANT) result = constant(a.value + ins.imm); break;
+        case 14: target = ins.regB; break;
+        default: return;
+        }
+        if (target != 0) regs[target] = result;
+    };
+
+    while (!worklist.empty()) {
+        size_t block = worklist.back();
+        worklist.pop_back();
+        in_worklist[block] = false;
+
+        reg_state state = block_in[block];
+        const basic_block& info = analysis.blocks[block];
+        for (uint16_t pc = info.start; pc < info.end; pc++) {
+            transfer(decode_instruction(image[pc]), state);
+        }
+
+        //a call may clobber every register
+        const reg_state& out = info.calls.empty() ? state : unknown_state;
+        for (size_t successor : info.successors) push_state(successor, out);
+    }
+
+    //collect the ports per function
+    for (analysis_function& function : analysis.functions) {
+        for (size_t block : function.blocks) {
+            reg_state state = block_in[block];
+            const basic_block& info = analysis.blocks[block];
+            for (uint16_t pc = info.start; pc < info.end; pc++) {
+                decoded_instruction ins = decode_instruction(image[pc]);
+                if (ins.opcode == 14 || ins.opcode == 15) {
+                    reg_value base = state.regs[ins.regA];
+                    if (base.kind == CONSTANT) {
+                        uint8_t address = (uint8_t)(base.value + sign_extend_offset(ins.offset));
+                        if (address >= MMIO_BASE_ADDRESS) {
+                            if (ins.opcode == 14) function.mmio_reads.insert(address);
+                            else function.mmio_writes.insert(address);
+                        }
+                    }
+                    else if (base.kind == VARYING) {
+                        function.has_unresolved_memory_access = true;
+                    }
+                }
+                transfer(ins, state);
+            }
+        }
+    }
+
+    return analysis;
+}
+
+static std::string mmio_port_name(uint8_t port) {
+    static const std::string port_names[] = { "pixel_x","pixel_y","draw_pixel","clear_pixel","load_pixel","buffer_screen",
+                                              "clear_screen_buffer","write_char","buffer_chars","clear_chars_buffer","show_number","clear_number",
+                                              "signed_mode","unsigned_mode","rng","controller_input" };
+    return (port >= MMIO_BASE_ADDRESS) ? port_names[port - MMIO_BASE_ADDRESS] : std::to_string(port);
+}
+
+static void print_analysis(const program_analysis& analysis) {
+    std::cout << "Blocks: " << analysis.blocks.size() << "  Functions: " << analysis.functions.size()
+              << "  Max call depth: " << ((analysis.max_call_depth < 0) ? "unbounded" : std::to_string(analysis.max_call_depth))
+              << "  Unreachable words: " << analysis.unreachable.size() << '\n';
+
+    for (const analysis_function& function : analysis.functions) {
+        std::cout << str_pad_right(function.name, 24) << " depth " << ((function.max_call_depth < 0) ? "inf" : std::to_string(function.max_call_depth));
+        if (!function.mmio_reads.empty()) {
+            std::cout << "  reads";
+            for (uint8_t port : function.mmio_reads) std::cout << ' ' << mmio_port_name(port);
+        }
+        if (!function.mmio_writes.empty()) {
+            std::cout << "  writes";
+            for (uint8_t port : function.mmio_writes) std::cout << ' ' << mmio_port_name(port);
+        }
+        if (function.has_unresolved_memory_access) std::cout << "  (+ computed addresses)";
+        std::cout << '\n';
+    }
+
+    for (const std::string& warning : analysis.warnings) std::cout << "WARNING : " << warning << '\n';
+    for (const std::string& error : analysis.errors) std::cout << "ERROR : " << error << '\n';
+}
+
+//assembles filename.as and analyzes it with the label names, returns true if the program is accepted
+static bool analyze_file(const std::string& filename) {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    program_analysis analysis = analyze_program(encode_program(program), program.jmp_location_names);
+    print_analysis(analysis);
+    return analysis.is_accepted();
+}
@@ -8,6 +8,13 @@
 #include <fstream>
 #include <iostream>
 #include <bitset>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+#include "numeric_parsing.h"
 
 static void to_lower(std::string& s) {
     for (int i = 0; i < s.size(); i++) {
@@ -15,17 +22,329 @@ static void to_lower(std::string& s) {
     }
 }
 
+//integer operand, define value or repeat count
+static int64_t parse_assembly_number(const std::string& str) {
+    numeric_literal literal = scan_numeric_literal(str);
+    if (!literal.is_integer() || literal.overflow)
+        throw std::runtime_error("Invalid number : " + str);
+    return literal.int_value;
+}
+
 static std::string str_pad_right(const std::string& str, size_t total_length) {
     if (str.length() >= total_length) return str;
     return str + std::string(total_length - str.length(), ' ');
 }
 
-static void assemble(const std::string& filename) {
-    std::ifstream assembly_file(filename + ".as");
-    std::ofstream machine_code_file(filename + ".mc");
-    std::ofstream machine_code_bin_file(filename + ".bin");
+static std::vector<std::string> tokenize_assembly_line(const std::string& line) {
+    std::vector<std::string> tokens;
+    if (line.length() == 0) return tokens;
+
+    //skip all leading space and trailing space
+    size_t start_index = 0;
+    size_t end_index = line.length() - 1;
+    while (line[start_index] == ' ' || line[start_index] == '\t') start_index++;
+    while (end_index > 0 && (line[end_index] == ' ' || line[end_index] == '\t')) end_index--;
+
+    //tokenize and strip comments
+    std::string token;
+
+    bool in_quotes = false;
+    for (char c : line.substr(start_index, end_index - start_index + 1)) {
+        if (c == '/' || c == '#' || c == ';') {
+            break;
+        }
+        else if ((c == ' ' || c == '\t') && !in_quotes) {
+            if (token != "") {
+                to_lower(token);
+                tokens.push_back(token);
+            }
+            token = "";
+        }
+        else if (c == ' ' && in_quotes) {
+            token += c;
+        }
+        else if (c == 0x27 || c == 0x22) {
+            in_quotes = !in_quotes;
+            token += c;
+        }
+        else {
+            token += c;
+        }
+    }
+    if (token != "") {
+        to_lower(token);
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+//
+//  Preprocessor - include, macro and repeat
+//
+//  include "lib/multiply.as"       (also .include) pastes another file, path relative to the including file
+//  macro name p1 p2 ...            defines a macro, the parameter names are replaced by the call arguments
+//      ...
+//  endmacro
+//  repeat n                        repeats the enclosed lines n times
+//      ...
+//  endrepeat
+//
+//  Labels defined inside a macro body are local to each expansion.
+//  Files and macro expansions are tokenized once and memoized by content hash, so the same library
+//  included into many programs is only tokenized once per process. The file cache is shared by the
+//  preprocessors of all threads behind a lock and is dropped once it holds more than 64 MB of source,
+//  the expansions of a macro are dropped when it is redefined.
+//
+
+using assembly_lines = std::vector<std::vector<std::string>>;
+
+struct assembly_expansion {
+    assembly_lines lines;
+    std::vector<std::string> local_labels;
+};
+
+struct assembly_macro {
+    std::vector<std::string> params;
+    assembly_lines body;
+    size_t definition = 0;
+    std::unordered_map<std::string, assembly_expansion> expansions; //by arguments
+};
+
+struct assembly_cache_entry {
+    std::string source;
+    std::shared_ptr<const assembly_lines> lines;
+};
+
+//tokenized files keyed by the hash of their contents
+struct assembly_file_cache {
+    static constexpr size_t MAX_SOURCE_BYTES = 64 << 20;
+
+    std::mutex mutex;
+    std::unordered_map<size_t, std::vector<assembly_cache_entry>> entries;
+    size_t source_bytes = 0;
+
+    static assembly_file_cache& instance() {
+        static assembly_file_cache cache;
+        return cache;
+    }
+};
+
+static std::shared_ptr<const assembly_lines> tokenize_assembly_source(const std::string& source) {
+    assembly_file_cache& cache = assembly_file_cache::instance();
+    size_t hash = std::hash<std::string>{}(source);
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto bucket = cache.entries.find(hash);
+        if (bucket != cache.entries.end()) {
+            for (const assembly_cache_entry& entry : bucket->second) {
+                if (entry.source == source) return entry.lines;
+            }
+        }
+    }
+
+    std::shared_ptr<assembly_lines> lines = std::make_shared<assembly_lines>();
+    std::istringstream source_stream(source);
+    std::string line;
+    while (getline(source_stream, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        //include paths are kept raw, the line tokenizer would lower case them and stop at the first '/'
+        std::vector<std::string> tokens = tokenize_assembly_line(line);
+        if (!tokens.empty() && (tokens[0] == "include" || tokens[0] == ".include")) {
+            size_t open_quote = line.find('"');
+            size_t close_quote = line.find('"', open_quote + 1);
+            if (open_quote == std::string::npos || close_quote == std::string::npos)
+                throw std::runtime_error("include expects a quoted file name : " + line);
+            tokens = { "include", line.substr(open_quote + 1, close_quote - open_quote - 1) };
+        }
+
+        if (!tokens.empty()) lines->push_back(tokens);
+    }
+
+    //the lines that were handed out stay alive when the cache is dropped
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.source_bytes + source.size() > assembly_file_cache::MAX_SOURCE_BYTES) {
+        cache.entries.clear();
+        cache.source_bytes = 0;
+    }
+    cache.entries[hash].push_back({ source, lines });
+    cache.source_bytes += source.size();
+    return lines;
+}
+
+class assembly_preprocessor {
+public:
+    assembly_lines preprocess_file(const std::string& path) {
+        assembly_lines output;
+        include_file(path, output);
+        return output;
+    }
+
+    assembly_lines preprocess_source(const std::string& source, const std::string& directory = "") {
+        assembly_lines output;
+        process(*tokenize_assembly_source(source), directory, output);
+        return output;
+    }
+
+    assembly_lines preprocess_lines(const assembly_lines& lines, const std::string& directory = "") {
+        assembly_lines output;
+        process(lines, directory, output);
+        return output;
+    }
+
+    bool is_macro(const std::string& name) const {
+        return macros.contains(name);
+    }
+
+    //every file opened so far, the file given to preprocess_file first
+    const std::vector<std::string>& files() const {
+        return opened_files;
+    }
+
+private:
+    void include_file(const std::string& path, assembly_lines& output) {
+        if (include_depth >= MAX_INCLUDE_DEPTH)
+            throw std::runtime_error("include nested too deeply (recursive include?) : " + path);
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Unable to open assembly file : " + path);
+        if (std::find(opened_files.begin(), opened_files.end(), path) == opened_files.end()) opened_files.push_back(path);
+
+        std::stringstream source;
+        source << file.rdbuf();
+
+        size_t slash_index = path.find_last_of("/\\");
+        std::string directory = (slash_index == std::string::npos) ? "" : path.substr(0, slash_index + 1);
+
+        include_depth++;
+        process(*tokenize_assembly_source(source.str()), directory, output);
+        include_depth--;
+    }
+
+    //collects the lines up to the matching end keyword, nested blocks of the same kind are kept intact
+    static size_t collect_block(const assembly_lines& lines, size_t index, const std::string& begin_keyword, const std::string& end_keyword, assembly_lines& block) {
+        int depth = 1;
+        for (index++; index < lines.size(); index++) {
+            if (lines[index][0] == begin_keyword) depth++;
+            else if (lines[index][0] == end_keyword) depth--;
+
+            if (depth == 0) return index;
+            block.push_back(lines[index]);
+        }
+        throw std::runtime_error("Missing " + end_keyword + " for " + begin_keyword);
+    }
+
+    void process(const assembly_lines& lines, const std::string& directory, assembly_lines& output) {
+        for (size_t index = 0; index < lines.size(); index++) {
+            const std::vector<std::string>& tokens = lines[index];
+
+            if (tokens[0] == "include") {
+                include_file(directory + tokens[1], output);
+            }
+            else if (tokens[0] == "macro") {
+                if (tokens.size() < 2)
+                    throw std::runtime_error("macro without a name");
+                assembly_macro macro;
+                macro.params = std::vector<std::string>(tokens.begin() + 2, tokens.end());
+                index = collect_block(lines, index, "macro", "endmacro", macro.body);
+                macro.definition = ++macro_definitions;
+                macros[tokens[1]] = std::move(macro); //without the expansions of an earlier definition
+            }
+            else if (tokens[0] == "repeat") {
+                if (tokens.size() < 2)
+                    throw std::runtime_error("repeat without a count");
+                assembly_lines block;
+                index = collect_block(lines, index, "repeat", "endrepeat", block);
+                int count = (int)parse_assembly_number(tokens[1]);
+                for (int i = 0; i < count; i++) process(block, directory, output);
+            }
+            else if (macros.contains(tokens[0])) {
+                expand_macro(tokens[0], std::vector<std::string>(tokens.begin() + 1, tokens.end()), directory, output);
+            }
+            else if (tokens[0][0] == '.' && tokens.size() > 1 && macros.contains(tokens[1])) {
+                //label in front of a macro call
+                output.push_back({ tokens[0] });
+                expand_macro(tokens[1], std::vector<std::string>(tokens.begin() + 2, tokens.end()), directory, output);
+            }
+            else {
+                output.push_back(tokens);
+            }
+        }
+    }
+
+    void expand_macro(const std::string& name, const std::vector<std::string>& args, const std::string& directory, assembly_lines& output) {
+        const assembly_macro& macro = macros[name];
+        if (args.size() != macro.params.size())
+            throw std::runtime_error("macro " + name + " expects " + std::to_string(macro.params.size()) + " arguments");
+
+        std::string key;
+        for (const std::string& arg : args) key += arg + '\0';
+
+        auto cached = macro.expansions.find(key);
+        const assembly_expansion* expansion_ptr = (cached != macro.expansions.end()) ? &cached->second : nullptr;
+        assembly_expansion uncached;
+        if (!expansion_ptr) {
+            if (expansion_depth >= MAX_INCLUDE_DEPTH)
+                throw std::runtime_error("macro expansion nested too deeply (recursive macro?) : " + name);
+
+            //substitute the parameters
+            size_t definition = macro.definition;
+            assembly_lines body = macro.body;
+            for (std::vector<std::string>& line : body) {
+                for (std::string& token : line) {
+                    for (size_t i = 0; i < macro.params.size(); i++) {
+                        if (token == macro.params[i]) {
+                            token = args[i];
+                            break;
+                        }
+                    }
+                }
+            }
+
+            expansion_depth++;
+            process(body, directory, uncached.lines);
+            expansion_depth--;
+
+            for (const std::vector<std::string>& line : uncached.lines) {
+                if (line[0][0] == '.') uncached.local_labels.push_back(line[0]);
+            }
+
+            //the body may have redefined the macro, the expansion then belongs to the old definition only
+            assembly_macro& current = macros[name];
+            if (current.definition == definition) expansion_ptr = &current.expansions.insert_or_assign(key, std::move(uncached)).first->second;
+            else expansion_ptr = &uncached;
+        }
+
+        //give the labels of this expansion unique names
+        const assembly_expansion& expansion = *expansion_ptr;
+        std::string suffix = "_" + std::to_string(expansion_count++);
+        for (std::vector<std::string> line : expansion.lines) {
+            for (std::string& token : line) {
+                for (const std::string& label : expansion.local_labels) {
+                    if (token == label) {
+                        token += suffix;
+                        break;
+                    }
+                }
+            }
+            output.push_back(std::move(line));
+        }
+    }
+
+private:
+    static constexpr int MAX_INCLUDE_DEPTH = 64;
+
+    std::unordered_map<std::string, assembly_macro> macros;
+    std::vector<std::string> opened_files;
+    size_t macro_definitions = 0;
+    int include_depth = 0;
+    int expansion_depth = 0;
+    size_t expansion_count = 0;
+};
 
-    std::unordered_map<std::string, uint16_t> symbols =
+static const std::unordered_map<std::string, uint16_t>& default_assembly_symbols() {
+    static const std::unordered_map<std::string, uint16_t> symbols =
     {
         {"nop",0}, {"hlt",1},{"add",2},{"sub",3},{"nor",4},{"and",5},{"xor",6},{"rsh",7},{"ldi",8},{"adi",9},{"jmp",10},{"brh",11},{"cal",12},{"ret",13},{"lod",14},{"str",15},
 
@@ -47,178 +366,203 @@ static void assemble(const std::string& filename) {
         {"\"p\"",16},{"\"q\"",17},{"\"r\"",18},{"\"s\"",19},{"\"t\"",20},{"\"u\"",21},{"\"v\"",22},{"\"w\"",23},{"\"x\"",24},{"\"y\"",25},{"\"z\"",26},{"\".\"",27},{"\"!\"",28},{"\"?\"",29}
     };
 
-    std::function<uint16_t(std::string)> resolve = [&symbols](std::string obj)
-        {
-            if (obj[0] == 45 || (obj[0] >= 48 && obj[0] <= 57)) { // obj[0] in "-0123456789"
-                //numeric
-                if (obj.length() >= 2 && obj.substr(0, 2) == "0b") {
-                    //binary 
-                    return (uint16_t)std::stoi(obj.substr(2, obj.length() - 2), nullptr, 2);
-                }
-                else if (obj.length() >= 2 && obj.substr(0, 2) == "0x") {
-                    //hex
-                    return (uint16_t)std::stoi(obj.substr(2, obj.length() - 2), nullptr, 16);
-                }
-                else {
-                    //dec
-                    return (uint16_t)std::stoi(obj, nullptr, 0);
-                }
+    return symbols;
+}
 
-            }
-            return symbols[obj];
-        };
+//
+//  Parsing - labels, defines and pseudo instructions
+//
 
-    std::vector<std::vector<std::string>> instructions;
+struct assembly_program {
+    assembly_lines instructions; //one entry per instruction word, pseudo instructions already lowered
+    std::unordered_map<std::string, uint16_t> symbols = default_assembly_symbols();
+    std::unordered_map<std::string, uint16_t> labels;
     std::unordered_map<uint16_t, std::string> jmp_location_names;
-    std::string line;
-    uint16_t pc = 0;
+};
 
-    while (getline(assembly_file, line)) {
-        if (line.length() == 0) continue;
+static void parse_assembly_line(std::vector<std::string> tokens, assembly_program& program) {
+    if (tokens.empty()) return;
 
-        //skip all leading space and trailing space
-        size_t start_index = 0;
-        size_t end_index = line.length() - 1;
-        while (line[start_index] == ' ' || line[start_index] == '\t') start_index++;
-        while (end_index > 0 && (line[end_index] == ' ' || line[end_index] == '\t')) end_index--;
+    uint16_t pc = (uint16_t)program.instructions.size();
+    assembly_lines& instructions = program.instructions;
 
-        //tokenize and preprocessor
-        std::vector<std::string> tokens;
-        std::string token;
-
-        bool in_quotes = false;
-        for (char c : line.substr(start_index, end_index - start_index + 1)) {
-            if (c == '/' || c == '#' || c == ';') {
-                break;
-            }
-            else if (c == ' ' && !in_quotes) {
-                if (token != "") {
-                    to_lower(token);
-                    tokens.push_back(token);
-                }
-                token = "";
-            }
-            else if (c == ' ' && in_quotes) {
-                token += c;
-            }
-            else if (c == 0x27 || c == 0x22) {
-                in_quotes = !in_quotes;
-                token += c;
-            }
-            else {
-                token += c;
-            }
-        }
-        if (token != "") {
-            to_lower(token);
-            tokens.push_back(token);
+    if (tokens[0] == "define") {
+        //definition
+        program.symbols[tokens[1]] = (uint16_t)parse_assembly_number(tokens[2]);
+    }
+    else if (tokens[0][0] == '.') {
+        //label
+        program.symbols[tokens[0]] = pc;
+        program.labels[tokens[0]] = pc;
+        program.jmp_location_names[pc] = tokens[0];
+        if (tokens.size() > 1) {
+            parse_assembly_line(std::vector<std::string>(tokens.begin() + 1, tokens.end()), program);
         }
+    }//pseudo instructions
+    else if (tokens[0] == "cmp") {
+        instructions.push_back({ "sub",tokens[1],tokens[2],"r0" });
+    }
+    else if (tokens[0] == "mov") {
+        instructions.push_back({ "add",tokens[1],"r0",tokens[2] });
+    }
+    else if (tokens[0] == "lsh") {
+        instructions.push_back({ "add",tokens[1],tokens[1],tokens[2] });
+    }
+    else if (tokens[0] == "inc") {
+        instructions.push_back({ "adi",tokens[1],"1" });
+    }
+    else if (tokens[0] == "dec") {
+        instructions.push_back({ "adi",tokens[1],"-1" });
+    }
+    else if (tokens[0] == "not") {
+        instructions.push_back({ "nor",tokens[1],"r0",tokens[2] });
+    }
+    else if (tokens[0] == "neg") {
+        instructions.push_back({ "sub","r0",tokens[1],tokens[2] });
+    }
+    else if ((tokens[0] == "lod" || tokens[0] == "str") && tokens.size() == 3) {
+        //lod/str optional offsets
+        tokens.push_back("0");
+        instructions.push_back(tokens);
+    }
+    else {
+        //add instruction
+        instructions.push_back(tokens);
+    }
+}
 
-        if (tokens.size() > 0) {
-            if (tokens[0] == "define") {
-                //definition
-                symbols[tokens[1]] = std::stoi(tokens[2]);
-            }
-            else if (tokens[0][0] == '.') {
-                //label
-                symbols[tokens[0]] = pc;
-                jmp_location_names[pc] = tokens[0];
-                if (tokens.size() > 1) {
-                    pc++;
-                    instructions.push_back(std::vector<std::string>(tokens.begin() + 1, tokens.end()));
-                }
-            }//pseudo instructions
-            else if (tokens[0] == "cmp") {
-                pc++;
-                instructions.push_back({ "sub",tokens[1],tokens[2],"r0" });
-            }
-            else if (tokens[0] == "mov") {
-                pc++;
-                instructions.push_back({ "add",tokens[1],"ro",tokens[2] });
-            }
-            else if (tokens[0] == "lsh") {
-                pc++;
-                instructions.push_back({ "add",tokens[1],tokens[1],tokens[2] });
-            }
-            else if (tokens[0] == "inc") {
-                pc++;
-                instructions.push_back({ "adi",tokens[1],"1" });
-            }
-            else if (tokens[0] == "dec") {
-                pc++;
-                instructions.push_back({ "adi",tokens[1],"-1" });
-            }
-            else if (tokens[0] == "not") {
-                pc++;
-                instructions.push_back({ "nor",tokens[1],"r0",tokens[2] });
-            }
-            else if (tokens[0] == "neg") {
-                pc++;
-                instructions.push_back({ "sub","ro",tokens[1],tokens[2] });
-            }
-            else if ((tokens[0] == "lod" || tokens[0] == "str") && tokens.size() == 3) {
-                //lod/str optional offsets
-                tokens.push_back("0");
-                instructions.push_back(tokens);
-                pc++;
-            }
-            else {
-                //add instruction
-                instructions.push_back(tokens);
-                pc++;
-            }
-        }
+static assembly_program parse_assembly(const assembly_lines& source_lines) {
+    assembly_program program;
+    for (const std::vector<std::string>& tokens : source_lines) {
+        parse_assembly_line(tokens, program);
+    }
+    return program;
+}
+
+//
+//  Encoding
+//
+
+static bool is_numeric_operand(const std::string& obj) {
+    return !obj.empty() && (obj[0] == 45 || (obj[0] >= 48 && obj[0] <= 57)); // obj[0] in "-0123456789"
+}
+
+static uint16_t resolve_operand(const std::string& obj, const std::unordered_map<std::string, uint16_t>& symbols) {
+    if (is_numeric_operand(obj)) {
+        //numeric, decimal, 0x hex or 0b binary
+        return (uint16_t)parse_assembly_number(obj);
     }
+    auto symbol = symbols.find(obj);
+    return (symbol == symbols.end()) ? 0 : symbol->second;
+}
 
-    size_t MAX_LEN_INSTRUCTION = 0;
+static uint8_t instruction_opcode(const std::vector<std::string>& instruction) {
+    const std::unordered_map<std::string, uint16_t>& symbols = default_assembly_symbols();
+    auto symbol = symbols.find(instruction[0]);
+    return (symbol == symbols.end()) ? 0 : (uint8_t)symbol->second;
+}
+
+static uint16_t encode_instruction(const std::vector<std::string>& instruction, const std::unordered_map<std::string, uint16_t>& symbols) {
+    auto resolve = [&symbols](const std::string& obj) { return resolve_operand(obj, symbols); };
+
+    uint8_t opcode = instruction_opcode(instruction);
+    uint16_t machine_code = opcode << 12;
+    if (opcode >= 2 && opcode <= 6) {
+        machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]) << 4 | resolve(instruction[3]);
+    }
+    else if (opcode == 7) {
+        machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]);
+    }
+    else if (opcode == 8 || opcode == 9) {
+        if (is_numeric_operand(instruction[2]) && !scan_numeric_literal(instruction[2]).fits_register())
+            throw std::runtime_error("Immediate does not fit in an 8 bit register : " + instruction[2]);
+        machine_code |= resolve(instruction[1]) << 8 | (resolve(instruction[2]) & 255);
+    }
+    else if (opcode == 10 || opcode == 12) {
+        machine_code |= resolve(instruction[1]);
+    }
+    else if (opcode == 11) {
+        machine_code |= resolve(instruction[1]) << 10 | resolve(instruction[2]);
+    }
+    else if (opcode == 14 || opcode == 15) {
+        machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]) << 4 | (resolve(instruction[3]) & 15);
+    }
+    return machine_code;
+}
 
-    //generate machine code
+static std::vector<uint16_t> encode_program(const assembly_program& program) {
     std::vector<uint16_t> machine_code_instructions;
-    machine_code_instructions.reserve(instructions.size());
-    size_t ins_index = 0;
-    for (const std::vector<std::string>& instruction : instructions) {
-        size_t ins_len = 0;
-        for (const std::string& s : instruction) ins_len += s.length() + 1;
-        if (ins_len > MAX_LEN_INSTRUCTION) MAX_LEN_INSTRUCTION = ins_len;
+    machine_code_instructions.reserve(program.instructions.size());
+    for (const std::vector<std::string>& instruction : program.instructions) {
+        machine_code_instructions.push_back(encode_instruction(instruction, program.symbols));
+    }
+    return machine_code_instructions;
+}
 
-        uint8_t opcode = (uint8_t)symbols[instruction[0]];
-        uint16_t machine_code = opcode << 12;
-        if (opcode >= 2 && opcode <= 6) {
-            machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]) << 4 | resolve(instruction[3]);
-        }
-        else if (opcode == 7) {
-            machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]);
-        }
-        else if (opcode == 8 || opcode == 9) {
-            machine_code |= resolve(instruction[1]) << 8 | (resolve(instruction[2]) & 255);
-        }
-        else if (opcode == 10 || opcode == 12) {
-            machine_code |= resolve(instruction[1]);
-        }
-        else if (opcode == 11) {
-            machine_code |= resolve(instruction[1]) << 10 | resolve(instruction[2]);
-        }
-        else if (opcode == 14 || opcode == 15) {
-            machine_code |= resolve(instruction[1]) << 8 | resolve(instruction[2]) << 4 | (resolve(instruction[3]) & 15);
-        }
+//
+//  Decoding - the field layout shared by the encoder, the emulator and the analyzers
+//
+//  opcode[15:12] regA[11:8] regB[7:4] regC[3:0]    offset = regC (signed 4 bit), imm = [7:0]
+//  cond[11:10] addr[9:0]
+//
 
-        machine_code_instructions.push_back(machine_code);
+struct decoded_instruction {
+    uint8_t opcode;
+    uint8_t regA;
+    uint8_t regB;
+    uint8_t regC;
+    uint8_t offset;
+    uint8_t imm;
+    uint16_t addr;
+    uint8_t cond;
+};
+
+static decoded_instruction decode_instruction(uint16_t instruction) {
+    decoded_instruction decoded;
+    decoded.opcode = instruction >> 12;
+    decoded.regA = (instruction & 0x0f00) >> 8;
+    decoded.regB = (instruction & 0x00f0) >> 4;
+    decoded.regC = (instruction & 0x000f);
+    decoded.offset = decoded.regC;
+    decoded.imm = (instruction & 0x00ff);
+    decoded.addr = (instruction & 0b0000001111111111);
+    decoded.cond = (instruction & 0b0000110000000000) >> 10;
+    return decoded;
+}
+
+//
+//  Output
+//
+
+static void write_machine_code(const std::string& filename, const std::vector<uint16_t>& machine_code_instructions) {
+    std::ofstream machine_code_file(filename + ".mc");
+    std::ofstream machine_code_bin_file(filename + ".bin", std::ios::binary);
 
+    for (size_t ins_index = 0; ins_index < machine_code_instructions.size(); ins_index++) {
+        uint16_t machine_code = machine_code_instructions[ins_index];
         machine_code_bin_file.write((char*)(&machine_code), sizeof(uint16_t));
         machine_code_file << std::bitset<16>(machine_code).to_string();
-        if (ins_index < instructions.size() - 1) machine_code_file << '\n';
+        if (ins_index < machine_code_instructions.size() - 1) machine_code_file << '\n';
+    }
+}
 
-        ins_index++;
+static void print_listing(const assembly_program& program, const std::vector<uint16_t>& machine_code_instructions) {
+    size_t MAX_LEN_INSTRUCTION = 0;
+    for (const std::vector<std::string>& instruction : program.instructions) {
+        size_t ins_len = 0;
+        for (const std::string& s : instruction) ins_len += s.length() + 1;
+        if (ins_len > MAX_LEN_INSTRUCTION) MAX_LEN_INSTRUCTION = ins_len;
     }
 
     //display code
     uint16_t line_index = 0;
     std::cout << "LINE " << str_pad_right("INSTRUCTION", MAX_LEN_INSTRUCTION) << " MACHINE CODE\n";
-    for (const std::vector<std::string>& instruction : instructions) {
+    for (const std::vector<std::string>& instruction : program.instructions) {
 
-        if (jmp_location_names.find(line_index) != jmp_location_names.end()) {
+        auto jmp_location_name = program.jmp_location_names.find(line_index);
+        if (jmp_location_name != program.jmp_location_names.end()) {
             //insert jump location
-            std::cout << jmp_location_names[line_index] << '\n';
+            std::cout << jmp_location_name->second << '\n';
         }
 
         //insert instruction
@@ -232,3 +576,14 @@ static void assemble(const std::string& filename) {
     }
 }
 
+static void assemble(const std::string& filename) {
+    //expand includes, macros and repeat blocks into plain token lines
+    assembly_preprocessor preprocessor;
+    assembly_lines source_lines = preprocessor.preprocess_file(filename + ".as");
+
+    assembly_program program = parse_assembly(source_lines);
+    std::vector<uint16_t> machine_code_instructions = encode_program(program);
+
+    write_machine_code(filename, machine_code_instructions);
+    print_listing(program, machine_code_instructions);
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <tuple>
+
+#include "Assembler.h"
+
+//
+//  Incremental assembler session
+//
+//  Keeps the line table, label addresses and encoded words of a program between edits. Editing, inserting or
+//  erasing a plain instruction/label line only re-encodes that line and the instructions that refer to labels
+//  that moved, everything else is shifted. Lines that change the meaning of other lines (define, include, macro, repeat,
+//  macro calls) fall back to re-assembling the whole program.
+//
+//  Every edit returns the words that changed as (address, word) patches that can be applied to a running
+//  BatPU with patch_instructions(), addresses past the end of a shrunk program are patched to NOP. An edit that
+//  throws, e.g. on an immediate that does not fit, leaves the session as it was before the edit.
+//
+
+struct instruction_patch {
+    uint16_t address;
+    uint16_t word;
+};
+
+class assembler_session {
+public:
+    explicit assembler_session(const std::string& source, const std::string& directory = "") :
+        directory(directory)
+    {
+        std::istringstream source_stream(source);
+        std::string line;
+        while (getline(source_stream, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            lines.push_back(line);
+        }
+        reassemble();
+    }
+
+    static assembler_session from_file(const std::string& filename) {
+        std::ifstream file(filename + ".as", std::ios::binary);
+        std::stringstream source;
+        source << file.rdbuf();
+
+        size_t slash_index = filename.find_last_of("/\\");
+        std::string directory = (slash_index == std::string::npos) ? "" : filename.substr(0, slash_index + 1);
+        return assembler_session(source.str(), directory);
+    }
+
+    const std::vector<uint16_t>& machine_code() const { return words; }
+    const assembly_program& program() const { return parsed; }
+    size_t line_count() const { return lines.size(); }
+
+    std::vector<instruction_patch> edit_line(size_t line_index, const std::string& text) {
+        if (line_index >= lines.size())
+            return insert_line(lines.size(), text);
+
+        return transaction([&] {
+            std::vector<std::string> new_tokens = tokenize_assembly_line(text);
+            size_t group_index = line_to_group[line_index];
+            lines[line_index] = text;
+
+            if (!groups[group_index].is_simple || !is_simple_line(new_tokens))
+                return reassemble();
+
+            return reencode_group(group_index, new_tokens);
+        });
+    }
+
+    std::vector<instruction_patch> insert_line(size_t line_index, const std::string& text) {
+        return transaction([&] { return insert_line_unchecked(std::min(line_index, lines.size()), text); });
+    }
+
+    std::vector<instruction_patch> erase_line(size_t line_index) {
+        if (line_index >= lines.size())
+            return {};
+
+        return transaction([&] {
+            size_t group_index = line_to_group[line_index];
+            lines.erase(lines.begin() + line_index);
+            if (!groups[group_index].is_simple)
+                return reassemble();
+
+            //empty the group, then drop it
+            std::vector<instruction_patch> patches = reencode_group(group_index, {});
+            groups.erase(groups.begin() + group_index);
+            line_to_group.erase(line_to_group.begin() + line_index);
+            for (size_t& group_of_line : line_to_group) {
+                if (group_of_line > group_index) group_of_line--;
+            }
+            return patches;
+        });
+    }
+
+    //re-assembles everything and returns the difference to the previous words
+    std::vector<instruction_patch> rebuild() {
+        return transaction([&] { return reassemble(); });
+    }
+
+private:
+    struct session_group {
+        bool is_simple = false; //a single line with plain instructions, labels or pseudo instructions
+        std::vector<std::pair<std::string, uint16_t>> labels; //label and offset from first_pc
+        uint16_t first_pc = 0;
+        uint16_t instruction_count = 0;
+    };
+
+    //runs an edit on the session and puts the whole state back if it throws, the edits below change the state
+    //before the last word is encoded
+    template <class edit_function>
+    std::vector<instruction_patch> transaction(edit_function edit) {
+        std::tuple saved(lines, line_to_group, groups, preprocessor, parsed, words);
+        try {
+            return edit();
+        }
+        catch (...) {
+            std::tie(lines, line_to_group, groups, preprocessor, parsed, words) = std::move(saved);
+            throw;
+        }
+    }
+
+    std::vector<instruction_patch> insert_line_unchecked(size_t line_index, const std::string& text) {
+        std::vector<std::string> new_tokens = tokenize_assembly_line(text);
+        lines.insert(lines.begin() + line_index, text);
+
+        //a line inside a block or one with a directive changes the meaning of other lines
+        bool starts_group = (line_index == 0 || line_index == line_to_group.size() || line_to_group[line_index] != line_to_group[line_index - 1]);
+        if (!starts_group || !is_simple_line(new_tokens))
+            return reassemble();
+
+        //an empty group at the insertion point that the line is then assembled into
+        size_t group_index = (line_index == line_to_group.size()) ? groups.size() : line_to_group[line_index];
+        session_group group;
+        group.is_simple = true;
+        group.first_pc = (group_index == groups.size()) ? (uint16_t)parsed.instructions.size() : groups[group_index].first_pc;
+        groups.insert(groups.begin() + group_index, group);
+        for (size_t& group_of_line : line_to_group) {
+            if (group_of_line >= group_index) group_of_line++;
+        }
+        line_to_group.insert(line_to_group.begin() + line_index, group_index);
+
+        return reencode_group(group_index, new_tokens);
+    }
+
+    std::vector<instruction_patch> reassemble() {
+        std::vector<uint16_t> old_words = words;
+
+        preprocessor = assembly_preprocessor();
+        parsed = assembly_program();
+        groups.clear();
+        line_to_group.assign(lines.size(), 0);
+
+        for (size_t line_index = 0; line_index < lines.size(); line_index++) {
+            session_group group;
+            group.first_pc = (uint16_t)parsed.instructions.size();
+
+            assembly_lines group_tokens;
+            std::vector<std::string> tokens = tokenize_assembly_line(lines[line_index]);
+            size_t last_line = line_index;
+
+            if (!tokens.empty() && (tokens[0] == "macro" || tokens[0] == "repeat")) {
+                //a block is one group up to its matching end keyword
+                std::string end_keyword = (tokens[0] == "macro") ? "endmacro" : "endrepeat";
+                int depth = 0;
+                for (; last_line < lines.size(); last_line++) {
+                    std::vector<std::string> block_tokens = tokenize_assembly_line(lines[last_line]);
+                    if (block_tokens.empty()) continue;
+                    if (block_tokens[0] == tokens[0]) depth++;
+                    else if (block_tokens[0] == end_keyword) depth--;
+                    group_tokens.push_back(block_tokens);
+                    if (depth == 0) break;
+                }
+                last_line = std::min(last_line, lines.size() - 1);
+            }
+            else if (!tokens.empty() && (tokens[0] == "include" || tokens[0] == ".include")) {
+                size_t open_quote = lines[line_index].find('"');
+                size_t close_quote = lines[line_index].find('"', open_quote + 1);
+                if (open_quote != std::string::npos && close_quote != std::string::npos)
+                    group_tokens.push_back({ "include", lines[line_index].substr(open_quote + 1, close_quote - open_quote - 1) });
+            }
+            else {
+                group.is_simple = is_simple_line(tokens);
+                if (!tokens.empty()) group_tokens.push_back(tokens);
+            }
+
+            for (const std::vector<std::string>& source_line : preprocessor.preprocess_lines(group_tokens, directory)) {
+                uint16_t offset = (uint16_t)(parsed.instructions.size() - group.first_pc);
+                for (const std::string& label : line_labels(source_line)) group.labels.push_back({ label, offset });
+                parse_assembly_line(source_line, parsed);
+            }
+            group.instruction_count = (uint16_t)(parsed.instructions.size() - group.first_pc);
+
+            for (size_t i = line_index; i <= last_line; i++) line_to_group[i] = groups.size();
+            groups.push_back(group);
+            line_index = last_line;
+        }
+
+        words = encode_program(parsed);
+        return diff_words(old_words, 0);
+    }
+
+    bool is_simple_line(const std::vector<std::string>& tokens) const {
+        if (tokens.empty()) return true;
+        static const std::unordered_set<std::string> directives = { "define","include",".include","export","macro","endmacro","repeat","endrepeat" };
+        for (const std::string& token : tokens) {
+            if (token[0] == '.' && token != ".include") continue; //leading labels
+            return !directives.contains(token) && !preprocessor.is_macro(token);
+        }
+        return !directives.contains(tokens[0]);
+    }
+
+    static std::vector<std::string> line_labels(const std::vector<std::string>& tokens) {
+        std::vector<std::string> labels;
+        for (const std::string& token : tokens) {
+            if (token[0] != '.') break;
+            labels.push_back(token);
+        }
+        return labels;
+    }
+
+    std::vector<instruction_patch> reencode_group(size_t group_index, const std::vector<std::string>& new_tokens) {
+        session_group& group = groups[group_index];
+        std::vector<uint16_t> old_words = words;
+
+        //lower the new line on its own
+        assembly_program line_program;
+        parse_assembly_line(new_tokens, line_program);
+        std::vector<std::pair<std::string, uint16_t>> new_labels;
+        for (const std::string& label : line_labels(new_tokens)) new_labels.push_back({ label, 0 });
+
+        int delta = (int)line_program.instructions.size() - (int)group.instruction_count;
+        uint16_t first_pc = group.first_pc;
+
+        //splice the instructions and placeholder words
+        parsed.instructions.erase(parsed.instructions.begin() + first_pc, parsed.instructions.begin() + first_pc + group.instruction_count);
+        parsed.instructions.insert(parsed.instructions.begin() + first_pc, line_program.instructions.begin(), line_program.instructions.end());
+        words.erase(words.begin() + first_pc, words.begin() + first_pc + group.instruction_count);
+        words.insert(words.begin() + first_pc, line_program.instructions.size(), 0);
+
+        group.instruction_count = (uint16_t)line_program.instructions.size();
+        bool labels_changed = (new_labels != group.labels);
+        group.labels = new_labels;
+        if (delta != 0) {
+            for (size_t i = group_index + 1; i < groups.size(); i++) groups[i].first_pc += delta;
+        }
+
+        //recompute the label table when anything could have moved
+        std::unordered_set<std::string> moved_labels;
+        if (delta != 0 || labels_changed) {
+            std::unordered_map<std::string, uint16_t> new_label_addresses;
+            for (const session_group& g : groups) {
+                for (const auto& [label, offset] : g.labels) new_label_addresses[label] = g.first_pc + offset;
+            }
+
+            for (const auto& [label, pc] : parsed.labels) {
+                auto new_label = new_label_addresses.find(label);
+                if (new_label == new_label_addresses.end()) {
+                    moved_labels.insert(label);
+                    parsed.symbols.erase(label);
+                }
+                else if (new_label->second != pc) {
+                    moved_labels.insert(label);
+                }
+            }
+            for (const auto& [label, pc] : new_label_addresses) {
+                if (!parsed.labels.contains(label)) moved_labels.insert(label);
+                parsed.symbols[label] = pc;
+            }
+
+            parsed.labels = std::move(new_label_addresses);
+            parsed.jmp_location_names.clear();
+            for (const session_group& g : groups) {
+                for (const auto& [label, offset] : g.labels) parsed.jmp_location_names[g.first_pc + offset] = label;
+            }
+        }
+
+        //re-encode the edited line and every instruction referring to a moved label
+        for (uint16_t pc = first_pc; pc < first_pc + group.instruction_count; pc++) {
+            words[pc] = encode_instruction(parsed.instructions[pc], parsed.symbols);
+        }
+        if (!moved_labels.empty()) {
+            for (uint16_t pc = 0; pc < parsed.instructions.size(); pc++) {
+                const std::vector<std::string>& instruction = parsed.instructions[pc];
+                for (size_t operand = 1; operand < instruction.size(); operand++) {
+                    if (moved_labels.contains(instruction[operand])) {
+                        words[pc] = encode_instruction(instruction, parsed.symbols);
+                        break;
+                    }
+                }
+            }
+        }
+
+        return diff_words(old_words, 0);
+    }
+
+    std::vector<instruction_patch> diff_words(const std::vector<uint16_t>& old_words, size_t from) const {
+        std::vector<instruction_patch> patches;
+        size_t end = std::max(old_words.size(), words.size());
+        for (size_t address = from; address < end && address < 1024; address++) {
+            uint16_t old_word = (address < old_words.size()) ? old_words[address] : 0;
+            uint16_t new_word = (address < words.size()) ? words[address] : 0;
+            if (old_word != new_word) patches.push_back({ (uint16_t)address, new_word });
+        }
+        return patches;
+    }
+
+private:
+    std::string directory;
+    std::vector<std::string> lines;
+    std::vector<size_t> line_to_group;
+    std::vector<session_group> groups;
+
+    assembly_preprocessor preprocessor;
+    assembly_program parsed;
+    std::vector<uint16_t> words;
+};
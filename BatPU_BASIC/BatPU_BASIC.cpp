@@ -4,15 +4,51 @@
 #include <fstream>
 
 #include "parser.h"
+#include "compiler.h"
 
-int main()
+static void write_assembly(const std::string& filename, const std::string& assembly) {
+	std::ofstream assembly_file(filename + ".as");
+	assembly_file << assembly;
+}
+
+int main(int argc, char* argv[])
 {
-	try {
-		node root = parse("test_basic");
-		std::cout << root.str();
+	//BatPU_BASIC [--fixed | --float] [--no-optimize] [--no-inline] file1 file2 ... compiles the files in parallel and
+	//reports the diagnostics of each. --fixed and --float select the representation of FLT and DBL values,
+	//--no-optimize skips the SSA passes and --no-inline keeps every runtime call.
+	//BatPU_BASIC --runtime writes the runtime library on its own to basic_runtime.as, with export lines for the linker.
+	if (argc > 1) {
+		codegen_options options;
+		std::vector<std::string> filenames;
+		for (int i = 1; i < argc; i++) {
+			std::string argument = argv[i];
+			if (argument == "--fixed") options.flt = flt_representation::FIXED;
+			else if (argument == "--float") options.flt = flt_representation::FLOAT;
+			else if (argument == "--no-optimize") options.optimize = false;
+			else if (argument == "--no-inline") options.inline_calls = false;
+			else if (argument == "--runtime") write_assembly("basic_runtime", runtime_library_source());
+			else filenames.push_back(argument);
+		}
+
+		bool success = true;
+		for (const compile_result& result : compile_batch(filenames, options)) {
+			std::cout << result.filename << " : " << result.statement_count << " statements, "
+				<< result.diagnostics.size() << " errors, " << result.milliseconds << " ms\n";
+			for (const diagnostic& error : result.diagnostics) std::cout << "  ERROR : " << error.str() << '\n';
+			if (result.success) write_assembly(result.filename, result.assembly);
+			success = success && result.success;
+		}
+		return success ? 0 : 1;
 	}
-	catch (std::exception& e) {
-		std::cout << "ERROR : " << e.what() << '\n';
+
+	//test_basic.bas --> test_basic.as
+	compiler basic_compiler;
+	if (basic_compiler.compile("test_basic")) {
+		write_assembly("test_basic", basic_compiler.assembly);
+		basic_compiler.codegen.report.print();
+	}
+	for (const diagnostic& error : basic_compiler.diagnostics) {
+		std::cout << "ERROR : " << error.str() << '\n';
 	}
-	
+
 }
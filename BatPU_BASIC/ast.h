@@ -0,0 +1,222 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <span>
+#include <unordered_map>
+#include <initializer_list>
+#include <cstdint>
+
+#include "../StringPool.h"
+
+enum class node_t : uint8_t {
+	UNKNOWN,
+	ROOT,
+	VARIABLE,
+	PARAMETER,
+	STMT_ASSIGN,
+	STMT_CLEAR,
+	STMT_DATA,
+	STMT_DEF_FN,
+	STMT_DIM,
+	STMT_END,
+	STMT_ERASE,
+	STMT_ERROR,
+	STMT_FOR,
+	STMT_GOSUB,
+	STMT_GOTO,
+	STMT_IF,
+	STMT_INPUT,
+	STMT_MID,
+	STMT_ON_ERROR_GOTO,
+	STMT_ON_EXPR_GOTO,
+	STMT_ON_EXPR_GOSUB,
+	STMT_POKE,
+	STMT_PEEK,
+	STMT_PRINT,
+	STMT_PRINT_SPACE,
+	STMT_PRINT_NOSPACE,
+	STMT_RANDOMIZE,
+	STMT_READ,
+	STMT_REM,
+	STMT_RESTORE,
+	STMT_RESUME,
+	STMT_RESUME_NEXT,
+	STMT_STOP,
+	STMT_SWAP,
+	STMT_WHILE,
+	EXPR,
+	OP_FUNC_CALL,
+	OP_INDEXING,
+	OP_NEG,
+	OP_POS,
+	OP_MUL,
+	OP_FLT_DIV,
+	OP_INT_DIV,
+	OP_MOD,
+	OP_ADD,
+	OP_SUB,
+	OP_EXP,
+	OP_AND,
+	OP_OR,
+	OP_NOT,
+	OP_XOR,
+	OP_EQV,
+	OP_IMP,
+	OP_EQU,
+	OP_GTR,
+	OP_LSS,
+	OP_LEQ,
+	OP_GEQ,
+	OP_NEQ,
+	LITERAL_STR,
+	LITERAL_INT,
+	LITERAL_FLT,
+	LITERAL_DBL,
+};
+
+static const std::string node_t_to_str[] = {
+	"UNKNOWN",
+	"ROOT",
+	"VARIABLE",
+	"PARAMETER",
+	"STMT_ASSIGN","STMT_CLEAR","STMT_DATA","STMT_DEF_FN","STMT_DIM","STMT_END",
+	"STMT_ERASE","STMT_ERROR","STMT_FOR","STMT_GOSUB","STMT_GOTO","STMT_IF","STMT_INPUT","STMT_MID","STMT_ON_ERROR_GOTO",
+	"STMT_ON_EXPR_GOTO","STMT_ON_EXPR_GOSUB","STMT_POKE","STMT_PEEK","STMT_PRINT","STMT_PRINT_SPACE","STMT_PRINT_NOSPACE",
+	"STMT_RANDOMIZE","STMT_READ","STMT_REM","STMT_RESTORE","STMT_RESUME","STMT_RESUME_NEXT","STMT_STOP","STMT_SWAP","STMT_WHILE",
+	"EXPR",
+	"OP_FUNC_CALL","OP_INDEXING","OP_NEG","OP_POS","OP_MUL","OP_FLT_DIV","OP_INT_DIV","OP_MOD","OP_ADD","OP_SUB","OP_EXP",
+	"OP_AND","OP_OR","OP_NOT","OP_XOR","OP_EQV","OP_IMP","OP_EQU","OP_GTR","OP_LSS","OP_LEQ","OP_GEQ","OP_NEQ",
+	"LITERAL_STR","LITERAL_INT","LITERAL_FLT","LITERAL_DBL" };
+
+//
+//	NODES
+//
+//	Nodes live in the ast arena and are referred to by index. The children of a node are a contiguous
+//	range of child ids, so a subtree can be referenced from several parents without copying it.
+//
+using node_id = uint32_t;
+static constexpr node_id NO_NODE = UINT32_MAX;
+
+struct node {
+	node_t type = node_t::UNKNOWN;
+	int line_number = 0;
+	uint32_t first_child = 0; //index into ast::child_ids
+	uint32_t child_count = 0;
+
+	union node_value {
+		str_id str_val;
+		float flt_val;
+		double dbl_val;
+		int int_val;
+	} value = {};
+};
+
+class ast {
+public:
+	string_pool strings;
+	node_id root = NO_NODE;
+
+	void reserve(size_t node_count) {
+		nodes.reserve(node_count);
+		child_ids.reserve(node_count);
+	}
+
+	node_id add(node_t type, int line_number = 0) {
+		node new_node;
+		new_node.type = type;
+		new_node.line_number = line_number;
+		new_node.first_child = (uint32_t)child_ids.size();
+		nodes.push_back(new_node);
+		return (node_id)(nodes.size() - 1);
+	}
+
+	node_id add(node_t type, std::span<const node_id> children, int line_number = 0) {
+		node_id id = add(type, line_number);
+		child_ids.insert(child_ids.end(), children.begin(), children.end());
+		nodes[id].child_count = (uint32_t)children.size();
+		return id;
+	}
+
+	node_id add(node_t type, std::initializer_list<node_id> children, int line_number = 0) {
+		return add(type, std::span<const node_id>(children.begin(), children.size()), line_number);
+	}
+
+	//copies the node itself, the children are shared with the original
+	node_id clone(node_id id) {
+		nodes.push_back(nodes[id]);
+		return (node_id)(nodes.size() - 1);
+	}
+
+	node& operator[](node_id id) { return nodes[id]; }
+	const node& operator[](node_id id) const { return nodes[id]; }
+
+	std::span<const node_id> children(node_id id) const {
+		const node& parent = nodes[id];
+		return std::span<const node_id>(child_ids.data() + parent.first_child, parent.child_count);
+	}
+
+	node_id child(node_id id, size_t index) const { return child_ids[nodes[id].first_child + index]; }
+	void set_child(node_id id, size_t index, node_id child) { child_ids[nodes[id].first_child + index] = child; }
+
+	size_t node_count() const { return nodes.size(); }
+
+	//deep copy of a subtree of another ast, PARAMETER nodes with index i are replaced by arguments[i]
+	node_id import(const ast& from, node_id id, std::span<const node_id> arguments = {}) {
+		const node& source = from[id];
+		if (source.type == node_t::PARAMETER && (size_t)source.value.int_val < arguments.size()) {
+			return arguments[source.value.int_val];
+		}
+
+		std::vector<node_id> children;
+		children.reserve(source.child_count);
+		for (node_id child_id : from.children(id)) children.push_back(import(from, child_id, arguments));
+
+		node_id copy = add(source.type, children, source.line_number);
+		nodes[copy].value = source.value;
+		if (source.type == node_t::LITERAL_STR) nodes[copy].value.str_val = strings.intern(from.strings.get(source.value.str_val));
+		return copy;
+	}
+
+	//drops every node and string, the allocated capacity is kept for the next line
+	void clear() {
+		nodes.clear();
+		child_ids.clear();
+		strings.clear();
+		root = NO_NODE;
+	}
+
+	std::string str(node_id id) const {
+		const node& n = nodes[id];
+		std::string ret_str = node_t_to_str[(int)n.type] + "(";
+
+		if (n.type == node_t::LITERAL_STR) {
+			ret_str += "str_value = \"" + strings.get(n.value.str_val) + "\"";
+		}
+		else if (n.type == node_t::LITERAL_INT) {
+			ret_str += "int_value = " + std::to_string(n.value.int_val);
+		}
+		else if (n.type == node_t::LITERAL_FLT) {
+			ret_str += "flt_value = " + std::to_string(n.value.flt_val);
+		}
+		else if (n.type == node_t::LITERAL_DBL) {
+			ret_str += "dbl_value = " + std::to_string(n.value.dbl_val);
+		}
+		else {
+			if (n.type != node_t::ROOT) {
+				ret_str += "line_number = " + std::to_string(n.line_number) + ", ";
+			}
+			for (node_id child_id : children(id)) {
+				ret_str += str(child_id) + ", ";
+			}
+		}
+		return ret_str + ")";
+	}
+
+	std::string str() const { return (root == NO_NODE) ? "" : str(root); }
+
+private:
+	std::vector<node> nodes;
+	std::vector<node_id> child_ids;
+};
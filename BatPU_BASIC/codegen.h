@@ -0,0 +1,977 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <optional>
+#include <unordered_set>
+#include <iostream>
+#include <cmath>
+#include <bit>
+
+#include "ast.h"
+#include "symbols.h"
+#include "parser.h"
+#include "regalloc.h"
+#include "runtime.h"
+#include "../IR.h"
+#include "../Inliner.h"
+
+//
+//	CODE GENERATOR
+//
+//	Turns the statements of the front end into BatPU assembly text for assemble(). Statements are handed
+//	over one at a time, as they come out of parse_stream(), and the .as text is complete after finish().
+//
+//	The target is an 8 bit machine, so every BASIC number is an unsigned byte:
+//		- FLT and DBL values are rounded like FLT --> INT, results wrap around at 256
+//		- / and \ are both unsigned integer divisions, x \ 0 is 255 and x MOD 0 is x
+//		- comparisons and logical operators give 255 (-1, true) or 0 (false)
+//
+//	With the FIXED or FLOAT representation of runtime.h, FLT and DBL values take two bytes instead. An
+//	operator works on them when one of its operands is a FLT or DBL, / always does, and everything else
+//	rounds them to a byte first. Their constants are not folded.
+//
+//	IF <condition> THEN <line> jumps when the condition is not 0, a FLT or DBL condition when either byte of
+//	its FIXED value or the low byte of its FLOAT value is not 0.
+//
+//	The code is first generated for an unlimited supply of virtual registers, one per variable and one per
+//	temporary, optimized by the SSA passes of IR.h and then mapped onto the machine by allocate_registers().
+//	Variables stay in registers for the whole program and only go to data memory when they are spilled. Some
+//	registers are reserved:
+//
+//		r11 r12 r13		arguments and results of the runtime routines, spill scratch
+//		r14				address and constant scratch
+//		r15				MMIO port
+//
+//	r11 is allocatable when the program calls no runtime routine, r15 when it does not use the MMIO ports.
+//	The runtime routines that were used follow the program, and inline_calls() of Inliner.h copies the short
+//	ones and the ones with a single call into their callers.
+//
+//	Constant subtrees are folded with the same 8 bit semantics as the generated code. Multiplication,
+//	division and MOD by a power of two become shifts and masks, a multiplication by a constant with few
+//	set bits becomes a shift-add sequence. Everything else calls a shift-add multiply or a restoring
+//	divide routine, which is only appended to the program when it is used.
+//
+struct codegen_report {
+	size_t instructions = 0;
+	size_t folded_constants = 0;
+	size_t strength_reductions = 0;
+	size_t runtime_calls = 0;
+	ir_report optimizer;
+	regalloc_report allocation;
+	inline_report inliner;
+
+	void print() const {
+		std::cout << "Code generator: " << instructions << " instructions\n"
+			<< "  folded constants       " << folded_constants << '\n'
+			<< "  strength reductions    " << strength_reductions << '\n'
+			<< "  runtime calls          " << runtime_calls << '\n'
+			<< "  virtual registers      " << allocation.virtual_registers << '\n'
+			<< "  registers used         " << allocation.registers_used << '\n'
+			<< "  spilled values         " << allocation.spilled_values << " in " << allocation.spill_slots << " slots, "
+			<< allocation.spill_loads << " loads, " << allocation.spill_stores << " stores\n";
+		if (!optimizer.passes.empty()) optimizer.print();
+		if (inliner.instructions_before != 0) inliner.print();
+	}
+};
+
+struct codegen_options {
+	bool fold_constants = true;
+	bool reduce_strength = true; //shifts, masks and shift-add sequences instead of runtime calls
+	bool optimize = true; //the SSA passes of IR.h
+	bool inline_calls = true; //runtime calls, by the static cost model of Inliner.h
+	flt_representation flt = flt_representation::BYTE;
+};
+
+//the 8 bit semantics of the operators, the generated code computes the same values
+inline uint8_t fold_operation(node_t op, uint8_t a, uint8_t b) {
+	switch (op)
+	{
+	case node_t::OP_NEG: return (uint8_t)-a;
+	case node_t::OP_POS: return a;
+	case node_t::OP_NOT: return (uint8_t)~a;
+	case node_t::OP_ADD: return (uint8_t)(a + b);
+	case node_t::OP_SUB: return (uint8_t)(a - b);
+	case node_t::OP_MUL: return (uint8_t)(a * b);
+	case node_t::OP_FLT_DIV:
+	case node_t::OP_INT_DIV: return (b == 0) ? 255 : (uint8_t)(a / b);
+	case node_t::OP_MOD: return (b == 0) ? a : (uint8_t)(a % b);
+	case node_t::OP_EXP: {
+		uint8_t result = 1;
+		for (int i = 0; i < b; i++) result = (uint8_t)(result * a);
+		return result;
+	}
+	case node_t::OP_AND: return a & b;
+	case node_t::OP_OR: return a | b;
+	case node_t::OP_XOR: return a ^ b;
+	case node_t::OP_EQV: return (uint8_t)~(a ^ b);
+	case node_t::OP_IMP: return (uint8_t)(~a | b);
+	case node_t::OP_EQU: return (a == b) ? 255 : 0;
+	case node_t::OP_NEQ: return (a != b) ? 255 : 0;
+	case node_t::OP_LSS: return (a < b) ? 255 : 0;
+	case node_t::OP_GTR: return (a > b) ? 255 : 0;
+	case node_t::OP_LEQ: return (a <= b) ? 255 : 0;
+	case node_t::OP_GEQ: return (a >= b) ? 255 : 0;
+	default:
+		throw std::runtime_error(std::format("The operator {} can not be folded", node_t_to_str[(int)op]));
+	}
+}
+
+//value of a numeric literal as a byte, nothing for any other node
+inline std::optional<uint8_t> constant_value(const ast& tree, node_id id) {
+	const node& n = tree[id];
+	switch (n.type)
+	{
+	case node_t::LITERAL_INT: return (uint8_t)n.value.int_val;
+	case node_t::LITERAL_FLT: return (uint8_t)(int)round(n.value.flt_val);
+	case node_t::LITERAL_DBL: return (uint8_t)(int)round(n.value.dbl_val);
+	default: return std::nullopt;
+	}
+}
+
+//value of a numeric literal
+inline double literal_value(const ast& tree, node_id id) {
+	const node& n = tree[id];
+	switch (n.type)
+	{
+	case node_t::LITERAL_FLT: return n.value.flt_val;
+	case node_t::LITERAL_DBL: return n.value.dbl_val;
+	default: return n.value.int_val;
+	}
+}
+
+//character display code, ' ' a-z . ! ?
+inline std::optional<uint8_t> display_char_code(char c) {
+	if (c == ' ') return 0;
+	if (c >= 'a' && c <= 'z') return (uint8_t)(c - 'a' + 1);
+	if (c >= 'A' && c <= 'Z') return (uint8_t)(c - 'A' + 1);
+	if (c == '.') return 27;
+	if (c == '!') return 28;
+	if (c == '?') return 29;
+	return std::nullopt;
+}
+
+//virtual registers of a 16 bit FLT or DBL value, -1 when there are none yet
+struct wide_value {
+	int hi = -1;
+	int lo = -1;
+};
+
+class code_generator {
+public:
+	codegen_options options;
+	codegen_report report;
+
+	explicit code_generator(const symbol_table& symbols, codegen_options options = {}) : options(options), symbols(symbols) {}
+
+	void clear() {
+		lines.clear();
+		report = {};
+		defined_lines.clear();
+		variable_vregs.clear();
+		is_variable.clear();
+		current_line = -1;
+		port.clear();
+		label_count = 0;
+		used_routines.clear();
+		uses_mmio = false;
+	}
+
+	//folds the constants of the statement in place and appends its code
+	void generate(ast& tree, node_id stmt) {
+		node_t stmt_type = tree[stmt].type;
+		int line_number = tree[stmt].line_number;
+
+		if (line_number != current_line) {
+			current_line = line_number;
+			defined_lines.insert(line_number);
+			lines.push_back({ std::format(".line_{}", line_number) });
+			port.clear();
+		}
+
+		folded_ids.assign(tree.node_count(), NO_NODE);
+
+		switch (stmt_type)
+		{
+		case node_t::STMT_ASSIGN: {
+			node_id variable = tree.child(stmt, 0);
+			if (variable_get_type(tree, variable) == node_t::LITERAL_STR)
+				throw std::runtime_error(std::format("String variables are not supported by the code generator, line {}", line_number));
+
+			node_id value = fold(tree, variable_get_value(tree, variable));
+			if (is_wide(tree, variable)) {
+				emit_wide(tree, value, line_number, variable_pair(tree, variable));
+			}
+			else {
+				emit_expression(tree, value, line_number, variable_vreg(tree, variable));
+			}
+			break;
+		}
+		case node_t::STMT_PRINT: {
+			bool uses_chars = false;
+			for (node_id item : tree.children(stmt)) {
+				node_id expression = tree.child(item, 0);
+				if (tree[expression].type == node_t::LITERAL_STR) {
+					if (!uses_chars) {
+						set_port("clear_chars_buffer");
+						emit({ "str", "r15", "r0" });
+						uses_chars = true;
+					}
+					set_port("write_char");
+					for (char c : tree.strings.get(tree[expression].value.str_val)) {
+						std::optional<uint8_t> char_code = display_char_code(c);
+						if (!char_code)
+							throw std::runtime_error(std::format("The character '{}' on line {} can not be shown on the character display", c, line_number));
+						if (*char_code == 0) {
+							emit({ "str", "r15", "r0" });
+						}
+						else {
+							emit({ "ldi", "r14", std::to_string(*char_code) });
+							emit({ "str", "r15", "r14" });
+						}
+					}
+				}
+				else {
+					int value = emit_expression(tree, fold(tree, expression), line_number);
+					set_port("show_number");
+					emit({ "str", "r15", vreg_name(value) });
+				}
+
+				if (tree[item].type == node_t::STMT_PRINT_SPACE && uses_chars) {
+					set_port("write_char");
+					emit({ "str", "r15", "r0" });
+				}
+			}
+			if (uses_chars) {
+				set_port("buffer_chars");
+				emit({ "str", "r15", "r0" });
+			}
+			break;
+		}
+		case node_t::STMT_GOTO:
+			emit({ "jmp", std::format(".line_{}", tree[tree.child(stmt, 0)].value.int_val) });
+			break;
+
+		case node_t::STMT_IF: {
+			node_id condition = fold(tree, tree.child(stmt, 0));
+			std::string target = std::format(".line_{}", tree[tree.child(stmt, 1)].value.int_val);
+			std::optional<uint16_t> constant = wide_constant(tree, condition);
+			if (!is_wide(tree, condition)) constant = byte_constant(tree, condition);
+			if (constant) {
+				if (*constant != 0) emit({ "jmp", target });
+			}
+			else if (is_wide(tree, condition)) {
+				wide_value value = emit_wide(tree, condition, line_number);
+				if (options.flt == flt_representation::FIXED) {
+					emit({ "cmp", vreg_name(value.hi), "r0" });
+					emit({ "brh", "notzero", target });
+				}
+				emit({ "cmp", vreg_name(value.lo), "r0" });
+				emit({ "brh", "notzero", target });
+			}
+			else {
+				int value = emit_expression(tree, condition, line_number);
+				emit({ "cmp", vreg_name(value), "r0" });
+				emit({ "brh", "notzero", target });
+			}
+			break;
+		}
+
+		case node_t::STMT_END:
+		case node_t::STMT_STOP:
+			emit({ "hlt" });
+			break;
+
+		case node_t::STMT_REM:
+			lines.push_back({ "// " + tree.strings.get(tree[tree.child(stmt, 0)].value.str_val) });
+			break;
+
+		case node_t::STMT_DEF_FN:
+			//the calls are already instantiated by the parser
+			break;
+
+		default:
+			throw std::runtime_error(std::format("{} on line {} is not supported by the code generator", node_t_to_str[(int)stmt_type], line_number));
+		}
+	}
+
+	//allocates the registers and returns the complete program, the runtime routines that were used are
+	//appended after the final hlt and inlined. Called once, after the last statement.
+	std::string finish() {
+		for (int target : symbols.jmp_list) {
+			if (!defined_lines.contains(target))
+				throw std::runtime_error(std::format("GOTO to the undefined line {}", target));
+		}
+		emit({ "hlt" });
+
+		if (options.optimize) optimize_lines(lines, report.optimizer);
+
+		//r12 r13 r14 stay free for the spill code, the runtime routines keep the registers they use
+		std::vector<int> allocatable_registers;
+		for (int reg : { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 15 }) {
+			bool is_reserved = (reg == 15 && uses_mmio);
+			for (const runtime_routine& routine : runtime_library()) {
+				if (is_linked(routine) && std::ranges::find(routine.clobbered_registers, reg) != routine.clobbered_registers.end()) is_reserved = true;
+			}
+			if (!is_reserved) allocatable_registers.push_back(reg);
+		}
+		report.allocation = allocate_registers(lines, allocatable_registers);
+
+		for (const runtime_routine& routine : runtime_library()) {
+			if (!is_linked(routine)) continue;
+			lines.push_back({});
+			lines.insert(lines.end(), routine.lines.begin(), routine.lines.end());
+		}
+		if (options.inline_calls && !inline_calls(lines, report.inliner))
+			throw std::runtime_error(std::format("The program does not fit the hardware call stack : {}", report.inliner.errors.front()));
+
+		std::string program;
+		report.instructions += render_lines(program, lines);
+		return program;
+	}
+
+private:
+	static constexpr int NO_VREG = -1;
+
+	void emit(codegen_line&& instruction) {
+		lines.push_back(std::move(instruction));
+	}
+
+	bool is_linked(const runtime_routine& routine) const {
+		return std::ranges::any_of(routine.entry_points, [&](const std::string& entry_point) { return used_routines.contains(entry_point); });
+	}
+
+	std::string new_label() {
+		return std::format(".__l{}", label_count++);
+	}
+
+	//r15 keeps the last port within a line, the expression code never writes it
+	void set_port(const std::string& port_name) {
+		uses_mmio = true;
+		if (port == port_name) return;
+		emit({ "ldi", "r15", port_name });
+		port = port_name;
+	}
+
+	//
+	//	VIRTUAL REGISTERS
+	//
+	//	A temporary is read by exactly one instruction sequence, so it may be changed in place. A variable
+	//	may only be written by its assignment.
+	//
+	int new_vreg() {
+		is_variable.push_back(false);
+		return (int)is_variable.size() - 1;
+	}
+
+	static std::string vreg_name(int vreg) {
+		return "v" + std::to_string(vreg);
+	}
+
+	int variable_vreg(const ast& tree, node_id variable) {
+		symbol_id symbol = variable_get_symbol(tree, variable);
+		if (symbol >= variable_vregs.size()) variable_vregs.resize(symbol + 1, NO_VREG);
+		if (variable_vregs[symbol] == NO_VREG) {
+			variable_vregs[symbol] = new_vreg();
+			is_variable[variable_vregs[symbol]] = true;
+			if (is_wide(tree, variable)) is_variable[new_vreg()] = true;
+		}
+		return variable_vregs[symbol];
+	}
+
+	//register for a result, the target when the caller asked for one
+	int result_vreg(int target) {
+		return (target == NO_VREG) ? new_vreg() : target;
+	}
+
+	int copy_to(int source, int target) {
+		if (target == NO_VREG || target == source) return source;
+		emit({ "mov", vreg_name(source), vreg_name(target) });
+		return target;
+	}
+
+	//register holding the value of source that an in place instruction (adi) may change
+	int writable_copy(int source, int target) {
+		if (target == NO_VREG && !is_variable[source]) return source;
+		int copy = result_vreg(target);
+		if (copy != source) emit({ "mov", vreg_name(source), vreg_name(copy) });
+		return copy;
+	}
+
+	//
+	//	CONSTANT FOLDING
+	//
+	//	Rewrites the subtree bottom up and returns the id that replaces it. A subtree can be shared by
+	//	several parents after FN inlining, so every node is folded once and the result is remembered.
+	//
+	node_id fold(ast& tree, node_id id) {
+		if (id >= folded_ids.size()) return id;
+		if (folded_ids[id] != NO_NODE) return folded_ids[id];
+
+		node_id result = id;
+		node_t type = tree[id].type;
+
+		if (type == node_t::EXPR) {
+			node_id inner = fold(tree, tree.child(id, 0));
+			tree.set_child(id, 0, inner);
+			if (constant_value(tree, inner)) result = inner;
+		}
+		else if ((type == node_t::LITERAL_FLT || type == node_t::LITERAL_DBL) && options.flt == flt_representation::BYTE) {
+			result = create_literal_int(tree, *constant_value(tree, id));
+		}
+		else if (is_node_op(type) && type != node_t::OP_INDEXING && type != node_t::OP_FUNC_CALL) {
+			bool is_constant = true;
+			uint8_t operands[2] = {};
+			for (size_t i = 0; i < tree[id].child_count; i++) {
+				node_id operand = fold(tree, tree.child(id, i));
+				tree.set_child(id, i, operand);
+				std::optional<uint8_t> value = is_wide(tree, operand) ? std::nullopt : constant_value(tree, operand);
+				is_constant = is_constant && value.has_value();
+				if (value) operands[i] = *value;
+			}
+			if (is_constant && options.fold_constants && !is_wide(tree, id)) {
+				result = create_literal_int(tree, fold_operation(type, operands[0], operands[1]));
+				report.folded_constants++;
+			}
+		}
+
+		folded_ids[id] = result;
+		return result;
+	}
+
+	//
+	//	EXPRESSIONS
+	//
+	//	Returns the register holding the value. With a target the value ends up in the target, which is
+	//	only written after the last read of the operands, so a variable can be its own operand.
+	//
+	int emit_expression(const ast& tree, node_id id, int line_number, int target = NO_VREG) {
+		const node& n = tree[id];
+
+		if (std::optional<uint8_t> value = byte_constant(tree, id)) {
+			int result = result_vreg(target);
+			emit({ "ldi", vreg_name(result), std::to_string(*value) });
+			return result;
+		}
+		if (is_wide(tree, id)) return emit_narrow(emit_wide(tree, id, line_number), target);
+
+		switch (n.type)
+		{
+		case node_t::VARIABLE:
+			return copy_to(variable_vreg(tree, id), target);
+
+		case node_t::EXPR:
+		case node_t::OP_POS:
+			return emit_expression(tree, tree.child(id, 0), line_number, target);
+
+		case node_t::OP_NEG:
+		case node_t::OP_NOT: {
+			int operand = emit_expression(tree, tree.child(id, 0), line_number);
+			int result = result_vreg(target);
+			emit({ (n.type == node_t::OP_NEG) ? "neg" : "not", vreg_name(operand), vreg_name(result) });
+			return result;
+		}
+
+		case node_t::LITERAL_STR:
+			throw std::runtime_error(std::format("String expressions are not supported by the code generator, line {}", line_number));
+
+		case node_t::OP_INDEXING:
+		case node_t::OP_FUNC_CALL:
+			throw std::runtime_error(std::format("Arrays are not supported by the code generator, line {}", line_number));
+
+		default:
+			return emit_binary(tree, n.type, tree.child(id, 0), tree.child(id, 1), line_number, target);
+		}
+	}
+
+	int emit_binary(const ast& tree, node_t op, node_id a, node_id b, int line_number, int target) {
+		bool is_commutative = op == node_t::OP_ADD || op == node_t::OP_MUL || op == node_t::OP_AND || op == node_t::OP_OR
+			|| op == node_t::OP_XOR || op == node_t::OP_EQV || op == node_t::OP_EQU || op == node_t::OP_NEQ;
+		if (is_comparison(op) && (is_wide(tree, a) || is_wide(tree, b))) return emit_wide_compare(tree, op, a, b, line_number, target);
+		if (is_commutative && byte_constant(tree, a) && !byte_constant(tree, b)) std::swap(a, b);
+
+		std::optional<uint8_t> constant = byte_constant(tree, b);
+		int operand_a = emit_expression(tree, a, line_number);
+
+		//operations with a constant right operand that need no second register
+		if (constant && (options.reduce_strength || op == node_t::OP_ADD || op == node_t::OP_SUB || op == node_t::OP_EXP)) {
+			uint8_t c = *constant;
+			bool is_power_of_two = std::has_single_bit(c);
+			int shift = std::countr_zero(c);
+
+			switch (op)
+			{
+			case node_t::OP_ADD:
+			case node_t::OP_SUB: {
+				if (c == 0) return copy_to(operand_a, target);
+				int result = writable_copy(operand_a, target);
+				emit({ "adi", vreg_name(result), std::to_string((op == node_t::OP_ADD) ? c : (uint8_t)-c) });
+				return result;
+			}
+			case node_t::OP_MUL: {
+				int result = emit_multiply_constant(operand_a, c, target);
+				if (result != NO_VREG) return result;
+				break;
+			}
+			case node_t::OP_FLT_DIV:
+			case node_t::OP_INT_DIV:
+				if (is_power_of_two) {
+					report.strength_reductions++;
+					if (c == 1) return copy_to(operand_a, target);
+					int result = result_vreg(target);
+					emit({ "rsh", vreg_name(operand_a), vreg_name(result) });
+					for (int i = 1; i < shift; i++) emit({ "rsh", vreg_name(result), vreg_name(result) });
+					return result;
+				}
+				break;
+			case node_t::OP_MOD:
+				if (is_power_of_two) {
+					report.strength_reductions++;
+					int result = result_vreg(target);
+					if (c == 1) {
+						emit({ "ldi", vreg_name(result), "0" });
+					}
+					else {
+						int mask = new_vreg();
+						emit({ "ldi", vreg_name(mask), std::to_string(c - 1) });
+						emit({ "and", vreg_name(operand_a), vreg_name(mask), vreg_name(result) });
+					}
+					return result;
+				}
+				break;
+			case node_t::OP_EXP:
+				return emit_power(operand_a, c, target);
+			default:
+				break;
+			}
+		}
+		else if (op == node_t::OP_EXP) {
+			throw std::runtime_error(std::format("Only constant exponents are supported by the code generator, line {}", line_number));
+		}
+
+		int operand_b = emit_expression(tree, b, line_number);
+		int result = result_vreg(target);
+		std::string r_a = vreg_name(operand_a), r_b = vreg_name(operand_b), r = vreg_name(result);
+
+		switch (op)
+		{
+		case node_t::OP_ADD: emit({ "add", r_a, r_b, r }); break;
+		case node_t::OP_SUB: emit({ "sub", r_a, r_b, r }); break;
+		case node_t::OP_AND: emit({ "and", r_a, r_b, r }); break;
+		case node_t::OP_XOR: emit({ "xor", r_a, r_b, r }); break;
+		case node_t::OP_OR:
+			emit({ "nor", r_a, r_b, r });
+			emit({ "not", r, r });
+			break;
+		case node_t::OP_EQV:
+			emit({ "xor", r_a, r_b, r });
+			emit({ "not", r, r });
+			break;
+		case node_t::OP_IMP: {
+			//b is still read after the first write, so that write can not go to the target
+			std::string not_a = vreg_name(new_vreg());
+			emit({ "not", r_a, not_a });
+			emit({ "nor", not_a, r_b, r });
+			emit({ "not", r, r });
+			break;
+		}
+		case node_t::OP_MUL:
+			emit_runtime_call(".__mul", r_a, r_b, "r13", r);
+			break;
+		case node_t::OP_FLT_DIV:
+		case node_t::OP_INT_DIV:
+			emit_runtime_call(".__div", r_a, r_b, "r11", r);
+			break;
+		case node_t::OP_MOD:
+			emit_runtime_call(".__div", r_a, r_b, "r13", r);
+			break;
+
+		//cmp sets C when a >= b and Z when a == b, the result is set to 255 unless the branch skips it
+		case node_t::OP_EQU: emit_compare(r_a, r_b, "notzero", r); break;
+		case node_t::OP_NEQ: emit_compare(r_a, r_b, "zero", r); break;
+		case node_t::OP_LSS: emit_compare(r_a, r_b, "carry", r); break;
+		case node_t::OP_GEQ: emit_compare(r_a, r_b, "notcarry", r); break;
+		case node_t::OP_GTR: emit_compare(r_b, r_a, "carry", r); break;
+		case node_t::OP_LEQ: emit_compare(r_b, r_a, "notcarry", r); break;
+
+		default:
+			throw std::runtime_error(std::format("{} on line {} is not supported by the code generator", node_t_to_str[(int)op], line_number));
+		}
+		return result;
+	}
+
+	static bool is_comparison(node_t op) {
+		return op == node_t::OP_EQU || op == node_t::OP_NEQ || op == node_t::OP_LSS || op == node_t::OP_GTR || op == node_t::OP_LEQ || op == node_t::OP_GEQ;
+	}
+
+	void emit_compare(const std::string& a, const std::string& b, const std::string& skip_condition, const std::string& result) {
+		emit({ "cmp", a, b });
+		emit_flag_result(skip_condition, result);
+	}
+
+	//255 unless the flags of the last comparison meet the skip condition, ldi leaves the flags alone
+	void emit_flag_result(const std::string& skip_condition, const std::string& result) {
+		std::string skip = new_label();
+		emit({ "ldi", result, "0" });
+		emit({ "brh", skip_condition, skip });
+		emit({ "ldi", result, "255" });
+		lines.push_back({ skip });
+	}
+
+	//x * c with shifts and adds when c has at most 3 set bits, NO_VREG if the runtime has to be called
+	int emit_multiply_constant(int operand, uint8_t c, int target) {
+		if (c != 0 && c != 1 && c != 255 && std::popcount(c) > 3) return NO_VREG;
+		report.strength_reductions++;
+
+		if (c == 1) return copy_to(operand, target);
+
+		int result = result_vreg(target);
+		std::string r = vreg_name(result);
+		if (c == 0) {
+			emit({ "ldi", r, "0" });
+			return result;
+		}
+		if (c == 255) {
+			emit({ "neg", vreg_name(operand), r });
+			return result;
+		}
+
+		//the operand is only read by the first instruction
+		int bit = std::countr_zero(c);
+		if (bit == 0) {
+			emit({ "mov", vreg_name(operand), r });
+		}
+		else {
+			emit({ "lsh", vreg_name(operand), r });
+			for (int i = 1; i < bit; i++) emit({ "lsh", r, r });
+		}
+		if (std::popcount(c) == 1) return result;
+
+		std::string shifted = vreg_name(new_vreg());
+		emit({ "mov", r, shifted });
+		for (int next = bit + 1; next < 8; next++) {
+			if (!(c & (1 << next))) continue;
+			for (; bit < next; bit++) emit({ "lsh", shifted, shifted });
+			emit({ "add", r, shifted, r });
+		}
+		return result;
+	}
+
+	//x ^ c by squaring
+	int emit_power(int operand, uint8_t c, int target) {
+		if (c == 1) return copy_to(operand, target);
+
+		int result = result_vreg(target);
+		std::string r = vreg_name(result);
+		if (c == 0) {
+			emit({ "ldi", r, "1" });
+			return result;
+		}
+
+		std::string base = vreg_name(new_vreg());
+		emit({ "mov", vreg_name(operand), base });
+		bool has_result = false;
+		for (uint8_t bits = c; bits != 0; bits >>= 1) {
+			if (bits & 1) {
+				if (has_result) {
+					emit_runtime_call(".__mul", r, base, "r13", r);
+				}
+				else {
+					emit({ "mov", base, r });
+					has_result = true;
+				}
+			}
+			if (bits > 1) emit_runtime_call(".__mul", base, base, "r13", base);
+		}
+		return result;
+	}
+
+	//the runtime leaves r1-r10 alone
+	void emit_runtime_call(const std::string& routine, const std::string& a, const std::string& b, const std::string& runtime_result, const std::string& result) {
+		emit({ "mov", a, "r11" });
+		emit({ "mov", b, "r12" });
+		emit({ "cal", routine });
+		emit({ "mov", runtime_result, result });
+		used_routines.insert(routine);
+		report.runtime_calls++;
+	}
+
+	//
+	//	FLT AND DBL
+	//
+	//	A FLT or DBL value in the FIXED or FLOAT representation is a pair of registers, high byte first.
+	//	Fixed point addition, subtraction and comparison are inlined, everything else calls the runtime.
+	//
+	bool is_wide(const ast& tree, node_id id) const {
+		if (options.flt == flt_representation::BYTE) return false;
+
+		switch (tree[id].type)
+		{
+		case node_t::LITERAL_FLT:
+		case node_t::LITERAL_DBL:
+		case node_t::OP_FLT_DIV:
+			return true;
+		case node_t::VARIABLE: {
+			node_t type = variable_get_type(tree, id);
+			return type == node_t::LITERAL_FLT || type == node_t::LITERAL_DBL;
+		}
+		case node_t::EXPR:
+		case node_t::OP_POS:
+		case node_t::OP_NEG:
+		case node_t::OP_EXP:
+			return is_wide(tree, tree.child(id, 0));
+		case node_t::OP_ADD:
+		case node_t::OP_SUB:
+		case node_t::OP_MUL:
+			return is_wide(tree, tree.child(id, 0)) || is_wide(tree, tree.child(id, 1));
+		default:
+			return false;
+		}
+	}
+
+	//value of a constant where a byte is expected, FLT and DBL constants are rounded like the runtime rounds them
+	std::optional<uint8_t> byte_constant(const ast& tree, node_id id) const {
+		node_t type = tree[id].type;
+		if (options.flt != flt_representation::BYTE && (type == node_t::LITERAL_FLT || type == node_t::LITERAL_DBL))
+			return wide_to_byte(options.flt, encode_wide(options.flt, literal_value(tree, id)));
+		return constant_value(tree, id);
+	}
+
+	std::optional<uint16_t> wide_constant(const ast& tree, node_id id) const {
+		node_t type = tree[id].type;
+		if (type == node_t::LITERAL_FLT || type == node_t::LITERAL_DBL) return encode_wide(options.flt, literal_value(tree, id));
+		if (std::optional<uint8_t> value = constant_value(tree, id)) return encode_wide(options.flt, *value);
+		return std::nullopt;
+	}
+
+	wide_value variable_pair(const ast& tree, node_id variable) {
+		int hi = variable_vreg(tree, variable);
+		return { hi, hi + 1 };
+	}
+
+	wide_value result_pair(wide_value target) {
+		if (target.hi != NO_VREG) return target;
+		int hi = new_vreg();
+		return { hi, new_vreg() };
+	}
+
+	wide_value copy_pair(wide_value source, wide_value target) {
+		if (target.hi == NO_VREG || target.hi == source.hi) return source;
+		emit({ "mov", vreg_name(source.hi), vreg_name(target.hi) });
+		emit({ "mov", vreg_name(source.lo), vreg_name(target.lo) });
+		return target;
+	}
+
+	wide_value emit_wide(const ast& tree, node_id id, int line_number, wide_value target = {}) {
+		if (std::optional<uint16_t> value = wide_constant(tree, id)) {
+			wide_value result = result_pair(target);
+			emit({ "ldi", vreg_name(result.hi), std::to_string(*value >> 8) });
+			emit({ "ldi", vreg_name(result.lo), std::to_string(*value & 255) });
+			return result;
+		}
+		if (!is_wide(tree, id)) return emit_widen(emit_expression(tree, id, line_number), target);
+
+		const node& n = tree[id];
+		switch (n.type)
+		{
+		case node_t::VARIABLE:
+			return copy_pair(variable_pair(tree, id), target);
+
+		case node_t::EXPR:
+		case node_t::OP_POS:
+			return emit_wide(tree, tree.child(id, 0), line_number, target);
+
+		case node_t::OP_NEG:
+			return emit_wide_negate(emit_wide(tree, tree.child(id, 0), line_number), target);
+
+		case node_t::OP_EXP: {
+			std::optional<uint8_t> exponent = byte_constant(tree, tree.child(id, 1));
+			if (!exponent)
+				throw std::runtime_error(std::format("Only constant exponents are supported by the code generator, line {}", line_number));
+			return emit_wide_power(emit_wide(tree, tree.child(id, 0), line_number), *exponent, target);
+		}
+
+		default: {
+			wide_value a = emit_wide(tree, tree.child(id, 0), line_number);
+			wide_value b = emit_wide(tree, tree.child(id, 1), line_number);
+			return emit_wide_arithmetic(n.type, a, b, target);
+		}
+		}
+	}
+
+	wide_value emit_wide_arithmetic(node_t op, wide_value a, wide_value b, wide_value target) {
+		wide_value result = result_pair(target);
+
+		//the carry of the low bytes goes into the high byte, which is written first
+		if (options.flt == flt_representation::FIXED && (op == node_t::OP_ADD || op == node_t::OP_SUB)) {
+			bool is_add = op == node_t::OP_ADD;
+			std::string skip = new_label();
+			emit({ is_add ? "add" : "sub", vreg_name(a.hi), vreg_name(b.hi), vreg_name(result.hi) });
+			emit({ is_add ? "add" : "sub", vreg_name(a.lo), vreg_name(b.lo), vreg_name(result.lo) });
+			emit({ "brh", is_add ? "notcarry" : "carry", skip });
+			emit({ is_add ? "inc" : "dec", vreg_name(result.hi) });
+			lines.push_back({ skip });
+			return result;
+		}
+
+		bool is_fixed = options.flt == flt_representation::FIXED;
+		std::string routine;
+		switch (op)
+		{
+		case node_t::OP_ADD: routine = ".__fadd"; break;
+		case node_t::OP_SUB: routine = ".__fsub"; break;
+		case node_t::OP_MUL: routine = is_fixed ? ".__fxmul" : ".__fmul"; break;
+		default: routine = is_fixed ? ".__fxdiv" : ".__fdiv"; break;
+		}
+		emit_wide_call(routine, a, b);
+		emit({ "mov", "r7", vreg_name(result.hi) });
+		emit({ "mov", "r8", vreg_name(result.lo) });
+		return result;
+	}
+
+	wide_value emit_wide_negate(wide_value a, wide_value target) {
+		wide_value result = result_pair(target);
+		std::string skip = new_label();
+
+		if (options.flt == flt_representation::FIXED) {
+			emit({ "neg", vreg_name(a.hi), vreg_name(result.hi) });
+			emit({ "sub", "r0", vreg_name(a.lo), vreg_name(result.lo) });
+			emit({ "brh", "carry", skip });
+			emit({ "dec", vreg_name(result.hi) });
+			lines.push_back({ skip });
+			return result;
+		}
+
+		//flips the sign bit, unless the value is 0
+		std::string sign = vreg_name(new_vreg());
+		emit({ "ldi", sign, "128" });
+		emit({ "cmp", vreg_name(a.lo), "r0" });
+		emit({ "brh", "notzero", skip });
+		emit({ "ldi", sign, "0" });
+		lines.push_back({ skip });
+		emit({ "xor", vreg_name(a.hi), sign, vreg_name(result.hi) });
+		emit({ "mov", vreg_name(a.lo), vreg_name(result.lo) });
+		return result;
+	}
+
+	//x ^ c by squaring
+	wide_value emit_wide_power(wide_value a, uint8_t c, wide_value target) {
+		if (c == 1) return copy_pair(a, target);
+
+		wide_value result = result_pair(target);
+		if (c == 0) {
+			uint16_t one = encode_wide(options.flt, 1);
+			emit({ "ldi", vreg_name(result.hi), std::to_string(one >> 8) });
+			emit({ "ldi", vreg_name(result.lo), std::to_string(one & 255) });
+			return result;
+		}
+
+		wide_value base = copy_pair(a, result_pair({}));
+		bool has_result = false;
+		for (uint8_t bits = c; bits != 0; bits >>= 1) {
+			if (bits & 1) {
+				if (has_result) {
+					emit_wide_arithmetic(node_t::OP_MUL, result, base, result);
+				}
+				else {
+					copy_pair(base, result);
+					has_result = true;
+				}
+			}
+			if (bits > 1) emit_wide_arithmetic(node_t::OP_MUL, base, base, base);
+		}
+		return result;
+	}
+
+	//the flags of a cmp of the two values are turned into 255 or 0 like for bytes
+	int emit_wide_compare(const ast& tree, node_t op, node_id a, node_id b, int line_number, int target) {
+		wide_value value_a = emit_wide(tree, a, line_number);
+		wide_value value_b = emit_wide(tree, b, line_number);
+		if (op == node_t::OP_GTR || op == node_t::OP_LEQ) std::swap(value_a, value_b);
+
+		if (options.flt == flt_representation::FIXED) {
+			std::string decided = new_label();
+			emit({ "cmp", vreg_name(value_a.hi), vreg_name(value_b.hi) });
+			emit({ "brh", "notzero", decided });
+			emit({ "cmp", vreg_name(value_a.lo), vreg_name(value_b.lo) });
+			lines.push_back({ decided });
+		}
+		else {
+			emit_wide_call(".__fcmp", value_a, value_b);
+		}
+
+		int result = result_vreg(target);
+		switch (op)
+		{
+		case node_t::OP_EQU: emit_flag_result("notzero", vreg_name(result)); break;
+		case node_t::OP_NEQ: emit_flag_result("zero", vreg_name(result)); break;
+		case node_t::OP_LSS:
+		case node_t::OP_GTR: emit_flag_result("carry", vreg_name(result)); break;
+		default: emit_flag_result("notcarry", vreg_name(result)); break;
+		}
+		return result;
+	}
+
+	//a byte as a FLT
+	wide_value emit_widen(int value, wide_value target) {
+		wide_value result = result_pair(target);
+		if (options.flt == flt_representation::FIXED) {
+			copy_to(value, result.hi);
+			emit({ "ldi", vreg_name(result.lo), "0" });
+			return result;
+		}
+
+		emit({ "mov", vreg_name(value), "r8" });
+		emit({ "cal", ".__fbyte" });
+		emit({ "mov", "r7", vreg_name(result.hi) });
+		emit({ "mov", "r8", vreg_name(result.lo) });
+		used_routines.insert(".__fbyte");
+		report.runtime_calls++;
+		return result;
+	}
+
+	//a FLT rounded to a byte
+	int emit_narrow(wide_value value, int target) {
+		int result = result_vreg(target);
+		if (options.flt == flt_representation::FIXED) {
+			//add sets the carry when the fraction is 0.5 or more
+			std::string skip = new_label();
+			emit({ "mov", vreg_name(value.hi), vreg_name(result) });
+			emit({ "add", vreg_name(value.lo), vreg_name(value.lo), "r0" });
+			emit({ "brh", "notcarry", skip });
+			emit({ "inc", vreg_name(result) });
+			lines.push_back({ skip });
+			return result;
+		}
+
+		emit({ "mov", vreg_name(value.hi), "r7" });
+		emit({ "mov", vreg_name(value.lo), "r8" });
+		emit({ "cal", ".__fint" });
+		emit({ "mov", "r8", vreg_name(result) });
+		used_routines.insert(".__fint");
+		report.runtime_calls++;
+		return result;
+	}
+
+	//A goes to r7:r8 and B to r9:r10, away from r12 and r14 which the spill code of the moves may use
+	void emit_wide_call(const std::string& routine, wide_value a, wide_value b) {
+		emit({ "mov", vreg_name(a.hi), "r7" });
+		emit({ "mov", vreg_name(a.lo), "r8" });
+		emit({ "mov", vreg_name(b.hi), "r9" });
+		emit({ "mov", vreg_name(b.lo), "r10" });
+		emit({ "cal", routine });
+		used_routines.insert(routine);
+		report.runtime_calls++;
+	}
+
+	const symbol_table& symbols;
+	std::vector<codegen_line> lines;
+	std::unordered_set<int> defined_lines;
+	std::vector<int> variable_vregs; //by symbol id
+	std::vector<bool> is_variable; //by virtual register
+	std::vector<node_id> folded_ids;
+	int current_line = -1;
+	std::string port; //MMIO port in r15, empty when unknown
+	size_t label_count = 0;
+	std::unordered_set<std::string> used_routines; //entry points of the runtime
+	bool uses_mmio = false;
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "parser.h"
+#include "codegen.h"
+
+//
+//	COMPILER
+//
+//	A compiler owns all the state of a compilation: the ast arena, the symbol table, the code generator
+//	and the diagnostics.
+//	The parser only works on the state it is handed, so compilers on different threads share nothing
+//	and need no locking. A compiler can be reused for the next file, the arena keeps its capacity.
+//
+//	An error ends the line it was found on, the rest of the file is still parsed so one compile reports
+//	every bad line. The assembly is only kept when there were no diagnostics.
+//
+struct diagnostic {
+	std::string filename;
+	int line_number = 0; //BASIC line number, 0 when the line number itself could not be read
+	std::string message;
+
+	std::string str() const {
+		return std::format("{}.bas : line {} : {}", filename, line_number, message);
+	}
+};
+
+class compiler {
+public:
+	ast tree;
+	symbol_table symbols;
+	code_generator codegen{ symbols };
+	std::vector<diagnostic> diagnostics;
+	size_t statement_count = 0;
+	std::string assembly; //BatPU assembly of the last compile
+
+	explicit compiler(statement_consumer consumer = {}) : consumer(std::move(consumer)) {}
+
+	//returns true when the file compiled without diagnostics
+	bool compile(const std::string& filename) {
+		reset();
+		std::ifstream file(filename + ".bas");
+		if (!file) {
+			diagnostics.push_back({ filename, 0, "Could not open the file" });
+			return false;
+		}
+		return compile_stream(file, filename);
+	}
+
+	bool compile(std::istream& input, const std::string& filename) {
+		reset();
+		return compile_stream(input, filename);
+	}
+
+private:
+	void reset() {
+		tree.clear();
+		symbols.clear();
+		codegen.clear();
+		diagnostics.clear();
+		statement_count = 0;
+		assembly.clear();
+	}
+
+	bool compile_stream(std::istream& input, const std::string& filename) {
+		parse_stream(input, tree, symbols,
+			[&](ast& tree, node_id stmt) {
+				statement_count++;
+				if (consumer) consumer(tree, stmt);
+				codegen.generate(tree, stmt);
+			},
+			true,
+			[&](int line_number, const std::exception& error) {
+				diagnostics.push_back({ filename, line_number, error.what() });
+			});
+		if (!diagnostics.empty()) return false;
+
+		try {
+			assembly = codegen.finish();
+		}
+		catch (const std::exception& error) {
+			diagnostics.push_back({ filename, 0, error.what() });
+		}
+		return diagnostics.empty();
+	}
+
+	statement_consumer consumer;
+};
+
+//
+//	BATCH DRIVER
+//
+//	Compiles a list of files on a pool of threads. Every worker owns one compiler and takes the next file
+//	from a shared counter, so a long file does not hold back the others. The results are in the order of
+//	the filenames, each with its own diagnostics.
+//
+struct compile_result {
+	std::string filename;
+	bool success = false;
+	size_t statement_count = 0;
+	std::vector<diagnostic> diagnostics;
+	std::string assembly;
+	double milliseconds = 0;
+};
+
+inline std::vector<compile_result> compile_batch(const std::vector<std::string>& filenames, const codegen_options& options = {}, size_t thread_count = 0) {
+	if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+	thread_count = std::min(thread_count, filenames.size());
+
+	std::vector<compile_result> results(filenames.size());
+	std::atomic<size_t> next_file = 0;
+
+	auto worker = [&]() {
+		compiler file_compiler;
+		file_compiler.codegen.options = options;
+		for (size_t i = next_file++; i < filenames.size(); i = next_file++) {
+			auto start = std::chrono::steady_clock::now();
+			compile_result& result = results[i];
+			result.filename = filenames[i];
+			result.success = file_compiler.compile(filenames[i]);
+			result.statement_count = file_compiler.statement_count;
+			result.diagnostics = std::move(file_compiler.diagnostics);
+			result.assembly = std::move(file_compiler.assembly);
+			result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+	};
+
+	//the calling thread is one of the workers
+	std::vector<std::thread> pool;
+	for (size_t i = 1; i < thread_count; i++) pool.emplace_back(worker);
+	worker();
+	for (std::thread& thread : pool) thread.join();
+
+	return results;
+}
@@ -6,132 +6,19 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <deque>
-
+#include <span>
+#include <array>
+#include <functional>
+#include <fstream>
+#include <cmath>
+#include <cfloat>
+
+#include "../numeric_parsing.h"
 #include "tokenizer.h"
+#include "ast.h"
+#include "symbols.h"
 
-enum class node_t {
-	UNKNOWN,
-	ROOT,
-	VARIABLE,
-	STMT_ASSIGN,
-	STMT_CLEAR,
-	STMT_DATA,
-	STMT_DEF_FN,
-	STMT_DIM,
-	STMT_END,
-	STMT_ERASE,
-	STMT_ERROR,
-	STMT_FOR,
-	STMT_GOSUB,
-	STMT_GOTO,
-	STMT_IF,
-	STMT_INPUT,
-	STMT_MID,
-	STMT_ON_ERROR_GOTO,
-	STMT_ON_EXPR_GOTO,
-	STMT_ON_EXPR_GOSUB,
-	STMT_POKE,
-	STMT_PEEK,
-	STMT_PRINT,
-	STMT_PRINT_SPACE,
-	STMT_PRINT_NOSPACE,
-	STMT_RANDOMIZE,
-	STMT_READ,
-	STMT_REM,
-	STMT_RESTORE,
-	STMT_RESUME,
-	STMT_RESUME_NEXT,
-	STMT_STOP,
-	STMT_SWAP,
-	STMT_WHILE,
-	EXPR,
-	OP_FUNC_CALL,
-	OP_INDEXING,
-	OP_NEG,
-	OP_POS,
-	OP_MUL,
-	OP_FLT_DIV,
-	OP_INT_DIV,
-	OP_MOD,
-	OP_ADD,
-	OP_SUB,
-	OP_EXP,
-	OP_AND,
-	OP_OR,
-	OP_NOT,
-	OP_XOR,
-	OP_EQV,
-	OP_IMP,
-	OP_EQU,
-	OP_GTR,
-	OP_LSS,
-	OP_LEQ,
-	OP_GEQ,
-	OP_NEQ,
-	LITERAL_STR,
-	LITERAL_INT,
-	LITERAL_FLT,
-	LITERAL_DBL,
-};
-
-static std::string node_t_to_str[] = {
-	"UNKNOWN",
-	"ROOT",
-	"VARIABLE",
-	"STMT_ASSIGN","STMT_CLEAR","STMT_DATA","STMT_DEF_FN","STMT_DIM","STMT_END",
-	"STMT_ERASE","STMT_ERROR","STMT_FOR","STMT_GOSUB","STMT_GOTO","STMT_IF","STMT_INPUT","STMT_MID","STMT_ON_ERROR_GOTO",
-	"STMT_ON_EXPR_GOTO","STMT_ON_EXPR_GOSUB","STMT_POKE","STMT_PEEK","STMT_PRINT","STMT_PRINT_SPACE","STMT_PRINT_NOSPACE",
-	"STMT_RANDOMIZE","STMT_READ","STMT_REM","STMT_RESTORE","STMT_RESUME","STMT_RESUME_NEXT","STMT_STOP","STMT_SWAP","STMT_WHILE",
-	"EXPR",
-	"OP_FUNC_CALL","OP_INDEXING","OP_NEG","OP_POS","OP_MUL","OP_FLT_DIV","OP_INT_DIV","OP_MOD","OP_ADD","OP_SUB","OP_EXP",
-	"OP_AND","OP_OR","OP_NOT","OP_XOR","OP_EQV","OP_IMP","OP_EQU","OP_GTR","OP_LSS","OP_LEQ","OP_GEQ","OP_NEQ",
-	"LITERAL_STR","LITERAL_INT","LITERAL_FLT","LITERAL_DBL" };
-
-struct node {
-	node_t type = node_t::UNKNOWN;
-	std::vector<node> child_nodes;
-	int line_number = 0;
-
-	union node_value {
-		char str_val[255];
-		float flt_val;
-		double dbl_val;
-		int int_val;
-	} value = {};
-
-	node() {}
-
-	node(node_t type) : type(type) {}
-
-	std::string str() const {
-		std::string ret_str = node_t_to_str[(int)type] + "(";
-			
-		if (type == node_t::LITERAL_STR) {
-			ret_str += "str_value = \""  + std::string(value.str_val) + "\"";
-		}
-		else if (type == node_t::LITERAL_INT) {
-			ret_str += "int_value = " + std::to_string(value.int_val);
-		}
-		else if (type == node_t::LITERAL_FLT) {
-			ret_str += "flt_value = " + std::to_string(value.flt_val);
-		}
-		else if (type == node_t::LITERAL_DBL) {
-			ret_str += "dbl_value = " + std::to_string(value.dbl_val);
-		}
-		else {
-			if (type != node_t::ROOT) {
-				ret_str += "line_number = " + std::to_string(line_number) + ", ";
-			}
-			for (const node& child_node : child_nodes) {
-				ret_str += child_node.str() + ", ";
-			}
-		}
-		return ret_str + ")";	
-	}
-};
-
-
-node_t get_decl_type(const std::string& name) {
+inline node_t get_decl_type(const std::string& name) {
 	switch (name.back())
 	{
 	case '%': return node_t::LITERAL_INT;
@@ -145,153 +32,141 @@ node_t get_decl_type(const std::string& name) {
 //
 //	LITERALS
 //
-bool try_parse_int(const std::string& str, int32_t& result) {
-	try {
-		result = std::stoi(str);
-		// Conversion succeeded
-		return true;
-	}
-	catch (const std::invalid_argument&) {
-		// Conversionfailed
-		return false;
-	}
+//the text of a literal without its %, ! or # type suffix
+inline std::string_view literal_digits(const std::string& str) {
+	std::string_view digits = str;
+	if (!digits.empty() && (digits.back() == '%' || digits.back() == '!' || digits.back() == '#')) digits.remove_suffix(1);
+	return digits;
 }
 
-bool try_parse_flt(const std::string& str, float& result) {
-	std::string trimmed_str = str;
-	if (trimmed_str.back() == '!') {
-		trimmed_str.pop_back(); // Remove the trailing '!'
-	}
-	try {
-		result = std::stof(trimmed_str);
-		return true;
-	}
-	catch (const std::invalid_argument&) {
-		return false;
-	}
-	catch (const std::out_of_range&) {
+inline bool try_parse_int(const std::string& str, int32_t& result) {
+	numeric_literal literal = scan_numeric_literal(literal_digits(str));
+	if (literal.kind != numeric_kind::INT || literal.overflow || literal.int_value < INT32_MIN || literal.int_value > INT32_MAX)
 		return false;
-	}
+	result = (int32_t)literal.int_value;
+	return true;
 }
 
-bool try_parse_dbl(const std::string& str, double& result) {
-	std::string trimmed_str = str;
-	if (trimmed_str.back() == '!') {
-		trimmed_str.pop_back(); // Remove the trailing '!'
-	}
-	try {
-		result = std::stod(trimmed_str);
-		return true;
-	}
-	catch (const std::invalid_argument&) {
-		return false;
-	}
-	catch (const std::out_of_range&) {
-		return false;
-	}
+inline bool try_parse_dbl(const std::string& str, double& result) {
+	numeric_literal literal = scan_numeric_literal(literal_digits(str));
+	if (!literal.valid()) return false;
+	result = literal.is_integer() ? (double)literal.int_value : literal.real_value;
+	return true;
 }
 
-node create_literal_str(const std::string& str_value) {
-	node str_node;
-	str_node.type = node_t::LITERAL_STR;
-	strcpy_s(str_node.value.str_val, str_value.c_str());
+inline bool try_parse_flt(const std::string& str, float& result) {
+	double value = 0.0;
+	if (!try_parse_dbl(str, value) || std::abs(value) > FLT_MAX) return false;
+	result = (float)value;
+	return true;
+}
+
+inline node_id create_literal_str(ast& tree, const std::string& str_value) {
+	node_id str_node = tree.add(node_t::LITERAL_STR);
+	tree[str_node].value.str_val = tree.strings.intern(str_value);
 	return str_node;
 }
 
-node create_literal_int(int int_value) {
-	node int_node;
-	int_node.type = node_t::LITERAL_INT;
-	int_node.value.int_val = int_value;
+inline node_id create_literal_int(ast& tree, int int_value) {
+	node_id int_node = tree.add(node_t::LITERAL_INT);
+	tree[int_node].value.int_val = int_value;
 	return int_node;
 }
 
-node create_literal_flt(float flt_value) {
-	node flt_node;
-	flt_node.type = node_t::LITERAL_INT;
-	flt_node.value.flt_val = flt_value;
+inline node_id create_literal_flt(ast& tree, float flt_value) {
+	node_id flt_node = tree.add(node_t::LITERAL_FLT);
+	tree[flt_node].value.flt_val = flt_value;
 	return flt_node;
 }
 
-node create_literal_dbl(double dbl_value) {
-	node dbl_node;
-	dbl_node.type = node_t::LITERAL_INT;
-	dbl_node.value.dbl_val = dbl_value;
+inline node_id create_literal_dbl(ast& tree, double dbl_value) {
+	node_id dbl_node = tree.add(node_t::LITERAL_DBL);
+	tree[dbl_node].value.dbl_val = dbl_value;
 	return dbl_node;
 }
 
-node create_literal_from_token(const token& token) {
-	node literal_node;
+inline node_id create_literal_from_token(ast& tree, const token& token) {
 	switch (token.type)
 	{
 	case token_t::LITERAL_STR:
 	{
-		return create_literal_str(token.value);
+		return create_literal_str(tree, token.str(tree.strings));
 	}
 	case token_t::LITERAL_INT:
 	{
-		literal_node.type = node_t::LITERAL_INT;
-		try_parse_int(token.value, literal_node.value.int_val);
+		node_id literal_node = tree.add(node_t::LITERAL_INT);
+		if (!try_parse_int(token.str(tree.strings), tree[literal_node].value.int_val))
+			throw std::runtime_error(std::format("The literal {} is out of range", token.str(tree.strings)));
 		return literal_node;
 	}
 	case token_t::LITERAL_DBL:
 	{
-		literal_node.type = node_t::LITERAL_DBL;
-		try_parse_dbl(token.value, literal_node.value.dbl_val);
+		node_id literal_node = tree.add(node_t::LITERAL_DBL);
+		if (!try_parse_dbl(token.str(tree.strings), tree[literal_node].value.dbl_val))
+			throw std::runtime_error(std::format("The literal {} is out of range", token.str(tree.strings)));
 		return literal_node;
 	}
 	case token_t::LITERAL_FLT:
 	{
-		literal_node.type = node_t::LITERAL_FLT;
-		try_parse_flt(token.value, literal_node.value.flt_val);
+		node_id literal_node = tree.add(node_t::LITERAL_FLT);
+		if (!try_parse_flt(token.str(tree.strings), tree[literal_node].value.flt_val))
+			throw std::runtime_error(std::format("The literal {} is out of range", token.str(tree.strings)));
 		return literal_node;
 	}
 	default:
-		throw std::runtime_error(std::format("Unable to parse the token {} into a literal", token.value));
+		throw std::runtime_error(std::format("Unable to parse the token {} into a literal", token.str(tree.strings)));
 	}
 }
 
 //
 //	VARIABLE
 //
-node create_variable(const std::string& variable_name, node variable_value) {
-	node variable;
-	variable.type = node_t::VARIABLE;
-	variable.child_nodes.push_back(create_literal_str(variable_name));
-	variable.child_nodes.push_back(node(get_decl_type(variable_name)));
-	variable.child_nodes.push_back(variable_value);
+//	VARIABLE(name, type[, value]), the node value is the symbol id
+//
+inline node_id create_variable(ast& tree, const std::string& variable_name, symbol_id symbol, node_id variable_value) {
+	node_id name = create_literal_str(tree, variable_name);
+	node_id decl_type = tree.add(get_decl_type(variable_name));
+	node_id variable = tree.add(node_t::VARIABLE, { name, decl_type, variable_value });
+	tree[variable].value.int_val = (int)symbol;
 	return variable;
 }
 
-node create_variable(const std::string& variable_name) {
-	node variable;
-	variable.type = node_t::VARIABLE;
-	variable.child_nodes.push_back(create_literal_str(variable_name));
-	variable.child_nodes.push_back(node(get_decl_type(variable_name)));
+inline node_id create_variable(ast& tree, const std::string& variable_name, symbol_id symbol) {
+	node_id name = create_literal_str(tree, variable_name);
+	node_id decl_type = tree.add(get_decl_type(variable_name));
+	node_id variable = tree.add(node_t::VARIABLE, { name, decl_type });
+	tree[variable].value.int_val = (int)symbol;
 	return variable;
 }
 
-void variable_set_name(node& variable, const std::string& variable_name) {
-	strcpy_s(variable.child_nodes[0].value.str_val,variable_name.c_str());
+inline symbol_id variable_get_symbol(const ast& tree, node_id variable) {
+	return (symbol_id)tree[variable].value.int_val;
 }
 
-std::string variable_get_name(node& variable) {
-	return std::string(variable.child_nodes[0].value.str_val);
+inline void variable_set_name(ast& tree, node_id variable, const std::string& variable_name) {
+	tree[tree.child(variable, 0)].value.str_val = tree.strings.intern(variable_name);
 }
 
-node_t variable_get_type(node& variable) {
-	return variable.child_nodes[1].type;
+inline std::string variable_get_name(const ast& tree, node_id variable) {
+	return tree.strings.get(tree[tree.child(variable, 0)].value.str_val);
 }
 
-node variable_get_value(node& variable) {
-	return variable.child_nodes[2];
+inline node_t variable_get_type(const ast& tree, node_id variable) {
+	return tree[tree.child(variable, 1)].type;
 }
 
-void variable_check_decl_type_match(node& variable, int line_number = 0) {
-	node_t declared_type = variable.child_nodes[1].type;
-	node_t variable_type = variable.child_nodes[2].type;
-	if (declared_type != variable_type && variable_type!= node_t::EXPR) {
+inline node_id variable_get_value(const ast& tree, node_id variable) {
+	return tree.child(variable, 2);
+}
+
+inline void variable_check_decl_type_match(ast& tree, node_id variable, int line_number = 0) {
+	node_t declared_type = tree[tree.child(variable, 1)].type;
+	node_t variable_type = tree[tree.child(variable, 2)].type;
+	bool is_literal = (variable_type >= node_t::LITERAL_STR && variable_type <= node_t::LITERAL_DBL);
+	if (declared_type != variable_type && is_literal) {
 		//Attemp type conversion
-		variable.child_nodes[2].type = declared_type;
+		node& value = tree[tree.child(variable, 2)];
+		value.type = declared_type;
 
 		if (declared_type == node_t::LITERAL_INT) {
 			switch (variable_type)
@@ -303,14 +178,14 @@ void variable_check_decl_type_match(node& variable, int line_number = 0) {
 			case node_t::LITERAL_FLT: {
 				//FLT --> INT
 				//MSBASIC says that FLT --> INT is done with rounding
-				variable.child_nodes[2].value.int_val = (int)round(variable.child_nodes[2].value.flt_val);
+				value.value.int_val = (int)round(value.value.flt_val);
 				break;
 			}
 			case node_t::LITERAL_DBL: {
 				//DBL --> INT
 				//MSBASIC says that FLT --> INT is done with rounding
 				// lets just do the same with DBL --> INT
-				variable.child_nodes[2].value.int_val = (int)round(variable.child_nodes[2].value.dbl_val);
+				value.value.int_val = (int)round(value.value.dbl_val);
 				break;
 			}
 			default:
@@ -326,13 +201,12 @@ void variable_check_decl_type_match(node& variable, int line_number = 0) {
 			}
 			case node_t::LITERAL_INT: {
 				//INT --> FLT
-				variable.child_nodes[2].value.flt_val = (float)variable.child_nodes[2].value.int_val;
-				break;
+				value.value.flt_val = (float)value.value.int_val;
 				break;
 			}
 			case node_t::LITERAL_DBL: {
 				//DBL --> FLT
-				variable.child_nodes[2].value.flt_val = (float)variable.child_nodes[2].value.dbl_val;
+				value.value.flt_val = (float)value.value.dbl_val;
 				break;
 			}
 			default:
@@ -348,12 +222,12 @@ void variable_check_decl_type_match(node& variable, int line_number = 0) {
 			}
 			case node_t::LITERAL_INT: {
 				//INT --> DBL
-				variable.child_nodes[2].value.dbl_val = (double)variable.child_nodes[2].value.int_val;
+				value.value.dbl_val = (double)value.value.int_val;
 				break;
 			}
 			case node_t::LITERAL_FLT: {
 				//FLT --> DBL
-				variable.child_nodes[2].value.dbl_val = (double)variable.child_nodes[2].value.flt_val;
+				value.value.dbl_val = (double)value.value.flt_val;
 				break;
 			}
 			default:
@@ -371,78 +245,82 @@ void variable_check_decl_type_match(node& variable, int line_number = 0) {
 //
 //	FUNCTION
 //
-node create_function(const std::string& function_name, const std::vector<node> param_list, node function_expression) {
-	node function;
-	function.type = node_t::STMT_DEF_FN;
-	function.child_nodes.push_back(create_literal_str(function_name));
-	function.child_nodes.push_back(get_decl_type(function_name));
-	for (node param : param_list) {
-		function.child_nodes.push_back(param);
-	}
-	function.child_nodes.push_back(function_expression);
-	return function;
-
+//	STMT_DEF_FN(name, type, param_1, ..., param_n, expression)
+//	The parameters are PARAMETER(name, type) nodes, the node value is the parameter index
+//
+inline node_id create_parameter(ast& tree, const std::string& param_name, size_t param_index) {
+	node_id name = create_literal_str(tree, param_name);
+	node_id decl_type = tree.add(get_decl_type(param_name));
+	node_id param = tree.add(node_t::PARAMETER, { name, decl_type });
+	tree[param].value.int_val = (int)param_index;
+	return param;
 }
 
-void function_set_name(node& function, const std::string& function_name) {
-	strcpy_s(function.child_nodes[0].value.str_val, function_name.c_str());
+inline node_id create_function(ast& tree, const std::string& function_name, const std::vector<node_id>& param_list, node_id function_expression) {
+	std::vector<node_id> children;
+	children.reserve(param_list.size() + 3);
+	children.push_back(create_literal_str(tree, function_name));
+	children.push_back(tree.add(get_decl_type(function_name)));
+	children.insert(children.end(), param_list.begin(), param_list.end());
+	children.push_back(function_expression);
+	return tree.add(node_t::STMT_DEF_FN, children);
 }
 
-std::string function_get_name(node& function) {
-	return std::string(function.child_nodes[0].value.str_val);
+inline void function_set_name(ast& tree, node_id function, const std::string& function_name) {
+	tree[tree.child(function, 0)].value.str_val = tree.strings.intern(function_name);
 }
 
-node_t function_get_type(node& function) {
-	return function.child_nodes[1].type;
+inline std::string function_get_name(const ast& tree, node_id function) {
+	return tree.strings.get(tree[tree.child(function, 0)].value.str_val);
 }
 
-void function_set_type(node& function, node_t function_type) {
-	function.child_nodes[1].type = function_type;
+inline node_t function_get_type(const ast& tree, node_id function) {
+	return tree[tree.child(function, 1)].type;
 }
 
-size_t function_param_count(const node& function) {
-	return function.child_nodes.size() - 3;
+inline void function_set_type(ast& tree, node_id function, node_t function_type) {
+	tree[tree.child(function, 1)].type = function_type;
 }
 
-void function_set_param_value(node& function, size_t param_index, node param_value) {
-	function.child_nodes[2 + param_index].child_nodes[1] = param_value;
+inline size_t function_param_count(const ast& tree, node_id function) {
+	if (function == NO_NODE) return 0;
+	return tree[function].child_count - 3;
 }
 
-node function_get_param_value(const node& function, size_t param_index) {
-	return function.child_nodes[2 + param_index].child_nodes[1];
+inline void function_set_expression(ast& tree, node_id function, node_id function_expression) {
+	tree.set_child(function, tree[function].child_count - 1, function_expression);
 }
 
-void function_set_param_value(node& function, const std::string& param_name, node param_value) {
-	for (size_t index = 3; index < function.child_nodes.size() - 1; index++) {
-		if (strcmp(function.child_nodes[index].child_nodes[0].value.str_val, param_name.c_str()) == 0) {
-			function.child_nodes[index].child_nodes[1] = param_value;
-			return;
-		}
-	}
+inline node_id function_get_expression(const ast& tree, node_id function) {
+	return tree.child(function, tree[function].child_count - 1);
 }
 
-node function_get_param_value(const node& function, const std::string& param_name) {
-	for (size_t index = 3; index < function.child_nodes.size() - 1; index++) {
-		if (strcmp(function.child_nodes[index].child_nodes[0].value.str_val, param_name.c_str()) == 0) {
-			return function.child_nodes[index].child_nodes[1];
-		}
+//index of the parameter with the given name, function_param_count() if there is none
+inline size_t function_find_param(const ast& tree, node_id function, const std::string& param_name) {
+	str_id name_id = tree.strings.find(param_name);
+	size_t param_count = function_param_count(tree, function);
+	if (name_id == NO_STR) return param_count;
+	for (size_t param_index = 0; param_index < param_count; param_index++) {
+		node_id param = tree.child(function, 2 + param_index);
+		if (tree[tree.child(param, 0)].value.str_val == name_id) return param_index;
 	}
-	return {};
+	return param_count;
 }
 
 //
 //	TYPES
 //
-node_t get_type(const node& node) {
-	if (node.type == node_t::VARIABLE) {
-		return node.child_nodes[1].type;
-	}
-	else if (node.type == node_t::LITERAL_DBL ||
-			 node.type == node_t::LITERAL_FLT || 
-		     node.type == node_t::LITERAL_INT || 
-		     node.type == node_t::LITERAL_STR) 
+inline node_t get_type(const ast& tree, node_id id) {
+	const node& n = tree[id];
+	if (n.type == node_t::VARIABLE) {
+		return tree[tree.child(id, 1)].type;
+	}
+	else if (n.type == node_t::LITERAL_DBL ||
+			 n.type == node_t::LITERAL_FLT ||
+		     n.type == node_t::LITERAL_INT ||
+		     n.type == node_t::LITERAL_STR)
 	{
-		return node.type;
+		return n.type;
 	}
 	return {};
 }
@@ -451,420 +329,343 @@ node_t get_type(const node& node) {
 //
 // OPERATORS
 //
-node create_expression(token op, node operand_1, node operand_2 = {}) {
-	node expr;
-	expr.type = node_t::EXPR;
+//	Binding strength of every operator node type, higher binds tighter. Operators of the same
+//	strength are left associative. The order follows MSBASIC: ^, unary -/+, * /, \, MOD, + -,
+//	relational, NOT, AND, OR, XOR, EQV, IMP.
+//
+static constexpr int NO_PRECEDENCE = -1;
+
+static constexpr std::array<int, (size_t)node_t::LITERAL_DBL + 1> make_op_precedence() {
+	std::array<int, (size_t)node_t::LITERAL_DBL + 1> precedence = {};
+	for (int& p : precedence) p = NO_PRECEDENCE;
+	precedence[(size_t)node_t::OP_FUNC_CALL] = 14;
+	precedence[(size_t)node_t::OP_INDEXING] = 14;
+	precedence[(size_t)node_t::OP_EXP] = 13;
+	precedence[(size_t)node_t::OP_NEG] = 12;
+	precedence[(size_t)node_t::OP_POS] = 12;
+	precedence[(size_t)node_t::OP_MUL] = 11;
+	precedence[(size_t)node_t::OP_FLT_DIV] = 11;
+	precedence[(size_t)node_t::OP_INT_DIV] = 10;
+	precedence[(size_t)node_t::OP_MOD] = 9;
+	precedence[(size_t)node_t::OP_ADD] = 8;
+	precedence[(size_t)node_t::OP_SUB] = 8;
+	precedence[(size_t)node_t::OP_EQU] = 7;
+	precedence[(size_t)node_t::OP_NEQ] = 7;
+	precedence[(size_t)node_t::OP_LSS] = 7;
+	precedence[(size_t)node_t::OP_GTR] = 7;
+	precedence[(size_t)node_t::OP_LEQ] = 7;
+	precedence[(size_t)node_t::OP_GEQ] = 7;
+	precedence[(size_t)node_t::OP_NOT] = 6;
+	precedence[(size_t)node_t::OP_AND] = 5;
+	precedence[(size_t)node_t::OP_OR] = 4;
+	precedence[(size_t)node_t::OP_XOR] = 3;
+	precedence[(size_t)node_t::OP_EQV] = 2;
+	precedence[(size_t)node_t::OP_IMP] = 1;
+	return precedence;
+}
+
+static constexpr std::array<int, (size_t)node_t::LITERAL_DBL + 1> map_op_to_precedence = make_op_precedence();
+
+constexpr bool is_node_op(node_t type) {
+	return map_op_to_precedence[(size_t)type] != NO_PRECEDENCE;
+}
+
+constexpr bool is_unary_op(node_t type) {
+	return type == node_t::OP_NEG || type == node_t::OP_POS || type == node_t::OP_NOT;
+}
 
-	switch (op.type)
+//operator node for a token in prefix position, UNKNOWN if the token is not a prefix operator
+constexpr node_t token_to_unary_op(token_t type) {
+	switch (type)
 	{
-		case token_t::OPERATOR_EXP:
-		{
-			break;
-		}
-		case token_t::OPERATOR_NEG:
-		{
-			expr.type = node_t::OP_NEG;
-			expr.child_nodes.push_back(operand_1);
-			break;
-		}
-		case token_t::OPERATOR_POS:
-		{
-			expr.type = node_t::OP_POS;
-			expr.child_nodes.push_back(operand_1);
-			break;
-		}
-		case token_t::OPERATOR_MUL:
-		{
-			node op_mul;
-			op_mul.type = node_t::OP_MUL;
-			op_mul.child_nodes.push_back(operand_1);
-			op_mul.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_mul);
-			break;
-		}
-		case token_t::OPERATOR_FLT_DIV:
-		{
-			node op_flt_div;
-			op_flt_div.type = node_t::OP_MUL;
-			op_flt_div.child_nodes.push_back(operand_1);
-			op_flt_div.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_flt_div);
-			break;
-		}
-		case token_t::OPERATOR_ADD:
-		{
-			node op_add;
-			op_add.type = node_t::OP_ADD;
-			op_add.child_nodes.push_back(operand_1);
-			op_add.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_add);
-			break;
-		}
-		case token_t::OPERATOR_SUB:
-		{
-			node op_sub;
-			op_sub.type = node_t::OP_SUB;
-			op_sub.child_nodes.push_back(operand_1);
-			op_sub.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_sub);
-			break;
-		}
-		case token_t::OPERATOR_INT_DIV:
-		{
-			node op_int_div;
-			op_int_div.type = node_t::OP_MUL;
-			op_int_div.child_nodes.push_back(operand_1);
-			op_int_div.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_int_div);
-			break;
-		}
-		case token_t::OPERATOR_MOD:
-		{
-			node op_mod;
-			op_mod.type = node_t::OP_SUB;
-			op_mod.child_nodes.push_back(operand_1);
-			op_mod.child_nodes.push_back(operand_2);
-			expr.child_nodes.push_back(op_mod);
-			break;
-		}
-		case token_t::OPERATOR_EQU:
-		{
-			break;
-		}
-		case token_t::OPERATOR_NEQ:
-		{
-			break;
-		}
-		case token_t::OPERATOR_LSS:
-		{
-			break;
-		}
-		case token_t::OPERATOR_GTR:
-		{
-			break;
-		}
-		case token_t::OPERATOR_LEQ:
-		{
-			break;
-		}
-		case token_t::OPERATOR_GEQ:
-		{
-			break;
-		}
-		case token_t::OPERATOR_NOT:
-		{
-			break;
-		}
-		case token_t::OPERATOR_AND:
-		{
-			break;
-		}
-		case token_t::OPERATOR_OR:
-		{
-			break;
-		}
-		case token_t::OPERATOR_XOR:
-		{
-			break;
-		}
-		case token_t::OPERATOR_EQV:
-		{
-			break;
-		}
-		case token_t::OPERATOR_IMP:
-		{
-			break;
-		}
-	default:
-		break;
+	case token_t::OPERATOR_NEG: return node_t::OP_NEG;
+	case token_t::OPERATOR_POS: return node_t::OP_POS;
+	case token_t::OPERATOR_NOT: return node_t::OP_NOT;
+	default: return node_t::UNKNOWN;
 	}
+}
 
-	return expr;
-}
-
-
-std::vector<int> jmp_list; //keep track of lines that need a label for (GOTO) jmp instructions
-std::unordered_map<std::string, node> map_name_to_variable;
-std::unordered_map<std::string, node> map_name_to_function;
-
-std::unordered_map<node_t, int> map_op_to_precedence =
-{
-	{node_t::OP_FUNC_CALL,22},
-	{node_t::OP_INDEXING,21},
-	{node_t::OP_NEG,20},
-	{node_t::OP_POS,19},
-	{node_t::OP_EXP,18},
-	{node_t::OP_MUL,17},
-	{node_t::OP_FLT_DIV,16},
-	{node_t::OP_INT_DIV,15},
-	{node_t::OP_MOD,14},
-	{node_t::OP_SUB,13},
-	{node_t::OP_ADD,12},
-	{node_t::OP_NOT,11},
-	{node_t::OP_AND,10},
-	{node_t::OP_OR,9},
-	{node_t::OP_XOR,8},
-	{node_t::OP_EQV,7},
-	{node_t::OP_IMP,6},
-	{node_t::OP_EQU,5},
-	{node_t::OP_GTR,4},
-	{node_t::OP_LSS,3},
-	{node_t::OP_LEQ,2},
-	{node_t::OP_GEQ,1},
-	{node_t::OP_NEQ,0}
-};
+//operator node for a token in infix position, UNKNOWN if the token is not a binary operator
+constexpr node_t token_to_binary_op(token_t type) {
+	switch (type)
+	{
+	case token_t::OPERATOR_EXP: return node_t::OP_EXP;
+	case token_t::OPERATOR_MUL: return node_t::OP_MUL;
+	case token_t::OPERATOR_FLT_DIV: return node_t::OP_FLT_DIV;
+	case token_t::OPERATOR_INT_DIV: return node_t::OP_INT_DIV;
+	case token_t::OPERATOR_MOD: return node_t::OP_MOD;
+	case token_t::OPERATOR_ADD: return node_t::OP_ADD;
+	case token_t::OPERATOR_SUB: return node_t::OP_SUB;
+	case token_t::OPERATOR_EQU: return node_t::OP_EQU;
+	case token_t::OPERATOR_ASSIGN: return node_t::OP_EQU; //inside an expression = compares
+	case token_t::OPERATOR_NEQ: return node_t::OP_NEQ;
+	case token_t::OPERATOR_LSS: return node_t::OP_LSS;
+	case token_t::OPERATOR_GTR: return node_t::OP_GTR;
+	case token_t::OPERATOR_LEQ: return node_t::OP_LEQ;
+	case token_t::OPERATOR_GEQ: return node_t::OP_GEQ;
+	case token_t::OPERATOR_AND: return node_t::OP_AND;
+	case token_t::OPERATOR_OR: return node_t::OP_OR;
+	case token_t::OPERATOR_XOR: return node_t::OP_XOR;
+	case token_t::OPERATOR_EQV: return node_t::OP_EQV;
+	case token_t::OPERATOR_IMP: return node_t::OP_IMP;
+	default: return node_t::UNKNOWN;
+	}
+}
 
-std::unordered_set<node_t> node_ops = {
-	node_t::OP_FUNC_CALL,
-	node_t::OP_INDEXING,
-	node_t::OP_NEG,
-	node_t::OP_POS,
-	node_t::OP_MUL,
-	node_t::OP_FLT_DIV,
-	node_t::OP_INT_DIV,
-	node_t::OP_MOD,
-	node_t::OP_ADD,
-	node_t::OP_SUB,
-	node_t::OP_EXP,
-	node_t::OP_AND,
-	node_t::OP_OR,
-	node_t::OP_NOT,
-	node_t::OP_XOR,
-	node_t::OP_EQV,
-	node_t::OP_IMP,
-	node_t::OP_EQU,
-	node_t::OP_GTR,
-	node_t::OP_LSS,
-	node_t::OP_LEQ,
-	node_t::OP_GEQ,
-	node_t::OP_NEQ
-};
+//unary operators are a single node, binary operators are wrapped in an EXPR
+inline node_id create_expression(ast& tree, node_t op, node_id operand_1, node_id operand_2 = NO_NODE) {
+	if (is_unary_op(op)) {
+		return tree.add(op, { operand_1 });
+	}
+	node_id binary_op = tree.add(op, { operand_1, operand_2 });
+	return tree.add(node_t::EXPR, { binary_op });
+}
+
+
+//
+//	EXPRESSIONS
+//
+//	Precedence climbing over a span of tokens, every token is visited once and no token is copied.
+//
+struct token_cursor {
+	std::span<const token> tokens;
+	size_t pos = 0;
 
-std::unordered_set<token_t> token_ops = {
-	token_t::OPERATOR_EXP,
-	token_t::OPERATOR_NEG,
-	token_t::OPERATOR_POS,
-	token_t::OPERATOR_MUL,
-	token_t::OPERATOR_FLT_DIV,
-	token_t::OPERATOR_ADD,
-	token_t::OPERATOR_SUB,
-	token_t::OPERATOR_INT_DIV,
-	token_t::OPERATOR_MOD,
-	token_t::OPERATOR_EQU,
-	token_t::OPERATOR_NEQ,
-	token_t::OPERATOR_LSS,
-	token_t::OPERATOR_GTR,
-	token_t::OPERATOR_LEQ,
-	token_t::OPERATOR_GEQ,
-	token_t::OPERATOR_NOT,
-	token_t::OPERATOR_AND,
-	token_t::OPERATOR_OR,
-	token_t::OPERATOR_XOR,
-	token_t::OPERATOR_EQV,
-	token_t::OPERATOR_IMP
+	bool at_end() const { return pos >= tokens.size(); }
+	token_t peek_type() const { return at_end() ? token_t::END_OF_FILE : tokens[pos].type; }
+	const token& next() { return tokens[pos++]; }
 };
 
+inline node_id parse_expression(ast& tree, symbol_table& symbols, token_cursor& cursor, int min_precedence, int line_number, node_id func);
 
-node parse_expression(std::vector<token>& tokens, int line_number, const node& func = {}) {
-	if (tokens.empty())
-		throw std::runtime_error("Attempting to evaluate an empty expression");
+//FN<NAME>(args) and <ARRAY>(indices), the cursor is on the open paren
+inline node_id parse_call(ast& tree, symbol_table& symbols, token_cursor& cursor, const std::string& name, int line_number, node_id func) {
+	std::vector<node_id> children = { create_literal_str(tree, name) };
+	cursor.next();
 
-	//Check for unwanted surrounding brackets
-	if (tokens.front().type == token_t::OPEN_PAREN && tokens.back().type == token_t::CLOSE_PAREN) {
-		int bracket_count = 1;
-		for (size_t i = 1; i < tokens.size(); i++) {
-			if (tokens[i].type == token_t::OPEN_PAREN)
-				bracket_count++;
-			else if (tokens[i].type == token_t::CLOSE_PAREN)
-				bracket_count--;
-		}
-		if (bracket_count == 0) {
-			tokens = std::vector<token>(tokens.begin() + 1, tokens.end() - 1);
+	if (cursor.peek_type() != token_t::CLOSE_PAREN) {
+		while (true) {
+			children.push_back(parse_expression(tree, symbols, cursor, 0, line_number, func));
+			if (cursor.peek_type() != token_t::COMMA) break;
+			cursor.next();
 		}
 	}
+	if (cursor.peek_type() != token_t::CLOSE_PAREN)
+		throw std::runtime_error(std::format("Missing closing parenthesis after {} on line {}", name, line_number));
+	cursor.next();
 
-	//Base case
-	if (tokens.size() == 1) {
-		//Single token to evaluate
-		if (tokens[0].type >= token_t::LITERAL_STR && tokens[0].type <= token_t::LITERAL_DBL) {
-			return create_literal_from_token(tokens[0]);
-		}
-		else if (tokens[0].type == token_t::IDENTIFIER) {
-			std::string variable_name = tokens[0].value;
+	if (name.substr(0, 2) != "FN") {
+		return tree.add(node_t::OP_INDEXING, children);
+	}
 
-			if (function_param_count(func) != 0) {
-				return function_get_param_value(func, variable_name);
-			}
-			else if (map_name_to_variable.contains(variable_name)) {
-				return map_name_to_variable[variable_name];
-			}
-			else {
-				throw std::runtime_error(std::format("Variable, {}, on line {} used before defined", tokens[0].value, line_number));
-			}	
-		}
+	//the call is replaced by the function template with the arguments substituted
+	symbol_id function_symbol = symbols.find_function(name);
+	if (function_symbol == NO_SYMBOL)
+		throw std::runtime_error(std::format("Function, {}, on line {} used before defined", name, line_number));
+
+	const function_template& function = symbols.function(function_symbol);
+	std::span<const node_id> arguments = std::span<const node_id>(children).subspan(1);
+	if (function.param_types.size() != arguments.size())
+		throw std::runtime_error(std::format("Function, {}, on line {} expects {} arguments", name, line_number, function.param_types.size()));
+
+	return tree.import(function.body, function.expression, arguments);
+}
+
+inline node_id parse_operand(ast& tree, symbol_table& symbols, token_cursor& cursor, int line_number, node_id func) {
+	if (cursor.at_end())
+		throw std::runtime_error(std::format("Incomplete expression on line {}", line_number));
+
+	const token& operand = cursor.next();
+
+	if (operand.type >= token_t::LITERAL_STR && operand.type <= token_t::LITERAL_DBL) {
+		return create_literal_from_token(tree, operand);
 	}
-	else if (tokens.size() == 2 && token_ops.contains(tokens[0].type)) {
-		//Unary Expression
-		token op = tokens[0];
-		std::vector<token> op_tokens_1 = { tokens[1] };
-		node operand_1 = parse_expression(op_tokens_1, line_number, func);
-		return create_expression(op, operand_1);
+
+	if (operand.type == token_t::OPEN_PAREN) {
+		node_id inner = parse_expression(tree, symbols, cursor, 0, line_number, func);
+		if (cursor.peek_type() != token_t::CLOSE_PAREN)
+			throw std::runtime_error(std::format("Missing closing parenthesis on line {}", line_number));
+		cursor.next();
+		return inner;
 	}
-	else if (tokens.size() == 3 && token_ops.contains(tokens[1].type)) {
-		//Binary Expressionss
-		std::vector<token> op_tokens_1 = { tokens[0] };
-		std::vector<token> op_tokens_2 = { tokens[2] };
-		token op = tokens[1];
-
-		node operand_1 = parse_expression(op_tokens_1, line_number, func);
-		node operand_2 = parse_expression(op_tokens_2, line_number, func);
-		node expr = create_expression(op, operand_1, operand_2);
-		return expr ;
+
+	node_t unary_op = token_to_unary_op(operand.type);
+	if (unary_op != node_t::UNKNOWN) {
+		node_id operand_1 = parse_expression(tree, symbols, cursor, map_op_to_precedence[(size_t)unary_op], line_number, func);
+		return create_expression(tree, unary_op, operand_1);
 	}
 
-	//Take tokens and turn into an EXPR
-	// EXPR has one child node that is either some Binary Operation or some Unary Operation which forms the root of the AST for the EXPR
+	if (operand.type == token_t::IDENTIFIER) {
+		const std::string& variable_name = operand.str(tree.strings);
 
-	//NOTE : on a function call (1) update the functions parameter values with given values
-	//                          (2) replace the OP_FUNC_CALL node with parse_expression(function.child_nodes.last(),func)
-	
-	int bracket_count = 0;
-	for (size_t i = 0; i < tokens.size(); i++) {
-		if (tokens[i].type == token_t::OPEN_PAREN) {
-			bracket_count++;
+		if (cursor.peek_type() == token_t::OPEN_PAREN) {
+			return parse_call(tree, symbols, cursor, variable_name, line_number, func);
 		}
-		else if (tokens[i].type == token_t::CLOSE_PAREN) {
-			bracket_count--;
+
+		size_t param_index = function_find_param(tree, func, variable_name);
+		symbol_id symbol = symbols.find_variable(variable_name);
+		if (param_index < function_param_count(tree, func)) {
+			return create_parameter(tree, variable_name, param_index);
+		}
+		else if (symbol != NO_SYMBOL) {
+			return create_variable(tree, variable_name, symbol);
 		}
-		else if (token_ops.contains(tokens[i].type) && bracket_count == 0) {
-			//Binary operator found
-			//Read left and right for operands
-			token op = tokens[i];
-			std::vector<token> left_op_tokens = std::vector<token>(tokens.begin(), tokens.begin() + i);
-			std::vector<token> right_op_tokens = std::vector<token>(tokens.begin() + i + 1, tokens.end());
-			node left_op = parse_expression(left_op_tokens, line_number, func);
-			node right_op = parse_expression(right_op_tokens, line_number, func);
-			node expression = create_expression(op, left_op, right_op);
-			return expression;
+		else {
+			throw std::runtime_error(std::format("Variable, {}, on line {} used before defined", variable_name, line_number));
 		}
 	}
 
-	return {};
+	throw std::runtime_error(std::format("Unexpected token {} in expression on line {}", operand.str(tree.strings), line_number));
 }
 
-node parse_line(const std::vector<token>& line, int line_number) {
-	node stmt;
-	stmt.line_number = line_number;
+inline node_id parse_expression(ast& tree, symbol_table& symbols, token_cursor& cursor, int min_precedence, int line_number, node_id func) {
+	node_id left = parse_operand(tree, symbols, cursor, line_number, func);
+
+	while (!cursor.at_end()) {
+		node_t op = token_to_binary_op(cursor.peek_type());
+		if (op == node_t::UNKNOWN) break;
+
+		int precedence = map_op_to_precedence[(size_t)op];
+		if (precedence < min_precedence) break;
+
+		cursor.next();
+		node_id right = parse_expression(tree, symbols, cursor, precedence + 1, line_number, func);
+		left = create_expression(tree, op, left, right);
+	}
+
+	return left;
+}
+
+inline node_id parse_expression(ast& tree, symbol_table& symbols, std::span<const token> tokens, int line_number, node_id func = NO_NODE) {
+	if (tokens.empty())
+		throw std::runtime_error("Attempting to evaluate an empty expression");
+
+	token_cursor cursor{ tokens };
+	node_id expression = parse_expression(tree, symbols, cursor, 0, line_number, func);
+	if (!cursor.at_end())
+		throw std::runtime_error(std::format("Unexpected token {} in expression on line {}", cursor.tokens[cursor.pos].str(tree.strings), line_number));
+	return expression;
+}
+
+inline node_id parse_line(ast& tree, symbol_table& symbols, std::span<const token> line, int line_number) {
+	node_t stmt_type = node_t::UNKNOWN;
+	std::vector<node_id> stmt_children;
 
 	if (line[0].type >= token_t::KEYWORD_CLEAR && line[0].type <= token_t::KEYWORD_WEND) {
 		//parse cmd
 		switch (line[0].type)
 		{
 		case token_t::KEYWORD_CLEAR:{
-			stmt.type = node_t::STMT_CLEAR;
+			stmt_type = node_t::STMT_CLEAR;
 			break;
 		}
-		
+
 		case token_t::KEYWORD_DATA:
 		{
-			stmt.type = node_t::STMT_DATA;
+			stmt_type = node_t::STMT_DATA;
 			for (size_t i = 1; i < line.size() - 1; i++) {
-				node data_node = create_literal_from_token(line[i]);
-				stmt.child_nodes.push_back(data_node);
+				stmt_children.push_back(create_literal_from_token(tree, line[i]));
 				i++;
 				if (line[i].type != token_t::COMMA) {
 					throw std::runtime_error(std::format("Data values should be separated by a comma on line {}", line_number));
 				}
 			}
-			node data_node = create_literal_from_token(line.back());
-			stmt.child_nodes.push_back(data_node);
+			stmt_children.push_back(create_literal_from_token(tree, line.back()));
 			break;
 		}
-		
+
 		case token_t::KEYWORD_END:
 		{
-			stmt.type = node_t::STMT_END;
+			stmt_type = node_t::STMT_END;
 			break;
 		}
-		
+
 		case token_t::KEYWORD_GOSUB:
 		{
-			stmt.type = node_t::STMT_GOSUB;
+			stmt_type = node_t::STMT_GOSUB;
 			break;
 		}
-		
+
 		case token_t::KEYWORD_GOTO:
 		{
-			stmt.type = node_t::STMT_GOTO;
-			node goto_location;
-			goto_location.type = node_t::LITERAL_INT;
-			if (!try_parse_int(line[1].value, goto_location.value.int_val))
-				throw std::runtime_error(std::format("Invalid GOTO loaction {} on line {}", line[1].value, line_number));
-			jmp_list.push_back(goto_location.value.int_val);
-			stmt.child_nodes.push_back(goto_location);
+			stmt_type = node_t::STMT_GOTO;
+			int goto_line_number = 0;
+			if (!try_parse_int(line[1].str(tree.strings), goto_line_number))
+				throw std::runtime_error(std::format("Invalid GOTO loaction {} on line {}", line[1].str(tree.strings), line_number));
+			symbols.jmp_list.push_back(goto_line_number);
+			stmt_children.push_back(create_literal_int(tree, goto_line_number));
+			break;
+		}
+
+		case token_t::KEYWORD_IF:
+		{
+			//IF <EXPR> THEN <LINE> or IF <EXPR> GOTO <LINE>, the children are the condition and the target line
+			stmt_type = node_t::STMT_IF;
+			size_t then_index = 1;
+			while (then_index < line.size() && line[then_index].type != token_t::KEYWORD_THEN && line[then_index].type != token_t::KEYWORD_GOTO) then_index++;
+			if (then_index == 1 || then_index + 2 != line.size())
+				throw std::runtime_error(std::format("IF on line {} should be IF <condition> THEN <line number>", line_number));
+			int target_line_number = 0;
+			if (!try_parse_int(line[then_index + 1].str(tree.strings), target_line_number))
+				throw std::runtime_error(std::format("Invalid IF target {} on line {}", line[then_index + 1].str(tree.strings), line_number));
+			stmt_children.push_back(parse_expression(tree, symbols, line.subspan(1, then_index - 1), line_number));
+			symbols.jmp_list.push_back(target_line_number);
+			stmt_children.push_back(create_literal_int(tree, target_line_number));
 			break;
 		}
-		
-		case token_t::KEYWORD_PRINT: 
+
+		case token_t::KEYWORD_PRINT:
 		{
-			stmt.type = node_t::STMT_PRINT;
-			std::vector<token> print_expression_tokens;
+			stmt_type = node_t::STMT_PRINT;
+			size_t expression_start = 1;
+			int bracket_count = 0;
 			for (size_t i = 1; i < line.size(); i++) {
-				if (line[i].type == token_t::COMMA) {
-					node print_stmt;
-					print_stmt.type = node_t::STMT_PRINT_SPACE;
-					print_stmt.child_nodes.push_back(parse_expression(print_expression_tokens, line_number));
-					stmt.child_nodes.push_back(print_stmt);
-					print_expression_tokens.clear();
+				if (line[i].type == token_t::OPEN_PAREN) {
+					bracket_count++;
 				}
-				else if (line[i].type == token_t::SEMICOLON) {
-					node print_stmt;
-					print_stmt.type = node_t::STMT_PRINT_NOSPACE;
-					print_stmt.child_nodes.push_back(parse_expression(print_expression_tokens, line_number));
-					stmt.child_nodes.push_back(print_stmt);
-					print_expression_tokens.clear();
+				else if (line[i].type == token_t::CLOSE_PAREN) {
+					bracket_count--;
 				}
-				else {
-					print_expression_tokens.push_back(line[i]);
+				else if ((line[i].type == token_t::COMMA || line[i].type == token_t::SEMICOLON) && bracket_count == 0) {
+					node_t print_type = (line[i].type == token_t::COMMA) ? node_t::STMT_PRINT_SPACE : node_t::STMT_PRINT_NOSPACE;
+					node_id print_expression = parse_expression(tree, symbols, line.subspan(expression_start, i - expression_start), line_number);
+					stmt_children.push_back(tree.add(print_type, { print_expression }));
+					expression_start = i + 1;
 				}
 			}
-			node print_stmt;
-			print_stmt.type = node_t::STMT_PRINT_NOSPACE;
-			print_stmt.child_nodes.push_back(parse_expression(print_expression_tokens, line_number));
-			stmt.child_nodes.push_back(print_stmt);
-			print_expression_tokens.clear();
+			node_id print_expression = parse_expression(tree, symbols, line.subspan(expression_start), line_number);
+			stmt_children.push_back(tree.add(node_t::STMT_PRINT_NOSPACE, { print_expression }));
 			break;
 		}
-		
-		case token_t::KEYWORD_REM: 
+
+		case token_t::KEYWORD_REM:
 		{
-			stmt.type = node_t::STMT_REM;
-			node comment = create_literal_str(line[1].value);
-			stmt.child_nodes.push_back(comment);
+			stmt_type = node_t::STMT_REM;
+			stmt_children.push_back(create_literal_str(tree, line[1].str(tree.strings)));
 			break;
 		}
-		
+
 		case token_t::KEYWORD_STOP: {
-			stmt.type = node_t::STMT_STOP;
+			stmt_type = node_t::STMT_STOP;
 			break;
 		}
-		
+
 		case token_t::KEYWORD_ERASE: {
-			stmt.type = node_t::STMT_ERASE;
+			stmt_type = node_t::STMT_ERASE;
 			break;
 		}
-		
+
 		case token_t::KEYWORD_DEF: {
 			//DEF FN<NAME>(param1, param2,...) = <EXPR>
-			
+
 			//Check function name
-			std::string function_name = line[1].value;
+			std::string function_name = line[1].str(tree.strings);
 			if (function_name.substr(0, 2) != "FN") {
 				throw std::runtime_error(std::format("Function name, {}, on line {} needs to start with FN", function_name, line_number));
 			}
 
 			//Check parameter list
-			std::vector<node> param_list;
+			std::vector<node_id> param_list;
 
 			if (line[2].type != token_t::OPEN_PAREN) {
 				throw std::runtime_error(std::format("The function, {}, on line {} needs parenthesis", function_name, line_number));
@@ -875,16 +676,16 @@ node parse_line(const std::vector<token>& line, int line_number) {
 			for (; line[i].type != token_t::CLOSE_PAREN; i++) {
 				if (line[i].type == token_t::COMMA) {
 					//save param
-					param_list.push_back(create_variable(param_name));
+					param_list.push_back(create_parameter(tree, param_name, param_list.size()));
 				}
 				else if (line[i].type == token_t::IDENTIFIER) {
-					param_name = line[i].value;
+					param_name = line[i].str(tree.strings);
 				}
 				else {
 					throw std::runtime_error(std::format("The function, {}, on line {} does not have valid parameter names", function_name, line_number));
-				}	
+				}
 			}
-			param_list.push_back(create_variable(param_name));
+			param_list.push_back(create_parameter(tree, param_name, param_list.size()));
 
 			i++;
 			if (line[i].type != token_t::OPERATOR_ASSIGN) {
@@ -892,72 +693,121 @@ node parse_line(const std::vector<token>& line, int line_number) {
 			}
 			i++;
 
-			std::vector<token> function_expr_tokens = std::vector<token>(line.begin() + i, line.end());
-			node function_expr = parse_expression(function_expr_tokens, line_number, stmt);
+			//the parameters have to be known while parsing the body, the expression slot is filled in afterwards
+			node_id function = create_function(tree, function_name, param_list, NO_NODE);
+			tree[function].line_number = line_number;
 
-			stmt = create_function(function_name, param_list, function_expr);
-			map_name_to_function[function_name] = stmt;
-			break;
+			node_id function_expr = parse_expression(tree, symbols, line.subspan(i), line_number, function);
+			function_set_expression(tree, function, function_expr);
+
+			//keep the body as a template, call sites instantiate it instead of parsing it again
+			function_template function_body;
+			function_body.name = function_name;
+			function_body.type = get_decl_type(function_name);
+			function_body.line_number = line_number;
+			for (node_id param : param_list) function_body.param_types.push_back(variable_get_type(tree, param));
+			function_body.expression = function_body.body.import(tree, function_expr);
+			symbols.define_function(std::move(function_body));
+			return function;
 		}
 
 		default:
-			throw std::runtime_error(std::format("Unknown command, {}, on line {}", line[0].value, line_number));
+			throw std::runtime_error(std::format("Unknown command, {}, on line {}", line[0].str(tree.strings), line_number));
 		}
 	}
 	else if (line[0].type == token_t::IDENTIFIER && line[1].type == token_t::OPERATOR_ASSIGN) {
 		//parse variable assign
-		stmt.type = node_t::STMT_ASSIGN;
+		stmt_type = node_t::STMT_ASSIGN;
 
 		//Get name and expression value
-		std::string variable_name = line[0].value;
-		std::vector<token> variable_value_token_expr(line.begin() + 2, line.end());
-		node variable_value = parse_expression(variable_value_token_expr, line_number);
+		std::string variable_name = line[0].str(tree.strings);
+		node_id variable_value = parse_expression(tree, symbols, line.subspan(2), line_number);
 
 		//Create variable object and add it to assignent object
-		node variable = create_variable(variable_name,variable_value);
-		variable_check_decl_type_match(variable, line_number);
+		symbol_id symbol = symbols.declare_variable(variable_name, get_decl_type(variable_name));
+		node_id variable = create_variable(tree, variable_name, symbol, variable_value);
+		variable_check_decl_type_match(tree, variable, line_number);
 
-		map_name_to_variable[variable_name] = variable;
-		stmt.child_nodes.push_back(variable);
+		stmt_children.push_back(variable);
 	}
 	else {
 		throw std::runtime_error(std::format("Line {} does not seem to be a command or variable assignment", line_number));
 	}
 
-	return stmt;
+	return tree.add(stmt_type, stmt_children, line_number);
 }
 
-node parse(const std::string& filename) {
-	node root;
-	root.type = node_t::ROOT;
-
-	std::vector<token> tokens = tokenize(filename);
-	std::vector<token> line;
-
-	int line_number = 0;
-	if (!try_parse_int(tokens[0].value, line_number))
-		throw std::runtime_error(std::format("No line number on first line"));
+//
+//	FRONT END
+//
+//	The source is read, tokenized and parsed one numbered line at a time. Every statement is handed to
+//	the consumer as soon as its line is parsed. When clear_after_line is set the ast is emptied after each
+//	line, so memory stays proportional to the longest line plus the symbol tables.
+//
+//	Without an error handler the first error is thrown. With one, the error ends only the line it was found
+//	on, the handler gets the BASIC line number (0 if the line number itself was bad) and parsing continues.
+//
+using statement_consumer = std::function<void(ast& tree, node_id stmt)>;
+using line_error_handler = std::function<void(int line_number, const std::exception& error)>;
+
+inline void parse_stream(std::istream& input, ast& tree, symbol_table& symbols, const statement_consumer& consumer, bool clear_after_line = true, const line_error_handler& on_error = {}) {
+	std::string source_line;
+	std::vector<token> tokens;
+	int source_line_number = 1;
+
+	while (std::getline(input, source_line)) {
+		if (source_line.empty()) continue;
+
+		int line_number = 0;
+		try {
+			tokens.clear();
+			tokenize_line(source_line, source_line_number, tokens, tree.strings);
+
+			if (!try_parse_int(tokens[0].str(tree.strings), line_number)) {
+				if (source_line_number == 1)
+					throw std::runtime_error(std::format("No line number on first line"));
+				throw std::runtime_error(std::format("Expected a line number : {}", tokens[0].str(tree.strings)));
+			}
 
-	for (size_t i = 1; i < tokens.size(); i++) {
-		if (tokens[i].type == token_t::NEWLINE && !line.empty()) {
-			node stmt = parse_line(line, line_number);
-			root.child_nodes.push_back(stmt);
-			line.clear();
-			i++;
-			if (tokens[i].type != token_t::END_OF_FILE) {
-				if (!try_parse_int(tokens[i].value, line_number))
-					throw std::runtime_error(std::format("Expected a line number : {}", tokens[i].value));
-			}			
-		}
-		else if (tokens[i].type == token_t::COLON && !line.empty()) {
-			node stmt = parse_line(line, line_number);
-			root.child_nodes.push_back(stmt);
-			line.clear();
+			//statements are separated by colons, the last one ends at the NEWLINE token
+			std::span<const token> line(tokens);
+			size_t stmt_start = 1;
+			for (size_t i = 1; i < line.size(); i++) {
+				if (line[i].type != token_t::COLON && line[i].type != token_t::NEWLINE) continue;
+				if (i > stmt_start) {
+					node_id stmt = parse_line(tree, symbols, line.subspan(stmt_start, i - stmt_start), line_number);
+					consumer(tree, stmt);
+				}
+				stmt_start = i + 1;
+			}
 		}
-		else {
-			line.push_back(tokens[i]);
+		catch (const std::exception& error) {
+			if (!on_error) throw;
+			on_error(line_number, error);
 		}
+		source_line_number++;
+
+		if (clear_after_line) tree.clear();
 	}
+}
+
+inline void parse_stream(const std::string& filename, const statement_consumer& consumer) {
+	std::ifstream file(filename + ".bas");
+	ast tree;
+	symbol_table symbols;
+	parse_stream(file, tree, symbols, consumer);
+}
 
-	return root;
-}
\ No newline at end of file
+//Parses the whole file into one tree with a ROOT node
+inline ast parse(const std::string& filename) {
+	ast tree;
+	std::vector<node_id> statements;
+
+	symbol_table symbols;
+	std::ifstream file(filename + ".bas");
+	parse_stream(file, tree, symbols, [&](ast&, node_id stmt) { statements.push_back(stmt); }, false);
+
+	//the root is created last so the statements end up as one contiguous child range
+	tree.root = tree.add(node_t::ROOT, statements);
+	return tree;
+}
@@ -0,0 +1,348 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <bit>
+#include <climits>
+#include <cstdint>
+
+//
+//	REGISTER ALLOCATION
+//
+//	Linear scan (Poletto and Sarkar) over the code of the code generator. The code uses virtual registers
+//	v0, v1, ... next to physical ones. Live ranges come from a liveness analysis over the control flow of
+//	jmp, brh and hlt, so a variable that is live around a GOTO loop keeps one register for the whole loop.
+//
+//	When no register is free, the interval that ends last is spilled to a byte of data memory. Spill slots
+//	start at address 0 and are shared by intervals that do not overlap, they have to stay below the MMIO
+//	ports at 240. A spilled operand is loaded into r12 (r13 for a second one) right before its instruction,
+//	a spilled result is written to r12 and stored right after it. Slots above 7 are addressed through r14.
+//	lod, str and ldi leave the flags alone, so spill code can sit between a cmp and its brh.
+//
+//	A line is a label (".name"), a comment ("// ..."), an empty line or an instruction and its operands.
+//
+using codegen_line = std::vector<std::string>;
+
+struct regalloc_report {
+	size_t virtual_registers = 0;
+	size_t registers_used = 0;
+	size_t spilled_values = 0;
+	size_t spill_slots = 0;
+	size_t spill_loads = 0;
+	size_t spill_stores = 0;
+};
+
+enum class operand_role : uint8_t {
+	NONE,
+	USE,
+	DEF,
+	USE_DEF,
+};
+
+inline std::array<operand_role, 3> operand_roles(const std::string& mnemonic) {
+	using enum operand_role;
+	if (mnemonic == "add" || mnemonic == "sub" || mnemonic == "nor" || mnemonic == "and" || mnemonic == "xor") return { USE, USE, DEF };
+	if (mnemonic == "rsh" || mnemonic == "lsh" || mnemonic == "mov" || mnemonic == "neg" || mnemonic == "not") return { USE, DEF, NONE };
+	if (mnemonic == "ldi") return { DEF, NONE, NONE };
+	if (mnemonic == "adi" || mnemonic == "inc" || mnemonic == "dec") return { USE_DEF, NONE, NONE };
+	if (mnemonic == "cmp") return { USE, USE, NONE };
+	if (mnemonic == "lod") return { USE, DEF, NONE };
+	if (mnemonic == "str") return { USE, USE, NONE };
+	return { NONE, NONE, NONE };
+}
+
+inline bool is_instruction_line(const codegen_line& line) {
+	return !line.empty() && line[0][0] != '.' && line[0][0] != '/';
+}
+
+//appends the lines as assembly text and returns the number of instructions among them
+inline size_t render_lines(std::string& output, const std::vector<codegen_line>& lines) {
+	size_t instructions = 0;
+	for (const codegen_line& line : lines) {
+		if (line.empty()) {
+			output += '\n';
+		}
+		else if (!is_instruction_line(line)) {
+			output += line[0] + '\n';
+		}
+		else {
+			output += "   ";
+			for (const std::string& token : line) output += ' ' + token;
+			output += '\n';
+			instructions++;
+		}
+	}
+	return instructions;
+}
+
+inline int virtual_register_id(const std::string& operand) {
+	if (operand.size() < 2 || operand[0] != 'v' || operand[1] < '0' || operand[1] > '9') return -1;
+	return std::stoi(operand.substr(1));
+}
+
+//rewrites the virtual registers of the lines into the allocatable physical registers and spill code
+inline regalloc_report allocate_registers(std::vector<codegen_line>& lines, const std::vector<int>& allocatable_registers) {
+	regalloc_report report;
+
+	//
+	//	Instructions, their virtual operands and the control flow between them
+	//
+	struct instruction_info {
+		size_t line = 0;
+		std::vector<int> uses;
+		std::vector<int> defs;
+		std::vector<size_t> successors;
+	};
+	std::vector<instruction_info> instructions;
+	std::unordered_map<std::string, size_t> label_targets;
+	int vreg_count = 0;
+
+	for (size_t line_index = 0; line_index < lines.size(); line_index++) {
+		const codegen_line& line = lines[line_index];
+		if (line.empty()) continue;
+		if (line[0][0] == '.') label_targets[line[0]] = instructions.size();
+		if (!is_instruction_line(line)) continue;
+
+		instruction_info info;
+		info.line = line_index;
+		std::array<operand_role, 3> roles = operand_roles(line[0]);
+		for (size_t i = 1; i < line.size() && i <= 3; i++) {
+			int vreg = virtual_register_id(line[i]);
+			if (vreg < 0) continue;
+			vreg_count = std::max(vreg_count, vreg + 1);
+			operand_role role = roles[i - 1];
+			if (role == operand_role::USE || role == operand_role::USE_DEF) info.uses.push_back(vreg);
+			if (role == operand_role::DEF || role == operand_role::USE_DEF) info.defs.push_back(vreg);
+		}
+		instructions.push_back(std::move(info));
+	}
+
+	size_t count = instructions.size();
+	for (size_t i = 0; i < count; i++) {
+		const codegen_line& line = lines[instructions[i].line];
+		const std::string& mnemonic = line[0];
+		bool falls_through = mnemonic != "jmp" && mnemonic != "hlt" && mnemonic != "ret";
+		if (falls_through && i + 1 < count) instructions[i].successors.push_back(i + 1);
+
+		if (mnemonic == "jmp" || mnemonic == "brh") {
+			auto target = label_targets.find(line.back());
+			if (target != label_targets.end() && target->second < count) instructions[i].successors.push_back(target->second);
+		}
+	}
+	report.virtual_registers = vreg_count;
+
+	//
+	//	Liveness, live_in[i] is a bitset of the virtual registers live before instruction i
+	//
+	size_t words = ((size_t)vreg_count + 63) / 64;
+	std::vector<uint64_t> live_in(count * words, 0);
+	std::vector<uint64_t> live_out(words);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = count; i-- > 0;) {
+			const instruction_info& info = instructions[i];
+			std::fill(live_out.begin(), live_out.end(), 0);
+			for (size_t successor : info.successors) {
+				for (size_t w = 0; w < words; w++) live_out[w] |= live_in[successor * words + w];
+			}
+			for (int vreg : info.defs) live_out[vreg / 64] &= ~(1ull << (vreg % 64));
+			for (int vreg : info.uses) live_out[vreg / 64] |= 1ull << (vreg % 64);
+
+			uint64_t* in = &live_in[i * words];
+			if (!std::equal(live_out.begin(), live_out.end(), in)) {
+				std::copy(live_out.begin(), live_out.end(), in);
+				changed = true;
+			}
+		}
+	}
+
+	//
+	//	Live intervals over the linear instruction order
+	//
+	struct live_interval {
+		int vreg = 0;
+		int start = INT_MAX;
+		int end = -1;
+	};
+	std::vector<live_interval> intervals(vreg_count);
+	for (int vreg = 0; vreg < vreg_count; vreg++) intervals[vreg].vreg = vreg;
+
+	auto extend = [&](int vreg, int position) {
+		intervals[vreg].start = std::min(intervals[vreg].start, position);
+		intervals[vreg].end = std::max(intervals[vreg].end, position);
+	};
+	for (size_t i = 0; i < count; i++) {
+		for (size_t w = 0; w < words; w++) {
+			for (uint64_t bits = live_in[i * words + w]; bits != 0; bits &= bits - 1) {
+				extend((int)(w * 64 + std::countr_zero(bits)), (int)i);
+			}
+		}
+		for (int vreg : instructions[i].defs) extend(vreg, (int)i);
+	}
+
+	std::vector<live_interval> sorted;
+	for (const live_interval& interval : intervals) {
+		if (interval.end >= 0) sorted.push_back(interval);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const live_interval& a, const live_interval& b) { return a.start < b.start; });
+
+	//
+	//	Linear scan, an interval ending at the instruction where another one starts can hand over its
+	//	register since every instruction reads its operands before it writes
+	//
+	std::vector<int> assigned(vreg_count, -1);
+	std::vector<bool> is_spilled(vreg_count, false);
+	std::vector<int> free_registers(allocatable_registers.rbegin(), allocatable_registers.rend());
+	std::vector<live_interval> active;
+	std::vector<bool> is_used(16, false);
+
+	for (const live_interval& interval : sorted) {
+		for (size_t a = 0; a < active.size();) {
+			if (active[a].end <= interval.start) {
+				free_registers.push_back(assigned[active[a].vreg]);
+				active.erase(active.begin() + a);
+			}
+			else {
+				a++;
+			}
+		}
+
+		if (!free_registers.empty()) {
+			//a copy gets the register of its source when that one just became free
+			auto chosen = free_registers.end() - 1;
+			const codegen_line& first_line = lines[instructions[interval.start].line];
+			if (first_line[0] == "mov") {
+				int source = virtual_register_id(first_line[1]);
+				if (source >= 0 && assigned[source] >= 0) {
+					auto hinted = std::find(free_registers.begin(), free_registers.end(), assigned[source]);
+					if (hinted != free_registers.end()) chosen = hinted;
+				}
+			}
+			assigned[interval.vreg] = *chosen;
+			free_registers.erase(chosen);
+		}
+		else {
+			auto last = std::max_element(active.begin(), active.end(), [](const live_interval& a, const live_interval& b) { return a.end < b.end; });
+			if (last != active.end() && last->end > interval.end) {
+				assigned[interval.vreg] = assigned[last->vreg];
+				assigned[last->vreg] = -1;
+				is_spilled[last->vreg] = true;
+				active.erase(last);
+			}
+			else {
+				is_spilled[interval.vreg] = true;
+				continue;
+			}
+		}
+
+		is_used[assigned[interval.vreg]] = true;
+		active.push_back(interval);
+	}
+
+	//
+	//	Spill slots, shared between spilled intervals that do not overlap
+	//
+	std::vector<int> slots(vreg_count, -1);
+	std::vector<live_interval> slot_active;
+	std::vector<int> free_slots;
+	int slot_count = 0;
+
+	for (const live_interval& interval : sorted) {
+		if (!is_spilled[interval.vreg]) continue;
+		report.spilled_values++;
+
+		for (size_t a = 0; a < slot_active.size();) {
+			if (slot_active[a].end < interval.start) {
+				free_slots.push_back(slots[slot_active[a].vreg]);
+				slot_active.erase(slot_active.begin() + a);
+			}
+			else {
+				a++;
+			}
+		}
+
+		if (free_slots.empty()) {
+			if (slot_count >= 240)
+				throw std::runtime_error("The program needs more spill slots than the data memory has");
+			free_slots.push_back(slot_count++);
+		}
+		slots[interval.vreg] = free_slots.back();
+		free_slots.pop_back();
+		slot_active.push_back(interval);
+	}
+	report.spill_slots = slot_count;
+	report.registers_used = std::count(is_used.begin(), is_used.end(), true);
+
+	//
+	//	Rewrite
+	//
+	auto slot_access = [&](const std::string& mnemonic, int slot, const std::string& reg, std::vector<codegen_line>& output) {
+		if (slot < 8) {
+			output.push_back({ mnemonic, "r0", reg, std::to_string(slot) });
+		}
+		else {
+			output.push_back({ "ldi", "r14", std::to_string(slot) });
+			output.push_back({ mnemonic, "r14", reg });
+		}
+	};
+
+	std::vector<codegen_line> output;
+	output.reserve(lines.size() + report.spilled_values * 4);
+
+	for (codegen_line& line : lines) {
+		if (!is_instruction_line(line)) {
+			output.push_back(std::move(line));
+			continue;
+		}
+
+		std::array<operand_role, 3> roles = operand_roles(line[0]);
+		std::vector<std::pair<int, std::string>> loaded; //spilled vreg and the scratch register it is in
+		int stored_vreg = -1;
+
+		for (size_t i = 1; i < line.size() && i <= 3; i++) {
+			int vreg = virtual_register_id(line[i]);
+			if (vreg < 0) continue;
+
+			if (!is_spilled[vreg]) {
+				line[i] = "r" + std::to_string(assigned[vreg]);
+				continue;
+			}
+
+			operand_role role = roles[i - 1];
+			if (role == operand_role::DEF) {
+				line[i] = "r12";
+				stored_vreg = vreg;
+				continue;
+			}
+
+			auto found = std::find_if(loaded.begin(), loaded.end(), [vreg](const auto& entry) { return entry.first == vreg; });
+			if (found == loaded.end()) {
+				std::string scratch = loaded.empty() ? "r12" : "r13";
+				slot_access("lod", slots[vreg], scratch, output);
+				report.spill_loads++;
+				loaded.push_back({ vreg, scratch });
+				found = loaded.end() - 1;
+			}
+			line[i] = found->second;
+			if (role == operand_role::USE_DEF) stored_vreg = vreg;
+		}
+
+		std::string stored_register = (stored_vreg >= 0 && roles[0] == operand_role::USE_DEF) ? line[1] : "r12";
+		output.push_back(std::move(line));
+		if (stored_vreg >= 0) {
+			slot_access("str", slots[stored_vreg], stored_register, output);
+			report.spill_stores++;
+		}
+	}
+
+	//a copy between the same registers only sets flags, and the generated code never reads them after a mov
+	std::erase_if(output, [](const codegen_line& line) { return line.size() == 3 && line[0] == "mov" && line[1] == line[2]; });
+
+	lines = std::move(output);
+	return report;
+}
@@ -0,0 +1,566 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#include "regalloc.h"
+
+//
+//	RUNTIME LIBRARY
+//
+//	The routines that the generated code calls, a program only gets the ones it uses. The byte routines
+//	work in r11 to r14. The routines for the 16 bit FLT representations take A in r7:r8 and B in r9:r10,
+//	high byte first, return their result in r7:r8 and may change r7 to r14. None of them touches r15.
+//
+//	FLT and DBL values can be represented as
+//		BYTE	rounded to a byte like INT, the default
+//		FIXED	unsigned 8.8 fixed point, the high byte is the integer part. Like the bytes, the values wrap
+//				around at 256. Addition, subtraction and comparison are inlined by the code generator.
+//		FLOAT	sign bit, 7 bit exponent with a bias of 64 and an 8 bit mantissa with an explicit leading 1,
+//				the value is mantissa * 2^(exponent - 71). Zero is 0:0, a result that is too large becomes
+//				the largest value and one that is too small becomes 0. Results are truncated, a product or
+//				quotient is less than one unit of its last place off. Addition and subtraction truncate the
+//				smaller operand as it is aligned, the result is less than one unit of the last place of the
+//				larger operand (or of the result) off. That is a large relative error when the operands
+//				nearly cancel, 147456 + -115200 gives 32768 instead of 32256.
+//
+//	runtime_library_source() is the whole library as one assembly module for the linker.
+//
+enum class flt_representation : uint8_t {
+	BYTE,
+	FIXED,
+	FLOAT,
+};
+
+//the 16 bit encoding of a FLT or DBL constant
+inline uint16_t encode_wide(flt_representation representation, double value) {
+	if (representation == flt_representation::FIXED) {
+		double scaled = std::isfinite(value) ? std::fmod(std::round(value * 256), 65536.0) : 0;
+		return (uint16_t)(int32_t)((scaled < 0) ? scaled + 65536 : scaled);
+	}
+
+	if (value == 0 || std::isnan(value)) return 0;
+	uint16_t sign = (value < 0) ? 0x8000 : 0;
+	if (std::isinf(value)) return sign | 0x7FFF;
+
+	int exponent = 0;
+	int mantissa = (int)std::round(std::ldexp(std::frexp(std::abs(value), &exponent), 8));
+	if (mantissa == 256) {
+		mantissa = 128;
+		exponent++;
+	}
+	exponent += 63;
+	if (exponent < 0) return 0;
+	if (exponent > 127) return sign | 0x7FFF;
+	return sign | (uint16_t)(exponent << 8) | (uint16_t)mantissa;
+}
+
+//the byte a 16 bit value is rounded to, the same as the inlined FIXED conversion and .__fint compute
+inline uint8_t wide_to_byte(flt_representation representation, uint16_t value) {
+	if (representation == flt_representation::FIXED) return (uint8_t)((value >> 8) + ((value & 0x80) ? 1 : 0));
+
+	int shift = ((value >> 8) & 127) - 71;
+	int mantissa = value & 255;
+	int magnitude = 0;
+	if (shift >= 0 && shift < 8) magnitude = mantissa << shift;
+	else if (shift < 0 && shift > -9) magnitude = ((mantissa >> (-shift - 1)) + 1) >> 1;
+
+	uint8_t result = (uint8_t)magnitude;
+	return (value & 0x8000) ? (uint8_t)-result : result;
+}
+
+struct runtime_routine {
+	std::vector<std::string> entry_points;
+	std::vector<int> clobbered_registers; //including the argument registers
+	std::vector<codegen_line> lines;
+};
+
+inline const std::vector<runtime_routine>& runtime_library() {
+	static const std::vector<runtime_routine> library = {
+		{
+			{ ".__mul" },
+			{ 11, 12, 13, 14 },
+			{
+				{ "// r13 = r11 * r12, clobbers r11 r12 r14" },
+				{ ".__mul" },
+				{ "ldi", "r13", "0" },
+				{ "ldi", "r14", "1" },
+				{ ".__mul_loop" },
+				{ "and", "r12", "r14", "r0" },
+				{ "brh", "zero", ".__mul_skip" },
+				{ "add", "r13", "r11", "r13" },
+				{ ".__mul_skip" },
+				{ "lsh", "r11", "r11" },
+				{ "rsh", "r12", "r12" },
+				{ "add", "r12", "r0", "r0" },
+				{ "brh", "notzero", ".__mul_loop" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__div" },
+			{ 11, 12, 13, 14 },
+			{
+				{ "// r11 = r11 \\ r12, r13 = r11 MOD r12, clobbers r14" },
+				{ ".__div" },
+				{ "ldi", "r13", "0" },
+				{ "ldi", "r14", "8" },
+				{ ".__div_loop" },
+				{ "lsh", "r13", "r13" },
+				{ "brh", "carry", ".__div_wide" },
+				{ "lsh", "r11", "r11" },
+				{ "brh", "notcarry", ".__div_compare" },
+				{ "inc", "r13" },
+				{ ".__div_compare" },
+				{ "cmp", "r13", "r12" },
+				{ "brh", "notcarry", ".__div_next" },
+				{ ".__div_subtract" },
+				{ "sub", "r13", "r12", "r13" },
+				{ "inc", "r11" },
+				{ ".__div_next" },
+				{ "dec", "r14" },
+				{ "brh", "notzero", ".__div_loop" },
+				{ "ret" },
+				{ "// the shifted remainder needs 9 bits, so it is larger than any divisor" },
+				{ ".__div_wide" },
+				{ "lsh", "r11", "r11" },
+				{ "brh", "notcarry", ".__div_subtract" },
+				{ "inc", "r13" },
+				{ "jmp", ".__div_subtract" },
+			},
+		},
+		{
+			{ ".__fxmul" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = r7:r8 * r9:r10, bits 8 to 23 of the 32 bit product. B is shifted out at the top, the" },
+				{ "// product in r11:r12:r13 is shifted left and A is added for every 1 bit" },
+				{ ".__fxmul" },
+				{ "ldi", "r11", "0" },
+				{ "ldi", "r12", "0" },
+				{ "ldi", "r13", "0" },
+				{ "ldi", "r14", "16" },
+				{ ".__fxmul_loop" },
+				{ "lsh", "r11", "r11" },
+				{ "lsh", "r12", "r12" },
+				{ "brh", "notcarry", ".__fxmul_shifted_middle" },
+				{ "inc", "r11" },
+				{ ".__fxmul_shifted_middle" },
+				{ "lsh", "r13", "r13" },
+				{ "brh", "notcarry", ".__fxmul_shifted" },
+				{ "inc", "r12" },
+				{ ".__fxmul_shifted" },
+				{ "lsh", "r9", "r9" },
+				{ "brh", "carry", ".__fxmul_add" },
+				{ "lsh", "r10", "r10" },
+				{ "brh", "notcarry", ".__fxmul_next" },
+				{ "inc", "r9" },
+				{ "jmp", ".__fxmul_next" },
+				{ ".__fxmul_add" },
+				{ "lsh", "r10", "r10" },
+				{ "brh", "notcarry", ".__fxmul_add_low" },
+				{ "inc", "r9" },
+				{ ".__fxmul_add_low" },
+				{ "add", "r13", "r8", "r13" },
+				{ "brh", "notcarry", ".__fxmul_add_middle" },
+				{ "inc", "r12" },
+				{ "brh", "notcarry", ".__fxmul_add_middle" },
+				{ "inc", "r11" },
+				{ ".__fxmul_add_middle" },
+				{ "add", "r12", "r7", "r12" },
+				{ "brh", "notcarry", ".__fxmul_next" },
+				{ "inc", "r11" },
+				{ ".__fxmul_next" },
+				{ "dec", "r14" },
+				{ "brh", "notzero", ".__fxmul_loop" },
+				{ "mov", "r11", "r7" },
+				{ "mov", "r12", "r8" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fxdiv" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = (r7:r8 << 8) / r9:r10, restoring division of the 24 bit dividend r7:r8:r13 with the remainder" },
+				{ "// in r11:r12. A division by 0 gives 255.996 like x \\ 0 gives 255" },
+				{ ".__fxdiv" },
+				{ "ldi", "r11", "0" },
+				{ "ldi", "r12", "0" },
+				{ "ldi", "r13", "0" },
+				{ "ldi", "r14", "24" },
+				{ ".__fxdiv_loop" },
+				{ "lsh", "r11", "r11" },
+				{ "brh", "carry", ".__fxdiv_wide" },
+				{ "lsh", "r12", "r12" },
+				{ "brh", "notcarry", ".__fxdiv_shift_high" },
+				{ "inc", "r11" },
+				{ ".__fxdiv_shift_high" },
+				{ "lsh", "r7", "r7" },
+				{ "brh", "notcarry", ".__fxdiv_shift_middle" },
+				{ "inc", "r12" },
+				{ ".__fxdiv_shift_middle" },
+				{ "lsh", "r8", "r8" },
+				{ "brh", "notcarry", ".__fxdiv_shift_low" },
+				{ "inc", "r7" },
+				{ ".__fxdiv_shift_low" },
+				{ "lsh", "r13", "r13" },
+				{ "brh", "notcarry", ".__fxdiv_compare" },
+				{ "inc", "r8" },
+				{ ".__fxdiv_compare" },
+				{ "cmp", "r11", "r9" },
+				{ "brh", "notzero", ".__fxdiv_decided" },
+				{ "cmp", "r12", "r10" },
+				{ ".__fxdiv_decided" },
+				{ "brh", "notcarry", ".__fxdiv_next" },
+				{ ".__fxdiv_subtract" },
+				{ "sub", "r12", "r10", "r12" },
+				{ "brh", "carry", ".__fxdiv_no_borrow" },
+				{ "dec", "r11" },
+				{ ".__fxdiv_no_borrow" },
+				{ "sub", "r11", "r9", "r11" },
+				{ "inc", "r13" },
+				{ ".__fxdiv_next" },
+				{ "dec", "r14" },
+				{ "brh", "notzero", ".__fxdiv_loop" },
+				{ "mov", "r8", "r7" },
+				{ "mov", "r13", "r8" },
+				{ "ret" },
+				{ "// the shifted remainder needs 17 bits, so it is larger than any divisor" },
+				{ ".__fxdiv_wide" },
+				{ "lsh", "r12", "r12" },
+				{ "brh", "notcarry", ".__fxdiv_wide_high" },
+				{ "inc", "r11" },
+				{ ".__fxdiv_wide_high" },
+				{ "lsh", "r7", "r7" },
+				{ "brh", "notcarry", ".__fxdiv_wide_middle" },
+				{ "inc", "r12" },
+				{ ".__fxdiv_wide_middle" },
+				{ "lsh", "r8", "r8" },
+				{ "brh", "notcarry", ".__fxdiv_wide_low" },
+				{ "inc", "r7" },
+				{ ".__fxdiv_wide_low" },
+				{ "lsh", "r13", "r13" },
+				{ "brh", "notcarry", ".__fxdiv_subtract" },
+				{ "inc", "r8" },
+				{ "jmp", ".__fxdiv_subtract" },
+			},
+		},
+		{
+			{ ".__fsub", ".__fadd" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = r7:r8 + r9:r10 and r7:r8 = r7:r8 - r9:r10. The operand with the smaller magnitude is moved to" },
+				{ "// r9:r10 and shifted right, the bits that fall off are lost" },
+				{ ".__fsub" },
+				{ "ldi", "r14", "128" },
+				{ "xor", "r9", "r14", "r9" },
+				{ ".__fadd" },
+				{ "cmp", "r10", "r0" },
+				{ "brh", "zero", ".__fadd_done" },
+				{ "cmp", "r8", "r0" },
+				{ "brh", "notzero", ".__fadd_nonzero" },
+				{ "mov", "r9", "r7" },
+				{ "mov", "r10", "r8" },
+				{ ".__fadd_done" },
+				{ "ret" },
+				{ ".__fadd_nonzero" },
+				{ "ldi", "r14", "127" },
+				{ "and", "r7", "r14", "r11" },
+				{ "and", "r9", "r14", "r12" },
+				{ "cmp", "r11", "r12" },
+				{ "brh", "notzero", ".__fadd_ordered" },
+				{ "cmp", "r8", "r10" },
+				{ ".__fadd_ordered" },
+				{ "brh", "carry", ".__fadd_align_start" },
+				{ "mov", "r7", "r13" },
+				{ "mov", "r9", "r7" },
+				{ "mov", "r13", "r9" },
+				{ "mov", "r8", "r13" },
+				{ "mov", "r10", "r8" },
+				{ "mov", "r13", "r10" },
+				{ "mov", "r11", "r13" },
+				{ "mov", "r12", "r11" },
+				{ "mov", "r13", "r12" },
+				{ ".__fadd_align_start" },
+				{ "sub", "r11", "r12", "r13" },
+				{ "ldi", "r14", "8" },
+				{ "cmp", "r13", "r14" },
+				{ "brh", "carry", ".__fadd_done" },
+				{ ".__fadd_align" },
+				{ "dec", "r13" },
+				{ "brh", "notcarry", ".__fadd_aligned" },
+				{ "rsh", "r10", "r10" },
+				{ "jmp", ".__fadd_align" },
+				{ ".__fadd_aligned" },
+				{ "ldi", "r12", "128" },
+				{ "xor", "r7", "r9", "r14" },
+				{ "and", "r14", "r12", "r0" },
+				{ "brh", "notzero", ".__fadd_subtract" },
+				{ "add", "r8", "r10", "r8" },
+				{ "brh", "notcarry", ".__fadd_done" },
+				{ "ldi", "r14", "127" },
+				{ "cmp", "r11", "r14" },
+				{ "brh", "zero", ".__fadd_overflow" },
+				{ "rsh", "r8", "r8" },
+				{ "add", "r8", "r12", "r8" },
+				{ "inc", "r7" },
+				{ "ret" },
+				{ ".__fadd_overflow" },
+				{ "ldi", "r8", "255" },
+				{ "ret" },
+				{ ".__fadd_subtract" },
+				{ "sub", "r8", "r10", "r8" },
+				{ "brh", "zero", ".__fadd_zero" },
+				{ ".__fadd_normalize" },
+				{ "and", "r8", "r12", "r0" },
+				{ "brh", "notzero", ".__fadd_done" },
+				{ "cmp", "r11", "r0" },
+				{ "brh", "zero", ".__fadd_zero" },
+				{ "dec", "r11" },
+				{ "dec", "r7" },
+				{ "lsh", "r8", "r8" },
+				{ "jmp", ".__fadd_normalize" },
+				{ ".__fadd_zero" },
+				{ "ldi", "r7", "0" },
+				{ "ldi", "r8", "0" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fmul" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = r7:r8 * r9:r10, the top 8 bits of the 16 bit mantissa product" },
+				{ ".__fmul" },
+				{ "cmp", "r8", "r0" },
+				{ "brh", "zero", ".__fmul_zero" },
+				{ "cmp", "r10", "r0" },
+				{ "brh", "zero", ".__fmul_zero" },
+				{ "xor", "r7", "r9", "r11" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r11", "r14", "r11" },
+				{ "ldi", "r14", "127" },
+				{ "and", "r7", "r14", "r7" },
+				{ "and", "r9", "r14", "r9" },
+				{ "add", "r7", "r9", "r7" },
+				{ "ldi", "r9", "0" },
+				{ "ldi", "r12", "0" },
+				{ "ldi", "r13", "8" },
+				{ ".__fmul_loop" },
+				{ "lsh", "r9", "r9" },
+				{ "lsh", "r12", "r12" },
+				{ "brh", "notcarry", ".__fmul_shifted" },
+				{ "inc", "r9" },
+				{ ".__fmul_shifted" },
+				{ "lsh", "r10", "r10" },
+				{ "brh", "notcarry", ".__fmul_next" },
+				{ "add", "r12", "r8", "r12" },
+				{ "brh", "notcarry", ".__fmul_next" },
+				{ "inc", "r9" },
+				{ ".__fmul_next" },
+				{ "dec", "r13" },
+				{ "brh", "notzero", ".__fmul_loop" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r9", "r14", "r0" },
+				{ "brh", "zero", ".__fmul_low" },
+				{ "inc", "r7" },
+				{ "jmp", ".__fmul_exponent" },
+				{ ".__fmul_low" },
+				{ "lsh", "r9", "r9" },
+				{ "lsh", "r12", "r12" },
+				{ "brh", "notcarry", ".__fmul_exponent" },
+				{ "inc", "r9" },
+				{ ".__fmul_exponent" },
+				{ "adi", "r7", "192" },
+				{ "brh", "notcarry", ".__fmul_zero" },
+				{ "mov", "r9", "r8" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r7", "r14", "r0" },
+				{ "brh", "zero", ".__fmul_in_range" },
+				{ "ldi", "r7", "127" },
+				{ "ldi", "r8", "255" },
+				{ ".__fmul_in_range" },
+				{ "add", "r7", "r11", "r7" },
+				{ "ret" },
+				{ ".__fmul_zero" },
+				{ "ldi", "r7", "0" },
+				{ "ldi", "r8", "0" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fdiv" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = r7:r8 / r9:r10, 8 quotient bits of the mantissas. A division by 0 gives the largest value" },
+				{ ".__fdiv" },
+				{ "xor", "r7", "r9", "r11" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r11", "r14", "r11" },
+				{ "cmp", "r10", "r0" },
+				{ "brh", "zero", ".__fdiv_overflow" },
+				{ "cmp", "r8", "r0" },
+				{ "brh", "zero", ".__fdiv_zero" },
+				{ "ldi", "r14", "127" },
+				{ "and", "r7", "r14", "r7" },
+				{ "and", "r9", "r14", "r9" },
+				{ "adi", "r7", "64" },
+				{ "sub", "r7", "r9", "r7" },
+				{ "brh", "notcarry", ".__fdiv_zero" },
+				{ "ldi", "r12", "0" },
+				{ "ldi", "r13", "8" },
+				{ "cmp", "r8", "r10" },
+				{ "brh", "notcarry", ".__fdiv_low" },
+				{ "sub", "r8", "r10", "r8" },
+				{ "ldi", "r12", "1" },
+				{ "ldi", "r13", "7" },
+				{ "jmp", ".__fdiv_loop" },
+				{ ".__fdiv_low" },
+				{ "dec", "r7" },
+				{ "brh", "notcarry", ".__fdiv_zero" },
+				{ ".__fdiv_loop" },
+				{ "lsh", "r12", "r12" },
+				{ "lsh", "r8", "r8" },
+				{ "brh", "carry", ".__fdiv_subtract" },
+				{ "cmp", "r8", "r10" },
+				{ "brh", "notcarry", ".__fdiv_next" },
+				{ ".__fdiv_subtract" },
+				{ "sub", "r8", "r10", "r8" },
+				{ "inc", "r12" },
+				{ ".__fdiv_next" },
+				{ "dec", "r13" },
+				{ "brh", "notzero", ".__fdiv_loop" },
+				{ "mov", "r12", "r8" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r7", "r14", "r0" },
+				{ "brh", "zero", ".__fdiv_in_range" },
+				{ ".__fdiv_overflow" },
+				{ "ldi", "r7", "127" },
+				{ "ldi", "r8", "255" },
+				{ ".__fdiv_in_range" },
+				{ "add", "r7", "r11", "r7" },
+				{ "ret" },
+				{ ".__fdiv_zero" },
+				{ "ldi", "r7", "0" },
+				{ "ldi", "r8", "0" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fcmp" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// sets Z and C like cmp would for r7:r8 and r9:r10. The sign bit is flipped on positive values and" },
+				{ "// negative ones are inverted, which gives keys that compare as unsigned numbers" },
+				{ ".__fcmp" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r7", "r14", "r0" },
+				{ "brh", "zero", ".__fcmp_positive_a" },
+				{ "not", "r7", "r7" },
+				{ "not", "r8", "r8" },
+				{ "jmp", ".__fcmp_b" },
+				{ ".__fcmp_positive_a" },
+				{ "xor", "r7", "r14", "r7" },
+				{ ".__fcmp_b" },
+				{ "and", "r9", "r14", "r0" },
+				{ "brh", "zero", ".__fcmp_positive_b" },
+				{ "not", "r9", "r9" },
+				{ "not", "r10", "r10" },
+				{ "jmp", ".__fcmp_compare" },
+				{ ".__fcmp_positive_b" },
+				{ "xor", "r9", "r14", "r9" },
+				{ ".__fcmp_compare" },
+				{ "cmp", "r7", "r9" },
+				{ "brh", "notzero", ".__fcmp_done" },
+				{ "cmp", "r8", "r10" },
+				{ ".__fcmp_done" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fbyte" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r7:r8 = the byte in r8" },
+				{ ".__fbyte" },
+				{ "ldi", "r7", "0" },
+				{ "cmp", "r8", "r0" },
+				{ "brh", "zero", ".__fbyte_done" },
+				{ "ldi", "r7", "71" },
+				{ "ldi", "r14", "128" },
+				{ ".__fbyte_normalize" },
+				{ "and", "r8", "r14", "r0" },
+				{ "brh", "notzero", ".__fbyte_done" },
+				{ "lsh", "r8", "r8" },
+				{ "dec", "r7" },
+				{ "jmp", ".__fbyte_normalize" },
+				{ ".__fbyte_done" },
+				{ "ret" },
+			},
+		},
+		{
+			{ ".__fint" },
+			{ 7, 8, 9, 10, 11, 12, 13, 14 },
+			{
+				{ "// r8 = r7:r8 rounded half away from zero and wrapped to 8 bits" },
+				{ ".__fint" },
+				{ "ldi", "r14", "127" },
+				{ "and", "r7", "r14", "r11" },
+				{ "adi", "r11", "185" },
+				{ "brh", "notcarry", ".__fint_right" },
+				{ "ldi", "r14", "8" },
+				{ "cmp", "r11", "r14" },
+				{ "brh", "carry", ".__fint_zero" },
+				{ ".__fint_left" },
+				{ "dec", "r11" },
+				{ "brh", "notcarry", ".__fint_sign" },
+				{ "lsh", "r8", "r8" },
+				{ "jmp", ".__fint_left" },
+				{ ".__fint_right" },
+				{ "neg", "r11", "r11" },
+				{ "ldi", "r14", "9" },
+				{ "cmp", "r11", "r14" },
+				{ "brh", "carry", ".__fint_zero" },
+				{ "dec", "r11" },
+				{ ".__fint_shift" },
+				{ "dec", "r11" },
+				{ "brh", "notcarry", ".__fint_round" },
+				{ "rsh", "r8", "r8" },
+				{ "jmp", ".__fint_shift" },
+				{ ".__fint_round" },
+				{ "inc", "r8" },
+				{ "brh", "carry", ".__fint_wrap" },
+				{ "rsh", "r8", "r8" },
+				{ "jmp", ".__fint_sign" },
+				{ ".__fint_wrap" },
+				{ "ldi", "r8", "128" },
+				{ ".__fint_sign" },
+				{ "ldi", "r14", "128" },
+				{ "and", "r7", "r14", "r0" },
+				{ "brh", "zero", ".__fint_done" },
+				{ "neg", "r8", "r8" },
+				{ ".__fint_done" },
+				{ "ret" },
+				{ ".__fint_zero" },
+				{ "ldi", "r8", "0" },
+				{ "ret" },
+			},
+		},
+	};
+	return library;
+}
+
+//every routine with its entry points exported, to be linked after a program
+inline std::string runtime_library_source() {
+	std::string source;
+	for (const runtime_routine& routine : runtime_library()) {
+		for (const std::string& entry_point : routine.entry_points) source += "export " + entry_point + '\n';
+	}
+	for (const runtime_routine& routine : runtime_library()) {
+		source += '\n';
+		render_lines(source, routine.lines);
+	}
+	return source;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+
+#include "ast.h"
+
+//
+//	SYMBOL TABLE
+//
+//	Variables get dense ids in order of declaration and a slot among the variables of the same type
+//	(the %, !, # and $ suffix), so a code generator can lay out each type contiguously.
+//
+//	A DEF FN body is parsed once into a template, an expression in its own arena where the parameters
+//	are PARAMETER placeholder nodes. A call site is the template instantiated with the argument
+//	subtrees, see ast::import().
+//
+//	One symbol_table belongs to one compilation, nothing is shared between compilations.
+//
+using symbol_id = uint32_t;
+static constexpr symbol_id NO_SYMBOL = UINT32_MAX;
+
+struct variable_symbol {
+	std::string name;
+	node_t type = node_t::LITERAL_FLT;
+	uint32_t slot = 0; //index among the variables of the same type
+};
+
+struct function_template {
+	std::string name;
+	node_t type = node_t::LITERAL_FLT;
+	std::vector<node_t> param_types;
+	int line_number = 0;
+
+	ast body;
+	node_id expression = NO_NODE;
+};
+
+class symbol_table {
+public:
+	std::vector<int> jmp_list; //keep track of lines that need a label for (GOTO) jmp instructions
+
+	symbol_id find_variable(const std::string& name) const {
+		auto found = variable_ids.find(name);
+		return (found == variable_ids.end()) ? NO_SYMBOL : found->second;
+	}
+
+	//returns the id of the variable, declaring it on first use
+	symbol_id declare_variable(const std::string& name, node_t type) {
+		auto found = variable_ids.find(name);
+		if (found != variable_ids.end()) return found->second;
+
+		symbol_id id = (symbol_id)variables.size();
+		variables.push_back({ name, type, type_slots[type_index(type)]++ });
+		variable_ids.emplace(name, id);
+		return id;
+	}
+
+	const variable_symbol& variable(symbol_id id) const { return variables[id]; }
+	size_t variable_count() const { return variables.size(); }
+	size_t slot_count(node_t type) const { return type_slots[type_index(type)]; }
+
+	symbol_id find_function(const std::string& name) const {
+		auto found = function_ids.find(name);
+		return (found == function_ids.end()) ? NO_SYMBOL : found->second;
+	}
+
+	//a redefinition replaces the template, call sites that were already instantiated keep the old body
+	symbol_id define_function(function_template&& function) {
+		auto found = function_ids.find(function.name);
+		if (found != function_ids.end()) {
+			functions[found->second] = std::move(function);
+			return found->second;
+		}
+
+		symbol_id id = (symbol_id)functions.size();
+		function_ids.emplace(function.name, id);
+		functions.push_back(std::move(function));
+		return id;
+	}
+
+	const function_template& function(symbol_id id) const { return functions[id]; }
+	size_t function_count() const { return functions.size(); }
+
+	void clear() {
+		jmp_list.clear();
+		variables.clear();
+		variable_ids.clear();
+		type_slots = {};
+		functions.clear();
+		function_ids.clear();
+	}
+
+private:
+	static size_t type_index(node_t type) {
+		switch (type)
+		{
+		case node_t::LITERAL_INT: return 0;
+		case node_t::LITERAL_DBL: return 2;
+		case node_t::LITERAL_STR: return 3;
+		default: return 1;
+		}
+	}
+
+	std::vector<variable_symbol> variables;
+	std::unordered_map<std::string, symbol_id> variable_ids;
+	std::array<uint32_t, 4> type_slots = {};
+
+	std::vector<function_template> functions;
+	std::unordered_map<std::string, symbol_id> function_ids;
+};
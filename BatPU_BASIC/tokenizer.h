@@ -3,9 +3,14 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <format>
-#include <regex>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
 
-enum class token_t
+#include "../StringPool.h"
+
+enum class token_t : uint8_t
 {
 	UNKNOWN,
 
@@ -87,7 +92,7 @@ enum class token_t
 
 struct token {
 	token_t type = token_t::UNKNOWN;
-	std::string value = "";
+	str_id value = 0; //the text of the token, interned in the pool the line was tokenized with
 	uint32_t line_number = 0;
 
 	token() {}
@@ -96,10 +101,11 @@ struct token {
 		type(type)
 	{}
 
-	token(token_t type, std::string value) :
+	token(token_t type, str_id value) :
 		type(type), value(value)
 	{}
 
+	const std::string& str(const string_pool& strings) const { return strings.get(value); }
 };
 
 static const std::unordered_map<std::string, token_t> token_type_map = {
@@ -172,220 +178,179 @@ static const std::unordered_map<std::string, token_t> token_type_map = {
 static const std::unordered_set<char> valid_char_set = { ' ','a','b','c','d','e','f','g','h','i','j','k','l','m','n',
 												         'o','p','q','r','s','t','u','v','w','x','y','z','.','!','?' };
 
-static bool is_valid_str(const std::string& str) {
-	std::regex pattern("^[a-zA-Z !?]*$");
-	return std::regex_match(str, pattern);
-}
-
-static bool is_str_hex(const std::string& str) {
-	if (str.empty()) return false;
-	std::regex pattern("^&H[0-9A-Fa-f]+$");
-	return std::regex_match(str, pattern);
-}
-
-static bool is_str_oct(const std::string& str) {
-	std::regex pattern("^&O[0-7]+$");
-	return std::regex_match(str, pattern);
-}
-
-static bool is_str_int(const std::string& str) {
-	if (str.empty()) return false;
-	if (is_str_hex(str)) return true;
-	if (is_str_oct(str)) return true;
-	std::regex pattern("^[-+]?[0-9]+$");
-	return std::regex_match(str, pattern);
-}
-
-static bool is_str_flt(const std::string& str) {
-	if (str.empty()) return false;
-	std::regex pattern("^[-+]?([0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][-+]?[0-9]+)?!?$");
-	return std::regex_match(str, pattern);
-}
-
-static bool is_str_dbl(const std::string& str) {
-	if (str.empty()) return false;
-	std::regex pattern("^[-+]?([0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][-+]?[0-9]+)?#?$");
-	return std::regex_match(str, pattern);
-}
-
-std::vector<token> tokenize(const std::string& filename) {
-	std::vector<token> tokens;
-
-	std::ifstream file(filename + ".bas");
-	std::string line;
-	int line_number = 1;
-
-	while (std::getline(file, line)) {
-		if (line.empty()) continue;
+//Appends the tokens of one source line, followed by a NEWLINE token. The token texts are interned in strings,
+//the parser passes the pool of its ast so they are dropped with the line.
+inline void tokenize_line(const std::string& line, int line_number, std::vector<token>& tokens, string_pool& strings) {
+	size_t first_token = tokens.size();
+	std::string token_value;
+
+	for (size_t i = 0; i < line.size(); i++) {
+		if (line[i] == '"') {
+			//read full string
+			i++;
+			size_t count = 0;
+			while (line[i + count] != '"') count++;
+			token token;
+			token.line_number = line_number;
+			token.type = token_t::LITERAL_STR;
+			token.value = strings.intern(line.substr(i, count));
+			tokens.push_back(token);
+			i += count;
+		}
+		else if (std::isdigit(line[i])) {
+			//read full numeric
+			token numeric;
+			numeric.line_number = line_number;
+			std::string num_str;
 
-		std::string token_value;
+			while (std::isdigit(line[i])){
+				num_str += line[i];
+				i++;
+			} 
 
-		for (size_t i = 0; i < line.size(); i++) {
-			char c = line[i];
-			if (line[i] == '"') {
-				//read full string
+			if (line[i] == '%') {
+				num_str += line[i];
 				i++;
-				size_t count = 0;
-				while (line[i + count] != '"') count++;
-				token token;
-				token.line_number = line_number;
-				token.type = token_t::LITERAL_STR;
-				token.value = line.substr(i, count);
-				tokens.push_back(token);
-				i += count;
 			}
-			else if (std::isdigit(line[i])) {
-				//read full numeric
-				token numeric;
-				numeric.line_number = line_number;
-				std::string num_str;
-
-				while (std::isdigit(line[i])){
-					num_str += line[i];
-					i++;
-				} 
 
-				if (line[i] == '%') {
-					num_str += line[i];
-					i++;
-				}
+			if (line[i] != '.') {
+				//save int
+				numeric.type = token_t::LITERAL_INT;
+				numeric.value = strings.intern(num_str);
+				tokens.push_back(numeric);
+				i--;
+				continue;
+			}
 
-				if (line[i] != '.') {
-					//save int
-					numeric.type = token_t::LITERAL_INT;
-					numeric.value = num_str;
-					tokens.push_back(numeric);
-					i--;
-					continue;
-				}
+			num_str += line[i];
+			i++;
+			while (std::isdigit(line[i])) {
+				num_str += line[i];
+				i++;
+			}
 
+			if (line[i] == 'E') {
+				//exponential form
+				num_str += line[i];
+				i++;
 				num_str += line[i];
 				i++;
 				while (std::isdigit(line[i])) {
 					num_str += line[i];
 					i++;
 				}
+			}
 
-				if (line[i] == 'E') {
-					//exponential form
-					num_str += line[i];
-					i++;
-					num_str += line[i];
-					i++;
-					while (std::isdigit(line[i])) {
-						num_str += line[i];
-						i++;
-					}
-				}
-
-				if (line[i] == '#') {
-					//save dbl
-					num_str += line[i];
-					i++;
-					numeric.type = token_t::LITERAL_DBL;
-					numeric.value = num_str;
-					tokens.push_back(numeric);
-					continue;
-				}
-				else if(line[i]=='!'){
-					num_str += line[i];
-					i++;
-					numeric.type = token_t::LITERAL_FLT;
-					numeric.value = num_str;
-					tokens.push_back(numeric);
-					continue;
-				}
+			if (line[i] == '#') {
+				//save dbl
+				num_str += line[i];
+				i++;
+				numeric.type = token_t::LITERAL_DBL;
+				numeric.value = strings.intern(num_str);
+				tokens.push_back(numeric);
+				i--;
+				continue;
+			}
+			else if(line[i]=='!'){
+				num_str += line[i];
+				i++;
+				numeric.type = token_t::LITERAL_FLT;
+				numeric.value = strings.intern(num_str);
+				tokens.push_back(numeric);
+				i--;
+				continue;
+			}
 
-				if (num_str.size() <= 8) {
-					//save flt
-					numeric.type = token_t::LITERAL_FLT;
-					numeric.value = num_str;
-					tokens.push_back(numeric);
-					continue;
-				}
-				else{
-					//save dbl
-					numeric.type = token_t::LITERAL_DBL;
-					numeric.value = num_str;
-					tokens.push_back(numeric);
-					continue;
-				}
-					
+			if (num_str.size() <= 8) {
+				//save flt
+				numeric.type = token_t::LITERAL_FLT;
+				numeric.value = strings.intern(num_str);
+				tokens.push_back(numeric);
+				i--;
+				continue;
+			}
+			else{
+				//save dbl
+				numeric.type = token_t::LITERAL_DBL;
+				numeric.value = strings.intern(num_str);
+				tokens.push_back(numeric);
+				i--;
+				continue;
 			}
-			else if (token_type_map.contains(std::string(1,line[i]))) {
-				//read in operator
 				
-				//save the current token value
-				if (!token_value.empty()) {
-					token token;
-					token.value = token_value;
-					token.line_number = line_number;
-					token.type = token_type_map.contains(token_value) ? token_type_map.at(token_value) : token_t::IDENTIFIER;
-					tokens.push_back(token);
-					token_value.clear();
-				}
+		}
+		else if (token_type_map.contains(std::string(1,line[i]))) {
+			//read in operator
+			
+			//save the current token value
+			if (!token_value.empty()) {
+				token token;
+				token.value = strings.intern(token_value);
+				token.line_number = line_number;
+				token.type = token_type_map.contains(token_value) ? token_type_map.at(token_value) : token_t::IDENTIFIER;
+				tokens.push_back(token);
+				token_value.clear();
+			}
 
-				std::string op2 = line.substr(i, 2);
-				std::string op1 = line.substr(i, 1);
+			std::string op2 = line.substr(i, 2);
+			std::string op1 = line.substr(i, 1);
 
-				token op;
-				op.line_number = line_number;
+			token op;
+			op.line_number = line_number;
 
-				if (token_type_map.contains(op2)) {
-					op.value = op2;
-					op.type = token_type_map.at(op2);
-					tokens.push_back(op);
-				}
-				else if (token_type_map.contains(op1)) {
-					op.value = op1;
-					op.type = token_type_map.at(op1);
-					tokens.push_back(op);
-				}
+			if (token_type_map.contains(op2)) {
+				op.value = strings.intern(op2);
+				op.type = token_type_map.at(op2);
+				tokens.push_back(op);
+				i++;
 			}
-			else if (line[i] == ' ') {
-				//save the current token value
-				if (!token_value.empty()) {
-					token token;
-					token.value = token_value;
-					token.line_number = line_number;
-					token.type = token_type_map.contains(token_value) ? token_type_map.at(token_value) : token_t::IDENTIFIER;
-					tokens.push_back(token);
-					token_value.clear();
-
-					//handle comments
-					if (token.type == token_t::KEYWORD_REM) {
-						i++;
-						std::string comment;
-						while (line[i] != ':' && line[i] != 0) {
-							comment += line[i];
-							i++;
-						}
-						tokens.emplace_back(token_t::LITERAL_STR,comment);
-					}
-				}
+			else if (token_type_map.contains(op1)) {
+				op.value = strings.intern(op1);
+				op.type = token_type_map.at(op1);
+				tokens.push_back(op);
 			}
-			else if (i == line.size() - 1) {
-				//save the current token value
-				token_value += line[i];
+		}
+		else if (line[i] == ' ') {
+			//save the current token value
+			if (!token_value.empty()) {
 				token token;
+				token.value = strings.intern(token_value);
 				token.line_number = line_number;
-				token.value = token_value;
 				token.type = token_type_map.contains(token_value) ? token_type_map.at(token_value) : token_t::IDENTIFIER;
 				tokens.push_back(token);
 				token_value.clear();
-			}
-			else {
-				token_value += line[i];
-			}
 
+				//handle comments
+				if (token.type == token_t::KEYWORD_REM) {
+					i++;
+					std::string comment;
+					while (line[i] != ':' && line[i] != 0) {
+						comment += line[i];
+						i++;
+					}
+					tokens.emplace_back(token_t::LITERAL_STR, strings.intern(comment));
+				}
+			}
 		}
-		tokens.push_back(token(token_t::NEWLINE));
-		line_number++;
+		else if (i == line.size() - 1) {
+			//save the current token value
+			token_value += line[i];
+			token token;
+			token.line_number = line_number;
+			token.value = strings.intern(token_value);
+			token.type = token_type_map.contains(token_value) ? token_type_map.at(token_value) : token_t::IDENTIFIER;
+			tokens.push_back(token);
+			token_value.clear();
+		}
+		else {
+			token_value += line[i];
+		}
+
 	}
-	tokens.push_back(token(token_t::END_OF_FILE));
+	tokens.push_back(token(token_t::NEWLINE));
 
 	//Do another pass to check for unary/binary op defs
-	for (size_t i = 1; i < tokens.size(); i++) {
+	for (size_t i = std::max<size_t>(first_token, 1); i < tokens.size(); i++) {
 		if (tokens[i].type == token_t::OPERATOR_NEG) {
 			if ((tokens[i - 1].type >= token_t::LITERAL_STR && tokens[i - 1].type <= token_t::LITERAL_DBL)
 				|| (tokens[i - 1].type == token_t::IDENTIFIER)
@@ -403,6 +368,21 @@ std::vector<token> tokenize(const std::string& filename) {
 			}
 		}
 	}
+}
+
+inline std::vector<token> tokenize(const std::string& filename, string_pool& strings) {
+	std::vector<token> tokens;
+
+	std::ifstream file(filename + ".bas");
+	std::string line;
+	int line_number = 1;
+
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+		tokenize_line(line, line_number, tokens, strings);
+		line_number++;
+	}
+	tokens.push_back(token(token_t::END_OF_FILE));
 
 	return tokens;
 }
\ No newline at end of file
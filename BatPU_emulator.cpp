@@ -8,122 +8,320 @@
 #include <functional>
 #include <unordered_set>
 #include <stdexcept>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include "Lexer.h"
 #include "Parser.h"
 #include "Assembler.h"
+#include "AssemblerSession.h"
+#include "Linker.h"
+#include "Peephole.h"
+#include "Analyzer.h"
+#include "Inliner.h"
+#include "Superoptimizer.h"
+#include "BatPU_BASIC/runtime.h"
 
-class BatPU
+//
+//  Timing model
+//
+//  The cycles every instruction takes, by opcode. A BRH costs branch_cycles instead, depending on whether it is
+//  taken, and a LOD or STR of an MMIO port (240-255) takes mmio_cycles more, e.g. for a screen buffer swap. The
+//  default is one cycle per instruction. A model file has one "name cycles" pair per line, the name being a
+//  mnemonic, brh_taken, brh_not_taken or a port name such as buffer_screen, and # starts a comment.
+//
+
+struct timing_model {
+    uint32_t opcode_cycles[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+    uint32_t branch_cycles[2] = { 1, 1 }; //not taken, taken
+    uint32_t mmio_cycles[16] = {};        //by port - 240
+};
+
+static timing_model load_timing_model(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) throw std::runtime_error("Can not open the timing model " + filename);
+
+    static const std::string mnemonics[] = { "nop", "hlt", "add", "sub", "nor", "and", "xor", "rsh", "ldi", "adi", "jmp", "brh", "cal", "ret", "lod", "str" };
+    const std::unordered_map<std::string, uint16_t>& symbols = default_assembly_symbols();
+    timing_model model;
+    for (std::string line; std::getline(file, line);) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream words(line);
+        std::string name;
+        uint32_t cycles = 0;
+        if (!(words >> name)) continue;
+        if (!(words >> cycles)) throw std::runtime_error("Expected a number of cycles in the timing model : " + line);
+
+        const std::string* mnemonic = std::find(std::begin(mnemonics), std::end(mnemonics), name);
+        auto port = symbols.find(name);
+        if (name == "brh_not_taken") model.branch_cycles[0] = cycles;
+        else if (name == "brh_taken") model.branch_cycles[1] = cycles;
+        else if (name == "brh") model.branch_cycles[0] = model.branch_cycles[1] = cycles;
+        else if (mnemonic != std::end(mnemonics)) model.opcode_cycles[mnemonic - mnemonics] = cycles;
+        else if (port != symbols.end() && port->second >= 240) model.mmio_cycles[port->second - 240] = cycles;
+        else throw std::runtime_error("Not an instruction or MMIO port in the timing model : " + name);
+    }
+    return model;
+}
+
+//
+//  Data memory instrumentation
+//
+//  The emulator is a template over a policy that LOD and STR report every access to. no_memory_instrumentation, the one
+//  BatPU uses, has empty hooks that compile away. mmio_recorder logs the stores to the MMIO ports for the differential
+//  checks, which compare the output of two builds of a program by it. memory_recorder counts the reads and writes of every address and the
+//  cycle it was first touched, and breaks at data watchpoints: any write to an address, or a write that changes its
+//  value. The watched addresses are 256 bit bitmaps, so a store only tests one bit. step() returns WATCHPOINT at a
+//  break, after the store, and the program resumes with the next step().
+//
+
+enum class step_result : uint8_t { RUNNING, HALTED, WATCHPOINT };
+
+struct no_memory_instrumentation {
+    void on_read(uint8_t, uint16_t, uint64_t) {}
+    bool on_write(uint8_t, uint8_t, uint8_t, uint16_t, uint64_t) { return false; }
+};
+
+struct watchpoint_hit {
+    uint8_t address = 0;
+    uint8_t old_value = 0;
+    uint8_t new_value = 0;
+    uint16_t pc = 0;
+    uint64_t cycle = 0;
+};
+
+struct memory_recorder {
+    static constexpr uint64_t UNTOUCHED = UINT64_MAX;
+
+    uint64_t reads[256] = {};
+    uint64_t writes[256] = {};
+    uint64_t first_touch[256]; //cycle, UNTOUCHED if never read or written
+    uint64_t write_watchpoints[4] = {};
+    uint64_t change_watchpoints[4] = {};
+    std::vector<watchpoint_hit> hits;
+
+    memory_recorder() { std::fill(std::begin(first_touch), std::end(first_touch), UNTOUCHED); }
+
+    void watch_writes(uint8_t address) { write_watchpoints[address >> 6] |= 1ull << (address & 63); }
+    void watch_changes(uint8_t address) { change_watchpoints[address >> 6] |= 1ull << (address & 63); }
+
+    void on_read(uint8_t address, uint16_t, uint64_t cycle) {
+        reads[address]++;
+        first_touch[address] = std::min(first_touch[address], cycle);
+    }
+
+    //true to break
+    bool on_write(uint8_t address, uint8_t old_value, uint8_t new_value, uint16_t pc, uint64_t cycle) {
+        writes[address]++;
+        first_touch[address] = std::min(first_touch[address], cycle);
+        bool is_hit = ((write_watchpoints[address >> 6] >> (address & 63)) & 1)
+                   || (old_value != new_value && ((change_watchpoints[address >> 6] >> (address & 63)) & 1));
+        if (is_hit) hits.push_back({ address, old_value, new_value, pc, cycle });
+        return is_hit;
+    }
+
+    //reads and writes of every address, in rows of 16 like print_state, on a log scale from ' ' (none) to '@'
+    void print_heatmap() const {
+        static const std::string shades = " .:-=+*#%@";
+        uint64_t most = 1;
+        for (int address = 0; address < 256; address++) most = std::max({ most, reads[address], writes[address] });
+
+        auto shade = [&](uint64_t count) {
+            if (count == 0) return shades[0];
+            size_t level = 1 + (size_t)((shades.size() - 2) * std::log2((double)count) / std::max(1.0, std::log2((double)most)));
+            return shades[std::min(level, shades.size() - 1)];
+        };
+
+        std::cout << "      reads              writes\n";
+        for (int row = 0; row < 16; row++) {
+            char line[48];
+            int length = snprintf(line, sizeof(line), "  %3d |", row * 16);
+            for (int col = 0; col < 16; col++) line[length++] = shade(reads[row * 16 + col]);
+            length += snprintf(line + length, sizeof(line) - length, "| |");
+            for (int col = 0; col < 16; col++) line[length++] = shade(writes[row * 16 + col]);
+            snprintf(line + length, sizeof(line) - length, "|");
+            std::cout << line << '\n';
+        }
+        std::cout << "  most accesses to one address : " << most << '\n';
+    }
+
+    //the touched addresses by their first access
+    void print_addresses() const {
+        std::vector<int> touched;
+        for (int address = 0; address < 256; address++) {
+            if (first_touch[address] != UNTOUCHED) touched.push_back(address);
+        }
+        std::sort(touched.begin(), touched.end(), [&](int a, int b) { return first_touch[a] < first_touch[b]; });
+
+        char row[96];
+        std::cout << "  address        reads       writes  first touch\n";
+        for (int address : touched) {
+            snprintf(row, sizeof(row), "  %7d %12llu %12llu %12llu\n", address, (unsigned long long)reads[address], (unsigned long long)writes[address], (unsigned long long)first_touch[address]);
+            std::cout << row;
+        }
+    }
+};
+
+struct mmio_recorder {
+    std::vector<std::pair<uint8_t, uint8_t>> writes; //(port, value) of every store to 240-255, in order
+
+    void on_read(uint8_t, uint16_t, uint64_t) {}
+
+    bool on_write(uint8_t address, uint8_t, uint8_t new_value, uint16_t, uint64_t) {
+        if (address >= 240) writes.push_back({ address, new_value });
+        return false;
+    }
+};
+
+template <class memory_policy = no_memory_instrumentation>
+class basic_batpu
 {
 public:
     void run_program(uint16_t program[1024]) {
-        memcpy(InstructionMemory, program, 1024 * sizeof(uint16_t));
-        bool is_running = true;
+        load_program(program);
+        while (step() != step_result::HALTED);
+    }
 
+    void load_program(const uint16_t program[1024]) {
+        memcpy(InstructionMemory, program, 1024 * sizeof(uint16_t));
         PC = 0;
+        Cycles = 0;
+        CallStack.clear();
+    }
 
-        while (is_running) {
-            uint16_t instruction = InstructionMemory[PC] >> 12;
-            uint8_t opcode = instruction >> 12;
-            uint8_t regA = (instruction & 0x0f00) >> 8;
-            uint8_t regB = (instruction & 0x00f0) >> 4;
-            uint8_t regC = (instruction & 0x000f);
-            uint8_t offset = regC;
-            uint8_t imm = (instruction & 0x00ff);
-            uint16_t addr = (instruction & 0b0000001111111111);
-            uint8_t cond = (instruction & 0b0000110000000000) >> 10;
-
-            switch (opcode)
-            {
-            case 0:
-            {
-                NOP();
-                break;
-            }
-            case 1:
-            {
-                HLT();
-                is_running = false;
-            }    break;
-            case 2:
-            {
-                ADD(regA, regB, regC);
-                break;
-            }
-            case 3:
-            {
-                SUB(regA, regB, regC);
-                break;
-            }
-            case 4:
-            {
-                NOR(regA, regB, regC);
-                break;
-            }
-            case 5:
-            {
-                AND(regA, regB, regC);
-                break;
-            }
-            case 6:
-            {
-                XOR(regA, regB, regC);
-                break;
-            }
-            case 7:
-            {
-                RSH(regA, regC);
-                break;
-            }
-            case 8:
-            {
-                LDI(regA, imm);
-                break;
-            }
-            case 9:
-            {
-                ADI(regA, imm);
-                break;
-            }
-            case 10:
-            {
-                JMP(addr);
-                break;
-            }
-            case 11:
-            {
-                BRH(cond, addr);
-                break;
-            }
-            case 12:
-            {
-                CAL(addr);
-                break;
-            }
-            case 13:
-            {
-                RET();
-                break;
-            }
-            case 14:
-            {
-                LOD(regA, regB, offset);
-                break;
-            }
-            case 15:
-            {
-                STR(regA, regB, offset);
-                break;
-            }
-            default:
-                is_running = false;
-                break;
-            }
+    uint16_t program_counter() const { return PC; }
+    uint8_t register_value(uint8_t index) const { return Registers[index & 15]; }
+    bool zero_flag() const { return Z != 0; }
+    bool carry_flag() const { return C != 0; }
+    uint16_t instruction(uint16_t address) const { return InstructionMemory[address & 1023]; }
+
+    //cycles since the program was loaded, by the timing model
+    uint64_t cycles() const { return Cycles; }
+    void set_timing_model(const timing_model& model) { Timing = model; }
+    memory_policy& memory() { return Memory; }
+    const memory_policy& memory() const { return Memory; }
+
+    bool state_equals(const basic_batpu& other) const {
+        return memcmp(Registers, other.Registers, sizeof(Registers)) == 0 && memcmp(DataMemory, other.DataMemory, sizeof(DataMemory)) == 0;
+    }
+
+    //hot patch the instruction memory, e.g. with the patches from an assembler_session edit
+    void patch_instructions(const std::vector<instruction_patch>& patches) {
+        for (const instruction_patch& patch : patches) {
+            if (patch.address < 1024) InstructionMemory[patch.address] = patch.word;
+        }
+    }
+
+    //executes one instruction, HALTED once the program has halted and WATCHPOINT after a store the memory policy breaks at
+    step_result step() {
+        auto [opcode, regA, regB, regC, offset, imm, addr, cond] = decode_instruction(InstructionMemory[PC]);
+
+        bool is_running = true;
+        uint16_t next_PC = PC + 1;
+        Cycles += (opcode == 11) ? Timing.branch_cycles[is_branch_taken(cond)] : Timing.opcode_cycles[opcode];
 
-            PC++;
-            if (PC >= 1024) {
-                is_running = false;
+        switch (opcode)
+        {
+        case 0:
+        {
+            NOP();
+            break;
+        }
+        case 1:
+        {
+            HLT();
+            is_running = false;
+        }    break;
+        case 2:
+        {
+            ADD(regA, regB, regC);
+            break;
+        }
+        case 3:
+        {
+            SUB(regA, regB, regC);
+            break;
+        }
+        case 4:
+        {
+            NOR(regA, regB, regC);
+            break;
+        }
+        case 5:
+        {
+            AND(regA, regB, regC);
+            break;
+        }
+        case 6:
+        {
+            XOR(regA, regB, regC);
+            break;
+        }
+        case 7:
+        {
+            RSH(regA, regC);
+            break;
+        }
+        case 8:
+        {
+            LDI(regA, imm);
+            break;
+        }
+        case 9:
+        {
+            ADI(regA, imm);
+            break;
+        }
+        case 10:
+        {
+            next_PC = JMP(addr);
+            break;
+        }
+        case 11:
+        {
+            next_PC = BRH(cond, addr);
+            break;
+        }
+        case 12:
+        {
+            next_PC = CAL(addr);
+            break;
+        }
+        case 13:
+        {
+            next_PC = RET();
+            break;
+        }
+        case 14:
+        {
+            Cycles += mmio_cycles(regA, offset);
+            LOD(regA, regB, offset);
+            break;
+        }
+        case 15:
+        {
+            Cycles += mmio_cycles(regA, offset);
+            if (STR(regA, regB, offset)) {
+                //a watchpoint, the program continues after the store
+                PC = next_PC;
+                return step_result::WATCHPOINT;
             }
+            break;
+        }
+        default:
+            is_running = false;
+            break;
         }
+
+        if (!is_running) return step_result::HALTED;
+
+        PC = next_PC;
+        return (PC < 1024) ? step_result::RUNNING : step_result::HALTED;
     }
 
     void print_state() const {
@@ -146,87 +344,109 @@ private:
     void HLT() {}
 
     void ADD(uint8_t regA, uint8_t regB, uint8_t regC) {
-        Registers[regC] = Registers[regA] + Registers[regB] + C;
-        Z = (Registers[regC] == 0);
-        C = (Registers[regC] > 255);
+        uint16_t result = Registers[regA] + Registers[regB];
+        write_register(regC, (uint8_t)result);
+        Z = ((uint8_t)result == 0);
+        C = (result > 255);
     }
 
     void SUB(uint8_t regA, uint8_t regB, uint8_t regC) {
-        Registers[regC] = Registers[regA] + ~Registers[regB] + C;
-        Z = (Registers[regC] == 0);
-        C = (Registers[regC] > 255);
+        uint16_t result = Registers[regA] + (uint8_t)~Registers[regB] + 1;
+        write_register(regC, (uint8_t)result);
+        Z = ((uint8_t)result == 0);
+        C = (result > 255);
     }
 
     void NOR(uint8_t regA, uint8_t regB, uint8_t regC) {
-        Registers[regC] = !(Registers[regA] | Registers[regB]);
-        Z = (Registers[regC] == 0);
+        uint8_t result = ~(Registers[regA] | Registers[regB]);
+        write_register(regC, result);
+        Z = (result == 0);
     }
 
     void AND(uint8_t regA, uint8_t regB, uint8_t regC) {
-        Registers[regC] = Registers[regA] & Registers[regB];
-        Z = (Registers[regC] == 0);
+        uint8_t result = Registers[regA] & Registers[regB];
+        write_register(regC, result);
+        Z = (result == 0);
     }
 
     void XOR(uint8_t regA, uint8_t regB, uint8_t regC) {
-        Registers[regC] = Registers[regA] ^ Registers[regB];
-        Z = (Registers[regC] == 0);
+        uint8_t result = Registers[regA] ^ Registers[regB];
+        write_register(regC, result);
+        Z = (result == 0);
     }
 
     void RSH(uint8_t regA, uint8_t regC) {
-        Registers[regC] = Registers[regA] >> 1;
+        write_register(regC, Registers[regA] >> 1);
     }
 
     void LDI(uint8_t regA, uint8_t imm) {
-        Registers[regA] = imm;
+        write_register(regA, imm);
     }
 
     void ADI(uint8_t regA, uint8_t imm) {
-        Registers[regA] += imm;
-        Z = (Registers[regA] == 0);
+        uint16_t result = Registers[regA] + imm;
+        write_register(regA, (uint8_t)result);
+        Z = ((uint8_t)result == 0);
+        C = (result > 255);
     }
 
-    void JMP(uint16_t addr) {
-        PC = addr;
+    uint16_t JMP(uint16_t addr) {
+        return addr;
     }
 
-    void BRH(uint8_t cond, uint16_t addr) {
-        if (cond == 0 && Z == 1) {
-            PC = addr;
-        }
-        else if (cond == 1 && Z == 0) {
-            PC = addr;
-        }
-        else if (cond == 2 && C == 1) {
-            PC = addr;
-        }
-        else if (cond == 3 && C == 0) {
-            PC = addr;
-        }
-        else {
-            PC++;
-        }
+    uint16_t BRH(uint8_t cond, uint16_t addr) {
+        return is_branch_taken(cond) ? addr : PC + 1;
     }
 
-    void CAL(uint16_t addr) {
-        if (CallStack.size() + 1 > 16) {
+    bool is_branch_taken(uint8_t cond) const {
+        return (cond == 0 && Z == 1) || (cond == 1 && Z == 0) || (cond == 2 && C == 1) || (cond == 3 && C == 0);
+    }
 
+    uint16_t CAL(uint16_t addr) {
+        if (CallStack.size() + 1 > 16) {
+            //the hardware stack is 16 deep, the oldest return address is lost
+            CallStack.erase(CallStack.begin());
         }
 
         CallStack.push_back(PC + 1);
-        PC = addr;
+        return addr;
     }
 
-    void RET() {
-        PC = CallStack.back();
+    uint16_t RET() {
+        if (CallStack.empty()) return PC + 1;
+        uint16_t return_addr = CallStack.back();
         CallStack.pop_back();
+        return return_addr;
     }
 
     void LOD(uint8_t regA, uint8_t regB, uint8_t offset) {
-        Registers[regB] = DataMemory[regA + offset];
+        uint8_t address = data_address(regA, offset);
+        Memory.on_read(address, PC, Cycles);
+        write_register(regB, DataMemory[address]);
+    }
+
+    //true at a watchpoint of the memory policy
+    bool STR(uint8_t regA, uint8_t regB, uint8_t offset) {
+        uint8_t address = data_address(regA, offset);
+        bool is_watchpoint = Memory.on_write(address, DataMemory[address], Registers[regB], PC, Cycles);
+        DataMemory[address] = Registers[regB];
+        return is_watchpoint;
+    }
+
+    //r0 is hardwired to zero
+    void write_register(uint8_t reg, uint8_t value) {
+        if (reg != 0) Registers[reg] = value;
     }
 
-    void STR(uint8_t regA, uint8_t regB, uint8_t offset) {
-        DataMemory[regA + offset] = Registers[regB];
+    //the 4 bit offset is signed
+    uint8_t data_address(uint8_t regA, uint8_t offset) const {
+        int8_t signed_offset = (offset & 0x8) ? (int8_t)(offset | 0xF0) : (int8_t)offset;
+        return (uint8_t)(Registers[regA] + signed_offset);
+    }
+
+    uint32_t mmio_cycles(uint8_t regA, uint8_t offset) const {
+        uint8_t address = data_address(regA, offset);
+        return (address >= 240) ? Timing.mmio_cycles[address - 240] : 0;
     }
    
 private:
@@ -243,14 +463,7 @@ private:
 
     static std::string instruction_to_str(uint16_t instruction) {
         std::stringstream ins_str;
-        uint8_t opcode = instruction >> 12;
-        uint8_t regA = (instruction & 0x0f00) >> 8;
-        uint8_t regB = (instruction & 0x00f0) >> 4;
-        uint8_t regC = (instruction & 0x000f);
-        uint8_t offset = regC;
-        uint8_t imm = (instruction & 0x00ff);
-        uint16_t addr = (instruction & 0b0000001111111111);
-        uint8_t cond = (instruction & 0b0000110000000000) >> 10;
+        auto [opcode, regA, regB, regC, offset, imm, addr, cond] = decode_instruction(instruction);
 
         static const std::string mnemonics[] = {"NOP", "HLT", "ADD", "SUB", "NOR", "AND","XOR","RSH","LDI","ADI","JMP","BRH","CAL","RET","LOD","STR"};
         
@@ -293,19 +506,764 @@ private:
     uint8_t Z = 0;  //Z flag
     uint8_t C = 0;  //C flag
     uint16_t PC = 0; //should be 10bits according to the specifications by MattBatWings
+    uint64_t Cycles = 0;
+    timing_model Timing;
+    memory_policy Memory;
+};
+
+using BatPU = basic_batpu<>;
+
+
+//One run of a program for the differential checks below.
+struct differential_run {
+    basic_batpu<mmio_recorder> cpu;
+    bool halted = false;
+    size_t steps = 0;
+    std::vector<size_t> write_steps;    //steps up to each MMIO write
+    std::vector<uint64_t> executions = std::vector<uint64_t>(1024, 0);  //executions of every address
+};
+
+static differential_run run_image(std::vector<uint16_t> image, size_t max_steps) {
+    differential_run result;
+    image.resize(1024, 0);
+    result.cpu.load_program(image.data());
+    while (!result.halted && result.steps < max_steps) {
+        result.executions[result.cpu.program_counter()]++;
+        result.halted = result.cpu.step() == step_result::HALTED;
+        result.steps++;
+        if (result.cpu.memory().writes.size() > result.write_steps.size()) result.write_steps.push_back(result.steps);
+    }
+    return result;
+}
+
+struct differential_comparison {
+    bool matches = true;
+    bool halted = false;        //both runs halted
+    size_t common_writes = 0;   //MMIO writes compared
 };
 
+//Both runs have to produce the same sequence of MMIO writes and both halt or both run for max_steps. If they halt they
+//have to make the same number of writes, and end with the same registers and data memory when compare_state. Runs
+//that do not halt are compared up to the writes both made.
+static differential_comparison compare_runs(const differential_run& a, const differential_run& b, bool compare_state = true) {
+    differential_comparison comparison;
+    const auto& a_writes = a.cpu.memory().writes;
+    const auto& b_writes = b.cpu.memory().writes;
+    comparison.common_writes = std::min(a_writes.size(), b_writes.size());
+    comparison.halted = a.halted && b.halted;
+    comparison.matches = std::equal(a_writes.begin(), a_writes.begin() + comparison.common_writes, b_writes.begin());
+    if (a.halted != b.halted) {
+        //one build halted and the other one hit max_steps
+        comparison.matches = false;
+    }
+    else if (comparison.halted) {
+        comparison.matches = comparison.matches && a_writes.size() == b_writes.size() && (!compare_state || a.cpu.state_equals(b.cpu));
+    }
+    return comparison;
+}
+
+//Differential emulation of a program against its peephole optimized version, with the rules of a table if one is
+//given, compared by compare_runs.
+static bool verify_peephole(const std::string& filename, size_t max_steps = 1000000, const std::string& rules_filename = "") {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    std::vector<uint16_t> original = encode_program(program);
+    peephole_report report = peephole_optimize(program, rules_filename.empty() ? std::vector<peephole_rule>{} : load_peephole_rules(rules_filename));
+    std::vector<uint16_t> optimized = encode_program(program);
+
+    differential_run original_run = run_image(original, max_steps);
+    differential_run optimized_run = run_image(optimized, max_steps);
+    differential_comparison comparison = compare_runs(original_run, optimized_run);
+
+    std::cout << filename << " : " << report.instructions_before << " -> " << report.instructions_after << " instructions, "
+              << original_run.steps << " -> " << optimized_run.steps << " steps, " << comparison.common_writes << " MMIO writes compared, "
+              << (comparison.matches ? "MATCH" : "MISMATCH") << '\n';
+    return comparison.matches;
+}
+
+//Checks the rules of a table (Superoptimizer.h) on the emulator, whose ALU the batch evaluator of the superoptimizer
+//mirrors. Every sample binds the variables of a rule to random distinct registers, loads random values and flags, runs
+//the pattern and the replacement and compares the registers and the flags the rule preserves.
+static bool verify_peephole_rules(const std::string& rules_filename, size_t samples = 1000) {
+    std::vector<peephole_rule> rules = load_peephole_rules(rules_filename);
+    std::mt19937 rng(1);
+    size_t mismatches = 0;
+
+    for (const peephole_rule& rule : rules) {
+        for (size_t sample = 0; sample < samples; sample++) {
+            //r1-r13 are bound and loaded, the flags are set through r14 and read back into r14 and r15
+            uint8_t registers[16] = {};
+            std::vector<uint8_t> pool = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13 };
+            std::shuffle(pool.begin(), pool.end(), rng);
+            for (uint8_t variable = 1; variable < 14; variable++) registers[variable] = pool[variable - 1];
+            uint8_t values[14];
+            for (uint8_t& value : values) value = (uint8_t)rng();
+            int flags = (int)(rng() & 3);
+
+            auto run = [&](const std::vector<decoded_instruction>& sequence) {
+                //adi operands that set z (bit 0) and c (bit 1)
+                static const char* flag_operands[4][2] = { { "1", "1" }, { "0", "0" }, { "255", "2" }, { "128", "128" } };
+                assembly_lines lines;
+                for (uint8_t reg = 1; reg < 14; reg++) lines.push_back({ "ldi", register_name(reg), std::to_string(values[reg]) });
+                lines.push_back({ "ldi", "r14", flag_operands[flags][0] });
+                lines.push_back({ "adi", "r14", flag_operands[flags][1] });
+                lines.push_back({ "ldi", "r14", "0" });
+                for (const decoded_instruction& ins : sequence) lines.push_back(rule_instruction_line(ins, registers));
+                size_t pc = lines.size();
+                lines.push_back({ "brh", "nz", std::to_string(pc + 2) });
+                lines.push_back((rule.preserved_flags & FLAG_Z) ? std::vector<std::string>{ "ldi", "r14", "1" } : std::vector<std::string>{ "nop" });
+                lines.push_back({ "brh", "nc", std::to_string(pc + 4) });
+                lines.push_back((rule.preserved_flags & FLAG_C) ? std::vector<std::string>{ "ldi", "r15", "1" } : std::vector<std::string>{ "nop" });
+                lines.push_back({ "hlt" });
+
+                std::vector<uint16_t> machine_code_instructions = encode_program(parse_assembly(lines));
+                machine_code_instructions.resize(1024, 0);
+                BatPU cpu;
+                cpu.load_program(machine_code_instructions.data());
+                while (cpu.step() != step_result::HALTED);
+                return cpu;
+            };
+
+            if (!run(rule.pattern).state_equals(run(rule.replacement))) {
+                std::cout << "  MISMATCH " << peephole_rule_str(rule) << '\n';
+                mismatches++;
+                break;
+            }
+        }
+    }
+
+    std::cout << rules_filename << " : " << rules.size() << " rules, " << samples << " samples each, " << (mismatches == 0 ? "MATCH" : "MISMATCH") << '\n';
+    return mismatches == 0;
+}
+
+//Differential emulation of two builds of the same program, e.g. the BASIC compiler with and without its SSA passes
+//(BatPU_BASIC --no-optimize). The registers may be allocated differently, so only the MMIO writes and halting are
+//compared (compare_runs). The size and the cycles of both builds are reported.
+static bool verify_optimization(const std::string& reference_filename, const std::string& filename, size_t max_steps = 1000000) {
+    auto assemble = [](const std::string& name, size_t& instructions) {
+        assembly_preprocessor preprocessor;
+        assembly_program program = parse_assembly(preprocessor.preprocess_file(name + ".as"));
+        instructions = program.instructions.size();
+        return encode_program(program);
+    };
+    size_t reference_instructions = 0, optimized_instructions = 0;
+    differential_run reference = run_image(assemble(reference_filename, reference_instructions), max_steps);
+    differential_run optimized = run_image(assemble(filename, optimized_instructions), max_steps);
+    bool matches = compare_runs(reference, optimized, false).matches;
+
+    std::cout << filename << " : " << reference_instructions << " -> " << optimized_instructions << " instructions, "
+              << reference.steps << " -> " << optimized.steps << " cycles" << (optimized.halted ? "" : " (did not halt)") << ", "
+              << optimized.cpu.memory().writes.size() << " MMIO writes, " << (matches ? "MATCH" : "MISMATCH") << '\n';
+    return matches;
+}
+
+//Executions of every CAL by its address, the profile that inline_calls (Inliner.h) chooses the calls to inline by.
+static std::unordered_map<uint16_t, uint64_t> collect_call_profile(const assembly_lines& source_lines, size_t max_steps = 1000000) {
+    std::vector<uint16_t> machine_code_instructions = encode_program(parse_assembly(source_lines));
+    machine_code_instructions.resize(1024, 0);
+
+    BatPU cpu;
+    cpu.load_program(machine_code_instructions.data());
+    std::unordered_map<uint16_t, uint64_t> call_counts;
+    bool running = true;
+    for (size_t steps = 0; running && steps < max_steps; steps++) {
+        uint16_t pc = cpu.program_counter();
+        if (decode_instruction(machine_code_instructions[pc]).opcode == 12) call_counts[pc]++;
+        running = cpu.step() != step_result::HALTED;
+    }
+    return call_counts;
+}
+
+//Differential emulation of a program against its inlined version (Inliner.h), with the call profile of a first run
+//when use_profile. The runs are compared by compare_runs and Analyzer.h has to accept the call depth of the inlined
+//program. A program that does not halt, e.g. one that waits for input, is timed to its last MMIO write that both runs
+//made.
+static bool verify_inlining(const std::string& filename, inline_options options = {}, bool use_profile = true, size_t max_steps = 1000000) {
+    assembly_preprocessor preprocessor;
+    assembly_lines source_lines = preprocessor.preprocess_file(filename + ".as");
+    if (use_profile) options.call_counts = collect_call_profile(source_lines, max_steps);
+    assembly_lines inlined_lines = source_lines;
+    inline_report report;
+    inline_calls(inlined_lines, report, options);
+
+    assembly_program original_program = parse_assembly(source_lines);
+    assembly_program inlined_program = parse_assembly(inlined_lines);
+    std::vector<uint16_t> original = encode_program(original_program);
+    std::vector<uint16_t> inlined = encode_program(inlined_program);
+    program_analysis analysis = analyze_program(inlined, inlined_program.jmp_location_names);
+
+    differential_run original_run = run_image(original, max_steps);
+    differential_run inlined_run = run_image(inlined, max_steps);
+    differential_comparison comparison = compare_runs(original_run, inlined_run);
+    bool matches = comparison.matches;
+    bool halted = comparison.halted;
+    size_t common = comparison.common_writes;
+    size_t original_cycles = halted ? original_run.steps : (common > 0) ? original_run.write_steps[common - 1] : 0;
+    size_t inlined_cycles = halted ? inlined_run.steps : (common > 0) ? inlined_run.write_steps[common - 1] : 0;
+
+    std::cout << filename << " : " << report.instructions_before << " -> " << report.instructions_after << " instructions, "
+              << original_cycles << " -> " << inlined_cycles << " cycles" << (halted ? "" : " to the last common MMIO write") << ", call depth "
+              << report.call_depth_before << " -> " << analysis.max_call_depth << ", " << report.inlined_calls << " inlined calls, "
+              << report.tail_calls << " tail calls, " << common << " MMIO writes compared, "
+              << (matches && analysis.is_accepted() ? "MATCH" : "MISMATCH") << '\n';
+    for (const std::string& error : report.errors) std::cout << "  ERROR : " << error << '\n';
+    for (const std::string& error : analysis.errors) std::cout << "  ERROR : " << error << '\n';
+    return matches && analysis.is_accepted();
+}
+
+//Differential emulation of a program against its linked version (Linker.h). The program is split into modules at
+//evenly spaced labels, every module exports its labels and gets the defines of the whole program. Linked without a
+//profile and without stripping, the image has to equal the assembled program word for word. Linked with stripping
+//and the section profile of a run of the program, hottest first, its run is compared by compare_runs.
+static bool verify_linking(const std::string& filename, size_t modules = 4, size_t max_steps = 1000000) {
+    assembly_preprocessor preprocessor;
+    assembly_lines source_lines = preprocessor.preprocess_file(filename + ".as");
+    std::vector<uint16_t> original = encode_program(parse_assembly(source_lines));
+
+    assembly_lines defines;
+    std::vector<size_t> label_lines;
+    for (size_t line = 0; line < source_lines.size(); line++) {
+        if (source_lines[line][0] == "define") defines.push_back(source_lines[line]);
+        else if (source_lines[line][0][0] == '.') label_lines.push_back(line);
+    }
+    std::vector<size_t> splits = { 0 };
+    for (size_t module = 1; module < modules && !label_lines.empty(); module++) {
+        size_t line = label_lines[module * label_lines.size() / modules];
+        if (line > splits.back()) splits.push_back(line);
+    }
+    splits.push_back(source_lines.size());
+
+    std::vector<object_file> objects;
+    for (size_t module = 0; module + 1 < splits.size(); module++) {
+        assembly_lines module_lines = defines;
+        std::vector<std::string> exports = { "export" };
+        for (size_t line = splits[module]; line < splits[module + 1]; line++) {
+            if (source_lines[line][0] == "define") continue;
+            if (source_lines[line][0][0] == '.') exports.push_back(source_lines[line][0]);
+            module_lines.push_back(source_lines[line]);
+        }
+        if (exports.size() > 1) module_lines.push_back(exports);
+        objects.push_back(assemble_object(module_lines, filename + "_" + std::to_string(module)));
+    }
+
+    link_options unchanged_options;
+    unchanged_options.strip_dead_sections = false;
+    bool matches = link_objects(objects, unchanged_options).image == original;
+
+    differential_run original_run = run_image(original, max_steps);
+
+    link_options options;
+    uint16_t object_base = 0;
+    for (const object_file& object : objects) {
+        for (const object_section& section : object.sections) {
+            uint64_t& heat = options.profile[section.name];
+            for (uint16_t offset = section.start; offset < section.start + section.size; offset++) heat += original_run.executions[object_base + offset];
+        }
+        object_base += (uint16_t)object.code.size();
+    }
+    link_result linked = link_objects(objects, options);
+    differential_comparison comparison = compare_runs(original_run, run_image(linked.image, max_steps));
+    matches = matches && comparison.matches;
+
+    std::cout << filename << " : " << objects.size() << " modules, " << original.size() << " -> " << linked.image.size() << " words, "
+              << linked.stripped_words << " stripped, " << comparison.common_writes << " MMIO writes compared, " << (matches ? "MATCH" : "MISMATCH") << '\n';
+    return matches;
+}
+
+//Runs an assembled program until it halts, every instruction takes the cycles of the timing model, one by default.
+//Used to compare the output of the compilers, e.g. the BASIC code generator.
+static size_t measure_cycles(const std::string& filename, size_t max_steps = 1000000, const timing_model& model = {}) {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    std::vector<uint16_t> machine_code_instructions = encode_program(program);
+    machine_code_instructions.resize(1024, 0);
+
+    basic_batpu<mmio_recorder> cpu;
+    cpu.set_timing_model(model);
+    cpu.load_program(machine_code_instructions.data());
+    bool running = true;
+    size_t steps = 0;
+    while (running && steps < max_steps) {
+        running = cpu.step() != step_result::HALTED;
+        steps++;
+    }
+
+    std::cout << filename << " : " << program.instructions.size() << " instructions, " << cpu.cycles() << " cycles"
+              << (running ? " (did not halt)" : "") << ", " << cpu.memory().writes.size() << " MMIO writes\n";
+    return cpu.cycles();
+}
+
+//
+//  Cycle profile
+//
+//  Where the cycles of a run go, by the timing model. A function is entered by a CAL and left by its RET, its self
+//  cycles are the ones of the instructions that ran in its frames and its total cycles include the functions it
+//  called (the outermost frame only, if it recurses). A label region is the code from a label to the next one. A
+//  frame of the screen ends with every write to frame_port, buffer_screen by default.
+//
+
+struct function_cycles {
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t self_cycles = 0;
+    uint64_t total_cycles = 0;
+    int active_frames = 0;
+};
+
+struct cycle_profile {
+    std::string filename;
+    uint64_t cycles = 0;
+    uint64_t steps = 0;
+    bool halted = false;
+    std::vector<function_cycles> functions;                //by self cycles, functions[0] is the program entry
+    std::vector<std::pair<std::string, uint64_t>> regions; //cycles by label region, the most first
+    std::vector<uint64_t> frames;                          //cycles of every screen frame
+
+    //clock_hz turns the frames into a frame rate, 0 leaves it out
+    void print(double clock_hz = 0, size_t rows = 10) const {
+        char row[160];
+        auto percent = [&](uint64_t part) { return (cycles == 0) ? 0.0 : 100.0 * (double)part / (double)cycles; };
+
+        std::cout << filename << " : " << cycles << " cycles, " << steps << " instructions" << (halted ? "" : " (did not halt)") << '\n';
+        std::cout << "  function                        calls         self       %        total       %\n";
+        for (size_t i = 0; i < functions.size() && i < rows; i++) {
+            const function_cycles& function = functions[i];
+            snprintf(row, sizeof(row), "  %-24s %12llu %12llu %6.1f%% %12llu %6.1f%%\n", function.name.c_str(), (unsigned long long)function.calls,
+                     (unsigned long long)function.self_cycles, percent(function.self_cycles), (unsigned long long)function.total_cycles, percent(function.total_cycles));
+            std::cout << row;
+        }
+        std::cout << "  label                                      cycles       %\n";
+        for (size_t i = 0; i < regions.size() && i < rows; i++) {
+            snprintf(row, sizeof(row), "  %-37s %12llu %6.1f%%\n", regions[i].first.c_str(), (unsigned long long)regions[i].second, percent(regions[i].second));
+            std::cout << row;
+        }
+        if (!frames.empty()) {
+            uint64_t total = 0;
+            for (uint64_t frame : frames) total += frame;
+            double average = (double)total / (double)frames.size();
+            std::cout << "  " << frames.size() << " frames, cycles per frame min " << *std::min_element(frames.begin(), frames.end())
+                      << " / avg " << (uint64_t)average << " / max " << *std::max_element(frames.begin(), frames.end());
+            if (clock_hz > 0) std::cout << ", " << clock_hz / average << " frames per second at " << clock_hz << " Hz";
+            std::cout << '\n';
+        }
+    }
+};
+
+static cycle_profile profile_cycles(const std::string& filename, const timing_model& model = {}, size_t max_steps = 1000000, uint8_t frame_port = 245) {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    std::vector<uint16_t> machine_code_instructions = encode_program(program);
+    machine_code_instructions.resize(1024, 0);
+
+    //the label region of every address
+    std::vector<std::string> region_names = { "(start)" };
+    std::vector<size_t> region_of(1024, 0);
+    for (size_t pc = 0; pc < 1024; pc++) {
+        auto label = program.jmp_location_names.find((uint16_t)pc);
+        if (label != program.jmp_location_names.end()) {
+            if (pc != 0) region_names.push_back(label->second);
+            else region_names[0] = label->second;
+        }
+        region_of[pc] = region_names.size() - 1;
+    }
+
+    cycle_profile profile;
+    profile.filename = filename;
+    std::unordered_map<uint16_t, size_t> function_index;
+    auto function_at = [&](uint16_t entry) {
+        auto [index, is_new] = function_index.try_emplace(entry, profile.functions.size());
+        if (is_new) {
+            auto label = program.jmp_location_names.find(entry);
+            function_cycles function;
+            function.name = (label != program.jmp_location_names.end()) ? label->second : (entry == 0) ? "(program)" : "0x" + std::to_string(entry);
+            profile.functions.push_back(function);
+        }
+        return index->second;
+    };
+
+    struct frame {
+        size_t function;
+        uint64_t start;
+    };
+    std::vector<frame> stack = { { function_at(0), 0 } };
+    profile.functions[0].calls = 1;
+    profile.functions[0].active_frames = 1;
+    std::vector<uint64_t> region_cycles(region_names.size(), 0);
+    uint64_t frame_start = 0;
+
+    basic_batpu<mmio_recorder> cpu;
+    cpu.set_timing_model(model);
+    cpu.load_program(machine_code_instructions.data());
+    bool running = true;
+    while (running && profile.steps < max_steps) {
+        uint16_t pc = cpu.program_counter();
+        decoded_instruction ins = decode_instruction(cpu.instruction(pc));
+        uint64_t cycles_before = cpu.cycles();
+        running = cpu.step() != step_result::HALTED;
+        profile.steps++;
+
+        uint64_t cycles = cpu.cycles() - cycles_before;
+        profile.functions[stack.back().function].self_cycles += cycles;
+        region_cycles[region_of[pc]] += cycles;
+
+        if (ins.opcode == 12) {
+            size_t callee = function_at(ins.addr);
+            profile.functions[callee].calls++;
+            profile.functions[callee].active_frames++;
+            stack.push_back({ callee, cpu.cycles() });
+        }
+        else if (ins.opcode == 13 && stack.size() > 1) {
+            function_cycles& function = profile.functions[stack.back().function];
+            if (--function.active_frames == 0) function.total_cycles += cpu.cycles() - stack.back().start;
+            stack.pop_back();
+        }
+
+        //the writes are dropped once they are seen, a game loop that never halts does not grow the log
+        std::vector<std::pair<uint8_t, uint8_t>>& writes = cpu.memory().writes;
+        for (const std::pair<uint8_t, uint8_t>& write : writes) {
+            if (write.first != frame_port) continue;
+            profile.frames.push_back(cpu.cycles() - frame_start);
+            frame_start = cpu.cycles();
+        }
+        writes.clear();
+    }
+
+    //the frames that are still open
+    for (; !stack.empty(); stack.pop_back()) {
+        function_cycles& function = profile.functions[stack.back().function];
+        if (--function.active_frames == 0) function.total_cycles += cpu.cycles() - stack.back().start;
+    }
+
+    profile.cycles = cpu.cycles();
+    profile.halted = !running;
+    std::sort(profile.functions.begin() + 1, profile.functions.end(), [](const function_cycles& a, const function_cycles& b) { return a.self_cycles > b.self_cycles; });
+    for (size_t region = 0; region < region_names.size(); region++) {
+        if (region_cycles[region] != 0) profile.regions.push_back({ region_names[region], region_cycles[region] });
+    }
+    std::sort(profile.regions.begin(), profile.regions.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    return profile;
+}
+
+//Runs a program with the memory recorder and prints the access heatmap. The run breaks at the first watchpoint,
+//e.g. a write to an address that another part of the game state is not supposed to share, and prints the store and the
+//machine state there.
+static memory_recorder trace_memory(const std::string& filename, const std::vector<uint8_t>& write_watchpoints = {}, const std::vector<uint8_t>& change_watchpoints = {}, size_t max_steps = 1000000) {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    std::vector<uint16_t> machine_code_instructions = encode_program(program);
+    machine_code_instructions.resize(1024, 0);
+
+    basic_batpu<memory_recorder> cpu;
+    for (uint8_t address : write_watchpoints) cpu.memory().watch_writes(address);
+    for (uint8_t address : change_watchpoints) cpu.memory().watch_changes(address);
+    cpu.load_program(machine_code_instructions.data());
+    step_result result = step_result::RUNNING;
+    size_t steps = 0;
+    while (result == step_result::RUNNING && steps < max_steps) {
+        result = cpu.step();
+        steps++;
+    }
+
+    const memory_recorder& recorder = cpu.memory();
+    std::cout << filename << " : " << steps << " instructions, " << cpu.cycles() << " cycles" << (result == step_result::RUNNING ? " (did not halt)" : "") << '\n';
+    recorder.print_heatmap();
+    if (result == step_result::WATCHPOINT) {
+        const watchpoint_hit& hit = recorder.hits.back();
+        std::string label;
+        for (uint16_t pc = hit.pc; label.empty(); pc--) {
+            auto name = program.jmp_location_names.find(pc);
+            if (name != program.jmp_location_names.end()) label = " (" + name->second + ")";
+            if (pc == 0) break;
+        }
+        std::cout << "watchpoint : address " << (int)hit.address << " " << (int)hit.old_value << " -> " << (int)hit.new_value
+                  << " by the instruction at " << hit.pc << label << ", cycle " << hit.cycle << '\n';
+        cpu.print_state();
+    }
+    return recorder;
+}
+
+//Cycles of the BASIC runtime library routines (BatPU_BASIC --runtime writes basic_runtime.as) on random operands.
+//Every sample loads the operands with ldi, calls the routine and halts, the cycles of a routine include its cal and ret.
+//FIXED addition, subtraction and comparison are inlined by the code generator and are not part of the library.
+//The result of every sample is checked against the host, exactly for the byte, FIXED and conversion routines and within
+//the truncation runtime.h documents for the FLOAT arithmetic.
+static bool benchmark_basic_runtime(const std::string& library_filename = "basic_runtime", size_t samples = 1000) {
+    assembly_preprocessor preprocessor;
+    assembly_lines library;
+    for (const std::vector<std::string>& tokens : preprocessor.preprocess_file(library_filename + ".as")) {
+        if (tokens[0] != "export") library.push_back(tokens);
+    }
+
+    //host references, FLOAT values are mantissa * 2^(exponent - 71) like encode_wide writes them
+    auto float_value = [](uint16_t value) {
+        double magnitude = std::ldexp(value & 255, ((value >> 8) & 127) - 71);
+        return (value & 0x8000) ? -magnitude : magnitude;
+    };
+    auto float_ulp = [](uint16_t value) { return std::ldexp(1.0, ((value >> 8) & 127) - 71); };
+    //a truncated FLOAT product or quotient is less than one unit of its last place off, a result out of range is clamped
+    auto float_matches = [&](double exact, uint16_t result) {
+        uint16_t rounded = encode_wide(flt_representation::FLOAT, exact);
+        if ((rounded & 0x7FFF) == 0x7FFF) return (result & 0x7FFF) == 0x7FFF || std::abs(float_value(result) - exact) < float_ulp(rounded);
+        if (rounded == 0) return result == 0 || std::abs(float_value(result)) <= std::ldexp(255.0, -71);
+        return std::abs(float_value(result) - exact) < float_ulp(rounded);
+    };
+    //a FLOAT sum is less than one unit of the last place of the larger operand or of the result off (runtime.h)
+    auto float_sum_matches = [&](double exact, uint16_t a, uint16_t b, uint16_t result) {
+        return std::abs(float_value(result) - exact) < std::max({ float_ulp(a), float_ulp(b), float_ulp(result) });
+    };
+
+    //the operands are loaded into the registers in order, FIXED and FLOAT operands take two registers, high byte first
+    enum class operand_kind { BYTE, FIXED, FLOAT };
+    struct routine_benchmark {
+        std::string entry_point;
+        operand_kind kind;
+        std::vector<int> registers;
+        std::function<bool(const std::vector<int>& operands, uint16_t a, uint16_t b, const BatPU& cpu)> check;
+    };
+    auto wide_result = [](const BatPU& cpu) { return (uint16_t)((cpu.register_value(7) << 8) | cpu.register_value(8)); };
+    const std::vector<routine_benchmark> routines = {
+        { ".__mul", operand_kind::BYTE, { 11, 12 }, [](const std::vector<int>& operands, uint16_t, uint16_t, const BatPU& cpu) {
+            return cpu.register_value(13) == (uint8_t)(operands[0] * operands[1]);
+        } },
+        { ".__div", operand_kind::BYTE, { 11, 12 }, [](const std::vector<int>& operands, uint16_t, uint16_t, const BatPU& cpu) {
+            if (operands[1] == 0) return cpu.register_value(11) == 255;
+            return cpu.register_value(11) == operands[0] / operands[1] && cpu.register_value(13) == operands[0] % operands[1];
+        } },
+        { ".__fxmul", operand_kind::FIXED, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return wide_result(cpu) == (uint16_t)(((uint32_t)a * b) >> 8);
+        } },
+        { ".__fxdiv", operand_kind::FIXED, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return wide_result(cpu) == ((b == 0) ? 0xFFFF : (uint16_t)(((uint32_t)a << 8) / b));
+        } },
+        { ".__fadd", operand_kind::FLOAT, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return float_sum_matches(float_value(a) + float_value(b), a, b, wide_result(cpu));
+        } },
+        { ".__fsub", operand_kind::FLOAT, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return float_sum_matches(float_value(a) - float_value(b), a, b, wide_result(cpu));
+        } },
+        { ".__fmul", operand_kind::FLOAT, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return float_matches(float_value(a) * float_value(b), wide_result(cpu));
+        } },
+        { ".__fdiv", operand_kind::FLOAT, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return float_matches(float_value(a) / float_value(b), wide_result(cpu));
+        } },
+        { ".__fcmp", operand_kind::FLOAT, { 7, 8, 9, 10 }, [&](const std::vector<int>&, uint16_t a, uint16_t b, const BatPU& cpu) {
+            return cpu.zero_flag() == (float_value(a) == float_value(b)) && cpu.carry_flag() == (float_value(a) >= float_value(b));
+        } },
+        { ".__fbyte", operand_kind::BYTE, { 8 }, [&](const std::vector<int>& operands, uint16_t, uint16_t, const BatPU& cpu) {
+            return wide_result(cpu) == encode_wide(flt_representation::FLOAT, operands[0]);
+        } },
+        { ".__fint", operand_kind::FLOAT, { 7, 8 }, [](const std::vector<int>&, uint16_t a, uint16_t, const BatPU& cpu) {
+            return cpu.register_value(8) == wide_to_byte(flt_representation::FLOAT, a);
+        } },
+    };
+
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> byte(0, 255), exponent(56, 86);
+    size_t total_mismatches = 0;
+    for (const routine_benchmark& routine : routines) {
+        size_t min_cycles = SIZE_MAX, max_cycles = 0, total_cycles = 0, mismatches = 0;
+        for (size_t sample = 0; sample < samples; sample++) {
+            std::string driver;
+            std::vector<int> operands;
+            for (size_t i = 0; i < routine.registers.size(); i++) {
+                //normalized FLOAT operands around 1
+                int value = byte(random);
+                if (routine.kind == operand_kind::FLOAT) value = (i % 2 == 0) ? (value & 0x80) | exponent(random) : value | 0x80;
+                operands.push_back(value);
+                driver += "ldi r" + std::to_string(routine.registers[i]) + " " + std::to_string(value) + '\n';
+            }
+            driver += "cal " + routine.entry_point + "\nhlt\n";
+
+            assembly_lines source_lines = preprocessor.preprocess_source(driver);
+            source_lines.insert(source_lines.end(), library.begin(), library.end());
+            std::vector<uint16_t> machine_code_instructions = encode_program(parse_assembly(source_lines));
+            machine_code_instructions.resize(1024, 0);
+
+            BatPU cpu;
+            cpu.load_program(machine_code_instructions.data());
+            size_t steps = 0;
+            while (cpu.step() != step_result::HALTED && steps < 100000) steps++;
+
+            size_t cycles = steps - routine.registers.size();
+            min_cycles = std::min(min_cycles, cycles);
+            max_cycles = std::max(max_cycles, cycles);
+            total_cycles += cycles;
+
+            uint16_t a = (operands.size() >= 2) ? (uint16_t)((operands[0] << 8) | operands[1]) : 0;
+            uint16_t b = (operands.size() >= 4) ? (uint16_t)((operands[2] << 8) | operands[3]) : 0;
+            if (!routine.check(operands, a, b, cpu)) {
+                if (mismatches == 0) {
+                    std::cout << "  MISMATCH " << routine.entry_point;
+                    for (int operand : operands) std::cout << ' ' << operand;
+                    std::cout << " -> r7:r8 " << (int)cpu.register_value(7) << ' ' << (int)cpu.register_value(8) << '\n';
+                }
+                mismatches++;
+            }
+        }
+        std::cout << routine.entry_point << " : " << min_cycles << " min, " << (double)total_cycles / samples << " average, "
+                  << max_cycles << " max cycles, " << mismatches << " mismatches\n";
+        total_mismatches += mismatches;
+    }
+    return total_mismatches == 0;
+}
+
+//Differential fuzzing of scan_numeric_literal (numeric_parsing.h) against strtoull and strtod, then its throughput.
+//Generated literals have a known kind and value. Random strings over the literal alphabet are checked both ways: what the
+//scanner accepts has to be read completely by the C library, and a real the C library reads completely has to be accepted.
+static bool verify_numeric_literals(size_t samples = 1000000) {
+    std::mt19937_64 random(1);
+    const std::string alphabet = "0123456789abcdefxXbB.eE+-uUlLfF";
+    const std::vector<std::string> integer_suffixes = { "", "u", "U", "l", "L", "ul", "LU", "ll", "ULL" };
+
+    std::vector<std::string> literals;
+    literals.reserve(samples);
+    size_t mismatches = 0;
+    auto check = [&mismatches](bool condition, const std::string& literal, const char* reason) {
+        if (!condition && mismatches++ < 10) std::cout << "MISMATCH " << literal << " : " << reason << '\n';
+    };
+
+    for (size_t sample = 0; sample < samples; sample++) {
+        std::string literal;
+        int generator = (int)(random() % 4);
+        if (generator == 0) {
+            //integer in one of the three bases, sometimes wider than 32 bits
+            uint64_t value = random() >> (random() % 64);
+            int base = (random() % 3 == 0) ? 16 : (random() % 2 == 0) ? 2 : 10;
+            char digits[72];
+            *std::to_chars(digits, digits + sizeof(digits), value, base).ptr = 0;
+            literal = std::string(base == 16 ? "0x" : base == 2 ? "0b" : "") + digits + integer_suffixes[random() % integer_suffixes.size()];
+
+            numeric_literal scanned = scan_numeric_literal(literal);
+            numeric_kind kind = base == 16 ? numeric_kind::HEX : base == 2 ? numeric_kind::BIN : numeric_kind::INT;
+            check(scanned.kind == kind, literal, "kind");
+            check(scanned.overflow == (value > UINT32_MAX), literal, "overflow");
+            check(scanned.overflow || scanned.int_value == (int64_t)value, literal, "value");
+            check(scanned.fits_register() == (value <= 255), literal, "register range");
+        }
+        else if (generator == 1) {
+            //real in scientific notation, float or double, sometimes out of range
+            bool is_float = random() % 2 == 0;
+            int exponent = is_float ? (int)(random() % 86) - 35 : (int)(random() % 631) - 300;
+            char text[64];
+            std::snprintf(text, sizeof(text), "%.*fe%d", (int)(random() % 18), (double)(random() % 100000) / 10000.0, exponent);
+            literal = std::string(text) + (is_float ? "f" : "");
+
+            numeric_literal scanned = scan_numeric_literal(literal);
+            errno = 0;
+            double expected = is_float ? (double)std::strtof(text, nullptr) : std::strtod(text, nullptr);
+            bool out_of_range = errno == ERANGE && std::isinf(expected);
+            check(scanned.kind == (is_float ? numeric_kind::FLT : numeric_kind::DBL), literal, "kind");
+            check(scanned.overflow == out_of_range, literal, "overflow");
+            check(scanned.overflow || scanned.real_value == expected, literal, "value");
+        }
+        else {
+            //random characters of the literal alphabet
+            size_t length = 1 + random() % 8;
+            for (size_t i = 0; i < length; i++) literal += alphabet[random() % alphabet.size()];
+
+            numeric_literal scanned = scan_numeric_literal(literal);
+            const char* text = literal.c_str();
+            char* end = nullptr;
+            if (scanned.is_integer()) {
+                bool is_negative = text[0] == '-';
+                const char* digits = text + ((text[0] == '-' || text[0] == '+') ? 1 : 0);
+                int base = scanned.kind == numeric_kind::HEX ? 16 : scanned.kind == numeric_kind::BIN ? 2 : 10;
+                errno = 0;
+                uint64_t value = std::strtoull(digits + (base == 10 ? 0 : 2), &end, base);
+                bool overflow = errno == ERANGE || value > UINT32_MAX;
+                bool is_unsigned = false;
+                check(is_integer_suffix(end, is_unsigned) && is_unsigned == scanned.is_unsigned, literal, "integer suffix");
+                check(scanned.overflow == overflow, literal, "integer overflow");
+                check(overflow || scanned.int_value == (is_negative ? -(int64_t)value : (int64_t)value), literal, "integer value");
+            }
+            else if (scanned.is_numeric()) {
+                double value = (scanned.kind == numeric_kind::FLT) ? (double)std::strtof(text, &end) : std::strtod(text, &end);
+                check(*end == 0 || std::string_view(end) == "f" || std::string_view(end) == "F", literal, "real suffix");
+                check(scanned.overflow || scanned.real_value == value, literal, "real value");
+            }
+            else if (literal.find_first_of("xXbB") == std::string::npos) {
+                std::strtod(text, &end);
+                check(end == text || *end != 0, literal, "rejected real");
+            }
+        }
+        literals.push_back(std::move(literal));
+    }
+
+    size_t characters = 0;
+    for (const std::string& literal : literals) characters += literal.size();
+    auto throughput = [&literals, characters](const char* name, auto&& convert) {
+        auto start = std::chrono::steady_clock::now();
+        int64_t sum = 0;
+        for (const std::string& literal : literals) sum += convert(literal);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << " : " << literals.size() / seconds / 1e6 << " M literals/s, " << characters / seconds / 1e6
+                  << " MB/s (" << sum << ")\n";
+    };
+    throughput("scan_numeric_literal", [](const std::string& literal) {
+        return (int64_t)scan_numeric_literal(literal).kind;
+    });
+    throughput("strtoull + strtod", [](const std::string& literal) {
+        char* end = nullptr;
+        uint64_t value = std::strtoull(literal.c_str(), &end, 0);
+        return (int64_t)(*end == 0 ? value : (uint64_t)std::strtod(literal.c_str(), &end));
+    });
+
+    std::cout << samples << " literals : " << (mismatches == 0 ? "MATCH" : "MISMATCH") << '\n';
+    return mismatches == 0;
+}
+
+//Time of tokenize and parse on generated C files of growing size, from functions / 8 to functions functions. Every
+//function has nested blocks, loops, calls and assignments. A parser that is linear in the tokens keeps the same time per
+//token at every size.
+static void benchmark_parser(size_t functions = 2000) {
+    for (size_t count = std::max<size_t>(functions / 8, 1); count <= functions; count *= 2) {
+        std::string filename = "parser_benchmark_" + std::to_string(count) + ".c";
+        {
+            std::ofstream file(filename);
+            file << "int counter = 0;\n";
+            for (size_t i = 0; i < count; i++) {
+                std::string name = "f" + std::to_string(i);
+                std::string call = (i == 0) ? "x" : "f" + std::to_string(i - 1) + "(x, b)";
+                file << "int " << name << "(int a, int b);\n"
+                     << "int " << name << "(int a, int b) {\n"
+                     << "    int x = (a + b) * " << i % 97 << " - (a << 2);\n"
+                     << "    for (int i = 0; i < b; i++) {\n"
+                     << "        if (x % 3 == 0 && !(a > b)) { x += i; continue; }\n"
+                     << "        else if (x > 100) break;\n"
+                     << "        while (x) x--;\n"
+                     << "    }\n"
+                     << "    counter = counter + " << call << ";\n"
+                     << "    return x;\n"
+                     << "}\n";
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        PARSE_TREE parse_tree;
+        std::vector<TOKEN> tokens;
+        tokenize(filename, tokens, parse_tree.strings);
+        auto tokenized = std::chrono::steady_clock::now();
+        parse(tokens, parse_tree);
+        auto parsed = std::chrono::steady_clock::now();
+        std::remove(filename.c_str());
+
+        double tokenize_ms = std::chrono::duration<double, std::milli>(tokenized - start).count();
+        double parse_ms = std::chrono::duration<double, std::milli>(parsed - tokenized).count();
+        std::cout << count << " functions, " << tokens.size() << " tokens, " << parse_tree.node_count() << " nodes : tokenize "
+                  << tokenize_ms << " ms, parse " << parse_ms << " ms, " << parse_ms * 1e6 / tokens.size() << " ns per token\n";
+    }
+}
 
 static void compile(const std::string& filename) {
-    //tokenize the .c file into a vector of tokens
+    //tokenize the .c file into a vector of tokens, their texts go to the string pool of the tree
+    PARSE_TREE parse_tree;
     std::vector<TOKEN> tokens;
-    tokenize(filename, tokens);
+    tokenize(filename, tokens, parse_tree.strings);
 
     //create a tree of the code flow
-    PARSE_TREE parse_tree;
     parse(tokens, parse_tree);
 
-    __debugbreak();
     //turn the tree into assembly code
 
     //Turn the .as file into .mc and .bin files
@@ -313,7 +1271,114 @@ static void compile(const std::string& filename) {
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
-    compile("parse_test.c");
+    //BatPU_emulator command arguments, programs are given without the .as extension
+    //  assemble program                        program.as --> program.mc and program.bin
+    //  optimize program [rules]                the same with the peephole optimizer and an optional rule table
+    //  link output module1 module2 ...         links the modules, reassembling the ones whose .as changed
+    //  analyze program                         control flow, call depth and MMIO analysis
+    //  cycles program [timing_model]           cycles until the program halts
+    //  profile program [timing_model]          cycles by function, label and screen frame
+    //  trace program [address | ~address]...   data memory heatmap, breaks at a write (or a change, ~) to an address
+    //  superoptimize table program1 ...        searches the programs for shorter sequences, appends to the rule table
+    //  verify-peephole program [rules]         the checks below compare two builds on the emulator and
+    //  verify-rules rules                      return 1 on a mismatch
+    //  verify-optimization reference program
+    //  verify-inlining program [--no-profile]
+    //  verify-linking program [modules]
+    //  verify-literals [samples]
+    //  benchmark-runtime [library]             also checks the results, returns 1 on a mismatch
+    //  benchmark-parser [functions]
+    //Without arguments parse_test.c is compiled.
+    if (argc < 2) {
+        compile("parse_test.c");
+        return 0;
+    }
+
+    std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
+    auto arg = [&args](size_t index, const std::string& default_value = "") { return (index < args.size()) ? args[index] : default_value; };
+    auto require = [&args, &command](size_t count) {
+        if (args.size() < count) throw std::runtime_error(command + " expects " + std::to_string(count) + " arguments");
+    };
+    auto model = [&arg](size_t index) { return arg(index).empty() ? timing_model() : load_timing_model(arg(index)); };
+
+    try {
+        if (command == "assemble") {
+            require(1);
+            assemble(args[0]);
+        }
+        else if (command == "optimize") {
+            require(1);
+            assemble_optimized(args[0], arg(1)).print();
+        }
+        else if (command == "link") {
+            require(2);
+            link(std::vector<std::string>(args.begin() + 1, args.end()), args[0]);
+        }
+        else if (command == "analyze") {
+            require(1);
+            return analyze_file(args[0]) ? 0 : 1;
+        }
+        else if (command == "cycles") {
+            require(1);
+            measure_cycles(args[0], 1000000, model(1));
+        }
+        else if (command == "profile") {
+            require(1);
+            profile_cycles(args[0], model(1)).print();
+        }
+        else if (command == "trace") {
+            require(1);
+            std::vector<uint8_t> write_watchpoints, change_watchpoints;
+            for (size_t i = 1; i < args.size(); i++) {
+                if (args[i][0] == '~') change_watchpoints.push_back((uint8_t)std::stoul(args[i].substr(1), nullptr, 0));
+                else write_watchpoints.push_back((uint8_t)std::stoul(args[i], nullptr, 0));
+            }
+            trace_memory(args[0], write_watchpoints, change_watchpoints);
+        }
+        else if (command == "superoptimize") {
+            require(2);
+            superoptimize_programs(std::vector<std::string>(args.begin() + 1, args.end()), args[0]);
+        }
+        else if (command == "verify-peephole") {
+            require(1);
+            return verify_peephole(args[0], 1000000, arg(1)) ? 0 : 1;
+        }
+        else if (command == "verify-rules") {
+            require(1);
+            return verify_peephole_rules(args[0]) ? 0 : 1;
+        }
+        else if (command == "verify-optimization") {
+            require(2);
+            return verify_optimization(args[0], args[1]) ? 0 : 1;
+        }
+        else if (command == "verify-inlining") {
+            require(1);
+            return verify_inlining(args[0], {}, arg(1) != "--no-profile") ? 0 : 1;
+        }
+        else if (command == "verify-linking") {
+            require(1);
+            return verify_linking(args[0], std::stoul(arg(1, "4"))) ? 0 : 1;
+        }
+        else if (command == "verify-literals") {
+            return verify_numeric_literals(std::stoul(arg(0, "1000000"))) ? 0 : 1;
+        }
+        else if (command == "benchmark-runtime") {
+            return benchmark_basic_runtime(arg(0, "basic_runtime")) ? 0 : 1;
+        }
+        else if (command == "benchmark-parser") {
+            benchmark_parser(std::stoul(arg(0, "2000")));
+        }
+        else {
+            std::cout << "Unknown command " << command << '\n';
+            return 1;
+        }
+    }
+    catch (const std::exception& error) {
+        std::cout << "ERROR : " << error.what() << '\n';
+        return 1;
+    }
+    return 0;
 }
@@ -0,0 +1,1680 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <bit>
+
+#include "numeric_parsing.h"
+
+//
+//  SSA intermediate representation
+//
+//  The front ends generate BatPU assembly for an unlimited supply of virtual registers v0, v1, ..., one line per
+//  label, comment or instruction. optimize_lines() lifts those lines into SSA form, runs the passes below and
+//  lowers the result back into lines for the register allocator, so every front end that emits virtual register
+//  code gets the same optimizations. The values are bytes and the operations are the ones of the ALU:
+//
+//      CONST c                     ldi, and r0 as an operand
+//      ADD a b         Z C         add adi inc dec lsh (a a), a mov that a brh reads the flags of (a 0)
+//      SUB a b         Z C         sub cmp neg (0 a), C is set when a >= b
+//      NOR a b         Z           nor not (a 0)
+//      AND a b         Z
+//      XOR a b         Z
+//      RSH a                       rsh leaves the flags alone
+//      PHI                         one operand per predecessor
+//      UNDEF                       a register read before it is written
+//      PINNED                      every other instruction and every instruction on a physical register: calls,
+//                                  MMIO, the arguments of the runtime, comments. The passes do not look into them.
+//
+//  Any other mov is a copy and disappears in the SSA construction. A cmp, or an operation that writes r0, has no
+//  result and only sets the flags. Blocks end in a JUMP, a BRANCH (brh, with a taken and a fall through successor),
+//  HALT or RETURN.
+//
+//  A brh reads the flags of the last instruction in its block that writes its flag, Z for zero/notzero and C for
+//  carry/notcarry. That instruction is its flag source, which is never removed, moved or merged. A block whose brh
+//  has no flag source of its own reads the flags that its predecessors left (flags_in), their last flag writers are
+//  flag sources as well.
+//
+//  The passes, in pipeline order:
+//      constant propagation    operations on constants, phis of a single value, x+0 x-x x^0 x&255 not(not x) ...
+//      branch folding          a branch on constant flags becomes a jump, the zero test of a 0/255 comparison
+//                              result branches on the flags of the comparison itself, a cmp x 0 right after the
+//                              operation computing x is dropped for the Z flag of that operation
+//      CSE                     over the dominator tree, commutative operands in a canonical order
+//      LICM                    invariant operations of a natural loop move to its preheader
+//      DCE                     values and flags nobody reads, empty and unreachable blocks
+//  Every pass is timed and counts its changes in the ir_report.
+//
+//  Lowering gives the values of a phi one register where they do not interfere and copies on the incoming edges
+//  otherwise, splitting the edges from a brh when a copy is not a constant. Constants are loaded into a register in
+//  the block that reads them, adi takes them as immediates and a 0 is r0. The lines are left alone when they jump to
+//  an unknown label or a register copy would have to go between a brh and the flags of an earlier block it reads.
+//
+
+using ir_line = std::vector<std::string>;
+using ir_id = uint32_t;
+static constexpr ir_id NO_IR_ID = UINT32_MAX;
+
+enum class ir_op : uint8_t {
+    CONST, UNDEF, ADD, SUB, NOR, AND, XOR, RSH, PHI, PINNED
+};
+
+enum class ir_terminator : uint8_t {
+    JUMP, BRANCH, HALT, RETURN
+};
+
+static constexpr uint8_t IR_FLAG_Z = 1;
+static constexpr uint8_t IR_FLAG_C = 2;
+
+//brh conditions by their code, a condition and its inverse differ in the lowest bit
+static constexpr std::array<const char*, 4> ir_condition_names = { "zero", "notzero", "carry", "notcarry" };
+
+struct ir_instruction {
+    ir_op op = ir_op::CONST;
+    bool has_result = false;
+    bool is_removed = false;
+    bool is_loaded = false;     //CONST kept in a register from its position on, instead of loaded where it is read
+    uint8_t constant = 0;       //CONST
+    uint8_t flags = 0;          //flags written
+    ir_id block = NO_IR_ID;
+    std::vector<ir_id> operands;
+
+    //PINNED: operands[i] goes to line[operand_slots[i]], the result to line[result_slot]
+    ir_line line;
+    std::vector<uint8_t> operand_slots;
+    uint8_t result_slot = 0;
+};
+
+struct ir_block {
+    std::string label;          //empty for blocks without a label of their own
+    std::vector<ir_id> instructions;    //phis first
+    std::vector<ir_id> predecessors;    //each one once, in the order of the phi operands
+    ir_terminator terminator = ir_terminator::JUMP;
+    uint8_t condition = 0;      //BRANCH
+    ir_id taken = NO_IR_ID;     //BRANCH target when the condition holds
+    ir_id next = NO_IR_ID;      //JUMP target, BRANCH fall through
+    bool is_removed = false;
+};
+
+struct ir_pass_report {
+    std::string name;
+    size_t changes = 0;
+    double milliseconds = 0;
+};
+
+struct ir_report {
+    bool applied = false;
+    size_t instructions_before = 0;
+    size_t instructions_after = 0;
+    std::vector<ir_pass_report> passes;
+
+    void print() const {
+        std::cout << "SSA optimizer: " << instructions_before << " -> " << instructions_after << " instructions"
+                  << (applied ? "" : " (not applied)") << '\n';
+        for (const ir_pass_report& pass : passes) {
+            std::cout << "  " << std::left << std::setw(23) << pass.name << std::right << std::setw(5) << pass.changes
+                      << " changes " << std::fixed << std::setprecision(3) << pass.milliseconds << " ms\n";
+        }
+        std::cout.unsetf(std::ios::floatfield);
+    }
+};
+
+struct ir_options {
+    bool constant_propagation = true;
+    bool branch_folding = true;
+    bool cse = true;
+    bool licm = true;
+    bool dce = true;
+};
+
+static int ir_virtual_register(const std::string& operand) {
+    if (operand.size() < 2 || operand[0] != 'v' || !is_decimal_digit(operand[1])) return -1;
+    return std::stoi(operand.substr(1));
+}
+
+static bool ir_is_physical_register(const std::string& operand) {
+    return operand.size() >= 2 && operand[0] == 'r' && is_decimal_digit(operand[1]) && operand != "r0";
+}
+
+static bool ir_is_instruction_line(const ir_line& line) {
+    return !line.empty() && line[0][0] != '.' && line[0][0] != '/';
+}
+
+//operand i of an instruction is read (1), written (2) or both (3)
+static std::array<uint8_t, 3> ir_operand_roles(const std::string& mnemonic) {
+    if (mnemonic == "add" || mnemonic == "sub" || mnemonic == "nor" || mnemonic == "and" || mnemonic == "xor") return { 1, 1, 2 };
+    if (mnemonic == "rsh" || mnemonic == "lsh" || mnemonic == "mov" || mnemonic == "neg" || mnemonic == "not" || mnemonic == "lod") return { 1, 2, 0 };
+    if (mnemonic == "ldi") return { 2, 0, 0 };
+    if (mnemonic == "adi" || mnemonic == "inc" || mnemonic == "dec") return { 3, 0, 0 };
+    if (mnemonic == "cmp" || mnemonic == "str") return { 1, 1, 0 };
+    return { 0, 0, 0 };
+}
+
+//a call may come back with any flags
+static uint8_t ir_flags_written(const std::string& mnemonic) {
+    if (mnemonic == "add" || mnemonic == "sub" || mnemonic == "adi" || mnemonic == "inc" || mnemonic == "dec" || mnemonic == "mov"
+        || mnemonic == "lsh" || mnemonic == "neg" || mnemonic == "cmp" || mnemonic == "cal") return IR_FLAG_Z | IR_FLAG_C;
+    if (mnemonic == "nor" || mnemonic == "and" || mnemonic == "xor" || mnemonic == "not") return IR_FLAG_Z;
+    return 0;
+}
+
+//condition code of a brh condition, the aliases of the assembler included
+static int ir_condition_code(const std::string& condition) {
+    static const std::unordered_map<std::string, int> codes = {
+        {"zero", 0}, {"notzero", 1}, {"carry", 2}, {"notcarry", 3},
+        {"z", 0}, {"nz", 1}, {"c", 2}, {"nc", 3},
+        {"eq", 0}, {"ne", 1}, {"ge", 2}, {"lt", 3},
+        {"=", 0}, {"!=", 1}, {">=", 2}, {"<", 3},
+    };
+    auto found = codes.find(condition);
+    return (found == codes.end()) ? -1 : found->second;
+}
+
+static uint8_t ir_condition_flag(uint8_t condition) {
+    return (condition <= 1) ? IR_FLAG_Z : IR_FLAG_C;
+}
+
+static bool ir_is_alu(ir_op op) {
+    return op >= ir_op::ADD && op <= ir_op::RSH;
+}
+
+static bool ir_is_commutative(ir_op op) {
+    return op == ir_op::ADD || op == ir_op::NOR || op == ir_op::AND || op == ir_op::XOR;
+}
+
+static uint8_t ir_alu_flags(ir_op op) {
+    if (op == ir_op::ADD || op == ir_op::SUB) return IR_FLAG_Z | IR_FLAG_C;
+    if (op == ir_op::NOR || op == ir_op::AND || op == ir_op::XOR) return IR_FLAG_Z;
+    return 0;
+}
+
+//result of an ALU operation, and the flags it sets in z and c
+static uint8_t ir_evaluate(ir_op op, uint8_t a, uint8_t b, bool& z, bool& c) {
+    unsigned result = 0;
+    c = false;
+    switch (op)
+    {
+    case ir_op::ADD: result = a + b; c = result > 255; break;
+    case ir_op::SUB: result = a + (uint8_t)~b + 1; c = result > 255; break;
+    case ir_op::NOR: result = (uint8_t)~(a | b); break;
+    case ir_op::AND: result = a & b; break;
+    case ir_op::XOR: result = a ^ b; break;
+    default: result = a >> 1; break;
+    }
+    z = (result & 255) == 0;
+    return (uint8_t)result;
+}
+
+class ir_function {
+public:
+    std::vector<ir_instruction> instructions;
+    std::vector<ir_block> blocks;
+    std::vector<ir_id> layout;  //block order of the lowered code
+
+    //builds the SSA form of the lines, false when they can not be lifted
+    bool lift(const std::vector<ir_line>& lines) {
+        instructions.clear();
+        blocks.clear();
+        layout.clear();
+
+        //
+        //  Blocks and their lines. Block 0 is an empty entry, so the first line may be a jump target.
+        //
+        struct block_lines {
+            std::vector<size_t> lines;
+            std::string target;     //jmp or brh label
+        };
+        std::vector<block_lines> contents;
+        std::unordered_map<std::string, ir_id> label_blocks;
+
+        auto new_block = [&](const std::string& label) {
+            ir_id id = (ir_id)blocks.size();
+            blocks.emplace_back();
+            blocks.back().label = label;
+            contents.emplace_back();
+            layout.push_back(id);
+            if (!label.empty()) label_blocks[label] = id;
+            return id;
+        };
+
+        new_block("");
+        ir_id current = new_block("");
+        blocks[0].next = current;
+        bool is_open = true;
+        ir_id falls_into_next = NO_IR_ID;   //block whose brh falls through into the next block
+
+        auto open_block = [&](const std::string& label) {
+            ir_id previous = current;
+            bool was_open = is_open;
+            current = new_block(label);
+            if (was_open) blocks[previous].next = current;
+            if (falls_into_next != NO_IR_ID) blocks[falls_into_next].next = current;
+            falls_into_next = NO_IR_ID;
+            is_open = true;
+        };
+
+        for (size_t index = 0; index < lines.size(); index++) {
+            const ir_line& line = lines[index];
+            if (!line.empty() && line[0][0] == '.') {
+                if (label_blocks.contains(line[0])) return false;
+                open_block(line[0]);
+                continue;
+            }
+            if (!is_open) open_block("");
+
+            if (!ir_is_instruction_line(line)) {
+                contents[current].lines.push_back(index);
+                continue;
+            }
+
+            const std::string& mnemonic = line[0];
+            ir_block& block = blocks[current];
+            if (mnemonic == "jmp" && line.size() == 2) {
+                block.terminator = ir_terminator::JUMP;
+                contents[current].target = line[1];
+                is_open = false;
+            }
+            else if (mnemonic == "brh" && line.size() == 3 && ir_condition_code(line[1]) >= 0) {
+                block.terminator = ir_terminator::BRANCH;
+                block.condition = (uint8_t)ir_condition_code(line[1]);
+                contents[current].target = line[2];
+                falls_into_next = current;
+                is_open = false;
+            }
+            else if (mnemonic == "hlt" || mnemonic == "ret") {
+                block.terminator = (mnemonic == "hlt") ? ir_terminator::HALT : ir_terminator::RETURN;
+                is_open = false;
+            }
+            else if (mnemonic == "jmp" || mnemonic == "brh") {
+                return false;
+            }
+            else {
+                contents[current].lines.push_back(index);
+            }
+        }
+        //the code may not run off its end
+        if (is_open || falls_into_next != NO_IR_ID) return false;
+
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            ir_block& block = blocks[id];
+            if (!contents[id].target.empty()) {
+                auto found = label_blocks.find(contents[id].target);
+                if (found == label_blocks.end()) return false;
+                if (block.terminator == ir_terminator::JUMP) block.next = found->second;
+                else block.taken = found->second;
+            }
+            if (block.terminator == ir_terminator::BRANCH && block.taken == block.next) block.terminator = ir_terminator::JUMP;
+        }
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            for (ir_id successor : successors(id)) blocks[successor].predecessors.push_back(id);
+        }
+
+        //
+        //  Flag sources among the lines, they have to stay real instructions
+        //
+        std::vector<bool> is_source_line(lines.size(), false);
+        std::vector<uint8_t> marked(blocks.size(), 0);
+        std::vector<std::pair<ir_id, uint8_t>> pending;
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            if (blocks[id].terminator == ir_terminator::BRANCH) pending.push_back({ id, ir_condition_flag(blocks[id].condition) });
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            auto [id, flag] = pending[i];
+            const std::vector<size_t>& block_lines = contents[id].lines;
+            auto source = std::find_if(block_lines.rbegin(), block_lines.rend(), [&](size_t line) {
+                return ir_is_instruction_line(lines[line]) && (ir_flags_written(lines[line][0]) & flag);
+            });
+            if (source != block_lines.rend()) {
+                is_source_line[*source] = true;
+                continue;
+            }
+            for (ir_id predecessor : blocks[id].predecessors) {
+                if (marked[predecessor] & flag) continue;
+                marked[predecessor] |= flag;
+                pending.push_back({ predecessor, flag });
+            }
+        }
+
+        //
+        //  Instructions, in reverse postorder so that every block but a loop header has seen its predecessors.
+        //  A read of a register that the block did not write yet goes to the predecessor, or a phi when there
+        //  are several. The phi operands are filled in when all blocks are done.
+        //
+        end_values.assign(blocks.size(), {});
+        entry_values.assign(blocks.size(), {});
+        undefined = add_instruction(0, ir_op::UNDEF, {});
+
+        remove_unreachable_blocks();
+        for (ir_id id : reverse_postorder()) {
+            for (size_t line : contents[id].lines) lift_line(id, lines[line], is_source_line[line]);
+        }
+
+        for (size_t i = 0; i < incomplete_phis.size(); i++) {
+            auto [phi, reg] = incomplete_phis[i];
+            const ir_block& block = blocks[instructions[phi].block];
+            std::vector<ir_id> operands;
+            for (ir_id predecessor : block.predecessors) operands.push_back(read_at_end(reg, predecessor));
+            instructions[phi].operands = std::move(operands);
+        }
+        incomplete_phis.clear();
+        end_values.clear();
+        entry_values.clear();
+
+        remove_trivial_phis();
+        return true;
+    }
+
+    //lowers the function to lines of virtual register code, false when it can not be lowered
+    bool lower(std::vector<ir_line>& output) {
+        remove_unreachable_blocks();
+        compute_flag_sources();
+        std::vector<ir_id> order = reverse_postorder();
+
+        //
+        //  Values that need a register, constants and UNDEF do not
+        //
+        std::vector<int> value_index(instructions.size(), -1);
+        std::vector<ir_id> values;
+        for (ir_id id = 0; id < instructions.size(); id++) {
+            const ir_instruction& ins = instructions[id];
+            if (ins.is_removed || !ins.has_result || (ins.op == ir_op::CONST && !ins.is_loaded) || ins.op == ir_op::UNDEF) continue;
+            value_index[id] = (int)values.size();
+            values.push_back(id);
+        }
+        size_t value_count = values.size();
+        size_t words = (value_count + 63) / 64;
+        auto is_register = [&](ir_id id) { return value_index[id] >= 0; };
+
+        //
+        //  Liveness over the blocks, a phi operand is read at the end of its predecessor
+        //
+        std::vector<std::vector<uint64_t>> live_in(blocks.size(), std::vector<uint64_t>(words, 0));
+        std::vector<std::vector<uint64_t>> live_out(blocks.size(), std::vector<uint64_t>(words, 0));
+        auto set_bit = [](std::vector<uint64_t>& bits, int index) { bits[index / 64] |= 1ull << (index % 64); };
+        auto clear_bit = [](std::vector<uint64_t>& bits, int index) { bits[index / 64] &= ~(1ull << (index % 64)); };
+        auto test_bit = [](const std::vector<uint64_t>& bits, int index) { return (bits[index / 64] >> (index % 64)) & 1; };
+
+        auto block_live_out = [&](ir_id id) {
+            std::vector<uint64_t> live(words, 0);
+            for (ir_id successor : successors(id)) {
+                for (size_t w = 0; w < words; w++) live[w] |= live_in[successor][w];
+                size_t edge = predecessor_index(successor, id);
+                for (ir_id phi : blocks[successor].instructions) {
+                    if (instructions[phi].op != ir_op::PHI) break;
+                    ir_id operand = instructions[phi].operands[edge];
+                    if (is_register(operand)) set_bit(live, value_index[operand]);
+                }
+            }
+            return live;
+        };
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = order.size(); i-- > 0;) {
+                ir_id id = order[i];
+                std::vector<uint64_t> live = block_live_out(id);
+                live_out[id] = live;
+                const std::vector<ir_id>& block_instructions = blocks[id].instructions;
+                for (size_t k = block_instructions.size(); k-- > 0;) {
+                    const ir_instruction& ins = instructions[block_instructions[k]];
+                    if (is_register(block_instructions[k])) clear_bit(live, value_index[block_instructions[k]]);
+                    if (ins.op == ir_op::PHI) continue;
+                    for (ir_id operand : ins.operands) {
+                        if (is_register(operand)) set_bit(live, value_index[operand]);
+                    }
+                }
+                if (live != live_in[id]) {
+                    live_in[id] = std::move(live);
+                    changed = true;
+                }
+            }
+        }
+
+        //
+        //  Interference, a value interferes with everything live where it is defined. The phis of a block are
+        //  all defined at its start.
+        //
+        std::vector<uint64_t> interference(value_count * words, 0);
+        auto interfere = [&](int a, int b) {
+            if (a == b) return;
+            interference[(size_t)a * words + b / 64] |= 1ull << (b % 64);
+            interference[(size_t)b * words + a / 64] |= 1ull << (a % 64);
+        };
+        auto interferes = [&](int a, int b) { return (interference[(size_t)a * words + b / 64] >> (b % 64)) & 1; };
+        auto interfere_with_live = [&](int value, const std::vector<uint64_t>& live) {
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = live[w]; bits != 0; bits &= bits - 1) interfere(value, (int)(w * 64 + std::countr_zero(bits)));
+            }
+        };
+
+        for (ir_id id : order) {
+            std::vector<uint64_t> live = live_out[id];
+            const std::vector<ir_id>& block_instructions = blocks[id].instructions;
+            std::vector<int> phis;
+            for (size_t k = block_instructions.size(); k-- > 0;) {
+                ir_id instruction = block_instructions[k];
+                const ir_instruction& ins = instructions[instruction];
+                if (ins.op == ir_op::PHI) {
+                    phis.push_back(value_index[instruction]);
+                    continue;
+                }
+                if (is_register(instruction)) {
+                    interfere_with_live(value_index[instruction], live);
+                    clear_bit(live, value_index[instruction]);
+                }
+                for (ir_id operand : ins.operands) {
+                    if (is_register(operand)) set_bit(live, value_index[operand]);
+                }
+            }
+            for (int phi : phis) {
+                interfere_with_live(phi, live);
+                for (int other : phis) interfere(phi, other);
+            }
+        }
+
+        //
+        //  Webs, a phi shares the register of its operands that interfere with none of its web
+        //
+        std::vector<int> web(value_count);
+        std::vector<std::vector<int>> members(value_count);
+        for (int i = 0; i < (int)value_count; i++) {
+            web[i] = i;
+            members[i] = { i };
+        }
+        auto webs_interfere = [&](int a, int b) {
+            for (int x : members[a]) {
+                for (int y : members[b]) {
+                    if (interferes(x, y)) return true;
+                }
+            }
+            return false;
+        };
+        for (ir_id id : order) {
+            for (ir_id phi : blocks[id].instructions) {
+                if (instructions[phi].op != ir_op::PHI) break;
+                for (ir_id operand : instructions[phi].operands) {
+                    if (!is_register(operand)) continue;
+                    int a = web[value_index[phi]], b = web[value_index[operand]];
+                    if (a == b || webs_interfere(a, b)) continue;
+                    for (int member : members[b]) web[member] = a;
+                    members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+                    members[b].clear();
+                }
+            }
+        }
+
+        //
+        //  Copies on the edges into phis. Constant copies (ldi) leave the flags alone and may go in front of a
+        //  brh when the other successor does not need the register, other copies get a block of their own.
+        //
+        struct ir_copy {
+            int destination = 0;    //web
+            int source = -1;        //web, -1 for a constant
+            uint8_t constant = 0;
+        };
+        std::vector<std::vector<ir_copy>> end_copies(blocks.size());
+        std::vector<ir_id> tail_blocks;     //split taken edges, after the last block
+
+        for (ir_id id : std::vector<ir_id>(order)) {
+            std::vector<ir_id> predecessors = blocks[id].predecessors;
+            for (size_t edge = 0; edge < predecessors.size(); edge++) {
+                ir_id predecessor = predecessors[edge];
+                std::vector<ir_copy> copies;
+                for (ir_id phi : blocks[id].instructions) {
+                    const ir_instruction& ins = instructions[phi];
+                    if (ins.op != ir_op::PHI) break;
+                    int destination = web[value_index[phi]];
+                    ir_id operand = ins.operands[edge];
+                    if (is_register(operand)) {
+                        if (web[value_index[operand]] != destination) copies.push_back({ destination, web[value_index[operand]], 0 });
+                    }
+                    else if (instructions[operand].op == ir_op::CONST) {
+                        copies.push_back({ destination, -1, instructions[operand].constant });
+                    }
+                }
+                if (copies.empty()) continue;
+
+                bool is_constant = std::ranges::all_of(copies, [](const ir_copy& copy) { return copy.source < 0; });
+                if (!is_constant && flags_in[id]) return false;
+
+                const ir_block& from = blocks[predecessor];
+                bool in_place = from.terminator != ir_terminator::BRANCH;
+                if (!in_place && is_constant) {
+                    //the other successor may neither read the register nor have its own copy to it in place
+                    ir_id other = (from.taken == id) ? from.next : from.taken;
+                    std::vector<uint64_t> other_live = live_in[other];
+                    size_t other_edge = predecessor_index(other, predecessor);
+                    for (ir_id phi : blocks[other].instructions) {
+                        if (instructions[phi].op != ir_op::PHI) break;
+                        ir_id operand = instructions[phi].operands[other_edge];
+                        if (is_register(operand)) set_bit(other_live, value_index[operand]);
+                    }
+                    in_place = std::ranges::none_of(copies, [&](const ir_copy& copy) {
+                        return std::ranges::any_of(members[copy.destination], [&](int member) { return test_bit(other_live, member); })
+                            || std::ranges::any_of(end_copies[predecessor], [&](const ir_copy& placed) { return placed.destination == copy.destination; });
+                    });
+                }
+                if (in_place) {
+                    end_copies[predecessor].insert(end_copies[predecessor].end(), copies.begin(), copies.end());
+                    continue;
+                }
+
+                ir_id split = (ir_id)blocks.size();
+                blocks.emplace_back();
+                std::vector<uint64_t> split_live = live_in[id];
+                for (const ir_copy& copy : copies) {
+                    if (copy.source >= 0) {
+                        for (int member : members[copy.source]) set_bit(split_live, member);
+                    }
+                }
+                live_in.push_back(std::move(split_live));
+                end_copies.emplace_back(std::move(copies));
+                blocks[split].next = id;
+                blocks[split].predecessors = { predecessor };
+                blocks[id].predecessors[edge] = split;
+                if (blocks[predecessor].next == id) {
+                    blocks[predecessor].next = split;
+                    layout.insert(std::find(layout.begin(), layout.end(), predecessor) + 1, split);
+                }
+                else {
+                    blocks[predecessor].taken = split;
+                    tail_blocks.push_back(split);
+                }
+            }
+        }
+        layout.insert(layout.end(), tail_blocks.begin(), tail_blocks.end());
+
+        //
+        //  Lines
+        //
+        std::vector<int> web_register(value_count, -1);
+        int register_count = 0;
+        auto web_name = [&](int w) {
+            if (web_register[w] < 0) web_register[w] = register_count++;
+            return "v" + std::to_string(web_register[w]);
+        };
+        auto temporary = [&]() { return "v" + std::to_string(register_count++); };
+
+        std::vector<ir_id> emitted;
+        for (ir_id id : layout) {
+            if (!blocks[id].is_removed) emitted.push_back(id);
+        }
+        std::vector<bool> is_referenced(blocks.size(), false);
+        auto next_in_layout = [&](size_t position) { return (position + 1 < emitted.size()) ? emitted[position + 1] : NO_IR_ID; };
+        for (size_t position = 0; position < emitted.size(); position++) {
+            const ir_block& block = blocks[emitted[position]];
+            ir_id following = next_in_layout(position);
+            if (block.terminator == ir_terminator::JUMP && block.next != following) is_referenced[block.next] = true;
+            if (block.terminator == ir_terminator::BRANCH) {
+                if (block.next == following) is_referenced[block.taken] = true;
+                else if (block.taken == following) is_referenced[block.next] = true;
+                else is_referenced[block.taken] = is_referenced[block.next] = true;
+            }
+        }
+        auto label = [&](ir_id id) {
+            return blocks[id].label.empty() ? ".__ir" + std::to_string(id) : blocks[id].label;
+        };
+
+        output.clear();
+        copy_count = 0;
+        for (size_t position = 0; position < emitted.size(); position++) {
+            ir_id id = emitted[position];
+            const ir_block& block = blocks[id];
+            if (!block.label.empty() || is_referenced[id]) output.push_back({ label(id) });
+
+            std::unordered_map<uint8_t, std::string> constants;     //loaded in this block
+            auto operand_name = [&](ir_id operand) -> std::string {
+                const ir_instruction& ins = instructions[operand];
+                if (is_register(operand)) return web_name(web[value_index[operand]]);
+                if (ins.op != ir_op::CONST || ins.constant == 0) return "r0";
+                auto found = constants.find(ins.constant);
+                if (found != constants.end()) return found->second;
+                std::string reg = temporary();
+                output.push_back({ "ldi", reg, std::to_string(ins.constant) });
+                constants[ins.constant] = reg;
+                return reg;
+            };
+
+            for (ir_id instruction : block.instructions) {
+                const ir_instruction& ins = instructions[instruction];
+                if (ins.op == ir_op::CONST && ins.is_loaded) output.push_back({ "ldi", web_name(web[value_index[instruction]]), std::to_string(ins.constant) });
+                if (ins.op == ir_op::PHI || ins.op == ir_op::CONST || ins.op == ir_op::UNDEF) continue;
+                if (ins.op == ir_op::PINNED) {
+                    ir_line line = ins.line;
+                    for (size_t i = 0; i < ins.operands.size(); i++) line[ins.operand_slots[i]] = operand_name(ins.operands[i]);
+                    if (ins.has_result) line[ins.result_slot] = web_name(web[value_index[instruction]]);
+                    output.push_back(std::move(line));
+                    continue;
+                }
+                lower_alu(instruction, output, operand_name,
+                    ins.has_result ? web_name(web[value_index[instruction]]) : std::string("r0"));
+            }
+
+            //parallel copies, a cycle goes through a temporary
+            std::vector<ir_copy> copies = end_copies[id];
+            std::erase_if(copies, [](const ir_copy& copy) { return copy.source == copy.destination; });
+            std::vector<std::pair<std::string, std::string>> moves;
+            for (const ir_copy& copy : copies) {
+                if (copy.source >= 0) moves.push_back({ web_name(copy.source), web_name(copy.destination) });
+            }
+            while (!moves.empty()) {
+                auto ready = std::find_if(moves.begin(), moves.end(), [&](const auto& move) {
+                    return std::ranges::none_of(moves, [&](const auto& other) { return other.first == move.second; });
+                });
+                if (ready == moves.end()) {
+                    std::string saved = temporary();
+                    std::string source = moves.front().first;
+                    output.push_back({ "mov", source, saved });
+                    for (auto& move : moves) {
+                        if (move.first == source) move.first = saved;
+                    }
+                    continue;
+                }
+                output.push_back({ "mov", ready->first, ready->second });
+                moves.erase(ready);
+            }
+            for (const ir_copy& copy : copies) {
+                if (copy.source < 0) output.push_back({ "ldi", web_name(copy.destination), std::to_string(copy.constant) });
+            }
+            copy_count += copies.size();
+
+            ir_id following = next_in_layout(position);
+            switch (block.terminator)
+            {
+            case ir_terminator::JUMP:
+                if (block.next != following) output.push_back({ "jmp", label(block.next) });
+                break;
+            case ir_terminator::BRANCH:
+                if (block.next == following) {
+                    output.push_back({ "brh", ir_condition_names[block.condition], label(block.taken) });
+                }
+                else if (block.taken == following) {
+                    output.push_back({ "brh", ir_condition_names[block.condition ^ 1], label(block.next) });
+                }
+                else {
+                    output.push_back({ "brh", ir_condition_names[block.condition], label(block.taken) });
+                    output.push_back({ "jmp", label(block.next) });
+                }
+                break;
+            case ir_terminator::HALT:
+                output.push_back({ "hlt" });
+                break;
+            case ir_terminator::RETURN:
+                output.push_back({ "ret" });
+                break;
+            }
+        }
+        return true;
+    }
+
+    //
+    //  Passes, each returns the number of changes
+    //
+
+    size_t constant_propagation() {
+        compute_flag_sources();
+        compute_dominators();
+        size_t changes = 0;
+        std::vector<ir_id> forward(instructions.size(), NO_IR_ID);
+        auto resolve = [&](ir_id id) {
+            while (forward[id] != NO_IR_ID) id = forward[id];
+            return id;
+        };
+        auto is_constant = [&](ir_id id, int value = -1) {
+            const ir_instruction& ins = instructions[id];
+            return ins.op == ir_op::CONST && (value < 0 || ins.constant == value);
+        };
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (ir_id block : rpo) {
+                for (ir_id id : blocks[block].instructions) {
+                    ir_instruction& ins = instructions[id];
+                    if (ins.is_removed || forward[id] != NO_IR_ID) continue;
+                    for (ir_id& operand : ins.operands) operand = resolve(operand);
+
+                    ir_id replacement = NO_IR_ID;
+                    int folded = -1;
+                    if (ins.op == ir_op::PHI) {
+                        ir_id single = NO_IR_ID;
+                        bool is_single = true;
+                        int common_constant = -1;
+                        bool is_constant_phi = true;
+                        for (ir_id operand : ins.operands) {
+                            if (operand == id || instructions[operand].op == ir_op::UNDEF) continue;
+                            if (single == NO_IR_ID) single = operand;
+                            else if (operand != single) is_single = false;
+                            if (!is_constant(operand) || (common_constant >= 0 && instructions[operand].constant != common_constant)) is_constant_phi = false;
+                            else common_constant = instructions[operand].constant;
+                        }
+                        if (single == NO_IR_ID) replacement = undefined;
+                        else if (is_single && dominates(instructions[single].block, block)) replacement = single;
+                        else if (is_constant_phi) folded = common_constant;
+                    }
+                    else if (ir_is_alu(ins.op) && ins.has_result && !flag_source[id]) {
+                        ir_id a = ins.operands[0];
+                        ir_id b = (ins.operands.size() > 1) ? ins.operands[1] : a;
+                        if (ins.op != ir_op::SUB && is_constant(a) && !is_constant(b)) std::swap(a, b);
+                        if (is_constant(a) && is_constant(b)) {
+                            bool z = false, c = false;
+                            folded = ir_evaluate(ins.op, instructions[a].constant, instructions[b].constant, z, c);
+                        }
+                        else if ((ins.op == ir_op::ADD || ins.op == ir_op::SUB || ins.op == ir_op::XOR) && is_constant(b, 0)) replacement = a;
+                        else if (ins.op == ir_op::AND && is_constant(b, 255)) replacement = a;
+                        else if (ins.op == ir_op::AND && is_constant(b, 0)) folded = 0;
+                        else if (ins.op == ir_op::AND && a == b) replacement = a;
+                        else if ((ins.op == ir_op::SUB || ins.op == ir_op::XOR) && a == b) folded = 0;
+                        else if (ins.op == ir_op::NOR && is_constant(b, 0)) {
+                            const ir_instruction& inner = instructions[a];
+                            if (inner.op == ir_op::NOR && inner.has_result && !inner.is_removed && is_constant(inner.operands[1], 0)) replacement = inner.operands[0];
+                        }
+                    }
+
+                    if (replacement != NO_IR_ID && replacement != id) {
+                        forward[id] = replacement;
+                        ins.is_removed = true;
+                        changes++;
+                        changed = true;
+                    }
+                    else if (folded >= 0) {
+                        ins.op = ir_op::CONST;
+                        ins.constant = (uint8_t)folded;
+                        ins.operands.clear();
+                        ins.flags = 0;
+                        changes++;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        replace_operands(forward);
+        compact_blocks();
+        return changes;
+    }
+
+    size_t branch_folding() {
+        compute_flag_sources();
+        size_t changes = 0;
+
+        std::vector<size_t> use_count(instructions.size(), 0);
+        for (const ir_instruction& ins : instructions) {
+            if (ins.is_removed) continue;
+            for (ir_id operand : ins.operands) use_count[operand]++;
+        }
+        auto is_constant = [&](ir_id id) { return instructions[id].op == ir_op::CONST; };
+        auto reads_flags_in = [&](ir_id id) {
+            return std::ranges::any_of(successors(id), [&](ir_id successor) { return flags_in[successor]; });
+        };
+
+        for (ir_id id : reverse_postorder()) {
+            ir_block& block = blocks[id];
+            if (block.is_removed || block.terminator != ir_terminator::BRANCH) continue;
+            ir_id source = branch_source[id];
+            if (source == NO_IR_ID) continue;
+            ir_instruction& ins = instructions[source];
+            if (!ir_is_alu(ins.op)) continue;
+
+            //constant flags
+            if (std::ranges::all_of(ins.operands, is_constant)) {
+                bool z = false, c = false;
+                ir_evaluate(ins.op, instructions[ins.operands[0]].constant, instructions[ins.operands.back()].constant, z, c);
+                bool flag = (block.condition <= 1) ? z : c;
+                bool is_taken = flag == ((block.condition & 1) == 0);
+                ir_id target = is_taken ? block.taken : block.next;
+                ir_id dropped = is_taken ? block.next : block.taken;
+                block.terminator = ir_terminator::JUMP;
+                block.next = target;
+                remove_predecessor(dropped, id);
+                changes++;
+                continue;
+            }
+
+            bool is_zero_test = block.condition <= 1 && ins.op == ir_op::SUB && !ins.has_result
+                && is_constant(ins.operands[1]) && instructions[ins.operands[1]].constant == 0;
+            if (!is_zero_test || reads_flags_in(id)) continue;
+            ir_id tested = ins.operands[0];
+
+            //cmp x 0 right after the operation computing x
+            std::vector<ir_id>& block_instructions = block.instructions;
+            auto position = std::find(block_instructions.begin(), block_instructions.end(), source);
+            auto writer = std::find_if(std::make_reverse_iterator(position), block_instructions.rend(), [&](ir_id other) {
+                return (instructions[other].flags & IR_FLAG_Z) != 0;
+            });
+            if (writer != block_instructions.rend() && *writer == tested && ir_is_alu(instructions[tested].op)) {
+                ins.is_removed = true;
+                block_instructions.erase(position);
+                changes++;
+                continue;
+            }
+
+            //zero test of a phi of constants, each predecessor knows the outcome
+            const ir_instruction& phi = instructions[tested];
+            if (phi.op != ir_op::PHI || phi.block != id || use_count[tested] != 1) continue;
+            bool is_threadable = std::ranges::all_of(block_instructions, [&](ir_id other) {
+                const ir_instruction& other_ins = instructions[other];
+                return other == tested || other == source || (other_ins.op == ir_op::CONST && use_count[other] <= 1);
+            });
+            if (!is_threadable) continue;
+
+            std::vector<ir_id> predecessors = block.predecessors;
+            for (ir_id predecessor : predecessors) {
+                ir_id value = instructions[tested].operands[predecessor_index(id, predecessor)];
+                if (!is_constant(value) || predecessor == id) continue;
+                bool z = instructions[value].constant == 0;
+                bool is_taken = z == ((block.condition & 1) == 0);
+                if (redirect_edge(predecessor, id, is_taken ? block.taken : block.next)) changes++;
+            }
+        }
+
+        changes += remove_unreachable_blocks();
+        return changes;
+    }
+
+    size_t common_subexpression_elimination() {
+        compute_flag_sources();
+        compute_dominators();
+        size_t changes = 0;
+        std::vector<ir_id> forward(instructions.size(), NO_IR_ID);
+
+        struct expression_hash {
+            size_t operator()(const std::array<uint32_t, 3>& key) const {
+                return ((size_t)key[0] * 0x9E3779B97F4A7C15ull) ^ ((size_t)key[1] << 20) ^ key[2];
+            }
+        };
+        std::unordered_map<std::array<uint32_t, 3>, ir_id, expression_hash> available;
+        std::vector<std::array<uint32_t, 3>> scope_keys;
+
+        auto key_of = [&](const ir_instruction& ins) -> std::array<uint32_t, 3> {
+            if (ins.op == ir_op::CONST) return { (uint32_t)ins.op, ins.constant, ins.is_loaded };
+            uint32_t a = ins.operands[0];
+            uint32_t b = (ins.operands.size() > 1) ? ins.operands[1] : NO_IR_ID;
+            if (ir_is_commutative(ins.op) && b < a) std::swap(a, b);
+            return { (uint32_t)ins.op, a, b };
+        };
+
+        //depth first over the dominator tree, the expressions of a block are available in the blocks it dominates
+        std::vector<std::vector<ir_id>> children(blocks.size());
+        for (ir_id id : rpo) {
+            if (id != rpo[0]) children[idom[id]].push_back(id);
+        }
+        struct frame {
+            ir_id block;
+            size_t scope_size;
+            size_t next_child;
+        };
+        std::vector<frame> stack;
+        auto enter = [&](ir_id id) {
+            stack.push_back({ id, scope_keys.size(), 0 });
+            for (ir_id instruction : blocks[id].instructions) {
+                ir_instruction& ins = instructions[instruction];
+                if (ins.is_removed || !ins.has_result || (ins.op != ir_op::CONST && !ir_is_alu(ins.op))) continue;
+                for (ir_id& operand : ins.operands) {
+                    while (forward[operand] != NO_IR_ID) operand = forward[operand];
+                }
+                std::array<uint32_t, 3> key = key_of(ins);
+                auto found = available.find(key);
+                if (found != available.end() && !flag_source[instruction]) {
+                    forward[instruction] = found->second;
+                    ins.is_removed = true;
+                    changes++;
+                }
+                else if (found == available.end()) {
+                    available.emplace(key, instruction);
+                    scope_keys.push_back(key);
+                }
+            }
+        };
+        enter(rpo[0]);
+        while (!stack.empty()) {
+            frame& top = stack.back();
+            if (top.next_child < children[top.block].size()) {
+                enter(children[top.block][top.next_child++]);
+                continue;
+            }
+            while (scope_keys.size() > top.scope_size) {
+                available.erase(scope_keys.back());
+                scope_keys.pop_back();
+            }
+            stack.pop_back();
+        }
+
+        replace_operands(forward);
+        compact_blocks();
+        return changes;
+    }
+
+    size_t loop_invariant_code_motion() {
+        compute_flag_sources();
+        compute_dominators();
+        size_t changes = 0;
+
+        //natural loops by header, the body of all back edges into it
+        std::vector<std::pair<ir_id, std::vector<bool>>> loops;
+        for (ir_id header : rpo) {
+            std::vector<bool> body(blocks.size(), false);
+            std::vector<ir_id> work;
+            for (ir_id predecessor : blocks[header].predecessors) {
+                if (rpo_index[predecessor] >= 0 && dominates(header, predecessor)) work.push_back(predecessor);
+            }
+            if (work.empty()) continue;
+            body[header] = true;
+            while (!work.empty()) {
+                ir_id id = work.back();
+                work.pop_back();
+                if (body[id]) continue;
+                body[id] = true;
+                for (ir_id predecessor : blocks[id].predecessors) work.push_back(predecessor);
+            }
+            loops.push_back({ header, std::move(body) });
+        }
+        std::ranges::sort(loops, [](const auto& a, const auto& b) { return std::ranges::count(a.second, true) < std::ranges::count(b.second, true); });
+
+        for (auto& [header, body] : loops) {
+            if (flags_in[header]) continue;
+
+            std::vector<ir_id> invariant;
+            std::vector<bool> is_hoisted(instructions.size(), false);
+            auto is_outside = [&](ir_id operand) { return !body[instructions[operand].block] || is_hoisted[operand]; };
+            bool found = true;
+            while (found) {
+                found = false;
+                for (ir_id id : rpo) {
+                    if (!body[id]) continue;
+                    for (ir_id instruction : blocks[id].instructions) {
+                        const ir_instruction& ins = instructions[instruction];
+                        bool is_movable = (ir_is_alu(ins.op) && ins.has_result && !flag_source[instruction]) || (ins.op == ir_op::CONST && ins.is_loaded);
+                        if (is_hoisted[instruction] || !is_movable) continue;
+                        if (!std::ranges::all_of(ins.operands, is_outside)) continue;
+                        is_hoisted[instruction] = true;
+                        invariant.push_back(instruction);
+                        found = true;
+                    }
+                }
+            }
+
+            //constants the loop reads from a register are loaded once, in the preheader
+            std::vector<std::pair<ir_id, size_t>> constant_operands;
+            for (ir_id id : rpo) {
+                if (!body[id]) continue;
+                for (ir_id instruction : blocks[id].instructions) {
+                    if (is_hoisted[instruction]) continue;
+                    for (size_t k = 0; k < instructions[instruction].operands.size(); k++) {
+                        if (needs_constant_register(instruction, k)) constant_operands.push_back({ instruction, k });
+                    }
+                }
+            }
+            if (invariant.empty() && constant_operands.empty()) continue;
+
+            ir_id preheader = loop_preheader(header, body);
+            for (auto& [other_header, other_body] : loops) {
+                other_body.resize(blocks.size(), false);
+                if (other_header != header && other_body[header]) other_body[preheader] = true;
+            }
+            for (ir_id instruction : invariant) {
+                std::vector<ir_id>& from = blocks[instructions[instruction].block].instructions;
+                from.erase(std::find(from.begin(), from.end(), instruction));
+                blocks[preheader].instructions.push_back(instruction);
+                instructions[instruction].block = preheader;
+                changes++;
+            }
+            std::unordered_map<uint8_t, ir_id> loaded;
+            for (auto [instruction, k] : constant_operands) {
+                uint8_t value = instructions[instructions[instruction].operands[k]].constant;
+                auto found = loaded.find(value);
+                if (found == loaded.end()) {
+                    ir_id constant = add_instruction(preheader, ir_op::CONST, {});
+                    instructions[constant].constant = value;
+                    instructions[constant].is_loaded = true;
+                    found = loaded.emplace(value, constant).first;
+                    changes++;
+                }
+                instructions[instruction].operands[k] = found->second;
+            }
+            compute_flag_sources();
+            compute_dominators();
+        }
+        return changes;
+    }
+
+    size_t dead_code_elimination() {
+        compute_flag_sources();
+        size_t changes = 0;
+
+        std::vector<bool> is_live(instructions.size(), false);
+        std::vector<ir_id> work;
+        for (ir_id id = 0; id < instructions.size(); id++) {
+            const ir_instruction& ins = instructions[id];
+            if (!ins.is_removed && (ins.op == ir_op::PINNED || flag_source[id])) work.push_back(id);
+        }
+        while (!work.empty()) {
+            ir_id id = work.back();
+            work.pop_back();
+            if (is_live[id]) continue;
+            is_live[id] = true;
+            for (ir_id operand : instructions[id].operands) work.push_back(operand);
+        }
+        for (ir_id id = 0; id < instructions.size(); id++) {
+            if (instructions[id].is_removed || is_live[id]) continue;
+            instructions[id].is_removed = true;
+            if (instructions[id].op != ir_op::UNDEF) changes++;
+        }
+        compact_blocks();
+
+        //empty blocks, their predecessors go straight to the successor
+        for (ir_id id : reverse_postorder()) {
+            ir_block& block = blocks[id];
+            if (id == 0 || block.terminator != ir_terminator::JUMP || block.next == id || !block.instructions.empty()) continue;
+            std::vector<ir_id> predecessors = block.predecessors;
+            for (ir_id predecessor : predecessors) {
+                if (redirect_edge(predecessor, id, block.next)) changes++;
+            }
+        }
+        changes += remove_unreachable_blocks();
+        return changes;
+    }
+
+    size_t count(ir_op op) const {
+        return std::ranges::count_if(instructions, [op](const ir_instruction& ins) { return !ins.is_removed && ins.op == op; });
+    }
+
+    //register copies and constant loads of the last lower()
+    size_t copy_count = 0;
+
+private:
+    ir_id undefined = NO_IR_ID;
+
+    //SSA construction
+    std::vector<std::unordered_map<int, ir_id>> end_values;     //last value of a register in a block
+    std::vector<std::unordered_map<int, ir_id>> entry_values;   //value of a register at the start of a block
+    std::vector<std::pair<ir_id, int>> incomplete_phis;
+
+    //flag sources and dominators, recomputed by the passes that need them
+    std::vector<bool> flag_source;      //by instruction
+    std::vector<ir_id> branch_source;   //by block, NO_IR_ID when the block reads the flags of its predecessors
+    std::vector<bool> flags_in;         //by block
+    std::vector<ir_id> rpo;
+    std::vector<int> rpo_index;
+    std::vector<ir_id> idom;
+    std::vector<uint32_t> dominator_enter, dominator_exit;
+
+    std::vector<ir_id> successors(ir_id id) const {
+        const ir_block& block = blocks[id];
+        switch (block.terminator)
+        {
+        case ir_terminator::JUMP: return { block.next };
+        case ir_terminator::BRANCH: return { block.taken, block.next };
+        default: return {};
+        }
+    }
+
+    size_t predecessor_index(ir_id block, ir_id predecessor) const {
+        const std::vector<ir_id>& predecessors = blocks[block].predecessors;
+        return std::find(predecessors.begin(), predecessors.end(), predecessor) - predecessors.begin();
+    }
+
+    ir_id add_instruction(ir_id block, ir_op op, std::vector<ir_id> operands, bool has_result = true) {
+        ir_id id = (ir_id)instructions.size();
+        ir_instruction& ins = instructions.emplace_back();
+        ins.op = op;
+        ins.block = block;
+        ins.operands = std::move(operands);
+        ins.has_result = has_result;
+        ins.flags = ir_alu_flags(op);
+        blocks[block].instructions.push_back(id);
+        return id;
+    }
+
+    //constants are defined in the entry block, they dominate every use
+    ir_id add_constant(uint8_t value) {
+        ir_id id = add_instruction(0, ir_op::CONST, {});
+        instructions[id].constant = value;
+        return id;
+    }
+
+    ir_id read_at_end(int reg, ir_id block) {
+        auto found = end_values[block].find(reg);
+        if (found != end_values[block].end()) return found->second;
+        return read_at_entry(reg, block);
+    }
+
+    ir_id read_at_entry(int reg, ir_id block) {
+        auto found = entry_values[block].find(reg);
+        if (found != entry_values[block].end()) return found->second;
+
+        ir_id value = undefined;
+        const std::vector<ir_id>& predecessors = blocks[block].predecessors;
+        if (predecessors.size() == 1) {
+            value = read_at_end(reg, predecessors[0]);
+        }
+        else if (predecessors.size() > 1) {
+            value = (ir_id)instructions.size();
+            ir_instruction& phi = instructions.emplace_back();
+            phi.op = ir_op::PHI;
+            phi.block = block;
+            phi.has_result = true;
+            std::vector<ir_id>& block_instructions = blocks[block].instructions;
+            block_instructions.insert(block_instructions.begin(), value);
+            incomplete_phis.push_back({ value, reg });
+        }
+        entry_values[block][reg] = value;
+        return value;
+    }
+
+    //a register or r0 as an operand, NO_IR_ID for anything else
+    ir_id read_operand(const std::string& operand, ir_id block) {
+        if (operand == "r0") return add_constant(0);
+        int reg = ir_virtual_register(operand);
+        return (reg < 0) ? NO_IR_ID : read_at_end(reg, block);
+    }
+
+    void lift_line(ir_id block, const ir_line& line, bool is_flag_source) {
+        if (ir_is_instruction_line(line) && lift_operation(block, line, is_flag_source)) return;
+
+        //the passes do not look into the instruction, its virtual registers become operands and the result
+        ir_id id = add_instruction(block, ir_op::PINNED, {}, false);
+        ir_instruction& ins = instructions[id];
+        ins.line = line;
+        if (!ir_is_instruction_line(line)) return;
+        ins.flags = ir_flags_written(line[0]);
+
+        std::array<uint8_t, 3> roles = ir_operand_roles(line[0]);
+        int defined = -1;
+        for (size_t i = 1; i < line.size() && i <= 3; i++) {
+            int reg = ir_virtual_register(line[i]);
+            if (reg < 0) continue;
+            if (roles[i - 1] & 1) {
+                ir_id value = read_at_end(reg, block);
+                instructions[id].operands.push_back(value);
+                instructions[id].operand_slots.push_back((uint8_t)i);
+            }
+            if (roles[i - 1] & 2) {
+                defined = reg;
+                instructions[id].result_slot = (uint8_t)i;
+            }
+        }
+        if (defined >= 0) {
+            instructions[id].has_result = true;
+            end_values[block][defined] = id;
+        }
+    }
+
+    //the ALU instructions on virtual registers, false when the line has to be pinned
+    bool lift_operation(ir_id block, const ir_line& line, bool is_flag_source) {
+        const std::string& mnemonic = line[0];
+        for (size_t i = 1; i < line.size(); i++) {
+            if (ir_is_physical_register(line[i])) return false;
+        }
+        auto operand_count = [&](size_t count) { return line.size() == count + 1; };
+        auto is_register = [&](const std::string& operand) { return operand == "r0" || ir_virtual_register(operand) >= 0; };
+        auto immediate = [&](const std::string& operand) -> int {
+            numeric_literal literal = scan_numeric_literal(operand);
+            return literal.fits_register() ? (int)(uint8_t)literal.int_value : -1;
+        };
+        auto define = [&](const std::string& destination, ir_id value) {
+            if (destination != "r0") end_values[block][ir_virtual_register(destination)] = value;
+        };
+        auto operation = [&](ir_op op, std::vector<ir_id> operands, const std::string& destination) {
+            ir_id id = add_instruction(block, op, std::move(operands), destination != "r0");
+            define(destination, id);
+        };
+
+        if (mnemonic == "ldi" && operand_count(2) && ir_virtual_register(line[1]) >= 0) {
+            int value = immediate(line[2]);
+            if (value < 0) return false;
+            define(line[1], add_constant((uint8_t)value));
+            return true;
+        }
+        if ((mnemonic == "adi" && operand_count(2)) || ((mnemonic == "inc" || mnemonic == "dec") && operand_count(1))) {
+            if (ir_virtual_register(line[1]) < 0) return false;
+            int value = (mnemonic == "inc") ? 1 : (mnemonic == "dec") ? 255 : immediate(line[2]);
+            if (value < 0) return false;
+            ir_id operand = read_operand(line[1], block);
+            operation(ir_op::ADD, { operand, add_constant((uint8_t)value) }, line[1]);
+            return true;
+        }
+        if (operand_count(3) && is_register(line[1]) && is_register(line[2]) && is_register(line[3])) {
+            ir_op op;
+            if (mnemonic == "add") op = ir_op::ADD;
+            else if (mnemonic == "sub") op = ir_op::SUB;
+            else if (mnemonic == "nor") op = ir_op::NOR;
+            else if (mnemonic == "and") op = ir_op::AND;
+            else if (mnemonic == "xor") op = ir_op::XOR;
+            else return false;
+            ir_id a = read_operand(line[1], block);
+            ir_id b = read_operand(line[2], block);
+            operation(op, { a, b }, line[3]);
+            return true;
+        }
+        if (operand_count(2) && is_register(line[1]) && is_register(line[2])) {
+            if (mnemonic == "cmp") {
+                ir_id a = read_operand(line[1], block);
+                ir_id b = read_operand(line[2], block);
+                operation(ir_op::SUB, { a, b }, "r0");
+                return true;
+            }
+            ir_id a = read_operand(line[1], block);
+            if (mnemonic == "mov" && !is_flag_source) define(line[2], a);
+            else if (mnemonic == "mov") operation(ir_op::ADD, { a, add_constant(0) }, line[2]);
+            else if (mnemonic == "lsh") operation(ir_op::ADD, { a, a }, line[2]);
+            else if (mnemonic == "not") operation(ir_op::NOR, { a, add_constant(0) }, line[2]);
+            else if (mnemonic == "neg") operation(ir_op::SUB, { add_constant(0), a }, line[2]);
+            else if (mnemonic == "rsh" && line[2] != "r0") operation(ir_op::RSH, { a }, line[2]);
+            else if (mnemonic != "rsh") return false;
+            return true;
+        }
+        return false;
+    }
+
+    //operand k is a constant that lower_alu or a pinned instruction reads from a register, not an immediate or r0
+    bool needs_constant_register(ir_id id, size_t k) const {
+        const ir_instruction& ins = instructions[id];
+        const ir_instruction& value = instructions[ins.operands[k]];
+        if (value.op != ir_op::CONST || value.is_loaded || value.constant == 0) return false;
+        if (ins.op == ir_op::PINNED) return true;
+        if (!ir_is_alu(ins.op)) return false;
+        ir_id other = ins.operands[(ins.operands.size() > 1) ? 1 - k : 0];
+        bool is_immediate = ins.has_result && (ins.op == ir_op::ADD || (ins.op == ir_op::SUB && k == 1)) && instructions[other].op != ir_op::CONST;
+        return !is_immediate;
+    }
+
+    template <typename OPERAND_NAME>
+    void lower_alu(ir_id id, std::vector<ir_line>& output, OPERAND_NAME& operand_name, const std::string& result) {
+        const ir_instruction& ins = instructions[id];
+        auto constant_of = [&](ir_id operand) { return (instructions[operand].op == ir_op::CONST) ? (int)instructions[operand].constant : -1; };
+        ir_id a = ins.operands[0];
+        ir_id b = (ins.operands.size() > 1) ? ins.operands[1] : a;
+        if (ir_is_commutative(ins.op) && constant_of(a) >= 0 && constant_of(b) < 0) std::swap(a, b);
+
+        //x + c and x - c as adi on the result register, it sets the same flags
+        int immediate = -1;
+        if (ins.has_result && constant_of(b) > 0 && (ins.op == ir_op::ADD || ins.op == ir_op::SUB))
+            immediate = (ins.op == ir_op::ADD) ? constant_of(b) : (uint8_t)-constant_of(b);
+        if (immediate > 0) {
+            std::string source = operand_name(a);
+            if (source != result) output.push_back({ "mov", source, result });
+            if (immediate == 1) output.push_back({ "inc", result });
+            else if (immediate == 255) output.push_back({ "dec", result });
+            else output.push_back({ "adi", result, std::to_string(immediate) });
+            return;
+        }
+
+        switch (ins.op)
+        {
+        case ir_op::ADD:
+            if (a == b) output.push_back({ "lsh", operand_name(a), result });
+            //allocate_registers() drops a mov between the same registers, a flag source stays an add
+            else if (constant_of(b) == 0 && ins.has_result && !flag_source[id]) output.push_back({ "mov", operand_name(a), result });
+            else {
+                std::string name_a = operand_name(a);
+                output.push_back({ "add", name_a, operand_name(b), result });
+            }
+            break;
+        case ir_op::SUB:
+            if (!ins.has_result) {
+                std::string name_a = operand_name(a);
+                output.push_back({ "cmp", name_a, operand_name(b) });
+            }
+            else if (constant_of(a) == 0) output.push_back({ "neg", operand_name(b), result });
+            else {
+                std::string name_a = operand_name(a);
+                output.push_back({ "sub", name_a, operand_name(b), result });
+            }
+            break;
+        case ir_op::NOR:
+            if (constant_of(b) == 0 && ins.has_result) output.push_back({ "not", operand_name(a), result });
+            else {
+                std::string name_a = operand_name(a);
+                output.push_back({ "nor", name_a, operand_name(b), result });
+            }
+            break;
+        case ir_op::AND:
+        case ir_op::XOR: {
+            std::string name_a = operand_name(a);
+            output.push_back({ (ins.op == ir_op::AND) ? "and" : "xor", name_a, operand_name(b), result });
+            break;
+        }
+        default:
+            output.push_back({ "rsh", operand_name(a), result });
+            break;
+        }
+    }
+
+    std::vector<ir_id> reverse_postorder() const {
+        std::vector<ir_id> order;
+        std::vector<bool> is_visited(blocks.size(), false);
+        std::vector<std::pair<ir_id, size_t>> stack = { { 0, 0 } };
+        is_visited[0] = true;
+        while (!stack.empty()) {
+            auto& [id, next] = stack.back();
+            std::vector<ir_id> block_successors = successors(id);
+            if (next < block_successors.size()) {
+                ir_id successor = block_successors[next++];
+                if (!is_visited[successor]) {
+                    is_visited[successor] = true;
+                    stack.push_back({ successor, 0 });
+                }
+                continue;
+            }
+            order.push_back(id);
+            stack.pop_back();
+        }
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+
+    //Cooper, Harvey and Kennedy, with an interval numbering of the dominator tree for dominates()
+    void compute_dominators() {
+        rpo = reverse_postorder();
+        rpo_index.assign(blocks.size(), -1);
+        for (size_t i = 0; i < rpo.size(); i++) rpo_index[rpo[i]] = (int)i;
+        idom.assign(blocks.size(), NO_IR_ID);
+        idom[rpo[0]] = rpo[0];
+
+        auto intersect = [&](ir_id a, ir_id b) {
+            while (a != b) {
+                while (rpo_index[a] > rpo_index[b]) a = idom[a];
+                while (rpo_index[b] > rpo_index[a]) b = idom[b];
+            }
+            return a;
+        };
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 1; i < rpo.size(); i++) {
+                ir_id id = rpo[i];
+                ir_id dominator = NO_IR_ID;
+                for (ir_id predecessor : blocks[id].predecessors) {
+                    if (rpo_index[predecessor] < 0 || idom[predecessor] == NO_IR_ID) continue;
+                    dominator = (dominator == NO_IR_ID) ? predecessor : intersect(predecessor, dominator);
+                }
+                if (dominator != idom[id]) {
+                    idom[id] = dominator;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<std::vector<ir_id>> children(blocks.size());
+        for (size_t i = 1; i < rpo.size(); i++) children[idom[rpo[i]]].push_back(rpo[i]);
+        dominator_enter.assign(blocks.size(), 0);
+        dominator_exit.assign(blocks.size(), 0);
+        uint32_t counter = 0;
+        std::vector<std::pair<ir_id, size_t>> stack = { { rpo[0], 0 } };
+        dominator_enter[rpo[0]] = counter++;
+        while (!stack.empty()) {
+            auto& [id, next] = stack.back();
+            if (next < children[id].size()) {
+                ir_id child = children[id][next++];
+                dominator_enter[child] = counter++;
+                stack.push_back({ child, 0 });
+                continue;
+            }
+            dominator_exit[id] = counter++;
+            stack.pop_back();
+        }
+    }
+
+    bool dominates(ir_id a, ir_id b) const {
+        if (rpo_index[a] < 0 || rpo_index[b] < 0) return false;
+        return dominator_enter[a] <= dominator_enter[b] && dominator_exit[b] <= dominator_exit[a];
+    }
+
+    void compute_flag_sources() {
+        flag_source.assign(instructions.size(), false);
+        branch_source.assign(blocks.size(), NO_IR_ID);
+        flags_in.assign(blocks.size(), false);
+
+        auto last_writer = [&](ir_id id, uint8_t flag) {
+            const std::vector<ir_id>& block_instructions = blocks[id].instructions;
+            auto found = std::find_if(block_instructions.rbegin(), block_instructions.rend(), [&](ir_id instruction) {
+                return (instructions[instruction].flags & flag) != 0;
+            });
+            return (found == block_instructions.rend()) ? NO_IR_ID : *found;
+        };
+
+        std::vector<uint8_t> marked(blocks.size(), 0);
+        std::vector<std::pair<ir_id, uint8_t>> pending;
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            const ir_block& block = blocks[id];
+            if (block.is_removed || block.terminator != ir_terminator::BRANCH) continue;
+            uint8_t flag = ir_condition_flag(block.condition);
+            branch_source[id] = last_writer(id, flag);
+            if (branch_source[id] != NO_IR_ID) {
+                flag_source[branch_source[id]] = true;
+                continue;
+            }
+            flags_in[id] = true;
+            pending.push_back({ id, flag });
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            auto [id, flag] = pending[i];
+            for (ir_id predecessor : blocks[id].predecessors) {
+                if (marked[predecessor] & flag) continue;
+                marked[predecessor] |= flag;
+                ir_id writer = last_writer(predecessor, flag);
+                if (writer != NO_IR_ID) flag_source[writer] = true;
+                else pending.push_back({ predecessor, flag });
+            }
+        }
+    }
+
+    //phis whose operands are one value, or the phi itself, are that value
+    void remove_trivial_phis() {
+        std::vector<ir_id> forward(instructions.size(), NO_IR_ID);
+        auto resolve = [&](ir_id id) {
+            while (forward[id] != NO_IR_ID) id = forward[id];
+            return id;
+        };
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (ir_id id = 0; id < instructions.size(); id++) {
+                ir_instruction& ins = instructions[id];
+                if (ins.is_removed || ins.op != ir_op::PHI) continue;
+                ir_id single = NO_IR_ID;
+                bool is_trivial = true;
+                for (ir_id& operand : ins.operands) {
+                    operand = resolve(operand);
+                    if (operand == id || operand == single) continue;
+                    if (single != NO_IR_ID) is_trivial = false;
+                    single = operand;
+                }
+                if (!is_trivial) continue;
+                forward[id] = (single == NO_IR_ID) ? undefined : single;
+                ins.is_removed = true;
+                changed = true;
+            }
+        }
+        replace_operands(forward);
+        compact_blocks();
+    }
+
+    void replace_operands(const std::vector<ir_id>& forward) {
+        for (ir_instruction& ins : instructions) {
+            if (ins.is_removed) continue;
+            for (ir_id& operand : ins.operands) {
+                while (operand < forward.size() && forward[operand] != NO_IR_ID) operand = forward[operand];
+            }
+        }
+    }
+
+    //drops the removed instructions, constants folded in place move to the entry block so that the phis stay first
+    void compact_blocks() {
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            std::erase_if(blocks[id].instructions, [&](ir_id instruction) {
+                ir_instruction& ins = instructions[instruction];
+                if (ins.is_removed) return true;
+                if (id == 0 || ins.op != ir_op::CONST || ins.is_loaded) return false;
+                ins.block = 0;
+                blocks[0].instructions.push_back(instruction);
+                return true;
+            });
+        }
+    }
+
+    void remove_predecessor(ir_id block, ir_id predecessor) {
+        std::vector<ir_id>& predecessors = blocks[block].predecessors;
+        auto found = std::find(predecessors.begin(), predecessors.end(), predecessor);
+        if (found == predecessors.end()) return;
+        size_t index = found - predecessors.begin();
+        predecessors.erase(found);
+        for (ir_id id : blocks[block].instructions) {
+            if (instructions[id].op == ir_op::PHI) instructions[id].operands.erase(instructions[id].operands.begin() + index);
+        }
+    }
+
+    //the edge from predecessor to block goes to target instead, block has to be a predecessor of target.
+    //False when the predecessor already reaches target with other phi operands.
+    bool redirect_edge(ir_id predecessor, ir_id block, ir_id target) {
+        if (target == block) return false;
+        size_t through = predecessor_index(target, block);
+        size_t existing = predecessor_index(target, predecessor);
+        bool is_existing = existing < blocks[target].predecessors.size();
+        for (ir_id id : blocks[target].instructions) {
+            const ir_instruction& ins = instructions[id];
+            if (ins.op != ir_op::PHI) continue;
+            if (is_existing && ins.operands[existing] != ins.operands[through]) return false;
+            if (instructions[ins.operands[through]].block == block) return false;
+        }
+
+        ir_block& from = blocks[predecessor];
+        if (from.next == block) from.next = target;
+        if (from.terminator == ir_terminator::BRANCH && from.taken == block) from.taken = target;
+        if (from.terminator == ir_terminator::BRANCH && from.taken == from.next) from.terminator = ir_terminator::JUMP;
+        remove_predecessor(block, predecessor);
+
+        if (!is_existing) {
+            blocks[target].predecessors.push_back(predecessor);
+            for (ir_id id : blocks[target].instructions) {
+                ir_instruction& ins = instructions[id];
+                if (ins.op == ir_op::PHI) ins.operands.push_back(ins.operands[through]);
+            }
+        }
+        return true;
+    }
+
+    void remove_block(ir_id id) {
+        ir_block& block = blocks[id];
+        for (ir_id successor : successors(id)) remove_predecessor(successor, id);
+        for (ir_id instruction : block.instructions) instructions[instruction].is_removed = true;
+        block.instructions.clear();
+        block.predecessors.clear();
+        block.terminator = ir_terminator::HALT;
+        block.is_removed = true;
+    }
+
+    size_t remove_unreachable_blocks() {
+        std::vector<bool> is_reachable(blocks.size(), false);
+        for (ir_id id : reverse_postorder()) is_reachable[id] = true;
+        size_t removed = 0;
+        for (ir_id id = 0; id < blocks.size(); id++) {
+            if (is_reachable[id] || blocks[id].is_removed) continue;
+            remove_block(id);
+            removed++;
+        }
+        return removed;
+    }
+
+    //the single block outside the loop that enters the header, a new one when there is none
+    ir_id loop_preheader(ir_id header, const std::vector<bool>& body) {
+        std::vector<ir_id> outside;
+        for (ir_id predecessor : blocks[header].predecessors) {
+            if (!body[predecessor]) outside.push_back(predecessor);
+        }
+        if (outside.size() == 1 && blocks[outside[0]].terminator == ir_terminator::JUMP) return outside[0];
+
+        ir_id preheader = (ir_id)blocks.size();
+        blocks.emplace_back();
+        blocks[preheader].next = header;
+        blocks[preheader].predecessors = outside;
+        layout.insert(std::find(layout.begin(), layout.end(), header), preheader);
+
+        //the header phis take the outside operands from a phi in the preheader
+        std::vector<ir_id> header_predecessors;
+        std::vector<size_t> inside_edges, outside_edges;
+        for (size_t edge = 0; edge < blocks[header].predecessors.size(); edge++) {
+            ir_id predecessor = blocks[header].predecessors[edge];
+            if (body[predecessor]) {
+                inside_edges.push_back(edge);
+                header_predecessors.push_back(predecessor);
+            }
+            else {
+                outside_edges.push_back(edge);
+            }
+        }
+        header_predecessors.push_back(preheader);
+        std::vector<ir_id> header_instructions = blocks[header].instructions;
+        for (ir_id id : header_instructions) {
+            if (instructions[id].op != ir_op::PHI) continue;
+            std::vector<ir_id> outside_operands;
+            for (size_t edge : outside_edges) outside_operands.push_back(instructions[id].operands[edge]);
+            ir_id entering = outside_operands[0];
+            if (std::ranges::any_of(outside_operands, [&](ir_id operand) { return operand != entering; })) {
+                entering = add_instruction(preheader, ir_op::PHI, outside_operands);
+                instructions[entering].flags = 0;
+            }
+            std::vector<ir_id> operands;
+            for (size_t edge : inside_edges) operands.push_back(instructions[id].operands[edge]);
+            operands.push_back(entering);
+            instructions[id].operands = std::move(operands);
+        }
+        blocks[header].predecessors = std::move(header_predecessors);
+
+        for (ir_id predecessor : outside) {
+            ir_block& from = blocks[predecessor];
+            if (from.next == header) from.next = preheader;
+            if (from.terminator == ir_terminator::BRANCH && from.taken == header) from.taken = preheader;
+        }
+        flag_source.resize(instructions.size(), false);
+        return preheader;
+    }
+};
+
+//Runs the passes of the options on virtual register lines, which are replaced by the optimized lines.
+//The lines stay as they are when they can not be lifted or lowered.
+static bool optimize_lines(std::vector<ir_line>& lines, ir_report& report, const ir_options& options = {}) {
+    report = {};
+    for (const ir_line& line : lines) {
+        if (ir_is_instruction_line(line)) report.instructions_before++;
+    }
+    report.instructions_after = report.instructions_before;
+
+    auto timed = [&](const std::string& name, auto&& pass) {
+        auto start = std::chrono::steady_clock::now();
+        size_t changes = pass();
+        report.passes.push_back({ name, changes, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() });
+    };
+
+    ir_function function;
+    bool is_lifted = false;
+    timed("SSA construction", [&]() { is_lifted = function.lift(lines); return function.count(ir_op::PHI); });
+    if (!is_lifted) return false;
+
+    if (options.constant_propagation) timed("constant propagation", [&]() { return function.constant_propagation(); });
+    if (options.branch_folding) timed("branch folding", [&]() { return function.branch_folding(); });
+    if (options.cse) timed("CSE", [&]() { return function.common_subexpression_elimination(); });
+    if (options.licm) timed("LICM", [&]() { return function.loop_invariant_code_motion(); });
+    if (options.dce) timed("DCE", [&]() { return function.dead_code_elimination(); });
+
+    std::vector<ir_line> lowered;
+    bool is_lowered = false;
+    timed("out of SSA", [&]() { is_lowered = function.lower(lowered); return function.copy_count; });
+    if (!is_lowered) return false;
+
+    lines = std::move(lowered);
+    report.applied = true;
+    report.instructions_after = 0;
+    for (const ir_line& line : lines) {
+        if (ir_is_instruction_line(line)) report.instructions_after++;
+    }
+    return true;
+}
@@ -0,0 +1,549 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+
+//
+//  Inliner
+//
+//  Whole program pass on assembly lines, one label, directive, comment or instruction per line and the pseudo
+//  instructions not lowered yet, so it takes the output of a code generator as well as a preprocessed .as file
+//  (a label in front of an instruction gets a line of its own). A function is what a CAL target reaches through
+//  JMP, BRH and falling through, up to its RETs. The rewrites are
+//
+//      cal .f              the body of .f, its labels renamed and every RET a jump behind the call
+//      cal .f   ret        tail call, jmp .f
+//
+//  A function can be inlined when it does not reach itself through calls and its body is one range of lines that
+//  starts at its entry. A CAL and its RET cost 2 cycles, the call sites are chosen by what they save for what they add:
+//      - without a profile, the calls of functions whose body has at most max_inline_size instructions
+//      - with a profile (how often each CAL ran, by address), the hottest calls first
+//      - either way a function with a single call site, its body is removed right away
+//  while the program grows by at most max_growth instructions. Then, while the static call depth (frames pushed below
+//  the program entry) is above max_call_depth, a call on the deepest chain of calls is inlined whatever it costs, as
+//  long as the program fits in the max_program_size words of the instruction memory. Every inline is measured on the
+//  rewritten lines and undone when the program ends up above its limit. A program that stays above the depth budget
+//  is reported with an error, and so is one that does not fit in the instruction memory. One that can not be
+//  analyzed, because it jumps to numeric addresses or uses labels as values, is left as it is with an error.
+//
+
+using inline_line = std::vector<std::string>;
+
+struct inline_options {
+    size_t max_inline_size = 8;         //instructions, without a profile
+    size_t max_growth = 64;             //instructions added by inlining for cost
+    size_t max_program_size = 1024;     //the instruction memory, inlining for the call depth stays within it
+    int max_call_depth = 16;            //the hardware call stack, HARDWARE_CALL_STACK_DEPTH of Analyzer.h
+    bool tail_calls = true;
+    std::unordered_map<uint16_t, uint64_t> call_counts;    //profile, executions of the CAL at each address
+};
+
+struct inline_report {
+    size_t instructions_before = 0;
+    size_t instructions_after = 0;
+    size_t inlined_calls = 0;
+    size_t depth_inlined_calls = 0;     //of the inlined calls, the ones that were inlined for the call depth
+    size_t tail_calls = 0;
+    size_t removed_functions = 0;
+    int call_depth_before = 0;          //-1 when unbounded
+    int call_depth_after = 0;
+    std::vector<std::string> errors;
+
+    bool is_within_budget() const { return errors.empty(); }
+
+    void print() const {
+        std::cout << "Inliner: " << instructions_before << " -> " << instructions_after << " instructions\n"
+                  << "  inlined calls          " << inlined_calls << " (" << depth_inlined_calls << " for the call depth)\n"
+                  << "  tail calls             " << tail_calls << '\n'
+                  << "  removed functions      " << removed_functions << '\n'
+                  << "  call depth             " << call_depth_before << " -> " << call_depth_after << '\n';
+        for (const std::string& error : errors) std::cout << "  ERROR : " << error << '\n';
+    }
+};
+
+class inline_program {
+public:
+    inline_program(std::vector<inline_line>& lines, inline_report& report, const inline_options& options)
+        : report(report), options(options) {
+        //labels in front of an instruction go on a line of their own
+        for (inline_line& line : lines) {
+            if (line.size() > 1 && line[0][0] == '.' && line[1][0] != '/') {
+                entries.push_back({ { line[0] } });
+                entries.push_back({ inline_line(line.begin() + 1, line.end()) });
+            }
+            else {
+                entries.push_back({ std::move(line) });
+            }
+        }
+        lines.clear();
+
+        size_t pc = 0;
+        for (inline_entry& entry : entries) {
+            if (!is_instruction(entry.line)) continue;
+            auto count = options.call_counts.find((uint16_t)pc);
+            if (count != options.call_counts.end()) entry.count = count->second;
+            pc++;
+        }
+    }
+
+    //runs the pass and hands the lines back
+    void run(std::vector<inline_line>& lines) {
+        is_analyzable = analyze();
+        report.instructions_before = code_size();
+        report.call_depth_before = program_depth;
+        if (!is_analyzable) {
+            report.errors.push_back("The program jumps to addresses that are not labels or uses labels as values, its call depth is not known");
+        }
+        else {
+            inline_by_cost();
+            if (options.tail_calls) convert_tail_calls();
+            inline_for_depth();
+            if (options.tail_calls) convert_tail_calls();
+            remove_dead_functions();
+            analyze();
+        }
+        report.instructions_after = code_size();
+        report.call_depth_after = program_depth;
+        if (is_analyzable && program_depth < 0) {
+            report.errors.push_back("The call depth is unbounded (recursive calls)");
+        }
+        else if (is_analyzable && program_depth > options.max_call_depth) {
+            std::string error = "The call depth can reach " + std::to_string(program_depth) + ", the budget is " + std::to_string(options.max_call_depth);
+            if (is_depth_size_bound) error += ", the calls left to inline do not fit in " + std::to_string(options.max_program_size) + " instructions";
+            report.errors.push_back(error);
+        }
+        if (report.instructions_after > options.max_program_size) {
+            report.errors.push_back("The program has " + std::to_string(report.instructions_after) + " instructions, the instruction memory holds " +
+                                    std::to_string(options.max_program_size));
+        }
+
+        lines.clear();
+        for (inline_entry& entry : entries) lines.push_back(std::move(entry.line));
+    }
+
+private:
+    struct inline_entry {
+        inline_line line;
+        uint64_t count = 0;     //executions of a CAL
+    };
+
+    enum class flow : uint8_t { NEXT, JUMP, BRANCH, CALL, RETURN, HALT };
+
+    struct function {
+        size_t entry = 0;
+        size_t last = 0;            //pc of the last instruction of the body
+        bool is_contiguous = false;
+        std::vector<size_t> sites;  //CALs of the entry
+        std::vector<size_t> callees;
+        bool is_referenced = false; //a jump or call into the body from outside, besides the calls of the entry
+        int depth = 0;              //frames pushed below the function, -1 if unbounded
+        int height = 0;             //frames pushed above the function on the longest chain from the program entry
+
+        size_t size() const { return last - entry + 1; }
+    };
+
+    inline_report& report;
+    const inline_options& options;
+    std::vector<inline_entry> entries;
+    size_t inline_count = 0;
+    std::unordered_set<std::string> inlined_entries;
+    std::unordered_set<size_t> rejected_sites;  //CALs whose inlining was undone, by pc, until the next inline
+    bool is_depth_size_bound = false;           //a call on the deepest chain did not fit in the instruction memory
+
+    //the analysis of the current lines
+    bool is_analyzable = false;
+    std::vector<size_t> entry_of_pc;        //index into entries
+    std::vector<flow> flow_of_pc;
+    std::vector<size_t> target_of_pc;
+    std::unordered_map<std::string, size_t> label_pc;
+    std::unordered_map<size_t, function> functions;     //by entry pc, the program entry is pc 0
+    int program_depth = 0;
+
+    static bool is_instruction(const inline_line& line) {
+        return !line.empty() && line[0][0] != '.' && line[0][0] != '/' && line[0] != "define" && line[0] != "export";
+    }
+
+    static bool is_label(const inline_line& line) {
+        return !line.empty() && line[0][0] == '.';
+    }
+
+    static size_t target_operand(const inline_line& line) {
+        return (line[0] == "brh") ? 2 : 1;
+    }
+
+    size_t code_size() const {
+        return (size_t)std::ranges::count_if(entries, [](const inline_entry& entry) { return is_instruction(entry.line); });
+    }
+
+    //the instructions that pc reaches, through calls as well when is_entering_calls
+    std::vector<bool> reach(size_t start, bool is_entering_calls, std::vector<size_t>* callees = nullptr) const {
+        size_t size = entry_of_pc.size();
+        std::vector<bool> reached(size + 1, false);
+        std::vector<size_t> pending = { start };
+        reached[start] = true;
+        while (!pending.empty()) {
+            size_t pc = pending.back();
+            pending.pop_back();
+            size_t successors[2] = { size + 1, size + 1 };
+            switch (flow_of_pc[pc])
+            {
+            case flow::NEXT: successors[0] = pc + 1; break;
+            case flow::JUMP: successors[0] = target_of_pc[pc]; break;
+            case flow::BRANCH: successors[0] = target_of_pc[pc]; successors[1] = pc + 1; break;
+            case flow::CALL:
+                successors[0] = pc + 1;
+                if (is_entering_calls) successors[1] = target_of_pc[pc];
+                if (callees && std::ranges::find(*callees, target_of_pc[pc]) == callees->end()) callees->push_back(target_of_pc[pc]);
+                break;
+            default: break;
+            }
+            for (size_t successor : successors) {
+                if (successor <= size && !reached[successor]) {
+                    reached[successor] = true;
+                    if (successor < size) pending.push_back(successor);
+                }
+            }
+        }
+        return reached;
+    }
+
+    //running off the end of the code, reach() marks it one past the last instruction
+    static bool falls_off(const std::vector<bool>& reached) {
+        return reached.back();
+    }
+
+    //
+    //  Control flow, functions and the call graph of the current lines, false when the targets are not all labels
+    //
+    bool analyze() {
+        entry_of_pc.clear();
+        flow_of_pc.clear();
+        target_of_pc.clear();
+        label_pc.clear();
+        functions.clear();
+
+        for (size_t index = 0; index < entries.size(); index++) {
+            const inline_line& line = entries[index].line;
+            if (is_label(line)) label_pc[line[0]] = entry_of_pc.size();
+            if (is_instruction(line)) entry_of_pc.push_back(index);
+        }
+        size_t size = entry_of_pc.size();
+        if (size == 0) return false;
+
+        flow_of_pc.assign(size, flow::NEXT);
+        target_of_pc.assign(size, size);
+        bool has_numeric_targets = false;
+        for (size_t pc = 0; pc < size; pc++) {
+            const inline_line& line = entries[entry_of_pc[pc]].line;
+            const std::string& mnemonic = line[0];
+            if (mnemonic == "jmp" || mnemonic == "brh" || mnemonic == "cal") {
+                flow_of_pc[pc] = (mnemonic == "jmp") ? flow::JUMP : (mnemonic == "brh") ? flow::BRANCH : flow::CALL;
+                size_t operand = target_operand(line);
+                auto target = (operand < line.size()) ? label_pc.find(line[operand]) : label_pc.end();
+                if (target == label_pc.end() || target->second >= size) has_numeric_targets = true;
+                else target_of_pc[pc] = target->second;
+            }
+            else if (mnemonic == "ret") {
+                flow_of_pc[pc] = flow::RETURN;
+            }
+            else if (mnemonic == "hlt") {
+                flow_of_pc[pc] = flow::HALT;
+            }
+            else if (std::ranges::any_of(line.begin() + 1, line.end(), [&](const std::string& operand) { return label_pc.contains(operand); })) {
+                has_numeric_targets = true;
+            }
+        }
+        if (has_numeric_targets) return false;
+
+        //the bodies
+        functions[0].entry = 0;
+        for (size_t pc = 0; pc < size; pc++) {
+            if (flow_of_pc[pc] != flow::CALL) continue;
+            function& callee = functions[target_of_pc[pc]];
+            callee.entry = target_of_pc[pc];
+            callee.sites.push_back(pc);
+        }
+        for (auto& [entry, f] : functions) {
+            std::vector<bool> reached = reach(entry, false, &f.callees);
+            size_t count = (size_t)std::ranges::count(reached, true);
+            f.last = entry;
+            for (size_t pc = entry; pc < size && reached[pc]; pc++) f.last = pc;
+            f.is_contiguous = count == f.last - entry + 1 && !falls_off(reached);
+        }
+
+        //jumps and calls into a body from outside of it
+        for (size_t pc = 0; pc < size; pc++) {
+            if (flow_of_pc[pc] != flow::JUMP && flow_of_pc[pc] != flow::BRANCH && flow_of_pc[pc] != flow::CALL) continue;
+            size_t target = target_of_pc[pc];
+            for (auto& [entry, f] : functions) {
+                bool is_inside = target >= entry && target <= f.last;
+                bool is_from_outside = pc < entry || pc > f.last;
+                bool is_entry_call = flow_of_pc[pc] == flow::CALL && target == entry;
+                if (is_inside && is_from_outside && !is_entry_call) f.is_referenced = true;
+            }
+        }
+
+        //depth below each function and height above it, recursion makes both unbounded
+        enum { UNVISITED, ON_STACK, DONE };
+        std::unordered_map<size_t, int> state;
+        std::vector<size_t> postorder;
+        std::vector<std::pair<size_t, size_t>> stack = { { 0, 0 } };
+        state[0] = ON_STACK;
+        while (!stack.empty()) {
+            auto& [entry, next_callee] = stack.back();
+            function& f = functions[entry];
+            if (next_callee < f.callees.size()) {
+                size_t callee = f.callees[next_callee++];
+                if (state[callee] == UNVISITED) {
+                    state[callee] = ON_STACK;
+                    stack.push_back({ callee, 0 });
+                }
+                else if (state[callee] == ON_STACK) {
+                    f.depth = -1;
+                }
+                continue;
+            }
+            for (size_t callee : f.callees) {
+                int callee_depth = functions[callee].depth;
+                if (callee_depth < 0 || f.depth < 0) f.depth = -1;
+                else f.depth = std::max(f.depth, callee_depth + 1);
+            }
+            state[entry] = DONE;
+            postorder.push_back(entry);
+            stack.pop_back();
+        }
+        program_depth = functions[0].depth;
+        if (program_depth >= 0) {
+            for (size_t i = postorder.size(); i-- > 0;) {
+                const function& f = functions[postorder[i]];
+                for (size_t callee : f.callees) functions[callee].height = std::max(functions[callee].height, f.height + 1);
+            }
+        }
+        return true;
+    }
+
+    bool is_inlinable(const function& f) const {
+        return f.entry != 0 && f.is_contiguous && f.depth >= 0;
+    }
+
+    //the original body goes away after its single call is inlined
+    bool is_single_call(const function& f) const {
+        return f.sites.size() == 1 && !f.is_referenced;
+    }
+
+    //instructions added by inlining one call of f, the final RET becomes the fall through
+    long growth(const function& f) const {
+        long added = (long)f.size() - 1;
+        if (flow_of_pc[f.last] == flow::RETURN) added--;
+        if (is_single_call(f)) added -= (long)f.size();
+        return added;
+    }
+
+    //the estimate, try_inline_call measures the rewritten lines
+    bool fits(const function& f, size_t limit) const {
+        return growth(f) <= 0 || code_size() + (size_t)growth(f) <= limit;
+    }
+
+    //inlines the CAL at pc and removes the bodies that are dead afterwards, undone when the program grows above limit
+    //instructions. The analysis is stale either way.
+    bool try_inline_call(size_t pc, size_t limit) {
+        size_t size_before = code_size();
+        std::vector<inline_entry> saved_entries = entries;
+        std::unordered_set<std::string> saved_inlined_entries = inlined_entries;
+        inline_report saved_report = report;
+
+        inline_call(pc);
+        remove_dead_functions();
+        if (code_size() <= std::max(limit, size_before)) {
+            rejected_sites.clear();
+            return true;
+        }
+
+        entries = std::move(saved_entries);
+        inlined_entries = std::move(saved_inlined_entries);
+        report = saved_report;
+        rejected_sites.insert(pc);
+        return false;
+    }
+
+    //
+    //  Inlining by cost, one call at a time. Without a profile leaf functions go first, so that their callers are
+    //  measured with the calls already inlined. With a profile the calls that save the most cycles per added
+    //  instruction go first.
+    //
+    void inline_by_cost() {
+        bool has_profile = !options.call_counts.empty();
+        size_t limit = std::min(options.max_program_size, report.instructions_before + options.max_growth);
+        while (analyze() && program_depth >= 0) {
+            size_t best_site = SIZE_MAX;
+            double best_score = 0;
+            for (const auto& [entry, f] : functions) {
+                if (!is_inlinable(f) || !fits(f, limit)) continue;
+                long added = growth(f);
+                for (size_t site : f.sites) {
+                    if (rejected_sites.contains(site)) continue;
+                    uint64_t count = entries[entry_of_pc[site]].count;
+                    double score = 0;
+                    if (added < 0) score = 1e18;
+                    else if (has_profile && count > 0) score = 2.0 * (double)count / (double)std::max(added, 1L);
+                    else if (!has_profile && f.size() <= options.max_inline_size) score = 1e9 - f.depth * 1e6 - (double)f.size();
+                    if (score > best_score) {
+                        best_score = score;
+                        best_site = site;
+                    }
+                }
+            }
+            if (best_site == SIZE_MAX) break;
+            try_inline_call(best_site, limit);
+        }
+    }
+
+    //inlines calls on the deepest chain until the depth is within the budget or no call left fits
+    void inline_for_depth() {
+        rejected_sites.clear();
+        while (analyze() && program_depth > options.max_call_depth) {
+            size_t best_site = SIZE_MAX;
+            size_t best_size = SIZE_MAX;
+            for (const auto& [entry, caller] : functions) {
+                for (size_t callee : caller.callees) {
+                    const function& f = functions[callee];
+                    if (caller.height + 1 + f.depth != program_depth || !is_inlinable(f) || f.size() >= best_size) continue;
+                    if (!fits(f, options.max_program_size)) {
+                        is_depth_size_bound = true;
+                        continue;
+                    }
+                    for (size_t site : f.sites) {
+                        if (site >= entry && site <= caller.last && !rejected_sites.contains(site)) {
+                            best_site = site;
+                            best_size = f.size();
+                            break;
+                        }
+                    }
+                }
+            }
+            if (best_site == SIZE_MAX) return;
+            if (try_inline_call(best_site, options.max_program_size)) report.depth_inlined_calls++;
+            else is_depth_size_bound = true;
+        }
+    }
+
+    //replaces the CAL at pc with a copy of the body of its target
+    void inline_call(size_t pc) {
+        const function& f = functions[target_of_pc[pc]];
+        size_t site_index = entry_of_pc[pc];
+        size_t first = entry_of_pc[f.entry];
+        size_t last = entry_of_pc[f.last];
+        while (first > 0 && is_label(entries[first - 1].line)) first--;
+
+        uint64_t site_count = entries[site_index].count;
+        uint64_t total_count = 0;
+        for (size_t site : f.sites) total_count += entries[entry_of_pc[site]].count;
+
+        std::string suffix = "__inline" + std::to_string(inline_count);
+        std::string return_label = ".__inline" + std::to_string(inline_count) + "_return";
+        inline_count++;
+        std::unordered_map<std::string, std::string> renamed;
+        for (size_t index = first; index <= last; index++) {
+            if (is_label(entries[index].line)) renamed[entries[index].line[0]] = entries[index].line[0] + suffix;
+        }
+
+        std::vector<inline_entry> copy;
+        bool has_return_jump = false;
+        for (size_t index = first; index <= last; index++) {
+            inline_entry entry = entries[index];
+            inline_line& line = entry.line;
+            if (is_label(line)) {
+                line = { renamed[line[0]] };
+            }
+            else if (!is_instruction(line)) {
+                continue;
+            }
+            else if (line[0] == "ret") {
+                if (index == last) continue;
+                line = { "jmp", return_label };
+                has_return_jump = true;
+            }
+            else if (line[0] == "jmp" || line[0] == "brh" || line[0] == "cal") {
+                std::string& target = line[target_operand(line)];
+                auto found = renamed.find(target);
+                if (found != renamed.end()) target = found->second;
+                if (line[0] == "cal") entry.count = (total_count == 0) ? 0 : entry.count * site_count / total_count;
+            }
+            copy.push_back(std::move(entry));
+        }
+        if (has_return_jump) copy.push_back({ { return_label } });
+
+        for (size_t index = first; index < entry_of_pc[f.entry]; index++) inlined_entries.insert(entries[index].line[0]);
+        entries.erase(entries.begin() + site_index);
+        entries.insert(entries.begin() + site_index, copy.begin(), copy.end());
+        report.inlined_calls++;
+    }
+
+    //cal .f followed by ret, directly or through jumps
+    void convert_tail_calls() {
+        if (!analyze()) return;
+        size_t size = entry_of_pc.size();
+        for (size_t pc = 0; pc < size; pc++) {
+            if (flow_of_pc[pc] != flow::CALL) continue;
+            size_t next = pc + 1;
+            for (int hops = 0; next < size && flow_of_pc[next] == flow::JUMP && hops < 16; hops++) next = target_of_pc[next];
+            if (next >= size || flow_of_pc[next] != flow::RETURN) continue;
+            entries[entry_of_pc[pc]].line[0] = "jmp";
+            report.tail_calls++;
+        }
+    }
+
+    //the bodies of inlined functions that nothing reaches anymore and no other line refers to
+    void remove_dead_functions() {
+        if (!analyze()) return;
+        size_t size = entry_of_pc.size();
+        std::vector<bool> reached = reach(0, true);
+
+        std::vector<bool> is_removed(entries.size(), false);
+        std::unordered_set<size_t> removed_entries;
+        for (const std::string& label : inlined_entries) {
+            auto found = label_pc.find(label);
+            if (found == label_pc.end() || found->second >= size || reached[found->second]) continue;
+            size_t entry = found->second;
+            if (removed_entries.contains(entry)) continue;
+            std::vector<bool> body = reach(entry, false);
+            size_t last = entry;
+            for (size_t pc = entry; pc < size && body[pc]; pc++) last = pc;
+            if ((size_t)std::ranges::count(body, true) != last - entry + 1 || falls_off(body)) continue;
+            if (std::any_of(reached.begin() + entry, reached.begin() + last + 1, [](bool is_reached) { return is_reached; })) continue;
+
+            size_t first = entry_of_pc[entry];
+            while (first > 0 && is_label(entries[first - 1].line)) first--;
+            std::unordered_set<std::string> body_labels;
+            for (size_t index = first; index <= entry_of_pc[last]; index++) {
+                if (is_label(entries[index].line)) body_labels.insert(entries[index].line[0]);
+            }
+            bool is_referenced = false;
+            for (size_t index = 0; index < entries.size(); index++) {
+                if ((index >= first && index <= entry_of_pc[last]) || !is_instruction(entries[index].line)) continue;
+                const inline_line& line = entries[index].line;
+                if (std::any_of(line.begin() + 1, line.end(), [&](const std::string& operand) { return body_labels.contains(operand); })) is_referenced = true;
+            }
+            if (is_referenced) continue;
+
+            for (size_t index = first; index <= entry_of_pc[last]; index++) is_removed[index] = true;
+            removed_entries.insert(entry);
+            report.removed_functions++;
+        }
+        size_t index = 0;
+        std::erase_if(entries, [&](const inline_entry&) { return is_removed[index++]; });
+    }
+};
+
+//Inlines calls and converts tail calls of the lines, see above. False when the call depth is not within the budget.
+static bool inline_calls(std::vector<inline_line>& lines, inline_report& report, const inline_options& options = {}) {
+    report = {};
+    inline_program program(lines, report, options);
+    program.run(lines);
+    return report.is_within_budget();
+}
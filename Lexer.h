@@ -1,239 +1,403 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <filesystem>
 
+#include "Token.h"
 #include "numeric_parsing.h"
 
-enum class TOKEN_TYPE {
-    KEYWORD, OPERATOR, LITERAL, IDENTIFIER
-};
+void debug_print_tokens(const std::vector<TOKEN>& tokens, const string_pool& strings) {
+    std::cout << "[";
+    for (const TOKEN& token : tokens) std::cout << token_type_to_str(token.type) << " " << strings.get(token.id) << ", ";
+    std::cout << "]\n";
+}
 
-struct TOKEN {
-    std::string value;
-    TOKEN_TYPE type;
+//a #define is kept as the tokens of its value, they replace the name wherever it is used
+using PREPROCESSOR_DEFINES = std::unordered_map<str_id, std::vector<TOKEN>>;
 
-    TOKEN(std::string value, TOKEN_TYPE type) :
-        value(value), type(type)
-    {
-    }
+enum class DIRECTIVE { NONE, INCLUDE, DEFINE, UNDEF, IFDEF, IFNDEF, ELSE, ENDIF };
+
+//consecutive lines of code, or one preprocessor directive
+struct LEXED_CHUNK {
+    DIRECTIVE directive = DIRECTIVE::NONE;
+    std::string name;           //the file of an include, the name of a define, undef, ifdef or ifndef
+    str_id name_id = NO_STR;    //the interned name of a define, undef, ifdef or ifndef
+    std::vector<TOKEN> tokens;  //the code, or the value of a define
+    SOURCE_LOCATION location;
 };
 
-std::string token_type_to_str(TOKEN_TYPE type) {
-    switch (type)
-    {
-    case TOKEN_TYPE::KEYWORD: return "KEYWORD";
-    case TOKEN_TYPE::OPERATOR: return "OPERATOR";
-    case TOKEN_TYPE::LITERAL: return "LITERAL";
-    case TOKEN_TYPE::IDENTIFIER: return "IDENTIFIER";
-    default: return "UNKNOWN_TOKEN_TYPE";
-    }
+//a C file lexed without the defines, they are applied every time the file is included.
+//A file wrapped in #ifndef X #define X ... #endif has the include guard X.
+//The ids of its tokens and names are ids in strings, the file is shared by all threads and never changes once lexed.
+struct LEXED_FILE {
+    std::string directory;
+    string_pool strings;
+    std::vector<LEXED_CHUNK> chunks;
+    str_id include_guard = NO_STR;
+    bool pragma_once = false;
+};
+
+static constexpr size_t MAX_C_INCLUDE_DEPTH = 64;
+
+static bool is_c_operator_char(char c) {
+    return std::string_view("+-*/%=><!&|^~,.()[]{};").find(c) != std::string_view::npos;
 }
 
-void debug_print_tokens(const std::vector<TOKEN>& tokens) {
-    std::cout << "[";
-    for (const TOKEN& token : tokens) std::cout << token_type_to_str(token.type) << " " << token.value << ", ";
-    std::cout << "]\n";
+static bool is_c_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
 }
 
-void tokenize(const std::string& filename, std::vector<TOKEN>& tokens_vec) {
-    //removal of comments
-    //expansion of macros
-    //expansion of included files
-
-    std::ifstream source_file(filename);
-    std::string source_code;
-    char c;
-    while (source_file.get(c)) source_code += c;
-
-    std::unordered_map<std::string, std::string> preprocessor_defines = { {"true","1"},{"false","0"} };
-
-    //Evaluate all #includes and save all defines
-    for (size_t index = 0; index < source_code.length(); index++) {
-        if (source_code[index] == '#') {
-            //preprocessor macros
-            std::string macro_type;
-            while (source_code[index] != ' ') {
-                macro_type += source_code[index];
-                index++;
-            }
-            if (macro_type == "#include") {
-                size_t start_index = index - macro_type.length();
-                std::string include_filename;
-                index++;
-                while (source_code[index] != '\n' && index < source_code.length()) {
-                    include_filename += source_code[index];
-                    index++;
-                }
-                std::string include_source_code;
-                std::ifstream include_file(include_filename.substr(1, include_filename.length() - 2));
-                char c;
-                while (include_file.get(c)) {
-                    include_source_code += c;
-                }
-                source_code = source_code.erase(start_index, index - start_index);
-                source_code.insert(start_index, include_source_code);
-                index = start_index - 1;
-            }
-            else if (macro_type == "#define") {
-                size_t start_index = index - macro_type.length();
-                std::string define_name;
-                index++;
-                while (source_code[index] != ' ') {
-                    define_name += source_code[index];
-                    index++;
-                }
-                index++;
-                std::string define_value;
-                while (source_code[index] != '\n' && index < source_code.length()) {
-                    define_value += source_code[index];
-                    index++;
-                }
-                index++;
-                preprocessor_defines[define_name] = define_value;
-                source_code = source_code.erase(start_index, index - start_index);
-                index = start_index - 1;
-            }
-            else if (macro_type == "#undef") {
-                std::string define_name;
-                index++;
-                while (source_code[index] != ' ') {
-                    define_name += source_code[index];
-                    index++;
-                }
-                index++;
-                preprocessor_defines[define_name] = "";
-            }
-        }
+//end of the number starting at index, 1.5e-3f is one word although . - and + are operators
+static size_t c_number_end(std::string_view line, size_t index) {
+    bool is_hex = line.substr(index, 2) == "0x" || line.substr(index, 2) == "0X";
+    size_t end = index;
+    while (end < line.size()) {
+        char c = line[end];
+        bool exponent_sign = (c == '-' || c == '+') && !is_hex && (line[end - 1] == 'e' || line[end - 1] == 'E');
+        if (!(std::isalnum((unsigned char)c) || c == '_' || c == '.' || exponent_sign)) break;
+        end++;
     }
+    return end;
+}
 
-    //Remove all comments and extra spacing
-    std::string source_code_no_comments;
-    for (size_t index = 0; index < source_code.length(); index++) {
-        if (source_code[index] == '/' && source_code[index + 1] == '/') {
-            //comment, skip to newline char
-            while (source_code[index] != '\n' && index < source_code.length()) index++;
-            index--;
-        }
-        else if (source_code[index] == '"') {
-            //string, skip to end of string
-            source_code_no_comments += source_code[index];
+static void append_word(std::string_view word, SOURCE_LOCATION location, string_pool& strings, std::vector<TOKEN>& tokens) {
+    C_TOKEN kind = c_token_kind(word);
+    if (kind != C_TOKEN::NONE) {
+        tokens.emplace_back(strings.intern(word), TOKEN_TYPE::KEYWORD, kind, location);
+    }
+    else if (word.size() >= 2 && word.starts_with('"') && word.ends_with('"')) {
+        tokens.emplace_back(strings.intern(word), TOKEN_TYPE::LITERAL, kind, location);
+    }
+    else if (numeric_literal literal = scan_numeric_literal(word); literal.is_numeric()) {
+        if (literal.overflow)
+            throw std::runtime_error(location.str() + " : the numeric literal " + std::string(word) + " is out of range");
+        tokens.emplace_back(strings.intern(word), TOKEN_TYPE::LITERAL, kind, location);
+    }
+    else {
+        tokens.emplace_back(strings.intern(word), TOKEN_TYPE::IDENTIFIER, kind, location);
+    }
+}
+
+//tokens of one line without preprocessor directives, location is the first character of the line
+static void lex_line(std::string_view line, SOURCE_LOCATION location, string_pool& strings, std::vector<TOKEN>& tokens) {
+    size_t first_column = location.column;
+    size_t index = 0;
+    while (index < line.size()) {
+        char c = line[index];
+        location.column = (uint16_t)(first_column + index);
+
+        if (is_c_space(c)) {
             index++;
-            while (true) {
-                if (source_code[index] == '"' && source_code[index - 1] != '\\') {
-                    break;
-                }
-                source_code_no_comments += source_code[index];
-                index++;
-            }
-            source_code_no_comments += source_code[index];
         }
-        else if (source_code[index] == ' ' || source_code[index] == '\t') {
-            //extra spaces or tabs
-            source_code_no_comments += ' ';
-            while (source_code[index] == ' ' || source_code[index] == '\t') index++;
-            index--;
+        else if (c == '/' && index + 1 < line.size() && line[index + 1] == '/') {
+            //comment, skip the rest of the line
+            break;
+        }
+        else if (c == '"') {
+            //string up to the next unescaped "
+            size_t end = index + 1;
+            while (end < line.size() && !(line[end] == '"' && line[end - 1] != '\\')) end++;
+            end = std::min(end + 1, line.size());
+            append_word(line.substr(index, end - index), location, strings, tokens);
+            index = end;
+        }
+        else if (is_decimal_digit(c) || (c == '.' && index + 1 < line.size() && is_decimal_digit(line[index + 1]))) {
+            size_t end = c_number_end(line, index);
+            append_word(line.substr(index, end - index), location, strings, tokens);
+            index = end;
+        }
+        else if (is_c_operator_char(c)) {
+            //the operator characters are all operators on their own
+            C_TOKEN kind = (index + 1 < line.size()) ? c_token_kind(line.substr(index, 2)) : C_TOKEN::NONE;
+            size_t length = (kind == C_TOKEN::NONE) ? 1 : 2;
+            if (length == 1) kind = c_token_kind(line.substr(index, 1));
+            tokens.emplace_back(strings.intern(line.substr(index, length)), TOKEN_TYPE::OPERATOR, kind, location);
+            index += length;
         }
         else {
-            source_code_no_comments += source_code[index];
+            size_t end = index;
+            while (end < line.size() && !is_c_space(line[end]) && !is_c_operator_char(line[end]) && line[end] != '"') end++;
+            append_word(line.substr(index, end - index), location, strings, tokens);
+            index = end;
         }
     }
-    source_code = source_code_no_comments;
+}
 
-    //Remove all blank lines, leading space and trailing space
-    std::string source_code_no_space;
-    for (size_t index = 0; index < source_code.length(); index++) {
-        //get line
-        std::string line;
-        while (source_code[index] != '\n' && index < source_code.length()) {
-            line += source_code[index];
-            index++;
-        }
-        if (line != "") {
-            //remove all leading and trailing space
-            size_t start_index = 0;
-            size_t end_index = line.length() - 1;
-            while (line[start_index] == ' ' || line[start_index] == '\t') start_index++;
-            while (end_index > 0 && (line[end_index] == ' ' || line[end_index] == '\t')) end_index--;
-            source_code_no_space += line.substr(start_index, end_index - start_index + 1);
-        }
+static std::string_view next_directive_word(std::string_view& text) {
+    size_t start = 0;
+    while (start < text.size() && is_c_space(text[start])) start++;
+    size_t end = start;
+    while (end < text.size() && !is_c_space(text[end])) end++;
+    std::string_view word = text.substr(start, end - start);
+    text.remove_prefix(end);
+    return word;
+}
+
+//#include "file", #define NAME value, #undef NAME, #ifdef NAME, #ifndef NAME, #else, #endif and #pragma once.
+//directive is the line after the #, other directives are skipped.
+static void lex_directive(std::string_view directive, SOURCE_LOCATION location, LEXED_FILE& file) {
+    std::string_view rest = directive;
+    std::string_view keyword = next_directive_word(rest);
+
+    LEXED_CHUNK chunk;
+    chunk.location = location;
+    if (keyword == "include") {
+        size_t open_quote = rest.find_first_of("\"<");
+        size_t close_quote = (open_quote == std::string_view::npos) ? open_quote : rest.find_first_of("\">", open_quote + 1);
+        if (close_quote == std::string_view::npos)
+            throw std::runtime_error(location.str() + " : #include expects a quoted file name");
+        chunk.directive = DIRECTIVE::INCLUDE;
+        chunk.name = rest.substr(open_quote + 1, close_quote - open_quote - 1);
+    }
+    else if (keyword == "define") {
+        chunk.directive = DIRECTIVE::DEFINE;
+        chunk.name = next_directive_word(rest);
+        SOURCE_LOCATION value_location = location;
+        value_location.column += (uint16_t)(rest.data() - directive.data() + 1);
+        lex_line(rest, value_location, file.strings, chunk.tokens);
+    }
+    else if (keyword == "undef" || keyword == "ifdef" || keyword == "ifndef") {
+        chunk.directive = (keyword == "undef") ? DIRECTIVE::UNDEF : (keyword == "ifdef") ? DIRECTIVE::IFDEF : DIRECTIVE::IFNDEF;
+        chunk.name = next_directive_word(rest);
+    }
+    else if (keyword == "else" || keyword == "endif") {
+        chunk.directive = (keyword == "else") ? DIRECTIVE::ELSE : DIRECTIVE::ENDIF;
+    }
+    else if (keyword == "if" || keyword == "elif") {
+        throw std::runtime_error(location.str() + " : #" + std::string(keyword) + " is not supported, use #ifdef or #ifndef");
+    }
+    else if (keyword == "pragma" && next_directive_word(rest) == "once") {
+        file.pragma_once = true;
     }
-    source_code = source_code_no_space;
 
-    //Tokenize
-    std::unordered_set<std::string> keywords = { "break","bool","char","continue","do","else","float","for","goto","if","int","long","return","short","signed","unsigned","void","while" };
-    std::unordered_set<std::string> operators = { "+","-","*","/","%","++","--","=","+=","-=","*=","/=","%=","==",">","<","!=",">=","<=","&&","||","!","&","|","^","~","<<",">>",",",".","(",")","{","}","[","]",";" };
+    if (chunk.directive != DIRECTIVE::NONE && chunk.name.empty() && chunk.directive != DIRECTIVE::ELSE && chunk.directive != DIRECTIVE::ENDIF)
+        throw std::runtime_error(location.str() + " : #" + std::string(keyword) + " without a name");
+    if (chunk.directive == DIRECTIVE::DEFINE || chunk.directive == DIRECTIVE::UNDEF || chunk.directive == DIRECTIVE::IFDEF || chunk.directive == DIRECTIVE::IFNDEF)
+        chunk.name_id = file.strings.intern(chunk.name);
+    if (chunk.directive != DIRECTIVE::NONE) file.chunks.push_back(std::move(chunk));
+}
 
-    std::string token_value;
-    std::vector<std::string> tokens;
+//#ifndef X and #define X first, and the #endif of the #ifndef last
+static str_id find_include_guard(const std::vector<LEXED_CHUNK>& chunks) {
+    if (chunks.size() < 3 || chunks[0].directive != DIRECTIVE::IFNDEF || chunks[1].directive != DIRECTIVE::DEFINE || chunks[1].name_id != chunks[0].name_id)
+        return NO_STR;
 
-    for (size_t index = 0; index < source_code.length(); index++) {
-        if (source_code[index] == ' ') {
-            //save current token
-            if (token_value != "") {
-                tokens.push_back(token_value);
-                token_value = "";
-            }
-        }
-        else if (operators.contains(std::string(1, source_code[index]))) {
-            if (operators.contains(source_code.substr(index, 2))) {
-                //double char operator
-                if (token_value != "") {
-                    tokens.push_back(token_value);
-                    token_value = "";
-                }
-                tokens.push_back(source_code.substr(index, 2));
-                index++;
-            }
-            else {
-                //single char operator
-                if (token_value != "") {
-                    tokens.push_back(token_value);
-                    token_value = "";
-                }
-                tokens.push_back(std::string(1, source_code[index]));
-            }
-        }
-        else if (source_code[index] == '"') {
-            //get full string
-            token_value += source_code[index];
-            index++;
-            while (true) {
-                if (source_code[index] == '"' && source_code[index - 1] != '\\')
-                    break;
-                token_value += source_code[index];
-                index++;
-            }
-            token_value += source_code[index];
-            if (token_value != "") {
-                tokens.push_back(token_value);
-                token_value = "";
-            }
+    int depth = 0;
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (chunks[index].directive == DIRECTIVE::IFDEF || chunks[index].directive == DIRECTIVE::IFNDEF) depth++;
+        else if (chunks[index].directive == DIRECTIVE::ELSE && depth == 1) return NO_STR;
+        else if (chunks[index].directive == DIRECTIVE::ENDIF && --depth == 0) return (index == chunks.size() - 1) ? chunks[0].name_id : NO_STR;
+    }
+    return NO_STR;
+}
+
+static std::shared_ptr<const LEXED_FILE> lex_file(const std::string& path) {
+    std::ifstream source_file(path, std::ios::binary);
+    if (!source_file.is_open())
+        throw std::runtime_error("Unable to open C source file : " + path);
+
+    std::stringstream source_stream;
+    source_stream << source_file.rdbuf();
+    std::string source = source_stream.str();
+
+    std::shared_ptr<LEXED_FILE> file = std::make_shared<LEXED_FILE>();
+    size_t slash_index = path.find_last_of("/\\");
+    file->directory = (slash_index == std::string::npos) ? "" : path.substr(0, slash_index + 1);
+
+    SOURCE_LOCATION location;
+    location.file = source_file_index(path);
+
+    size_t index = 0;
+    for (location.line = 1; index < source.size(); location.line++) {
+        size_t line_end = source.find('\n', index);
+        if (line_end == std::string::npos) line_end = source.size();
+        std::string_view line(source.data() + index, line_end - index);
+        index = line_end + 1;
+
+        location.column = 1;
+        size_t first_char = line.find_first_not_of(" \t");
+        if (first_char != std::string_view::npos && line[first_char] == '#') {
+            location.column += (uint16_t)first_char;
+            lex_directive(line.substr(first_char + 1), location, *file);
+            continue;
         }
-        else {
-            //just add char to current token
-            token_value += source_code[index];
+
+        //consecutive lines of code share one chunk
+        if (file->chunks.empty() || file->chunks.back().directive != DIRECTIVE::NONE) {
+            file->chunks.emplace_back();
+            file->chunks.back().location = location;
         }
+        lex_line(line, location, file->strings, file->chunks.back().tokens);
     }
 
-    //set the tokenizer types
-    tokens_vec.reserve(tokens.size());
+    file->include_guard = find_include_guard(file->chunks);
+    return file;
+}
 
-    for (std::string& token : tokens) {
-        if (keywords.contains(token)) {
-            tokens_vec.emplace_back(token, TOKEN_TYPE::KEYWORD);
-        }
-        else if (operators.contains(token)) {
-            tokens_vec.emplace_back(token, TOKEN_TYPE::OPERATOR);
+struct CACHED_LEXED_FILE {
+    std::filesystem::file_time_type last_write_time;
+    std::shared_ptr<const LEXED_FILE> file;
+};
+
+//lexed files keyed by their canonical path, a file is lexed again once it changes
+static std::unordered_map<std::string, CACHED_LEXED_FILE>& lexed_file_cache() {
+    static std::unordered_map<std::string, CACHED_LEXED_FILE> cache;
+    return cache;
+}
+
+static std::shared_ptr<const LEXED_FILE> cached_lex_file(const std::string& path) {
+    std::error_code error;
+    std::string canonical_path = std::filesystem::canonical(path, error).string();
+    std::filesystem::file_time_type last_write_time = std::filesystem::last_write_time(path, error);
+    if (error)
+        throw std::runtime_error("Unable to open C source file : " + path);
+
+    {
+        std::lock_guard<std::mutex> lock(source_cache_mutex());
+        auto cached = lexed_file_cache().find(canonical_path);
+        if (cached != lexed_file_cache().end() && cached->second.last_write_time == last_write_time) return cached->second.file;
+    }
+
+    //lexed without the lock, two threads might both lex a new file and the last one is kept
+    std::shared_ptr<const LEXED_FILE> file = lex_file(path);
+    std::lock_guard<std::mutex> lock(source_cache_mutex());
+    lexed_file_cache()[canonical_path] = { last_write_time, file };
+    return file;
+}
+
+//maps the ids of the string pool of a lexed file to ids in the pool the tokens of a tokenize call are interned in,
+//every string of the file is interned at most once per call
+struct STRING_REMAP {
+    const string_pool* from = nullptr;
+    string_pool* to = nullptr;
+    std::vector<str_id> ids;
+
+    str_id operator()(str_id id) {
+        if (ids.empty()) ids.assign(from->size(), NO_STR);
+        if (ids[id] == NO_STR) ids[id] = to->intern(from->get(id));
+        return ids[id];
+    }
+};
+
+static void append_expanded(const std::vector<TOKEN>& source, STRING_REMAP& remap, const PREPROCESSOR_DEFINES& defines, std::vector<TOKEN>& tokens) {
+    for (const TOKEN& source_token : source) {
+        TOKEN token = source_token;
+        token.id = remap(source_token.id);
+        auto define = (token.type == TOKEN_TYPE::IDENTIFIER) ? defines.find(token.id) : defines.end();
+        if (define == defines.end()) {
+            tokens.push_back(token);
+            continue;
         }
-        else if (preprocessor_defines.contains(token)) {
-            token = preprocessor_defines[token];
-            tokens_vec.emplace_back(token, TOKEN_TYPE::LITERAL);
+        for (const TOKEN& value_token : define->second) {
+            tokens.push_back(value_token);
+            tokens.back().location = token.location;
         }
-        else if (is_numeric(token) || (token.starts_with('"') && token.ends_with('"'))) {
-            tokens_vec.emplace_back(token, TOKEN_TYPE::LITERAL);
+    }
+}
+
+//a file on the include stack and the next chunk to use
+struct INCLUDE_FRAME {
+    std::shared_ptr<const LEXED_FILE> file;
+    STRING_REMAP* remap = nullptr;
+    size_t chunk = 0;
+    size_t condition_depth = 0;
+};
+
+//The files are lexed once and kept in a cache shared by all threads. An include pushes the included file onto an include
+//stack and the defines are replaced token by token. Including a file again after its #pragma once, or with its include
+//guard defined, is only a lookup. Every token knows the file, line and column it came from.
+//The token texts are interned in strings, which belongs to the caller (e.g. the PARSE_TREE), so tokenize calls on
+//different threads share no strings.
+void tokenize(const std::string& filename, std::vector<TOKEN>& tokens_vec, string_pool& strings) {
+    PREPROCESSOR_DEFINES preprocessor_defines = {
+        { strings.intern("true"), { TOKEN(strings.intern("1"), TOKEN_TYPE::LITERAL) } },
+        { strings.intern("false"), { TOKEN(strings.intern("0"), TOKEN_TYPE::LITERAL) } },
+    };
+
+    //included files by the path they were included with, to skip the file system when they are included again
+    std::unordered_map<std::string, std::shared_ptr<const LEXED_FILE>> included_files;
+    std::unordered_set<const LEXED_FILE*> pragma_once_files;
+    std::unordered_map<const LEXED_FILE*, STRING_REMAP> remaps;
+    auto remap_of = [&](const LEXED_FILE& file) {
+        STRING_REMAP& remap = remaps[&file];
+        remap.from = &file.strings;
+        remap.to = &strings;
+        return &remap;
+    };
+
+    //for every open #ifdef or #ifndef, whether its lines are used
+    std::vector<bool> conditions;
+
+    std::vector<INCLUDE_FRAME> include_stack;
+    std::shared_ptr<const LEXED_FILE> main_file = cached_lex_file(filename);
+    include_stack.push_back({ main_file, remap_of(*main_file) });
+
+    while (!include_stack.empty()) {
+        INCLUDE_FRAME& frame = include_stack.back();
+        if (frame.chunk == frame.file->chunks.size()) {
+            if (conditions.size() != frame.condition_depth)
+                throw std::runtime_error(frame.file->chunks.back().location.str() + " : missing #endif at the end of the file");
+            include_stack.pop_back();
+            continue;
         }
-        else {
-            tokens_vec.emplace_back(token, TOKEN_TYPE::IDENTIFIER);
+
+        const LEXED_CHUNK& chunk = frame.file->chunks[frame.chunk++];
+        bool active = conditions.empty() || conditions.back();
+        switch (chunk.directive) {
+        case DIRECTIVE::IFDEF:
+        case DIRECTIVE::IFNDEF:
+            conditions.push_back(active && preprocessor_defines.contains((*frame.remap)(chunk.name_id)) == (chunk.directive == DIRECTIVE::IFDEF));
+            break;
+        case DIRECTIVE::ELSE:
+        case DIRECTIVE::ENDIF: {
+            if (conditions.size() == frame.condition_depth)
+                throw std::runtime_error(chunk.location.str() + " : #else or #endif without #ifdef");
+            bool parent_active = conditions.size() < 2 || conditions[conditions.size() - 2];
+            if (chunk.directive == DIRECTIVE::ELSE) conditions.back() = parent_active && !conditions.back();
+            else conditions.pop_back();
+        }   break;
+        default:
+            if (!active) break;
+
+            if (chunk.directive == DIRECTIVE::NONE) {
+                append_expanded(chunk.tokens, *frame.remap, preprocessor_defines, tokens_vec);
+            }
+            else if (chunk.directive == DIRECTIVE::DEFINE) {
+                //defines used in the value are expanded right away
+                std::vector<TOKEN> value_tokens;
+                append_expanded(chunk.tokens, *frame.remap, preprocessor_defines, value_tokens);
+                preprocessor_defines[(*frame.remap)(chunk.name_id)] = std::move(value_tokens);
+            }
+            else if (chunk.directive == DIRECTIVE::UNDEF) {
+                preprocessor_defines.erase((*frame.remap)(chunk.name_id));
+            }
+            else if (chunk.directive == DIRECTIVE::INCLUDE) {
+                if (include_stack.size() >= MAX_C_INCLUDE_DEPTH)
+                    throw std::runtime_error(chunk.location.str() + " : #include nested too deeply (recursive include?)");
+
+                std::string path = frame.file->directory + chunk.name;
+                std::shared_ptr<const LEXED_FILE>& included = included_files[path];
+                if (!included) included = cached_lex_file(path);
+
+                STRING_REMAP* included_remap = remap_of(*included);
+                if (included->pragma_once && !pragma_once_files.insert(included.get()).second) break;
+                if (included->include_guard != NO_STR && preprocessor_defines.contains((*included_remap)(included->include_guard))) break;
+                include_stack.push_back({ included, included_remap, 0, conditions.size() });
+            }
+            break;
         }
     }
-
 }
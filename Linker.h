@@ -0,0 +1,495 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "Assembler.h"
+
+//
+//  Relocatable objects
+//
+//  assemble_object() assembles a single module as if it started at address 0. Every operand that names a
+//  label (JMP/CAL address, BRH address, LDI immediate) is left as 0 and recorded as a relocation, so the
+//  linker can move the code anywhere in the 1024 word instruction memory.
+//
+//  Labels are local to their module unless exported with
+//      export .name
+//  A reference to a label that is not defined in the module is resolved against the exports of the other
+//  modules at link time. Numeric jump addresses are absolute and are not relocated.
+//
+//  The code of a module is split into sections at every label that cannot be reached by falling through,
+//  i.e. the previous instruction is a JMP, RET or HLT. Sections are the unit of dead code stripping and
+//  layout, the first section of the first object is the program entry and is always placed at address 0.
+//  The last section of a module that does not end in a JMP, RET or HLT falls through into the first section
+//  of the next module, the two are kept alive and placed together.
+//
+
+enum class relocation_t : uint8_t { ADDR10, IMM8 };
+
+struct object_relocation {
+    uint16_t offset = 0; //instruction index within the object
+    relocation_t type = relocation_t::ADDR10;
+    std::string symbol;
+};
+
+struct object_symbol {
+    std::string name;
+    uint16_t offset = 0;
+    bool is_exported = false;
+};
+
+struct object_section {
+    std::string name; //label at the start of the section, the module name for the first section
+    uint16_t start = 0;
+    uint16_t size = 0;
+};
+
+struct object_file {
+    std::string module_name;
+    std::vector<uint16_t> code;
+    std::vector<object_symbol> symbols;
+    std::vector<object_relocation> relocations;
+    std::vector<object_section> sections;
+    std::vector<std::string> includes; //files pulled in with include, checked by load_or_assemble_object
+};
+
+static object_file assemble_object(const assembly_lines& source_lines, const std::string& module_name) {
+    object_file object;
+    object.module_name = module_name;
+
+    //export directives are collected before the lines are parsed
+    std::unordered_set<std::string> exports;
+    assembly_lines lines;
+    lines.reserve(source_lines.size());
+    for (const std::vector<std::string>& tokens : source_lines) {
+        if (tokens[0] == "export") {
+            exports.insert(tokens.begin() + 1, tokens.end());
+        }
+        else {
+            lines.push_back(tokens);
+        }
+    }
+
+    assembly_program program = parse_assembly(lines);
+
+    //labels are encoded as 0 and patched by the linker
+    std::unordered_map<std::string, uint16_t> local_symbols = program.symbols;
+    for (const auto& [label, pc] : program.labels) local_symbols.erase(label);
+
+    for (const auto& [label, pc] : program.labels) {
+        object.symbols.push_back({ label, pc, exports.contains(label) });
+    }
+    std::sort(object.symbols.begin(), object.symbols.end(), [](const object_symbol& a, const object_symbol& b) {
+        return a.offset < b.offset || (a.offset == b.offset && a.name < b.name);
+    });
+
+    object.code.reserve(program.instructions.size());
+    for (uint16_t pc = 0; pc < program.instructions.size(); pc++) {
+        const std::vector<std::string>& instruction = program.instructions[pc];
+        uint8_t opcode = instruction_opcode(instruction);
+
+        //which operand holds an address or an immediate that may name a label
+        size_t operand_index = 0;
+        relocation_t type = relocation_t::ADDR10;
+        if (opcode == 10 || opcode == 12) operand_index = 1;
+        else if (opcode == 11) operand_index = 2;
+        else if (opcode == 8) {
+            operand_index = 2;
+            type = relocation_t::IMM8;
+        }
+
+        if (operand_index != 0 && operand_index < instruction.size()) {
+            const std::string& operand = instruction[operand_index];
+            if (!is_numeric_operand(operand) && !local_symbols.contains(operand)) {
+                object.relocations.push_back({ pc, type, operand });
+            }
+        }
+
+        object.code.push_back(encode_instruction(instruction, local_symbols));
+    }
+
+    //split into sections at labels that are not fallen into
+    for (uint16_t pc = 0; pc < object.code.size(); pc++) {
+        bool starts_section = (pc == 0);
+        if (!starts_section) {
+            uint8_t previous_opcode = object.code[pc - 1] >> 12;
+            starts_section = (previous_opcode == 1 || previous_opcode == 10 || previous_opcode == 13) && program.jmp_location_names.contains(pc);
+        }
+        if (starts_section) {
+            std::string name = (pc == 0) ? module_name : program.jmp_location_names[pc];
+            object.sections.push_back({ name, pc, 0 });
+        }
+        object.sections.back().size++;
+    }
+
+    return object;
+}
+
+static object_file assemble_object(const std::string& filename) {
+    assembly_preprocessor preprocessor;
+    std::string module_name = std::filesystem::path(filename).filename().string();
+    object_file object = assemble_object(preprocessor.preprocess_file(filename + ".as"), module_name);
+    object.includes.assign(preprocessor.files().begin() + 1, preprocessor.files().end());
+    return object;
+}
+
+//
+//  Object file serialization (.obj)
+//
+//  "BPUO" version
+//  module_name
+//  code_size      code words
+//  symbol_count   { name offset is_exported }
+//  reloc_count    { offset type symbol }
+//  section_count  { name start size }
+//  include_count  { path }                 (version 2)
+//
+//  Strings are stored as a 16 bit length followed by the characters, all integers are little endian.
+//  Version 1 objects are still read, without includes.
+//
+
+static constexpr uint16_t OBJECT_FILE_VERSION = 2;
+
+static void write_u16(std::ostream& out, uint16_t value) {
+    char bytes[2] = { (char)(value & 0xFF), (char)(value >> 8) };
+    out.write(bytes, 2);
+}
+
+static uint16_t read_u16(std::istream& in) {
+    unsigned char bytes[2] = {};
+    in.read((char*)bytes, 2);
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static void write_str(std::ostream& out, const std::string& str) {
+    write_u16(out, (uint16_t)str.size());
+    out.write(str.data(), str.size());
+}
+
+static std::string read_str(std::istream& in) {
+    std::string str(read_u16(in), '\0');
+    in.read(str.data(), str.size());
+    return str;
+}
+
+static void write_object(const std::string& filename, const object_file& object) {
+    std::ofstream out(filename + ".obj", std::ios::binary);
+    out.write("BPUO", 4);
+    write_u16(out, OBJECT_FILE_VERSION);
+    write_str(out, object.module_name);
+
+    write_u16(out, (uint16_t)object.code.size());
+    for (uint16_t word : object.code) write_u16(out, word);
+
+    write_u16(out, (uint16_t)object.symbols.size());
+    for (const object_symbol& symbol : object.symbols) {
+        write_str(out, symbol.name);
+        write_u16(out, symbol.offset);
+        write_u16(out, symbol.is_exported);
+    }
+
+    write_u16(out, (uint16_t)object.relocations.size());
+    for (const object_relocation& relocation : object.relocations) {
+        write_u16(out, relocation.offset);
+        write_u16(out, (uint16_t)relocation.type);
+        write_str(out, relocation.symbol);
+    }
+
+    write_u16(out, (uint16_t)object.sections.size());
+    for (const object_section& section : object.sections) {
+        write_str(out, section.name);
+        write_u16(out, section.start);
+        write_u16(out, section.size);
+    }
+
+    write_u16(out, (uint16_t)object.includes.size());
+    for (const std::string& include : object.includes) write_str(out, include);
+}
+
+static object_file read_object(const std::string& filename) {
+    std::ifstream in(filename + ".obj", std::ios::binary);
+    char magic[4] = {};
+    in.read(magic, 4);
+    uint16_t version = read_u16(in);
+    if (!in || std::string(magic, 4) != "BPUO" || version < 1 || version > OBJECT_FILE_VERSION)
+        throw std::runtime_error("Not a BatPU object file : " + filename + ".obj");
+
+    object_file object;
+    object.module_name = read_str(in);
+
+    object.code.resize(read_u16(in));
+    for (uint16_t& word : object.code) word = read_u16(in);
+
+    object.symbols.resize(read_u16(in));
+    for (object_symbol& symbol : object.symbols) {
+        symbol.name = read_str(in);
+        symbol.offset = read_u16(in);
+        symbol.is_exported = read_u16(in) != 0;
+    }
+
+    object.relocations.resize(read_u16(in));
+    for (object_relocation& relocation : object.relocations) {
+        relocation.offset = read_u16(in);
+        relocation.type = (relocation_t)read_u16(in);
+        relocation.symbol = read_str(in);
+    }
+
+    object.sections.resize(read_u16(in));
+    for (object_section& section : object.sections) {
+        section.name = read_str(in);
+        section.start = read_u16(in);
+        section.size = read_u16(in);
+    }
+
+    if (version >= 2) {
+        object.includes.resize(read_u16(in));
+        for (std::string& include : object.includes) include = read_str(in);
+    }
+
+    if (!in)
+        throw std::runtime_error("Truncated BatPU object file : " + filename + ".obj");
+    return object;
+}
+
+//
+//  Linking
+//
+
+struct link_options {
+    bool strip_dead_sections = true;
+    //section name -> execution count (e.g. from an emulator run), hotter sections are placed first
+    std::unordered_map<std::string, uint64_t> profile;
+};
+
+struct link_result {
+    std::vector<uint16_t> image; //used part of the 1024 word instruction memory
+    std::unordered_map<std::string, uint16_t> section_addresses;
+    size_t stripped_words = 0;
+};
+
+static link_result link_objects(const std::vector<object_file>& objects, const link_options& options = {}) {
+    if (objects.empty() || objects[0].code.empty())
+        throw std::runtime_error("Nothing to link");
+
+    struct section_ref {
+        size_t object_index;
+        size_t section_index;
+    };
+    struct symbol_ref {
+        size_t object_index;
+        uint16_t offset;
+    };
+
+    //global exports
+    std::unordered_map<std::string, symbol_ref> exports;
+    for (size_t object_index = 0; object_index < objects.size(); object_index++) {
+        for (const object_symbol& symbol : objects[object_index].symbols) {
+            if (!symbol.is_exported) continue;
+            if (exports.contains(symbol.name))
+                throw std::runtime_error("Symbol " + symbol.name + " is exported by both " + objects[exports[symbol.name].object_index].module_name + " and " + objects[object_index].module_name);
+            exports[symbol.name] = { object_index, symbol.offset };
+        }
+    }
+
+    //flatten the sections, section_ids[object][section] indexes into sections
+    std::vector<section_ref> sections;
+    std::vector<std::vector<size_t>> section_ids(objects.size());
+    for (size_t object_index = 0; object_index < objects.size(); object_index++) {
+        for (size_t section_index = 0; section_index < objects[object_index].sections.size(); section_index++) {
+            section_ids[object_index].push_back(sections.size());
+            sections.push_back({ object_index, section_index });
+        }
+    }
+
+    auto section_of = [&](size_t object_index, uint16_t offset) {
+        const std::vector<object_section>& object_sections = objects[object_index].sections;
+        size_t section_index = 0;
+        while (section_index + 1 < object_sections.size() && object_sections[section_index + 1].start <= offset) section_index++;
+        return section_ids[object_index][section_index];
+    };
+
+    //resolve every relocation to a target object and offset
+    struct resolved_relocation {
+        size_t object_index;
+        uint16_t offset;
+        relocation_t type;
+        symbol_ref target;
+        const std::string* symbol;
+    };
+    std::vector<resolved_relocation> relocations;
+    std::vector<std::vector<size_t>> section_references(sections.size());
+
+    for (size_t object_index = 0; object_index < objects.size(); object_index++) {
+        const object_file& object = objects[object_index];
+
+        std::unordered_map<std::string, uint16_t> local_symbols;
+        for (const object_symbol& symbol : object.symbols) local_symbols[symbol.name] = symbol.offset;
+
+        for (const object_relocation& relocation : object.relocations) {
+            symbol_ref target;
+            if (local_symbols.contains(relocation.symbol)) {
+                target = { object_index, local_symbols[relocation.symbol] };
+            }
+            else if (exports.contains(relocation.symbol)) {
+                target = exports[relocation.symbol];
+            }
+            else {
+                throw std::runtime_error("Undefined symbol " + relocation.symbol + " referenced in " + object.module_name);
+            }
+            relocations.push_back({ object_index, relocation.offset, relocation.type, target, &relocation.symbol });
+            section_references[section_of(object_index, relocation.offset)].push_back(section_of(target.object_index, target.offset));
+        }
+    }
+
+    //the last section of a module falls through into the next module unless it ends in a JMP, RET or HLT
+    std::vector<size_t> falls_into(sections.size(), SIZE_MAX);
+    for (size_t object_index = 0; object_index + 1 < objects.size(); object_index++) {
+        const object_file& object = objects[object_index];
+        if (object.code.empty() || objects[object_index + 1].sections.empty()) continue;
+        uint8_t last_opcode = object.code.back() >> 12;
+        if (last_opcode == 1 || last_opcode == 10 || last_opcode == 13) continue;
+        size_t section = section_ids[object_index].back();
+        falls_into[section] = section_ids[object_index + 1][0];
+        section_references[section].push_back(falls_into[section]);
+    }
+
+    //dead section stripping, everything reachable from the entry section stays
+    std::vector<bool> is_live(sections.size(), !options.strip_dead_sections);
+    std::vector<size_t> worklist = { 0 };
+    is_live[0] = true;
+    while (!worklist.empty()) {
+        size_t section = worklist.back();
+        worklist.pop_back();
+        for (size_t referenced : section_references[section]) {
+            if (!is_live[referenced]) {
+                is_live[referenced] = true;
+                worklist.push_back(referenced);
+            }
+        }
+    }
+
+    //layout, the entry stays at address 0 and the rest is ordered hottest first
+    auto section_info = [&](size_t section) -> const object_section& {
+        return objects[sections[section].object_index].sections[sections[section].section_index];
+    };
+    auto heat = [&](size_t section) -> uint64_t {
+        auto count = options.profile.find(section_info(section).name);
+        return (count == options.profile.end()) ? 0 : count->second;
+    };
+
+    //sections that fall through into each other are placed as one chain, ordered by its hottest section
+    std::vector<bool> is_fallen_into(sections.size(), false);
+    for (size_t section = 0; section < sections.size(); section++) {
+        if (is_live[section] && falls_into[section] != SIZE_MAX) is_fallen_into[falls_into[section]] = true;
+    }
+    auto chain_heat = [&](size_t section) {
+        uint64_t hottest = 0;
+        for (; section != SIZE_MAX; section = falls_into[section]) hottest = std::max(hottest, heat(section));
+        return hottest;
+    };
+
+    std::vector<size_t> chains;
+    for (size_t section = 1; section < sections.size(); section++) {
+        if (is_live[section] && !is_fallen_into[section]) chains.push_back(section);
+    }
+    std::stable_sort(chains.begin(), chains.end(), [&](size_t a, size_t b) { return chain_heat(a) > chain_heat(b); });
+    chains.insert(chains.begin(), 0);
+
+    std::vector<size_t> layout;
+    for (size_t chain : chains) {
+        for (size_t section = chain; section != SIZE_MAX; section = falls_into[section]) layout.push_back(section);
+    }
+
+    link_result result;
+    std::vector<uint16_t> section_base(sections.size(), 0);
+    uint16_t address = 0;
+    for (size_t section : layout) {
+        section_base[section] = address;
+        address += section_info(section).size;
+        if (address > 1024)
+            throw std::runtime_error("Linked program does not fit in the 1024 word instruction memory");
+    }
+    for (size_t section = 0; section < sections.size(); section++) {
+        if (!is_live[section]) result.stripped_words += section_info(section).size;
+    }
+
+    //copy the code
+    result.image.resize(address, 0);
+    for (size_t section : layout) {
+        const object_file& object = objects[sections[section].object_index];
+        const object_section& info = section_info(section);
+        std::copy(object.code.begin() + info.start, object.code.begin() + info.start + info.size, result.image.begin() + section_base[section]);
+        result.section_addresses[info.name] = section_base[section];
+    }
+
+    //apply the relocations
+    auto final_address = [&](size_t object_index, uint16_t offset) {
+        size_t section = section_of(object_index, offset);
+        return (uint16_t)(section_base[section] + offset - section_info(section).start);
+    };
+
+    for (const resolved_relocation& relocation : relocations) {
+        if (!is_live[section_of(relocation.object_index, relocation.offset)]) continue;
+
+        uint16_t& word = result.image[final_address(relocation.object_index, relocation.offset)];
+        uint16_t target_address = final_address(relocation.target.object_index, relocation.target.offset);
+        if (relocation.type == relocation_t::ADDR10) {
+            word = (word & 0xFC00) | (target_address & 0x03FF);
+        }
+        else {
+            if (target_address > 0xFF)
+                throw std::runtime_error("Address " + std::to_string(target_address) + " of " + *relocation.symbol + " does not fit in the 8 bit immediate of an LDI in " + objects[relocation.object_index].module_name);
+            word = (word & 0xFF00) | target_address;
+        }
+    }
+
+    return result;
+}
+
+//
+//  Incremental build - a module is only reassembled when its .as or one of the files it includes is newer than
+//  its .obj. A module shipped as a .obj without its .as is linked as it is.
+//
+
+static object_file load_or_assemble_object(const std::string& filename) {
+    std::filesystem::path source_path = filename + ".as";
+    std::filesystem::path object_path = filename + ".obj";
+
+    if (std::filesystem::exists(object_path)) {
+        if (!std::filesystem::exists(source_path))
+            return read_object(filename);
+
+        auto object_time = std::filesystem::last_write_time(object_path);
+        if (object_time >= std::filesystem::last_write_time(source_path)) {
+            object_file object = read_object(filename);
+            bool is_current = std::all_of(object.includes.begin(), object.includes.end(), [&](const std::string& include) {
+                return std::filesystem::exists(include) && std::filesystem::last_write_time(include) <= object_time;
+            });
+            if (is_current) return object;
+        }
+    }
+
+    object_file object = assemble_object(filename);
+    write_object(filename, object);
+    return object;
+}
+
+static void link(const std::vector<std::string>& module_filenames, const std::string& output_filename, const link_options& options = {}) {
+    std::vector<object_file> objects;
+    objects.reserve(module_filenames.size());
+    for (const std::string& filename : module_filenames) {
+        objects.push_back(load_or_assemble_object(filename));
+    }
+
+    link_result result = link_objects(objects, options);
+    write_machine_code(output_filename, result.image);
+
+    std::cout << "Linked " << objects.size() << " modules into " << result.image.size() << " words, stripped " << result.stripped_words << " unused words\n";
+}
@@ -2,6 +2,11 @@
 
 #include <string>
 #include <vector>
+#include <stdexcept>
+#include <span>
+#include <initializer_list>
+#include <utility>
+#include <cstdint>
 
 #include "Lexer.h"
 
@@ -60,65 +65,7 @@ struct TYPE {
     }
 };
 
-struct STMT;
-struct EXPR;
-struct ARG;
-struct PARSE_TREE;
-struct RETURN;
-struct ASSIGN;
-struct RE_ASSIGN;
-struct AUG_ASSIGN;
-struct FOR;
-struct WHILE;
-struct IF;
-struct BREAK;
-struct CONTINUE;
-struct CODE_BLOCK;
-
-bool try_parse_function_dec(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree);
-bool try_parse_function_def(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree);
-bool try_parse_assign      (const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree);
-bool try_parse_return      (const std::vector<TOKEN>& tokens, RETURN&     return_statement);
-bool try_parse_assign      (const std::vector<TOKEN>& tokens, ASSIGN&     assign_statement);
-bool try_parse_reassign    (const std::vector<TOKEN>& tokens, RE_ASSIGN&  reassign_statement);
-bool try_parse_augassign   (const std::vector<TOKEN>& tokens, AUG_ASSIGN& augassign_statement);
-bool try_parse_for         (const std::vector<TOKEN>& tokens, FOR&        for_statement);
-bool try_parse_while       (const std::vector<TOKEN>& tokens, WHILE&      while_statement);
-bool try_parse_if          (const std::vector<TOKEN>& tokens, IF&         if_statement);
-bool try_parse_break       (const std::vector<TOKEN>& tokens, BREAK&      break_statement);
-bool try_parse_continue    (const std::vector<TOKEN>& tokens, CONTINUE&   continue_statement);
-bool try_parse_code_block  (const std::vector<TOKEN>& tokens, CODE_BLOCK& code_block);
-
-
-// Tree Node Structs
-
-struct STMT{
-    virtual std::string str() const {
-        return "Statement()";
-    }
-};
-
-struct EXPR{
-    virtual std::string str() const {
-        return "Expression()";
-    }
-};
-
-struct ARG {
-    std::string name;
-    TYPE type;
-
-    ARG(std::string name, TYPE type) :
-        name(name), type(type)
-    {}
-
-    std::string str() const {
-        return "Arg(name = " + name + ", type = " + type.str() + ")";
-    }
-
-};
-
-enum class EXPR_CONTEXT { LOAD, STORE };
+enum class EXPR_CONTEXT : uint8_t { LOAD, STORE };
 
 static std::string expr_ctx_to_str(EXPR_CONTEXT expr_ctx) {
     switch (expr_ctx)
@@ -129,8 +76,9 @@ static std::string expr_ctx_to_str(EXPR_CONTEXT expr_ctx) {
     }
 }
 
-enum class OP { ADD, SUB, MUL, DIV, MOD, RSH, LSH, BIT_OR, BIT_AND, BIT_XOR,
-                AND, OR, XOR, NOT,
+enum class OP : uint8_t {
+                ADD, SUB, MUL, DIV, MOD, RSH, LSH, BIT_OR, BIT_AND, BIT_XOR,
+                AND, OR, XOR, NOT, BIT_NOT,
                 EQUALS, NOT_EQUALS, LESS_THAN, LESS_THAN_OR_EQUALS, GREATER_THAN, GREATER_THAN_OR_EQUALS
              };
 
@@ -151,618 +99,793 @@ static std::string op_to_str(OP op) {
     case OP::OR: return "OR";
     case OP::XOR: return "XOR";
     case OP::NOT: return "NOT";
+    case OP::BIT_NOT: return "BIT_NOT";
     case OP::EQUALS: return "EQUALS";
     case OP::NOT_EQUALS: return "NOT_EQUALS";
     case OP::LESS_THAN: return "LESS_THAN";
     case OP::LESS_THAN_OR_EQUALS: return "LESS_THAN_OR_EQUALS";
     case OP::GREATER_THAN: return "GREATER_THAN";
-    case OP::GREATER_THAN_OR_EQUALS: "GREATER_THAN_OR_EQUALS";
+    case OP::GREATER_THAN_OR_EQUALS: return "GREATER_THAN_OR_EQUALS";
     default: return "UNKNOWN_OP";
     }
 }
 
 
 //
-// Statements
+//  Tree Nodes
+//
+//  Every node lives in the PARSE_TREE arena and is referred to by a 32 bit index. The children of a node are a
+//  contiguous range of child ids, absent optional children are NO_NODE_ID. What the children are depends on the kind
+//      CODE_BLOCK      statements...
+//      FUNCTION_DEC    ARG...                                  type = return type, name
+//      FUNCTION_DEF    CODE_BLOCK, ARG...                      type = return type, name
+//      ARG                                                     type, name (NO_STR when unnamed)
+//      RETURN          value                                   value is NO_NODE_ID for return;
+//      ASSIGN          target, value                           type, value is NO_NODE_ID without an initializer
+//      RE_ASSIGN       target, value
+//      AUG_ASSIGN      target, value                           op
+//      FOR             init, condition, expr, CODE_BLOCK       the first three are NO_NODE_ID when left out
+//      WHILE           condition, CODE_BLOCK
+//      IF              condition, CODE_BLOCK, CODE_BLOCK       the else block, NO_NODE_ID without an else
+//      BREAK, CONTINUE
+//      BIN_OP          left, right                             op
+//      UNARY_OP        operand                                 op
+//      CALL            function, arguments...
+//      CONSTANT                                                name = the literal as written
+//      SUBSCRIPT       value, index                            ctx
+//      ARRAY           elements...
+//      NAME                                                    name, ctx
+//  Nodes hold no owning members, so a tree is freed or cleared with its three vectors whatever its size.
 //
-struct CODE_BLOCK : STMT {
-    std::vector<std::shared_ptr<STMT>> body;
 
-    std::string str() const override {
-        std::string s = "CodeBlock(";
-        for (const auto& statement : body) s += statement->str() + ", ";
-        return s + ")";
-    }
+enum class NODE_KIND : uint8_t {
+    //statements
+    CODE_BLOCK, FUNCTION_DEC, FUNCTION_DEF, ARG, RETURN, ASSIGN, RE_ASSIGN, AUG_ASSIGN, FOR, WHILE, IF, BREAK, CONTINUE,
+    //expressions
+    BIN_OP, UNARY_OP, CALL, CONSTANT, SUBSCRIPT, ARRAY, NAME
 };
 
-struct FUNCTION_DEC : STMT {
-    TYPE return_type;
-    std::string name;
-    std::vector<ARG> args;
-
-    std::string str() const override {
-        std::string s = "FunctionDeclaration(return_type = " + return_type.str() + ", name = " + name + ", args = [";
-        for (const ARG arg : args) s += arg.str() + ", ";
-        return s + "])";
-    }
+using NODE_ID = uint32_t;
+static constexpr NODE_ID NO_NODE_ID = UINT32_MAX;
+static constexpr uint32_t NO_TYPE = UINT32_MAX;
+
+struct NODE {
+    NODE_KIND kind = NODE_KIND::CODE_BLOCK;
+    OP op = OP::ADD;
+    EXPR_CONTEXT ctx = EXPR_CONTEXT::LOAD;
+    uint32_t first_child = 0;   //index into PARSE_TREE::child_ids
+    uint32_t child_count = 0;
+    str_id name = NO_STR;       //interned in PARSE_TREE::strings
+    uint32_t type = NO_TYPE;    //index into PARSE_TREE::types
+    SOURCE_LOCATION location;
 };
 
-struct FUNCTION_DEF : STMT {
-    TYPE return_type;
-    std::string name;
-    std::vector<ARG> args;
-    CODE_BLOCK code_block;
+static_assert(sizeof(NODE) == 28, "NODE should stay small, the passes walk the arena linearly");
 
-    std::string str() const override {
-        std::string s = "FunctionDefinition(name = " + name + ", args = [";
-        for (const ARG& arg : args) s += arg.str() + ", ";
-        s += "], code_block = " + code_block.str();
-        return s + "])";
-    }
+class PARSE_TREE {
+public:
+    //the texts of the tokens and names, tokenize() interns into it
+    string_pool strings;
+    //ASSIGN nodes of the global variables
+    std::vector<NODE_ID> global_variable_assignments;
+    //FUNCTION_DEC nodes
+    std::vector<NODE_ID> function_declarations;
+    //FUNCTION_DEF nodes
+    std::vector<NODE_ID> function_definitions;
 
-};
+    void reserve(size_t node_count) {
+        nodes.reserve(node_count);
+        child_ids.reserve(node_count);
+    }
 
-struct RETURN : STMT {
-    std::shared_ptr<EXPR> value;
+    NODE_ID add(NODE_KIND kind, SOURCE_LOCATION location = {}) {
+        NODE node;
+        node.kind = kind;
+        node.location = location;
+        node.first_child = (uint32_t)child_ids.size();
+        nodes.push_back(node);
+        return (NODE_ID)(nodes.size() - 1);
+    }
 
-    std::string str() const override {
-        return "Return(" + value->str() + ")";
+    NODE_ID add(NODE_KIND kind, std::span<const NODE_ID> children, SOURCE_LOCATION location = {}) {
+        NODE_ID id = add(kind, location);
+        child_ids.insert(child_ids.end(), children.begin(), children.end());
+        nodes[id].child_count = (uint32_t)children.size();
+        return id;
     }
-};
 
-struct ASSIGN : STMT {
-    TYPE type;
-    std::shared_ptr<EXPR> target;
-    std::shared_ptr<EXPR> value;
+    NODE_ID add(NODE_KIND kind, std::initializer_list<NODE_ID> children, SOURCE_LOCATION location = {}) {
+        return add(kind, std::span<const NODE_ID>(children.begin(), children.size()), location);
+    }
 
-    std::string str() const override {
-        return "Assignment(type = " + type.str() + ", target = " + target->str() + ", value = " + value->str() + ")";
+    uint32_t add_type(const TYPE& type) {
+        types.push_back(type);
+        return (uint32_t)(types.size() - 1);
     }
-};
 
-struct RE_ASSIGN : STMT {
-    std::shared_ptr<EXPR> target;
-    std::shared_ptr<EXPR> value;
+    NODE& operator[](NODE_ID id) { return nodes[id]; }
+    const NODE& operator[](NODE_ID id) const { return nodes[id]; }
+
+    const TYPE& type(NODE_ID id) const { return types[nodes[id].type]; }
+    const std::string& name(NODE_ID id) const { return strings.get(nodes[id].name); }
 
-    std::string str() const override {
-        return "ReAssignment(target = " + target->str() + ", value = " + value->str() + ")";
+    std::span<const NODE_ID> children(NODE_ID id) const {
+        const NODE& parent = nodes[id];
+        return std::span<const NODE_ID>(child_ids.data() + parent.first_child, parent.child_count);
     }
-};
 
-struct AUG_ASSIGN : STMT {
-    std::shared_ptr<EXPR> target;
-    OP op;
-    std::shared_ptr<EXPR> value;
+    NODE_ID child(NODE_ID id, size_t index) const { return child_ids[nodes[id].first_child + index]; }
+    void set_child(NODE_ID id, size_t index, NODE_ID child) { child_ids[nodes[id].first_child + index] = child; }
+
+    size_t node_count() const { return nodes.size(); }
 
-    std::string str() const override {
-        return "AugmentedAssignment(target = " + target->str() + ", operator = " + op_to_str(op) + ", value = " + value->str() + ")";
+    //drops every node and string, the allocated capacity is kept for the next file
+    void clear() {
+        strings.clear();
+        nodes.clear();
+        child_ids.clear();
+        types.clear();
+        global_variable_assignments.clear();
+        function_declarations.clear();
+        function_definitions.clear();
     }
-};
 
-struct FOR : STMT {
-    std::shared_ptr<STMT> init;
-    std::shared_ptr<EXPR> condition;
-    std::shared_ptr<EXPR> expr;
-    CODE_BLOCK body;
+    std::string str(NODE_ID id) const;
 
-    std::string str() const override {
-        return "ForLoop(init = " + init->str() + ", condition = " + condition->str() + ", expr = " + expr->str() + ", code_block = " + body.str() + ")";
-    }
+private:
+    std::vector<NODE> nodes;
+    std::vector<NODE_ID> child_ids;
+    std::vector<TYPE> types;
 };
 
-struct WHILE : STMT {
-    std::shared_ptr<EXPR> condition;
-    CODE_BLOCK body;
 
-    std::string str() const override {
-        return "WhileLoop(condition = " + condition->str() + ", body = " + body.str() + ")";
+//
+//  Visitors
+//
+//  A pass derives from AST_VISITOR<PASS> and defines the visit_ functions of the kinds it handles, every other kind
+//  visits its children. visit dispatches with a switch on the kind of the node instead of virtual calls.
+//
+//      struct COUNT_CALLS : AST_VISITOR<COUNT_CALLS> {
+//          size_t calls = 0;
+//          using AST_VISITOR::AST_VISITOR;
+//          void visit_call(NODE_ID id) { calls++; visit_children(id); }
+//      };
+//
+
+template <typename PASS>
+struct AST_VISITOR {
+    const PARSE_TREE& tree;
+
+    explicit AST_VISITOR(const PARSE_TREE& tree) : tree(tree) {}
+
+    void visit(NODE_ID id) {
+        if (id == NO_NODE_ID) return;
+        PASS& pass = static_cast<PASS&>(*this);
+        switch (tree[id].kind)
+        {
+        case NODE_KIND::CODE_BLOCK: pass.visit_code_block(id); break;
+        case NODE_KIND::FUNCTION_DEC: pass.visit_function_dec(id); break;
+        case NODE_KIND::FUNCTION_DEF: pass.visit_function_def(id); break;
+        case NODE_KIND::ARG: pass.visit_arg(id); break;
+        case NODE_KIND::RETURN: pass.visit_return(id); break;
+        case NODE_KIND::ASSIGN: pass.visit_assign(id); break;
+        case NODE_KIND::RE_ASSIGN: pass.visit_reassign(id); break;
+        case NODE_KIND::AUG_ASSIGN: pass.visit_augassign(id); break;
+        case NODE_KIND::FOR: pass.visit_for(id); break;
+        case NODE_KIND::WHILE: pass.visit_while(id); break;
+        case NODE_KIND::IF: pass.visit_if(id); break;
+        case NODE_KIND::BREAK: pass.visit_break(id); break;
+        case NODE_KIND::CONTINUE: pass.visit_continue(id); break;
+        case NODE_KIND::BIN_OP: pass.visit_bin_op(id); break;
+        case NODE_KIND::UNARY_OP: pass.visit_unary_op(id); break;
+        case NODE_KIND::CALL: pass.visit_call(id); break;
+        case NODE_KIND::CONSTANT: pass.visit_constant(id); break;
+        case NODE_KIND::SUBSCRIPT: pass.visit_subscript(id); break;
+        case NODE_KIND::ARRAY: pass.visit_array(id); break;
+        case NODE_KIND::NAME: pass.visit_name(id); break;
+        }
     }
+
+    void visit_children(NODE_ID id) {
+        for (NODE_ID child : tree.children(id)) visit(child);
+    }
+
+    //every function definition, declaration and global variable of the tree
+    void visit_tree() {
+        for (NODE_ID id : tree.global_variable_assignments) visit(id);
+        for (NODE_ID id : tree.function_declarations) visit(id);
+        for (NODE_ID id : tree.function_definitions) visit(id);
+    }
+
+    void visit_code_block(NODE_ID id) { visit_children(id); }
+    void visit_function_dec(NODE_ID id) { visit_children(id); }
+    void visit_function_def(NODE_ID id) { visit_children(id); }
+    void visit_arg(NODE_ID) {}
+    void visit_return(NODE_ID id) { visit_children(id); }
+    void visit_assign(NODE_ID id) { visit_children(id); }
+    void visit_reassign(NODE_ID id) { visit_children(id); }
+    void visit_augassign(NODE_ID id) { visit_children(id); }
+    void visit_for(NODE_ID id) { visit_children(id); }
+    void visit_while(NODE_ID id) { visit_children(id); }
+    void visit_if(NODE_ID id) { visit_children(id); }
+    void visit_break(NODE_ID) {}
+    void visit_continue(NODE_ID) {}
+    void visit_bin_op(NODE_ID id) { visit_children(id); }
+    void visit_unary_op(NODE_ID id) { visit_children(id); }
+    void visit_call(NODE_ID id) { visit_children(id); }
+    void visit_constant(NODE_ID) {}
+    void visit_subscript(NODE_ID id) { visit_children(id); }
+    void visit_array(NODE_ID id) { visit_children(id); }
+    void visit_name(NODE_ID) {}
 };
 
-struct IF : STMT {
-    std::shared_ptr<EXPR> condition;
-    CODE_BLOCK body;
-    CODE_BLOCK orelse;
+//the text form of a subtree, CodeBlock(Return(Name(id = a), ), )
+struct AST_PRINTER : AST_VISITOR<AST_PRINTER> {
+    std::string s;
+
+    using AST_VISITOR::AST_VISITOR;
 
-    std::string str() const override {
-        return "If(condition = " + condition->str() + ", body = " + body.str() + ", orelse = " + orelse.str() + ")";
+    void visit_list(std::span<const NODE_ID> ids) {
+        for (NODE_ID id : ids) {
+            visit(id);
+            s += ", ";
+        }
     }
-};
 
-struct BREAK : STMT {
-    std::string str() const override {
-        return "Break()";
+    void visit_function_header(NODE_ID id) {
+        s += "return_type = " + tree.type(id).str() + ", name = " + tree.name(id) + ", args = [";
     }
-};
 
-struct CONTINUE : STMT {
-    std::string str() const override {
-        return "Continue()";
+    void visit_code_block(NODE_ID id) {
+        s += "CodeBlock(";
+        visit_list(tree.children(id));
+        s += ")";
     }
-};
 
-//
-// Expressions
-//
+    void visit_function_dec(NODE_ID id) {
+        s += "FunctionDeclaration(";
+        visit_function_header(id);
+        visit_list(tree.children(id));
+        s += "])";
+    }
 
-struct BIN_OP : EXPR {
-    std::shared_ptr<EXPR> left;
-    OP op;
-    std::shared_ptr<EXPR> right;
+    void visit_function_def(NODE_ID id) {
+        s += "FunctionDefinition(";
+        visit_function_header(id);
+        visit_list(tree.children(id).subspan(1));
+        s += "], code_block = ";
+        visit(tree.child(id, 0));
+        s += ")";
+    }
 
-    std::string str() const override {
-        return "BinaryOp(left = " + left->str() + ", operator = " + op_to_str(op) + ", right = " + right->str() + ")";
+    void visit_arg(NODE_ID id) {
+        s += "Arg(name = " + ((tree[id].name == NO_STR) ? std::string() : tree.name(id)) + ", type = " + tree.type(id).str() + ")";
     }
-};
 
-struct UNARY_OP : EXPR {
-    OP op;
-    std::shared_ptr<EXPR> operand;
+    void visit_return(NODE_ID id) {
+        s += "Return(";
+        visit(tree.child(id, 0));
+        s += ")";
+    }
 
-    std::string str() const override {
-        return "UnaryOp(operator = " + op_to_str(op) + ", operand = " + operand->str() + ")";
+    void visit_assign(NODE_ID id) {
+        s += "Assignment(type = " + tree.type(id).str() + ", target = ";
+        visit(tree.child(id, 0));
+        s += ", value = ";
+        visit(tree.child(id, 1));
+        s += ")";
     }
-};
 
-struct CALL : EXPR {
-    std::shared_ptr<EXPR> func;
-    std::vector<std::shared_ptr<EXPR>> args;
+    void visit_reassign(NODE_ID id) {
+        s += "ReAssignment(target = ";
+        visit(tree.child(id, 0));
+        s += ", value = ";
+        visit(tree.child(id, 1));
+        s += ")";
+    }
 
-    std::string str() const override {
-        std::string s = "Call( function = " + func->str() + ", arguments = [";
-        for (const auto& expr : args) {
-            s += expr->str() + ", ";
-        }
-        return s + "])";
+    void visit_augassign(NODE_ID id) {
+        s += "AugmentedAssignment(target = ";
+        visit(tree.child(id, 0));
+        s += ", operator = " + op_to_str(tree[id].op) + ", value = ";
+        visit(tree.child(id, 1));
+        s += ")";
     }
-};
 
-struct CONSTANT : EXPR {
-    void* value;
-    std::string str_value;
+    void visit_for(NODE_ID id) {
+        s += "ForLoop(init = ";
+        visit(tree.child(id, 0));
+        s += ", condition = ";
+        visit(tree.child(id, 1));
+        s += ", expr = ";
+        visit(tree.child(id, 2));
+        s += ", code_block = ";
+        visit(tree.child(id, 3));
+        s += ")";
+    }
 
-    CONSTANT(void* value, std::string str_value) : value(value), str_value(str_value) {}
+    void visit_while(NODE_ID id) {
+        s += "WhileLoop(condition = ";
+        visit(tree.child(id, 0));
+        s += ", body = ";
+        visit(tree.child(id, 1));
+        s += ")";
+    }
 
-    std::string str() const override {
-        return "Constant(" + str_value + ")";
+    void visit_if(NODE_ID id) {
+        s += "If(condition = ";
+        visit(tree.child(id, 0));
+        s += ", body = ";
+        visit(tree.child(id, 1));
+        s += ", orelse = ";
+        visit(tree.child(id, 2));
+        s += ")";
     }
-};
 
-struct SUBSCRIPT : EXPR {
-    std::shared_ptr<EXPR> value;
-    std::shared_ptr<EXPR> index;
-    EXPR_CONTEXT ctx;
+    void visit_break(NODE_ID) { s += "Break()"; }
+    void visit_continue(NODE_ID) { s += "Continue()"; }
 
-    std::string str() const override {
-        return "Subscript(value = " + value->str() + ", index = " + index->str() + ", ctx = " + expr_ctx_to_str(ctx) + ")";
+    void visit_bin_op(NODE_ID id) {
+        s += "BinaryOp(left = ";
+        visit(tree.child(id, 0));
+        s += ", operator = " + op_to_str(tree[id].op) + ", right = ";
+        visit(tree.child(id, 1));
+        s += ")";
     }
-};
 
-struct ARRAY : EXPR {
-    std::vector<std::shared_ptr<EXPR>> elements;
+    void visit_unary_op(NODE_ID id) {
+        s += "UnaryOp(operator = " + op_to_str(tree[id].op) + ", operand = ";
+        visit(tree.child(id, 0));
+        s += ")";
+    }
 
-    std::string str() const override {
-        std::string s = "Array(elements = [";
-        for (const auto& expr : elements) {
-            s += expr->str() + ", ";
-        }
-        return s + "])";
+    void visit_call(NODE_ID id) {
+        s += "Call( function = ";
+        visit(tree.child(id, 0));
+        s += ", arguments = [";
+        visit_list(tree.children(id).subspan(1));
+        s += "])";
     }
-};
 
-struct NAME : EXPR {
-    std::string id;
-    EXPR_CONTEXT ctx;
+    void visit_constant(NODE_ID id) { s += "Constant(" + tree.name(id) + ")"; }
 
-    NAME(std::string id, EXPR_CONTEXT ctx) :
-        id(id), ctx(ctx)
-    {}
+    void visit_subscript(NODE_ID id) {
+        s += "Subscript(value = ";
+        visit(tree.child(id, 0));
+        s += ", index = ";
+        visit(tree.child(id, 1));
+        s += ", ctx = " + expr_ctx_to_str(tree[id].ctx) + ")";
+    }
 
-    std::string str() const override {
-        return "Name(id = " + id + ")";
+    void visit_array(NODE_ID id) {
+        s += "Array(elements = [";
+        visit_list(tree.children(id));
+        s += "])";
     }
-};
 
-struct PARSE_TREE {
-    //global variables
-    std::vector<ASSIGN> global_variable_assignments;
-    //function declarations
-    std::vector<FUNCTION_DEC> function_declarations;
-    //function definitions
-    std::vector<FUNCTION_DEF> function_definitions;
+    void visit_name(NODE_ID id) { s += "Name(id = " + tree.name(id) + ")"; }
 };
 
+inline std::string PARSE_TREE::str(NODE_ID id) const {
+    AST_PRINTER printer(*this);
+    printer.visit(id);
+    return printer.s;
+}
+
 
 //
-//  Statement Parsing
+//  Parsing
+//
+//  One pass over the tokens with a cursor, every parser reads its construct and leaves the cursor after it. In a code
+//  block the first token of a statement tells what it is, a keyword starts its statement, a type starts a variable and
+//  anything else is an expression that the token after it may turn into an assignment. At the top level a statement
+//  starts with a type and a name and the next token tells what it is. ( starts a function, then the token after the
+//  parameters decides between
+//      int func(int a, int b);      a declaration
+//      int func(int a, int b){...   a definition
+//  and ; or = is a global variable.
 //
 
-bool try_parse_function_dec(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree) {
-    if (tokens.empty()) return false;
-
-    const std::unordered_set<std::string> valid_types = { "bool","char","int","long","short","void" };
+struct TOKEN_CURSOR {
+    const std::vector<TOKEN>& tokens;
+    const string_pool& strings;
+    size_t index = 0;
 
-    TYPE function_return_type;
-    std::string function_name;
-    std::vector<std::string> function_argument_types;
-    std::vector<ARG> function_args;
+    const std::string& text(const TOKEN& token) const { return strings.get(token.id); }
 
-    int index = 0;
+    bool at_end() const { return index >= tokens.size(); }
+    const TOKEN& peek() const { return tokens[index]; }
+    SOURCE_LOCATION location() const { return at_end() ? SOURCE_LOCATION{} : tokens[index].location; }
+    bool is(C_TOKEN kind) const { return !at_end() && tokens[index].kind == kind; }
 
-    // type modifier
-    if (tokens[index].value == "signed" || tokens[index].value == "unsigned") {
-        function_return_type.set_signed(tokens[index].value);
-        index++;
-        if (index == tokens.size()) return false;
+    const TOKEN& take() {
+        if (at_end()) error("unexpected end of the file");
+        return tokens[index++];
     }
 
-    // type
-    if (!valid_types.contains(tokens[index].value))
-        return false;
-
-    function_return_type.set_type(tokens[index].value);
-    index++;
-    if (index == tokens.size()) return false;
-
-    // pointer ?
-    if (tokens[index].value == "*") {
-        function_return_type.is_ptr = true;
+    bool accept(C_TOKEN kind) {
+        if (!is(kind)) return false;
         index++;
-        if (index == tokens.size()) return false;
+        return true;
     }
 
-    // function name
-    if (tokens[index].type != TOKEN_TYPE::IDENTIFIER)
-        return false;
-
-    function_name = tokens[index].value;
-    index++;
-    if (index == tokens.size()) return false;
-
-    // function parameters
-    if (tokens[index].value != "(")
-        return false;
-
-    index++;
-    if (index == tokens.size()) return false;
-
-    while ( tokens[index].value != ")" && index < tokens.size())
-    {
-        TYPE argument_type;
-
-        //type modifier
-        if (tokens[index].value == "signed" || tokens[index].value == "unsigned") {
-            argument_type.set_signed(tokens[index].value);
-            index++;
-            if (index == tokens.size()) return false;
-        }
-
-        //type
-        if (!valid_types.contains(tokens[index].value))
-            return false;
-
-        argument_type.set_type(tokens[index].value);
-        index++;
-        if (index == tokens.size()) return false;
-
-        // pointer?
-        if (tokens[index].value == "*") {
-            argument_type.is_ptr = true;
-            index++;
-            if (index == tokens.size()) return false;
-        }
-
-        //save the type
-        function_args.emplace_back("", argument_type);
-
-        //parameter has name given, skip
-        if (tokens[index].type == TOKEN_TYPE::IDENTIFIER) {
-            index++;
-            if (index == tokens.size()) return false;
-        }
-
-        //comma
-        if (tokens[index].value == ",") {
-            index++;
-            if (index == tokens.size()) return false;
-        }
-
+    void expect(C_TOKEN kind) {
+        if (!accept(kind)) error("expected " + std::string(c_token_text(kind)));
     }
 
-    //should be a ;
-    index++;
-    if (index == tokens.size()) return false;
+    [[noreturn]] void error(const std::string& message) const {
+        if (at_end()) throw std::runtime_error("C parse error at the end of the file : " + message);
+        throw std::runtime_error("C parse error at " + tokens[index].location.str() + " (" + text(tokens[index]) + ") : " + message);
+    }
+};
 
-    if (tokens[index].value != ";")
-        return false;
+static bool is_type_start(const TOKEN_CURSOR& cursor) {
+    return cursor.is(C_TOKEN::SIGNED) || cursor.is(C_TOKEN::UNSIGNED) || cursor.is(C_TOKEN::BOOL) || cursor.is(C_TOKEN::CHAR) ||
+        cursor.is(C_TOKEN::FLOAT) || cursor.is(C_TOKEN::INT) || cursor.is(C_TOKEN::LONG) || cursor.is(C_TOKEN::SHORT) || cursor.is(C_TOKEN::VOID);
+}
 
-    FUNCTION_DEC function_declaration;
-    function_declaration.name = function_name;
-    function_declaration.return_type = function_return_type; 
-    function_declaration.args = function_args;
+// [signed | unsigned] <type> [*]
+static TYPE parse_type(TOKEN_CURSOR& cursor) {
+    TYPE type;
+    if (cursor.is(C_TOKEN::SIGNED) || cursor.is(C_TOKEN::UNSIGNED)) type.set_signed(cursor.text(cursor.take()));
 
-    parse_tree.function_declarations.push_back(function_declaration);
+    if (!is_type_start(cursor) || cursor.is(C_TOKEN::SIGNED) || cursor.is(C_TOKEN::UNSIGNED))
+        cursor.error("expected a type");
+    type.set_type(cursor.text(cursor.take()));
 
-    return true;
+    type.is_ptr = cursor.accept(C_TOKEN::MUL);
+    return type;
 }
 
-bool try_parse_function_def(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree) {
-    if (tokens.empty()) return false;
-    if (tokens.back().value != "}") return false;
+static const TOKEN& parse_name(TOKEN_CURSOR& cursor) {
+    if (cursor.at_end() || cursor.peek().type != TOKEN_TYPE::IDENTIFIER)
+        cursor.error("expected a name");
+    return cursor.take();
+}
 
-    const std::unordered_set<std::string> valid_types = { "bool","char","int","long","short","void" };
 
-    TYPE function_return_type;
-    std::string function_name;
-    std::vector<ARG> function_args;
+//
+//  Expression Parsing
+//
+//  Precedence climbing over the binary operators, from the loosest to the tightest binding
+//      ||   &&   |   ^   &   == !=   < <= > >=   << >>   + -   * / %
+//  all of them left associative. Below them are the unary - ! ~, then calls and subscripts, then names, literals,
+//  (...) and {...} arrays.
+//
 
-    int index = 0;
+struct BINARY_OPERATOR {
+    C_TOKEN token;
+    OP op;
+    int precedence;
+};
 
-    // type modifier
-    if (tokens[index].value == "signed" || tokens[index].value == "unsigned") {
-        function_return_type.set_signed(tokens[index].value);
-        index++;
-        if (index == tokens.size()) return false;
-    }
+static constexpr BINARY_OPERATOR binary_operators[] = {
+    { C_TOKEN::OR, OP::OR, 1 },
+    { C_TOKEN::AND, OP::AND, 2 },
+    { C_TOKEN::BIT_OR, OP::BIT_OR, 3 },
+    { C_TOKEN::BIT_XOR, OP::BIT_XOR, 4 },
+    { C_TOKEN::BIT_AND, OP::BIT_AND, 5 },
+    { C_TOKEN::EQUALS, OP::EQUALS, 6 }, { C_TOKEN::NOT_EQUALS, OP::NOT_EQUALS, 6 },
+    { C_TOKEN::LESS_THAN, OP::LESS_THAN, 7 }, { C_TOKEN::LESS_THAN_OR_EQUALS, OP::LESS_THAN_OR_EQUALS, 7 },
+    { C_TOKEN::GREATER_THAN, OP::GREATER_THAN, 7 }, { C_TOKEN::GREATER_THAN_OR_EQUALS, OP::GREATER_THAN_OR_EQUALS, 7 },
+    { C_TOKEN::LSH, OP::LSH, 8 }, { C_TOKEN::RSH, OP::RSH, 8 },
+    { C_TOKEN::ADD, OP::ADD, 9 }, { C_TOKEN::SUB, OP::SUB, 9 },
+    { C_TOKEN::MUL, OP::MUL, 10 }, { C_TOKEN::DIV, OP::DIV, 10 }, { C_TOKEN::MOD, OP::MOD, 10 },
+};
 
-    // type
-    if (!valid_types.contains(tokens[index].value))
-        return false;
+//the binary operator at the cursor, nullptr if there is none
+static const BINARY_OPERATOR* peek_binary_operator(const TOKEN_CURSOR& cursor) {
+    if (cursor.at_end()) return nullptr;
+    for (const BINARY_OPERATOR& binary : binary_operators)
+        if (binary.token == cursor.peek().kind) return &binary;
+    return nullptr;
+}
 
-    function_return_type.set_type(tokens[index].value);
-    index++;
-    if (index == tokens.size()) return false;
+static NODE_ID parse_expression(TOKEN_CURSOR& cursor, PARSE_TREE& tree, int min_precedence = 1);
 
-    // pointer ?
-    if (tokens[index].value == "*") {
-        function_return_type.is_ptr = true;
-        index++;
-        if (index == tokens.size()) return false;
+// name | literal | (expression) | {expression, ...}
+static NODE_ID parse_primary(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    if (cursor.accept(C_TOKEN::OPEN_PAREN)) {
+        NODE_ID expression = parse_expression(cursor, tree);
+        cursor.expect(C_TOKEN::CLOSE_PAREN);
+        return expression;
     }
 
-    // function name
-    if (tokens[index].type != TOKEN_TYPE::IDENTIFIER)
-        return false;
-
-    function_name = tokens[index].value;
-    index++;
-    if (index == tokens.size()) return false;
-
-    // function parameters
-    if (tokens[index].value != "(")
-        return false;
-
-    //read until closing bracket
-
-    index++;
-    if (index == tokens.size()) return false;
-
-    while (tokens[index].value != ")" && index < tokens.size())
-    {
-        TYPE argument_type;
-
-        //type modifier
-        if (tokens[index].value == "signed" || tokens[index].value == "unsigned") {
-            argument_type.set_signed(tokens[index].value);
-            index++;
-            if (index == tokens.size()) return false;
+    if (cursor.accept(C_TOKEN::OPEN_BRACE)) {
+        std::vector<NODE_ID> elements;
+        while (!cursor.accept(C_TOKEN::CLOSE_BRACE)) {
+            if (!elements.empty()) cursor.expect(C_TOKEN::COMMA);
+            elements.push_back(parse_expression(cursor, tree));
         }
+        return tree.add(NODE_KIND::ARRAY, elements, location);
+    }
 
-        //type
-        if (!valid_types.contains(tokens[index].value))
-            return false;
-
-        argument_type.set_type(tokens[index].value);
-        index++;
-        if (index == tokens.size()) return false;
+    if (cursor.at_end() || !(cursor.peek().type == TOKEN_TYPE::LITERAL || cursor.peek().type == TOKEN_TYPE::IDENTIFIER))
+        cursor.error("expected an expression");
+    const TOKEN& token = cursor.take();
+    NODE_ID primary = tree.add((token.type == TOKEN_TYPE::LITERAL) ? NODE_KIND::CONSTANT : NODE_KIND::NAME, location);
+    tree[primary].name = token.id;
+    return primary;
+}
 
-        // pointer?
-        if (tokens[index].value == "*") {
-            argument_type.is_ptr = true;
-            index++;
-            if (index == tokens.size()) return false;
+// primary followed by any number of (arguments, ...) and [index]
+static NODE_ID parse_postfix(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    NODE_ID expression = parse_primary(cursor, tree);
+    while (true) {
+        if (cursor.accept(C_TOKEN::OPEN_PAREN)) {
+            //the function is the first child of a call, the arguments follow
+            std::vector<NODE_ID> children = { expression };
+            while (!cursor.accept(C_TOKEN::CLOSE_PAREN)) {
+                if (children.size() != 1) cursor.expect(C_TOKEN::COMMA);
+                children.push_back(parse_expression(cursor, tree));
+            }
+            expression = tree.add(NODE_KIND::CALL, children, location);
         }
-
-        //parameter name
-        if (tokens[index].type == TOKEN_TYPE::IDENTIFIER) {
-            std::string argument_name = tokens[index].value;
-            function_args.emplace_back(argument_name, argument_type);
-            index++;
-            if (index == tokens.size()) return false;
+        else if (cursor.accept(C_TOKEN::OPEN_BRACKET)) {
+            NODE_ID index = parse_expression(cursor, tree);
+            cursor.expect(C_TOKEN::CLOSE_BRACKET);
+            expression = tree.add(NODE_KIND::SUBSCRIPT, { expression, index }, location);
         }
-
-        //comma
-        if (tokens[index].value == ",") {
-            index++;
-            if (index == tokens.size()) return false;
+        else {
+            return expression;
         }
-
     }
+}
 
+// [- | ! | ~]... postfix
+static NODE_ID parse_unary(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    OP op;
+    if (cursor.accept(C_TOKEN::SUB)) op = OP::SUB;
+    else if (cursor.accept(C_TOKEN::NOT)) op = OP::NOT;
+    else if (cursor.accept(C_TOKEN::BIT_NOT)) op = OP::BIT_NOT;
+    else return parse_postfix(cursor, tree);
+
+    NODE_ID operand = parse_unary(cursor, tree);
+    NODE_ID unary = tree.add(NODE_KIND::UNARY_OP, { operand }, location);
+    tree[unary].op = op;
+    return unary;
+}
 
-    //should be a function body code block {...}
-    index++;
-    if (index == tokens.size()) return false;
-
-    if (tokens[index].value != "{")
-        return false;
-
-    index++;
-    if (index == tokens.size()) return false;
-    
-    int start_index = index;
-    int bracket_count = 1;
+//an expression whose binary operators bind at least as tightly as min_precedence
+static NODE_ID parse_expression(TOKEN_CURSOR& cursor, PARSE_TREE& tree, int min_precedence) {
+    SOURCE_LOCATION location = cursor.location();
+    NODE_ID left = parse_unary(cursor, tree);
+    while (const BINARY_OPERATOR* binary = peek_binary_operator(cursor)) {
+        if (binary->precedence < min_precedence) break;
+        cursor.take();
 
-    while (bracket_count != 0 && index < tokens.size()) {
-        if (tokens[index].value == "{") {
-            bracket_count++;
-            index++;
-            if (index == tokens.size()) return false;
-        }
-        else if (tokens[index].value == "}") {
-            bracket_count--;
-            index++;
-        }
-        else {
-            index++;
-            if (index == tokens.size()) return false;
-        }
+        NODE_ID right = parse_expression(cursor, tree, binary->precedence + 1);
+        NODE_ID bin_op = tree.add(NODE_KIND::BIN_OP, { left, right }, location);
+        tree[bin_op].op = binary->op;
+        left = bin_op;
     }
+    return left;
+}
 
-    if (index != tokens.size())
-        return false;
 
-    std::vector<TOKEN> code_block_tokens = std::vector<TOKEN>(tokens.begin() + start_index, tokens.end()-1);
-    CODE_BLOCK code_block;
+//
+//  Statement Parsing
+//
+//  The statement parsers append their nodes to the tree and return the id of the statement. The simple statements leave
+//  their ; to parse_statement, so that the header of a for can reuse them. The bodies of if, while and for are code
+//  blocks, a body without braces is a block of its one statement. An expression on its own, a call, is its own node.
+//
 
-    if (try_parse_code_block(code_block_tokens, code_block)) {
-        //save function definition
-        FUNCTION_DEF function_definition;
-        function_definition.name = function_name;
-        function_definition.return_type = function_return_type;
-        function_definition.args = function_args;
-        function_definition.code_block = code_block;
-        parse_tree.function_definitions.push_back(function_definition);
-    }
-    else {
-        return false;
-    }
+static NODE_ID parse_statement(TOKEN_CURSOR& cursor, PARSE_TREE& tree);
 
-    return true;
+// { statement... }
+static NODE_ID parse_code_block(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    cursor.expect(C_TOKEN::OPEN_BRACE);
+    std::vector<NODE_ID> statements;
+    while (!cursor.accept(C_TOKEN::CLOSE_BRACE)) statements.push_back(parse_statement(cursor, tree));
+    return tree.add(NODE_KIND::CODE_BLOCK, statements, location);
 }
 
-bool try_parse_assign(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree) {
-    // <type> <name> = <expression> ; OR <type> <name>;
-    if (tokens.size() < 2) return false;
+static NODE_ID parse_body(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    if (cursor.is(C_TOKEN::OPEN_BRACE)) return parse_code_block(cursor, tree);
+    SOURCE_LOCATION location = cursor.location();
+    NODE_ID statement = parse_statement(cursor, tree);
+    return tree.add(NODE_KIND::CODE_BLOCK, { statement }, location);
+}
 
-    const std::unordered_set<std::string> valid_types = { "bool","char","int","long","short","void" };
+// [= value] after the type and the name of a variable
+static NODE_ID parse_variable(TOKEN_CURSOR& cursor, PARSE_TREE& tree, uint32_t type, const TOKEN& name_token, SOURCE_LOCATION location) {
+    NODE_ID target = tree.add(NODE_KIND::NAME, name_token.location);
+    tree[target].name = name_token.id;
+    tree[target].ctx = EXPR_CONTEXT::STORE;
 
-    TYPE variable_type;
+    NODE_ID value = cursor.accept(C_TOKEN::ASSIGN) ? parse_expression(cursor, tree) : NO_NODE_ID;
+    NODE_ID assignment = tree.add(NODE_KIND::ASSIGN, { target, value }, location);
+    tree[assignment].type = type;
+    return assignment;
+}
 
-    int index = 0;
-    
-    if (tokens[index].value == "signed" || tokens[index].value == "unsigned") {
-        variable_type.set_signed(tokens[index].value);
-        index++;
-        if (index == tokens.size()) return false;
-    }
+// <type> name [= value]
+static NODE_ID parse_assign(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    uint32_t type = tree.add_type(parse_type(cursor));
+    const TOKEN& name_token = parse_name(cursor);
+    return parse_variable(cursor, tree, type, name_token, location);
+}
 
-    if (!valid_types.contains(tokens[index].value))
-        return false;
+// target = value | target op= value | target++ | target-- | expression
+static NODE_ID parse_reassign(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    static constexpr std::pair<C_TOKEN, OP> augmented_operators[] = {
+        { C_TOKEN::ADD_ASSIGN, OP::ADD }, { C_TOKEN::SUB_ASSIGN, OP::SUB }, { C_TOKEN::MUL_ASSIGN, OP::MUL },
+        { C_TOKEN::DIV_ASSIGN, OP::DIV }, { C_TOKEN::MOD_ASSIGN, OP::MOD }, { C_TOKEN::INC, OP::ADD }, { C_TOKEN::DEC, OP::SUB },
+    };
 
-    variable_type.set_type(tokens[index].value);
-    index++;
-    if (index == tokens.size()) return false;
+    SOURCE_LOCATION location = cursor.location();
+    NODE_ID target = parse_expression(cursor, tree);
+    if (cursor.at_end()) return target;
 
-    if (tokens[index].value == "*") {
-        variable_type.is_ptr = true;
-        index++;
-        if (index == tokens.size()) return false;
-    }
+    C_TOKEN kind = cursor.peek().kind;
+    const std::pair<C_TOKEN, OP>* augmented = nullptr;
+    for (const auto& pair : augmented_operators)
+        if (pair.first == kind) augmented = &pair;
+    if (kind != C_TOKEN::ASSIGN && augmented == nullptr) return target;
 
-    std::string variable_name = tokens[index].value;
-    index++;
-    if (index == tokens.size()) return false;
+    if (tree[target].kind != NODE_KIND::NAME && tree[target].kind != NODE_KIND::SUBSCRIPT)
+        cursor.error("only a name or a subscript can be assigned to");
+    tree[target].ctx = EXPR_CONTEXT::STORE;
+    cursor.take();
 
-    if (tokens[index].value == ";") {
-        //no variable value given
-        ASSIGN assignment;
-        assignment.type = variable_type;
-        assignment.target = std::make_shared<NAME>(variable_name, EXPR_CONTEXT::STORE);
-        parse_tree.global_variable_assignments.push_back(assignment);
+    if (kind == C_TOKEN::ASSIGN) {
+        NODE_ID value = parse_expression(cursor, tree);
+        return tree.add(NODE_KIND::RE_ASSIGN, { target, value }, location);
     }
-    else if (tokens[index].value == "=") {
-        //variable value given
 
+    NODE_ID value;
+    if (kind == C_TOKEN::INC || kind == C_TOKEN::DEC) {
+        //x++ is x += 1
+        value = tree.add(NODE_KIND::CONSTANT, location);
+        tree[value].name = tree.strings.intern("1");
     }
     else {
-        return false;
+        value = parse_expression(cursor, tree);
     }
-
-    return true;
+    NODE_ID augassign = tree.add(NODE_KIND::AUG_ASSIGN, { target, value }, location);
+    tree[augassign].op = augmented->second;
+    return augassign;
 }
 
-bool try_parse_return(const std::vector<TOKEN>& tokens, RETURN& return_statement) {
-    if (tokens.size() < 2) return false;
-
-    if (tokens.front().value != "return") return false;
-    if (tokens.back().value != ";") return false;
+// return [value]
+static NODE_ID parse_return(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    cursor.expect(C_TOKEN::RETURN);
+    NODE_ID value = cursor.is(C_TOKEN::SEMICOLON) ? NO_NODE_ID : parse_expression(cursor, tree);
+    return tree.add(NODE_KIND::RETURN, { value }, location);
+}
 
-    std::vector<TOKEN> return_expr_tokens = std::vector<TOKEN>(tokens.begin() + 1, tokens.end() - 1);
+// for ([init]; [condition]; [expr]) body
+static NODE_ID parse_for(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    cursor.expect(C_TOKEN::FOR);
+    cursor.expect(C_TOKEN::OPEN_PAREN);
 
-    debug_print_tokens(return_expr_tokens);
-    return false;
-}
+    NODE_ID init = NO_NODE_ID;
+    if (!cursor.is(C_TOKEN::SEMICOLON)) init = is_type_start(cursor) ? parse_assign(cursor, tree) : parse_reassign(cursor, tree);
+    cursor.expect(C_TOKEN::SEMICOLON);
 
-bool try_parse_assign(const std::vector<TOKEN>& tokens, ASSIGN& assign_statement) {
-    return false;
-}
+    NODE_ID condition = cursor.is(C_TOKEN::SEMICOLON) ? NO_NODE_ID : parse_expression(cursor, tree);
+    cursor.expect(C_TOKEN::SEMICOLON);
 
-bool try_parse_reassign(const std::vector<TOKEN>& tokens, RE_ASSIGN& reassign_statement) {
-    return false;
-}
+    NODE_ID expr = cursor.is(C_TOKEN::CLOSE_PAREN) ? NO_NODE_ID : parse_reassign(cursor, tree);
+    cursor.expect(C_TOKEN::CLOSE_PAREN);
 
-bool try_parse_augassign(const std::vector<TOKEN>& tokens, AUG_ASSIGN& augassign_statement) {
-    return false;
+    NODE_ID body = parse_body(cursor, tree);
+    return tree.add(NODE_KIND::FOR, { init, condition, expr, body }, location);
 }
 
-bool try_parse_for(const std::vector<TOKEN>& tokens, FOR& for_statement) {
-    return false;
-}
+// while (condition) body
+static NODE_ID parse_while(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    cursor.expect(C_TOKEN::WHILE);
+    cursor.expect(C_TOKEN::OPEN_PAREN);
+    NODE_ID condition = parse_expression(cursor, tree);
+    cursor.expect(C_TOKEN::CLOSE_PAREN);
 
-bool try_parse_while(const std::vector<TOKEN>& tokens, WHILE& while_statement) {
-    return false;
+    NODE_ID body = parse_body(cursor, tree);
+    return tree.add(NODE_KIND::WHILE, { condition, body }, location);
 }
 
-bool try_parse_if(const std::vector<TOKEN>& tokens, IF& if_statement) {
-    return false;
+// if (condition) body [else body], an else if is an else block holding the inner if
+static NODE_ID parse_if(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    cursor.expect(C_TOKEN::IF);
+    cursor.expect(C_TOKEN::OPEN_PAREN);
+    NODE_ID condition = parse_expression(cursor, tree);
+    cursor.expect(C_TOKEN::CLOSE_PAREN);
+
+    NODE_ID body = parse_body(cursor, tree);
+    NODE_ID orelse = cursor.accept(C_TOKEN::ELSE) ? parse_body(cursor, tree) : NO_NODE_ID;
+    return tree.add(NODE_KIND::IF, { condition, body, orelse }, location);
 }
 
-bool try_parse_break(const std::vector<TOKEN>& tokens, BREAK& break_statement) {
-    return false;
-}
+static NODE_ID parse_statement(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    if (cursor.at_end()) cursor.error("expected a statement");
 
-bool try_parse_continue(const std::vector<TOKEN>& tokens, CONTINUE& continue_statement) {
-    return false;
+    SOURCE_LOCATION location = cursor.location();
+    NODE_ID statement;
+    switch (cursor.peek().kind)
+    {
+    case C_TOKEN::OPEN_BRACE: return parse_code_block(cursor, tree);
+    case C_TOKEN::FOR: return parse_for(cursor, tree);
+    case C_TOKEN::WHILE: return parse_while(cursor, tree);
+    case C_TOKEN::IF: return parse_if(cursor, tree);
+    case C_TOKEN::RETURN: statement = parse_return(cursor, tree); break;
+    case C_TOKEN::BREAK: cursor.take(); statement = tree.add(NODE_KIND::BREAK, location); break;
+    case C_TOKEN::CONTINUE: cursor.take(); statement = tree.add(NODE_KIND::CONTINUE, location); break;
+    default: statement = is_type_start(cursor) ? parse_assign(cursor, tree) : parse_reassign(cursor, tree); break;
+    }
+    cursor.expect(C_TOKEN::SEMICOLON);
+    return statement;
 }
 
-bool try_parse_code_block(const std::vector<TOKEN>& tokens, CODE_BLOCK& code_block) {
-    return true;
-}
 
 //
-//  Expression Parsing
+//  Top Level Parsing
 //
 
-bool try_parse_expression(const std::vector<TOKEN>& tokens, EXPR& expression) {
-    return true;
+// (<type> [name], ...), parameter names are optional, the ARG nodes go to args
+static void parse_arguments(TOKEN_CURSOR& cursor, PARSE_TREE& tree, std::vector<NODE_ID>& args) {
+    cursor.expect(C_TOKEN::OPEN_PAREN);
+    size_t first_arg = args.size();
+    while (!cursor.accept(C_TOKEN::CLOSE_PAREN)) {
+        if (args.size() != first_arg) cursor.expect(C_TOKEN::COMMA);
+
+        SOURCE_LOCATION location = cursor.location();
+        TYPE argument_type = parse_type(cursor);
+        NODE_ID arg = tree.add(NODE_KIND::ARG, location);
+        tree[arg].type = tree.add_type(argument_type);
+        if (!cursor.at_end() && cursor.peek().type == TOKEN_TYPE::IDENTIFIER)
+            tree[arg].name = cursor.take().id;
+
+        args.push_back(arg);
+    }
 }
 
-void parse(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree) {
-    //Convert list of tokens into an Abstract Syntax Tree
-    bool end_of_tokens = false;
-    bool found = false;
-    size_t start_index = 0;
-    size_t end_index = 0;
-
-    while (start_index < tokens.size()) {
-        //Take a vector slice from start_index to end_index and try parse the slice
-        for (; end_index <= tokens.size(); end_index++) {
-            std::vector<TOKEN> tokens_slice = std::vector<TOKEN>(tokens.begin() + start_index, tokens.begin() + end_index);
-            //Function declarations
-            if (try_parse_function_dec(tokens_slice, parse_tree))
-                break;
-            //Function definitions
-            if (try_parse_function_def(tokens_slice, parse_tree))
-                break;
-            //Global variable definitions
-            if(try_parse_assign(tokens_slice,parse_tree))
-                break;
+static void parse_top_level_statement(TOKEN_CURSOR& cursor, PARSE_TREE& tree) {
+    SOURCE_LOCATION location = cursor.location();
+    uint32_t type = tree.add_type(parse_type(cursor));
+    const TOKEN& name_token = parse_name(cursor);
+
+    if (cursor.is(C_TOKEN::OPEN_PAREN)) {
+        //the code block of a definition is its first child, the arguments follow
+        std::vector<NODE_ID> children = { NO_NODE_ID };
+        parse_arguments(cursor, tree, children);
+        NODE_KIND kind;
+        if (cursor.accept(C_TOKEN::SEMICOLON)) {
+            kind = NODE_KIND::FUNCTION_DEC;
+            children.erase(children.begin());
+        }
+        else if (cursor.is(C_TOKEN::OPEN_BRACE)) {
+            kind = NODE_KIND::FUNCTION_DEF;
+            children[0] = parse_code_block(cursor, tree);
+        }
+        else {
+            cursor.error("expected ; or { after the parameters of " + cursor.text(name_token));
         }
-        start_index = end_index;
+
+        NODE_ID function = tree.add(kind, children, location);
+        tree[function].type = type;
+        tree[function].name = name_token.id;
+        if (kind == NODE_KIND::FUNCTION_DEC) tree.function_declarations.push_back(function);
+        else tree.function_definitions.push_back(function);
+        return;
     }
+
+    NODE_ID assignment = parse_variable(cursor, tree, type, name_token, location);
+    cursor.expect(C_TOKEN::SEMICOLON);
+    tree.global_variable_assignments.push_back(assignment);
 }
 
-//TODO - MAKE ALL THE POINTERS INTO SHARED POINTERS
-// Still not sure about the pointing of nodes to other nodes in the tree
-// The structs containing vectors of structs alredy takes care of the tree structure...BUT!!!! you cant have generics with 
\ No newline at end of file
+void parse(const std::vector<TOKEN>& tokens, PARSE_TREE& parse_tree) {
+    //Convert list of tokens into an Abstract Syntax Tree
+    TOKEN_CURSOR cursor{ tokens, parse_tree.strings };
+    while (!cursor.at_end()) parse_top_level_statement(cursor, parse_tree);
+}
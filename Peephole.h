@@ -0,0 +1,466 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "Assembler.h"
+
+//
+//  Peephole optimizer
+//
+//  Runs on a parsed assembly_program, after the pseudo instructions are lowered and before encoding.
+//  Instructions refer to labels by name, so removing instructions only needs the label addresses to be
+//  recomputed. The rewrites are
+//
+//      ldi rX v                the register already holds v (within a basic block)
+//      cmp / adi rX 0 / ...    the result is discarded (r0 or unchanged register) and the flags are never read
+//      jmp .a   .a: jmp .b     jump threaded to .b (also for brh and cal)
+//      jmp .next               jump or branch to the next instruction
+//      str rA rB o / lod rA rC o   the load reads back the stored register (non MMIO addresses only)
+//      rules of a rule table   e.g. the rewrites Superoptimizer.h found, see below
+//
+//  Flag liveness is computed over the instruction level control flow graph. A CAL or RET is assumed to
+//  read both flags. If the program jumps to numeric addresses no instruction is removed, since the
+//  addresses could not be re-resolved.
+//
+
+struct peephole_report {
+    size_t instructions_before = 0;
+    size_t instructions_after = 0;
+    size_t redundant_loads = 0;
+    size_t dead_flag_writes = 0;
+    size_t threaded_jumps = 0;
+    size_t jumps_to_next = 0;
+    size_t forwarded_loads = 0;
+    size_t rule_rewrites = 0;
+
+    size_t saved() const { return instructions_before - instructions_after; }
+
+    void print() const {
+        std::cout << "Peephole: " << instructions_before << " -> " << instructions_after << " instructions (" << saved() << " saved)\n"
+                  << "  redundant ldi          " << redundant_loads << '\n'
+                  << "  unused flag writes     " << dead_flag_writes << '\n'
+                  << "  jumps threaded         " << threaded_jumps << '\n'
+                  << "  jumps to next removed  " << jumps_to_next << '\n'
+                  << "  loads after stores     " << forwarded_loads << '\n'
+                  << "  rule rewrites          " << rule_rewrites << '\n';
+    }
+};
+
+static constexpr uint8_t FLAG_Z = 1;
+static constexpr uint8_t FLAG_C = 2;
+
+static uint8_t flags_read(const decoded_instruction& ins) {
+    if (ins.opcode == 11) return (ins.cond <= 1) ? FLAG_Z : FLAG_C;
+    if (ins.opcode == 12 || ins.opcode == 13) return FLAG_Z | FLAG_C;
+    return 0;
+}
+
+static uint8_t flags_written(const decoded_instruction& ins) {
+    if (ins.opcode == 2 || ins.opcode == 3 || ins.opcode == 9) return FLAG_Z | FLAG_C;
+    if (ins.opcode >= 4 && ins.opcode <= 6) return FLAG_Z;
+    return 0;
+}
+
+//register written by the instruction, 0 if none (writes to r0 are discarded anyway)
+static uint8_t register_written(const decoded_instruction& ins) {
+    if (ins.opcode >= 2 && ins.opcode <= 7) return ins.regC;
+    if (ins.opcode == 8 || ins.opcode == 9) return ins.regA;
+    if (ins.opcode == 14) return ins.regB;
+    return 0;
+}
+
+static std::string register_name(uint8_t reg) {
+    return "r" + std::to_string(reg);
+}
+
+//
+//  Rule tables
+//
+//  A rule replaces a sequence of register instructions (add sub nor and xor rsh ldi adi) by a shorter one. Its
+//  registers r1, r2, ... are variables that match distinct registers, r0 only matches r0, and immediates match
+//  exactly. preserved_flags are the flags the replacement leaves as the pattern does, the rule only applies where
+//  the others are not read afterwards. One rule per line,
+//
+//      zc : add r1 r0 r2 ; add r2 r0 r1 => add r1 r0 r2
+//
+//  with the preserved flags zc, z, c or - before the colon, an empty replacement removes the pattern. Lines
+//  starting with # are comments.
+//
+
+struct peephole_rule {
+    std::vector<decoded_instruction> pattern;
+    std::vector<decoded_instruction> replacement;
+    uint8_t preserved_flags = FLAG_Z | FLAG_C;
+
+    size_t saved() const { return pattern.size() - replacement.size(); }
+};
+
+static bool is_rule_instruction(const decoded_instruction& ins) {
+    return ins.opcode >= 2 && ins.opcode <= 9;
+}
+
+//the registers the instructions name, as a mask
+static uint16_t rule_registers(const std::vector<decoded_instruction>& sequence) {
+    uint16_t registers = 0;
+    for (const decoded_instruction& ins : sequence) {
+        registers |= 1 << ins.regA;
+        if (ins.opcode <= 7) registers |= 1 << ins.regC;
+        if (ins.opcode <= 6) registers |= 1 << ins.regB;
+    }
+    return registers;
+}
+
+static std::vector<std::string> rule_instruction_line(const decoded_instruction& ins, const uint8_t registers[16]) {
+    static const char* mnemonics[] = { "nop", "hlt", "add", "sub", "nor", "and", "xor", "rsh", "ldi", "adi" };
+    if (ins.opcode == 7) return { mnemonics[7], register_name(registers[ins.regA]), register_name(registers[ins.regC]) };
+    if (ins.opcode == 8 || ins.opcode == 9) return { mnemonics[ins.opcode], register_name(registers[ins.regA]), std::to_string(ins.imm) };
+    return { mnemonics[ins.opcode], register_name(registers[ins.regA]), register_name(registers[ins.regB]), register_name(registers[ins.regC]) };
+}
+
+static std::string rule_sequence_str(const std::vector<decoded_instruction>& sequence) {
+    static const uint8_t identity[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    std::string str;
+    for (const decoded_instruction& ins : sequence) {
+        if (!str.empty()) str += " ; ";
+        std::vector<std::string> line = rule_instruction_line(ins, identity);
+        for (size_t i = 0; i < line.size(); i++) str += (i == 0 ? "" : " ") + line[i];
+    }
+    return str;
+}
+
+static std::string peephole_rule_str(const peephole_rule& rule) {
+    std::string flags;
+    if (rule.preserved_flags & FLAG_Z) flags += 'z';
+    if (rule.preserved_flags & FLAG_C) flags += 'c';
+    if (flags.empty()) flags = "-";
+    std::string replacement = rule_sequence_str(rule.replacement);
+    return flags + " : " + rule_sequence_str(rule.pattern) + " =>" + (replacement.empty() ? "" : " ") + replacement;
+}
+
+static std::vector<decoded_instruction> parse_rule_sequence(const std::string& text) {
+    std::vector<decoded_instruction> sequence;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, ';')) {
+        std::vector<std::string> tokens;
+        std::stringstream words(part);
+        for (std::string word; words >> word;) tokens.push_back(word);
+        if (tokens.empty()) continue;
+
+        decoded_instruction ins = decode_instruction(encode_instruction(tokens, default_assembly_symbols()));
+        size_t operands = (ins.opcode == 7 || ins.opcode == 8 || ins.opcode == 9) ? 2 : 3;
+        if (!is_rule_instruction(ins) || tokens.size() != operands + 1) throw std::runtime_error("Not a register instruction in a peephole rule : " + part);
+        sequence.push_back(ins);
+    }
+    return sequence;
+}
+
+static peephole_rule parse_peephole_rule(const std::string& line) {
+    size_t colon = line.find(':');
+    size_t arrow = line.find("=>");
+    if (colon == std::string::npos || arrow == std::string::npos || arrow < colon) throw std::runtime_error("Malformed peephole rule : " + line);
+
+    peephole_rule rule;
+    rule.preserved_flags = 0;
+    for (char flag : line.substr(0, colon)) {
+        if (flag == 'z') rule.preserved_flags |= FLAG_Z;
+        else if (flag == 'c') rule.preserved_flags |= FLAG_C;
+    }
+    rule.pattern = parse_rule_sequence(line.substr(colon + 1, arrow - colon - 1));
+    rule.replacement = parse_rule_sequence(line.substr(arrow + 2));
+    if (rule.pattern.empty() || rule.replacement.size() >= rule.pattern.size()) throw std::runtime_error("A peephole rule has to shorten its pattern : " + line);
+    if (rule_registers(rule.replacement) & ~rule_registers(rule.pattern) & ~1) throw std::runtime_error("A peephole rule replacement uses registers its pattern does not bind : " + line);
+    return rule;
+}
+
+//the rules of a table file, the ones that save the most first
+static std::vector<peephole_rule> load_peephole_rules(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) throw std::runtime_error("Can not open the rule table " + filename);
+
+    std::vector<peephole_rule> rules;
+    for (std::string line; std::getline(file, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos || line[line.find_first_not_of(" \t")] == '#') continue;
+        rules.push_back(parse_peephole_rule(line));
+    }
+    std::stable_sort(rules.begin(), rules.end(), [](const peephole_rule& a, const peephole_rule& b) { return a.saved() > b.saved(); });
+    return rules;
+}
+
+//binds the variables of the rule to the registers of the instructions at pc, false if the rule does not match
+static bool match_peephole_rule(const peephole_rule& rule, const std::vector<decoded_instruction>& decoded, size_t pc, uint8_t registers[16]) {
+    bool is_bound[16] = {};
+    bool is_used[16] = {};
+    auto bind = [&](uint8_t variable, uint8_t reg) {
+        if (variable == 0 || reg == 0) return variable == reg;
+        if (is_bound[variable]) return registers[variable] == reg;
+        if (is_used[reg]) return false;
+        is_bound[variable] = is_used[reg] = true;
+        registers[variable] = reg;
+        return true;
+    };
+
+    for (size_t i = 0; i < rule.pattern.size(); i++) {
+        const decoded_instruction& pattern = rule.pattern[i];
+        const decoded_instruction& ins = decoded[pc + i];
+        if (ins.opcode != pattern.opcode) return false;
+        if (ins.opcode == 8 || ins.opcode == 9) {
+            if (ins.imm != pattern.imm || !bind(pattern.regA, ins.regA)) return false;
+        }
+        else if (ins.opcode == 7) {
+            if (!bind(pattern.regA, ins.regA) || !bind(pattern.regC, ins.regC)) return false;
+        }
+        else if (!bind(pattern.regA, ins.regA) || !bind(pattern.regB, ins.regB) || !bind(pattern.regC, ins.regC)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool peephole_pass(assembly_program& program, peephole_report& report, const std::vector<peephole_rule>& rules) {
+    assembly_lines& instructions = program.instructions;
+    size_t size = instructions.size();
+    if (size == 0) return false;
+
+    std::vector<decoded_instruction> decoded(size);
+    for (size_t pc = 0; pc < size; pc++) decoded[pc] = decode_instruction(encode_instruction(instructions[pc], program.symbols));
+
+    //control flow targets, by label
+    bool has_absolute_targets = false;
+    std::vector<bool> is_block_start(size + 1, false);
+    is_block_start[0] = true;
+    for (const auto& [label, pc] : program.labels) {
+        if (pc <= size) is_block_start[pc] = true;
+    }
+    for (size_t pc = 0; pc < size; pc++) {
+        uint8_t opcode = decoded[pc].opcode;
+        if (opcode == 10 || opcode == 11 || opcode == 12) {
+            const std::string& target = instructions[pc][(opcode == 11) ? 2 : 1];
+            if (!program.labels.contains(target)) has_absolute_targets = true;
+        }
+        if (opcode == 1 || (opcode >= 10 && opcode <= 13)) is_block_start[pc + 1] = true;
+    }
+
+    //
+    //  Flag liveness, live_after[pc] = flags read on some path after pc before being overwritten
+    //
+    std::vector<uint8_t> live_in(size + 1, 0);
+    std::vector<uint8_t> live_after(size, 0);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = size; i-- > 0;) {
+            const decoded_instruction& ins = decoded[i];
+            uint8_t after = 0;
+            bool falls_through = !(ins.opcode == 1 || ins.opcode == 10 || ins.opcode == 13);
+            if (falls_through) after |= live_in[i + 1];
+            if ((ins.opcode == 10 || ins.opcode == 11) && ins.addr < size) after |= live_in[ins.addr];
+            if (ins.opcode == 13 || has_absolute_targets) after = FLAG_Z | FLAG_C;
+
+            uint8_t in = (after & ~flags_written(ins)) | flags_read(ins);
+            if (after != live_after[i] || in != live_in[i]) {
+                live_after[i] = after;
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<bool> remove(size, false);
+    std::vector<bool> rewritten(size, false);
+    bool modified = false;
+
+    //
+    //  Jump threading and jumps to the next instruction
+    //
+    for (size_t pc = 0; pc < size; pc++) {
+        uint8_t opcode = decoded[pc].opcode;
+        if (opcode != 10 && opcode != 11 && opcode != 12) continue;
+
+        size_t operand = (opcode == 11) ? 2 : 1;
+        std::string target = instructions[pc][operand];
+        int hops = 0;
+        while (program.labels.contains(target) && hops < 16) {
+            uint16_t target_pc = program.labels[target];
+            if (target_pc >= size || target_pc == pc || decoded[target_pc].opcode != 10) break;
+            const std::string& next_target = instructions[target_pc][1];
+            if (!program.labels.contains(next_target) || next_target == target) break;
+            target = next_target;
+            hops++;
+        }
+        if (target != instructions[pc][operand]) {
+            instructions[pc][operand] = target;
+            report.threaded_jumps++;
+            modified = true;
+        }
+
+        if (!has_absolute_targets && opcode != 12 && program.labels.contains(target) && program.labels[target] == pc + 1) {
+            remove[pc] = true;
+            report.jumps_to_next++;
+        }
+    }
+
+    //
+    //  Forward scan per basic block: known register constants and the last store
+    //
+    struct last_store {
+        bool is_valid = false;
+        uint8_t base_reg = 0;
+        uint8_t offset = 0;
+        uint8_t source_reg = 0;
+    };
+    std::optional<uint8_t> known[16];
+    last_store store;
+
+    for (size_t pc = 0; pc < size; pc++) {
+        if (is_block_start[pc]) {
+            for (std::optional<uint8_t>& value : known) value.reset();
+            store = {};
+        }
+        known[0] = 0;
+        const decoded_instruction& ins = decoded[pc];
+        uint8_t written = register_written(ins);
+
+        if (remove[pc]) continue;
+
+        if (!has_absolute_targets && ins.opcode == 8 && known[ins.regA] == ins.imm) {
+            remove[pc] = true;
+            report.redundant_loads++;
+            continue;
+        }
+
+        //results that go nowhere and flags that nobody reads
+        bool discards_result = (written == 0 && ins.opcode >= 2 && ins.opcode <= 9)
+                            || (ins.opcode == 9 && ins.imm == 0)
+                            || (ins.opcode == 2 && ins.regC == ins.regA && ins.regB == 0)
+                            || (ins.opcode == 2 && ins.regC == ins.regB && ins.regA == 0);
+        if (!has_absolute_targets && discards_result && (flags_written(ins) & live_after[pc]) == 0) {
+            remove[pc] = true;
+            report.dead_flag_writes++;
+            continue;
+        }
+
+        if (ins.opcode == 14 && store.is_valid && store.base_reg == ins.regA && store.offset == ins.offset && known[ins.regA]) {
+            int8_t signed_offset = (ins.offset & 0x8) ? (int8_t)(ins.offset | 0xF0) : (int8_t)ins.offset;
+            uint8_t address = (uint8_t)(*known[ins.regA] + signed_offset);
+            if (address < 240) {
+                if (ins.regB == store.source_reg) {
+                    if (!has_absolute_targets) {
+                        remove[pc] = true;
+                        report.forwarded_loads++;
+                        continue;
+                    }
+                }
+                else if ((live_after[pc] & (FLAG_Z | FLAG_C)) == 0) {
+                    //same length, but a register move instead of a memory access
+                    instructions[pc] = { "add", register_name(store.source_reg), "r0", register_name(ins.regB) };
+                    rewritten[pc] = true;
+                    report.forwarded_loads++;
+                    modified = true;
+                }
+            }
+        }
+
+        //update the known state
+        if (ins.opcode == 15) {
+            store = { true, ins.regA, ins.offset, ins.regB };
+        }
+        if (ins.opcode == 12) {
+            for (std::optional<uint8_t>& value : known) value.reset();
+            store = {};
+        }
+        if (written != 0) {
+            if (ins.opcode == 8) known[written] = ins.imm;
+            else if (ins.opcode == 9 && known[written]) known[written] = (uint8_t)(*known[written] + ins.imm);
+            else known[written].reset();
+
+            if (store.is_valid && (written == store.base_reg || written == store.source_reg)) store = {};
+        }
+    }
+
+    //
+    //  Rule table rewrites, within a basic block and on instructions the scans above left alone
+    //
+    for (size_t pc = 0; pc < size && !has_absolute_targets && !rules.empty(); pc++) {
+        if (remove[pc] || rewritten[pc] || !is_rule_instruction(decoded[pc])) continue;
+
+        for (const peephole_rule& rule : rules) {
+            size_t length = rule.pattern.size();
+            if (rule.pattern[0].opcode != decoded[pc].opcode || pc + length > size) continue;
+
+            bool is_window_free = true;
+            for (size_t i = pc; i < pc + length && is_window_free; i++) {
+                is_window_free = !remove[i] && !rewritten[i] && (i == pc || !is_block_start[i]);
+            }
+            uint8_t registers[16] = {};
+            if (!is_window_free || (live_after[pc + length - 1] & ~rule.preserved_flags) != 0 || !match_peephole_rule(rule, decoded, pc, registers)) continue;
+
+            for (size_t i = 0; i < length; i++) {
+                if (i < rule.replacement.size()) instructions[pc + i] = rule_instruction_line(rule.replacement[i], registers);
+                else remove[pc + i] = true;
+                rewritten[pc + i] = true;
+            }
+            report.rule_rewrites++;
+            modified = true;
+            pc += length - 1;
+            break;
+        }
+    }
+
+    //
+    //  Compact and move the labels onto the next kept instruction
+    //
+    std::vector<uint16_t> new_pc(size + 1, 0);
+    assembly_lines kept;
+    kept.reserve(size);
+    for (size_t pc = 0; pc < size; pc++) {
+        new_pc[pc] = (uint16_t)kept.size();
+        if (remove[pc]) {
+            modified = true;
+        }
+        else {
+            kept.push_back(std::move(instructions[pc]));
+        }
+    }
+    new_pc[size] = (uint16_t)kept.size();
+    instructions = std::move(kept);
+
+    program.jmp_location_names.clear();
+    for (auto& [label, pc] : program.labels) {
+        pc = (pc <= size) ? new_pc[pc] : pc;
+        program.symbols[label] = pc;
+        program.jmp_location_names[pc] = label;
+    }
+
+    return modified;
+}
+
+static peephole_report peephole_optimize(assembly_program& program, const std::vector<peephole_rule>& rules = {}) {
+    peephole_report report;
+    report.instructions_before = program.instructions.size();
+    for (int iteration = 0; iteration < 16 && peephole_pass(program, report, rules); iteration++);
+    report.instructions_after = program.instructions.size();
+    return report;
+}
+
+//rules_filename is an optional rule table, e.g. the one superoptimize_programs (Superoptimizer.h) writes
+static peephole_report assemble_optimized(const std::string& filename, const std::string& rules_filename = "") {
+    assembly_preprocessor preprocessor;
+    assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+    peephole_report report = peephole_optimize(program, rules_filename.empty() ? std::vector<peephole_rule>{} : load_peephole_rules(rules_filename));
+
+    std::vector<uint16_t> machine_code_instructions = encode_program(program);
+    write_machine_code(filename, machine_code_instructions);
+    print_listing(program, machine_code_instructions);
+    report.print();
+    return report;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+
+//
+//  STRING POOL
+//
+//  Every string is stored once and referred to by a 32 bit id, equal strings get equal ids.
+//  Id 0 is always the empty string.
+//  A pool belongs to one tree or one lexed file and is not locked, the front ends on different threads
+//  each intern into their own pool. The BASIC ast clears its pool after every line.
+//
+using str_id = uint32_t;
+static constexpr str_id NO_STR = UINT32_MAX;
+
+class string_pool {
+public:
+    string_pool() { intern(""); }
+
+    str_id intern(std::string_view str) {
+        auto found = ids.find(str);
+        if (found != ids.end()) return found->second;
+
+        str_id id = (str_id)strings.size();
+        const std::string& stored = strings.emplace_back(str); //deque elements never move, the key view stays valid
+        ids.emplace(std::string_view(stored), id);
+        return id;
+    }
+
+    //id of an already interned string, NO_STR if it was never interned
+    str_id find(std::string_view str) const {
+        auto found = ids.find(str);
+        return (found == ids.end()) ? NO_STR : found->second;
+    }
+
+    const std::string& get(str_id id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+
+    void clear() {
+        ids.clear();
+        strings.clear();
+        intern("");
+    }
+
+private:
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, str_id> ids;
+};
@@ -0,0 +1,528 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <optional>
+#include <unordered_set>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+
+#include "Assembler.h"
+#include "Peephole.h"
+
+//
+//  Superoptimizer
+//
+//  An offline search for the shortest sequence that is equivalent to a fragment of 2 to 6 register instructions
+//  (add sub nor and xor rsh ldi adi). The results are written as a rule table that the peephole optimizer applies
+//  (Peephole.h, assemble_optimized).
+//
+//  Fragments name their registers r1, r2, ... in order of appearance, so a rule covers every choice of distinct
+//  registers. The candidates are all sequences over the registers of the fragment, r0 and a few immediates (the
+//  ones of the fragment, their sums, differences and negations, 0, 1 and 255), shortest first. They are enumerated
+//  depth first on a batch of states, so every prefix is evaluated once, and a candidate that matches the fragment
+//  on the batch is verified on every value of the registers and flags that either sequence reads or only one of
+//  them writes. The batch is laid out by register and the ALU (the semantics of BatPU_emulator.cpp) is a loop over
+//  the lanes, which the compiler vectorizes. The flags are compared one by one, a rule that changes a flag only
+//  applies where it is not read afterwards.
+//
+//  The fragments are searched on a pool of threads. Every result, also that nothing shorter was found, is appended
+//  to the table file as it is found, and the fragments of the file are skipped, so an interrupted search resumes
+//  where it stopped.
+//
+
+using superopt_fragment = std::vector<decoded_instruction>;
+
+struct superopt_options {
+    size_t max_fragment_length = 6; //instructions of a fragment, at least 2
+    size_t max_length = 3;          //instructions of a replacement that are searched, the run time grows ~300x per instruction
+    uint8_t max_registers = 3;      //registers of a fragment besides r0, their values are verified exhaustively
+    size_t thread_count = 0;        //0 for one thread per hardware thread
+};
+
+struct superopt_report {
+    size_t fragments = 0;
+    size_t resumed = 0; //already in the table
+    size_t searched = 0;
+    size_t rules = 0;
+    uint64_t candidates = 0;    //sequences evaluated on the batch
+    uint64_t verifications = 0; //candidates that matched the batch and were verified on every input
+    double milliseconds = 0;
+
+    void print() const {
+        std::cout << "Superoptimizer: " << fragments << " fragments, " << resumed << " resumed, " << searched << " searched, "
+                  << rules << " rules, " << candidates << " candidates, " << verifications << " verified, " << milliseconds << " ms\n";
+    }
+};
+
+//
+//  Batch evaluation
+//
+
+static constexpr size_t SUPEROPT_LANES = 64;
+
+//one machine state per lane, laid out by register so that an instruction is a loop over the lanes
+struct superopt_batch {
+    alignas(64) uint8_t registers[16][SUPEROPT_LANES] = {};
+    alignas(64) uint8_t z[SUPEROPT_LANES] = {};
+    alignas(64) uint8_t c[SUPEROPT_LANES] = {};
+
+    void copy_from(const superopt_batch& other, uint8_t register_count) {
+        memcpy(registers[1], other.registers[1], register_count * SUPEROPT_LANES);
+        memcpy(z, other.z, SUPEROPT_LANES);
+        memcpy(c, other.c, SUPEROPT_LANES);
+    }
+};
+
+static void superopt_execute(const decoded_instruction& ins, superopt_batch& batch) {
+    //r0 is hardwired to zero, a result written to it is discarded
+    alignas(64) uint8_t discarded[SUPEROPT_LANES];
+    uint8_t written = (ins.opcode == 8 || ins.opcode == 9) ? ins.regA : ins.regC;
+    uint8_t* out = (written == 0) ? discarded : batch.registers[written];
+    const uint8_t* a = batch.registers[ins.regA];
+    const uint8_t* b = batch.registers[ins.regB];
+    uint8_t* z = batch.z;
+    uint8_t* c = batch.c;
+    uint8_t imm = ins.imm;
+
+    switch (ins.opcode) {
+    case 2:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint16_t result = a[i] + b[i];
+            out[i] = (uint8_t)result;
+            z[i] = (uint8_t)result == 0;
+            c[i] = result > 255;
+        }
+        break;
+    case 3:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint16_t result = a[i] + (uint8_t)~b[i] + 1;
+            out[i] = (uint8_t)result;
+            z[i] = (uint8_t)result == 0;
+            c[i] = result > 255;
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint8_t result = ~(a[i] | b[i]);
+            out[i] = result;
+            z[i] = result == 0;
+        }
+        break;
+    case 5:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint8_t result = a[i] & b[i];
+            out[i] = result;
+            z[i] = result == 0;
+        }
+        break;
+    case 6:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint8_t result = a[i] ^ b[i];
+            out[i] = result;
+            z[i] = result == 0;
+        }
+        break;
+    case 7:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) out[i] = a[i] >> 1;
+        break;
+    case 8:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) out[i] = imm;
+        break;
+    case 9:
+        for (size_t i = 0; i < SUPEROPT_LANES; i++) {
+            uint16_t result = a[i] + imm;
+            out[i] = (uint8_t)result;
+            z[i] = (uint8_t)result == 0;
+            c[i] = result > 255;
+        }
+        break;
+    }
+}
+
+static bool superopt_rows_equal(const uint8_t* a, const uint8_t* b, size_t length) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+//the flags that are equal in every lane, or -1 if a register differs
+static int superopt_compare(const superopt_batch& a, const superopt_batch& b, uint8_t register_count) {
+    if (!superopt_rows_equal(a.registers[1], b.registers[1], register_count * SUPEROPT_LANES)) return -1;
+    return (superopt_rows_equal(a.z, b.z, SUPEROPT_LANES) ? FLAG_Z : 0) | (superopt_rows_equal(a.c, b.c, SUPEROPT_LANES) ? FLAG_C : 0);
+}
+
+//
+//  Fragments
+//
+
+//renames the registers to r1, r2, ... in order of appearance, false if there are more than max_registers
+static bool canonicalize_fragment(superopt_fragment& fragment, uint8_t max_registers) {
+    uint8_t names[16] = {};
+    uint8_t count = 0;
+    auto rename = [&](uint8_t& reg) {
+        if (reg == 0) return;
+        if (names[reg] == 0) names[reg] = ++count;
+        reg = names[reg];
+    };
+    for (decoded_instruction& ins : fragment) {
+        if (ins.opcode == 8 || ins.opcode == 9) {
+            rename(ins.regA);
+            ins = decode_instruction(ins.opcode << 12 | ins.regA << 8 | ins.imm);
+        }
+        else if (ins.opcode == 7) {
+            rename(ins.regA);
+            rename(ins.regC);
+            ins = decode_instruction(ins.opcode << 12 | ins.regA << 8 | ins.regC);
+        }
+        else {
+            rename(ins.regA);
+            rename(ins.regB);
+            rename(ins.regC);
+            ins = decode_instruction(ins.opcode << 12 | ins.regA << 8 | ins.regB << 4 | ins.regC);
+        }
+    }
+    return count <= max_registers;
+}
+
+//the highest register of a canonical fragment, which is the number of registers besides r0
+static uint8_t fragment_register_count(const superopt_fragment& fragment) {
+    return (uint8_t)(std::bit_width(rule_registers(fragment)) - 1);
+}
+
+//the distinct fragments of straight line register instructions within the basic blocks of a program
+static std::vector<superopt_fragment> collect_superopt_fragments(const assembly_program& program, const superopt_options& options = {}) {
+    size_t size = program.instructions.size();
+    std::vector<decoded_instruction> decoded(size);
+    for (size_t pc = 0; pc < size; pc++) decoded[pc] = decode_instruction(encode_instruction(program.instructions[pc], program.symbols));
+
+    std::vector<bool> is_block_start(size + 1, false);
+    for (const auto& [label, pc] : program.labels) {
+        if (pc <= size) is_block_start[pc] = true;
+    }
+
+    std::vector<superopt_fragment> fragments;
+    std::unordered_set<std::string> seen;
+    for (size_t pc = 0; pc < size; pc++) {
+        for (size_t length = 1; length <= options.max_fragment_length && pc + length <= size; length++) {
+            size_t last = pc + length - 1;
+            if (!is_rule_instruction(decoded[last]) || (length > 1 && is_block_start[last])) break;
+            if (length < 2) continue;
+
+            superopt_fragment fragment(decoded.begin() + pc, decoded.begin() + pc + length);
+            if (canonicalize_fragment(fragment, options.max_registers) && seen.insert(rule_sequence_str(fragment)).second) {
+                fragments.push_back(std::move(fragment));
+            }
+        }
+    }
+    return fragments;
+}
+
+//
+//  Search
+//
+
+class superopt_search {
+public:
+    superopt_search(const superopt_fragment& fragment, const superopt_options& options)
+        : fragment(fragment), register_count(std::max<uint8_t>(fragment_register_count(fragment), 1)) {
+        max_length = std::min(fragment.size() - 1, options.max_length);
+
+        //random lanes, with the edge values in the first ones
+        std::mt19937 rng((uint32_t)std::hash<std::string>{}(rule_sequence_str(fragment)));
+        static const uint8_t edges[] = { 0, 1, 127, 128, 255, 254 };
+        for (size_t lane = 0; lane < SUPEROPT_LANES; lane++) {
+            for (uint8_t reg = 1; reg <= register_count; reg++) {
+                inputs.registers[reg][lane] = (lane < 6) ? edges[(lane + reg) % 6] : (uint8_t)rng();
+            }
+            inputs.z[lane] = (lane >> 0) & 1;
+            inputs.c[lane] = (lane >> 1) & 1;
+        }
+        target.copy_from(inputs, register_count);
+        for (const decoded_instruction& ins : fragment) superopt_execute(ins, target);
+
+        add_candidate_instructions();
+    }
+
+    //the rules that shorten the fragment, at most one per set of preserved flags
+    std::vector<peephole_rule> run() {
+        levels.resize(max_length + 1);
+        levels[0].copy_from(inputs, register_count);
+        for (size_t length = 0; length <= max_length && !best[FLAG_Z | FLAG_C]; length++) {
+            sequence.clear();
+            search(length);
+        }
+
+        //a fragment that ends in a comparison is there for its flags
+        uint8_t needed_flags = (register_written(fragment.back()) == 0) ? flags_written(fragment.back()) : 0;
+
+        std::vector<peephole_rule> rules;
+        for (uint8_t flags : { 3, 1, 2, 0 }) {
+            if (!best[flags] || (flags & needed_flags) != needed_flags) continue;
+            //only if it is shorter than what a rule preserving more flags does
+            bool is_shorter = best[flags]->size() < fragment.size();
+            for (uint8_t more = 0; more < 4; more++) {
+                if ((more & flags) == flags && more != flags && best[more]) is_shorter = is_shorter && best[flags]->size() < best[more]->size();
+            }
+            if (is_shorter) rules.push_back({ fragment, *best[flags], flags });
+        }
+        return rules;
+    }
+
+    size_t searched_length() const { return max_length; }
+
+    uint64_t candidates = 0;
+    uint64_t verifications = 0;
+
+private:
+    void add_candidate_instructions() {
+        std::vector<uint8_t> immediates = { 0, 1, 255 };
+        std::vector<uint8_t> fragment_immediates;
+        for (const decoded_instruction& ins : fragment) {
+            if (ins.opcode == 8 || ins.opcode == 9) fragment_immediates.push_back(ins.imm);
+        }
+        for (uint8_t a : fragment_immediates) {
+            immediates.push_back(a);
+            immediates.push_back((uint8_t)-a);
+            for (uint8_t b : fragment_immediates) {
+                immediates.push_back((uint8_t)(a + b));
+                immediates.push_back((uint8_t)(a - b));
+            }
+        }
+        std::sort(immediates.begin(), immediates.end());
+        immediates.erase(std::unique(immediates.begin(), immediates.end()), immediates.end());
+
+        //the ones that leave the flags alone first, so they are preferred among sequences of the same length
+        auto add = [&](uint16_t word) { candidate_instructions.push_back(decode_instruction(word)); };
+        for (uint16_t a = 1; a <= register_count; a++) {
+            for (uint16_t c = 1; c <= register_count; c++) add(7 << 12 | a << 8 | c);
+            for (uint8_t imm : immediates) add(8 << 12 | a << 8 | imm);
+        }
+        for (uint16_t opcode = 2; opcode <= 6; opcode++) {
+            bool is_commutative = opcode != 3;
+            for (uint16_t a = 0; a <= register_count; a++) {
+                for (uint16_t b = is_commutative ? a : 0; b <= register_count; b++) {
+                    //a result written to r0 still sets the flags
+                    for (uint16_t c = 0; c <= register_count; c++) add(opcode << 12 | a << 8 | b << 4 | c);
+                }
+            }
+        }
+        for (uint16_t a = 1; a <= register_count; a++) {
+            for (uint8_t imm : immediates) add(9 << 12 | a << 8 | imm);
+        }
+    }
+
+    void search(size_t length) {
+        size_t depth = sequence.size();
+        if (depth == length) {
+            candidates++;
+            int flags = superopt_compare(levels[depth], target, register_count);
+            if (flags >= 0 && is_wanted(flags)) {
+                verifications++;
+                int verified = verify(sequence);
+                for (uint8_t wanted = 0; verified >= 0 && wanted < 4; wanted++) {
+                    if ((wanted & verified) == wanted && !best[wanted]) best[wanted] = sequence;
+                }
+            }
+            return;
+        }
+
+        for (const decoded_instruction& ins : candidate_instructions) {
+            superopt_batch& next = levels[depth + 1];
+            next.copy_from(levels[depth], register_count);
+            superopt_execute(ins, next);
+            //an instruction that changes nothing in the batch can not be part of the shortest sequence
+            if (superopt_compare(next, levels[depth], register_count) == (FLAG_Z | FLAG_C)) continue;
+
+            sequence.push_back(ins);
+            search(length);
+            sequence.pop_back();
+            if (best[FLAG_Z | FLAG_C]) return;
+        }
+    }
+
+    //a set of preserved flags that the candidate matches on the batch and that has no sequence yet
+    bool is_wanted(int flags) const {
+        for (uint8_t wanted = 0; wanted < 4; wanted++) {
+            if ((wanted & flags) == wanted && !best[wanted]) return true;
+        }
+        return false;
+    }
+
+    struct sequence_effects {
+        uint32_t read = 0;    //registers read before they are written
+        uint32_t written = 0; //registers and flags, the flags in bits 16 and 17
+    };
+
+    static sequence_effects effects(const std::vector<decoded_instruction>& instructions) {
+        sequence_effects effects;
+        auto read = [&](uint8_t reg) { if (!(effects.written & (1u << reg))) effects.read |= 1u << reg; };
+        for (const decoded_instruction& ins : instructions) {
+            if (ins.opcode != 8) read(ins.regA);
+            if (ins.opcode >= 2 && ins.opcode <= 6) read(ins.regB);
+            effects.written |= 1u << register_written(ins);
+            effects.written |= (uint32_t)flags_written(ins) << 16;
+        }
+        return effects;
+    }
+
+    //the flags that are equal on every relevant input, or -1 if a register differs on one
+    int verify(const std::vector<decoded_instruction>& candidate) {
+        sequence_effects fragment_effects = effects(fragment);
+        sequence_effects candidate_effects = effects(candidate);
+        //the initial value matters if a sequence reads it, or if only one of them overwrites it
+        uint32_t relevant = (fragment_effects.read | candidate_effects.read | (fragment_effects.written ^ candidate_effects.written)) & ~1u;
+
+        std::vector<uint8_t*> bytes;
+        std::vector<uint8_t*> bits;
+        for (uint8_t reg = 1; reg <= register_count; reg++) {
+            if (relevant & (1u << reg)) bytes.push_back(verify_inputs.registers[reg]);
+        }
+        if (relevant & (FLAG_Z << 16)) bits.push_back(verify_inputs.z);
+        if (relevant & (FLAG_C << 16)) bits.push_back(verify_inputs.c);
+
+        verify_inputs = {};
+        uint64_t total = 1ull << (8 * bytes.size() + bits.size());
+        int flags = FLAG_Z | FLAG_C;
+        for (uint64_t first = 0; first < total; first += SUPEROPT_LANES) {
+            for (size_t lane = 0; lane < SUPEROPT_LANES; lane++) {
+                uint64_t input = (first + lane) % total;
+                for (uint8_t* bit : bits) {
+                    bit[lane] = input & 1;
+                    input >>= 1;
+                }
+                for (uint8_t* byte : bytes) {
+                    byte[lane] = (uint8_t)input;
+                    input >>= 8;
+                }
+            }
+            verify_fragment.copy_from(verify_inputs, register_count);
+            verify_candidate.copy_from(verify_inputs, register_count);
+            for (const decoded_instruction& ins : fragment) superopt_execute(ins, verify_fragment);
+            for (const decoded_instruction& ins : candidate) superopt_execute(ins, verify_candidate);
+
+            int equal = superopt_compare(verify_fragment, verify_candidate, register_count);
+            if (equal < 0) return -1;
+            flags &= equal;
+        }
+        return flags;
+    }
+
+    const superopt_fragment& fragment;
+    uint8_t register_count;
+    size_t max_length = 0;
+    std::vector<decoded_instruction> candidate_instructions;
+    superopt_batch inputs, target;
+    superopt_batch verify_inputs, verify_fragment, verify_candidate;
+    std::vector<superopt_batch> levels;
+    std::vector<decoded_instruction> sequence;
+    std::array<std::optional<std::vector<decoded_instruction>>, 4> best; //the shortest sequence by preserved flags
+};
+
+//
+//  Table files
+//
+//  A fragment without a shorter sequence is recorded as a comment with the replacement length that was searched,
+//
+//      # searched 3 : add r1 r2 r3 ; xor r3 r1 r2
+//
+
+static std::string superopt_table_key(const std::string& line, size_t& searched_length) {
+    static const std::string searched = "# searched ";
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return "";
+    if (line.starts_with(searched)) {
+        searched_length = std::stoul(line.substr(searched.size(), colon - searched.size()));
+        return line.substr(colon + 2);
+    }
+    if (line.starts_with("#")) return "";
+
+    //a rule is the shortest sequence, it can not be improved by searching longer ones
+    size_t arrow = line.find(" =>");
+    searched_length = SIZE_MAX;
+    return (arrow == std::string::npos) ? "" : line.substr(colon + 2, arrow - colon - 2);
+}
+
+//Searches the fragments that the table does not have yet and appends the results to it.
+static superopt_report superoptimize(const std::vector<superopt_fragment>& fragments, const std::string& table_filename, const superopt_options& options = {}) {
+    auto start = std::chrono::steady_clock::now();
+    superopt_report report;
+    report.fragments = fragments.size();
+
+    std::unordered_map<std::string, size_t> searched;
+    {
+        std::ifstream table(table_filename);
+        for (std::string line; std::getline(table, line);) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t length = 0;
+            std::string key = superopt_table_key(line, length);
+            if (!key.empty()) searched[key] = std::max(searched[key], length);
+        }
+    }
+
+    std::vector<const superopt_fragment*> pending;
+    for (const superopt_fragment& fragment : fragments) {
+        auto entry = searched.find(rule_sequence_str(fragment));
+        if (entry != searched.end() && entry->second >= std::min(fragment.size() - 1, options.max_length)) report.resumed++;
+        else pending.push_back(&fragment);
+    }
+
+    size_t thread_count = (options.thread_count == 0) ? std::max(1u, std::thread::hardware_concurrency()) : options.thread_count;
+    thread_count = std::max<size_t>(1, std::min(thread_count, pending.size()));
+
+    std::ofstream table(table_filename, std::ios::app);
+    if (!table) throw std::runtime_error("Can not open the rule table " + table_filename);
+    std::mutex table_mutex;
+    std::atomic<size_t> next_fragment = 0;
+
+    auto worker = [&]() {
+        for (size_t i = next_fragment++; i < pending.size(); i = next_fragment++) {
+            superopt_search search(*pending[i], options);
+            std::vector<peephole_rule> rules = search.run();
+
+            //a whole fragment at a time, so an interrupted search leaves complete lines
+            std::lock_guard<std::mutex> lock(table_mutex);
+            for (const peephole_rule& rule : rules) table << peephole_rule_str(rule) << '\n';
+            if (rules.empty()) table << "# searched " << search.searched_length() << " : " << rule_sequence_str(*pending[i]) << '\n';
+            table.flush();
+            report.searched++;
+            report.rules += rules.size();
+            report.candidates += search.candidates;
+            report.verifications += search.verifications;
+        }
+    };
+
+    //the calling thread is one of the workers
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < thread_count; i++) pool.emplace_back(worker);
+    worker();
+    for (std::thread& thread : pool) thread.join();
+
+    report.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+//Collects the fragments of the programs (.as files) and searches them, see superoptimize.
+static superopt_report superoptimize_programs(const std::vector<std::string>& filenames, const std::string& table_filename, const superopt_options& options = {}) {
+    std::vector<superopt_fragment> fragments;
+    std::unordered_set<std::string> seen;
+    for (const std::string& filename : filenames) {
+        assembly_preprocessor preprocessor;
+        assembly_program program = parse_assembly(preprocessor.preprocess_file(filename + ".as"));
+        for (superopt_fragment& fragment : collect_superopt_fragments(program, options)) {
+            if (seen.insert(rule_sequence_str(fragment)).second) fragments.push_back(std::move(fragment));
+        }
+    }
+    superopt_report report = superoptimize(fragments, table_filename, options);
+    report.print();
+    return report;
+}
@@ -1,7 +1,16 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <deque>
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
 
-enum class TOKEN_TYPE {
+#include "StringPool.h"
+
+enum class TOKEN_TYPE : uint8_t {
     KEYWORD, OPERATOR, LITERAL, IDENTIFIER
 };
 
@@ -16,12 +25,99 @@ static std::string token_type_to_str(TOKEN_TYPE type) {
     }
 }
 
+//keywords and operators are resolved when they are lexed, the parser compares kinds instead of strings.
+//Identifiers and literals are NONE.
+enum class C_TOKEN : uint8_t {
+    NONE,
+    //keywords
+    BREAK, BOOL, CHAR, CONTINUE, DO, ELSE, FLOAT, FOR, GOTO, IF, INT, LONG, RETURN, SHORT, SIGNED, UNSIGNED, VOID, WHILE,
+    //operators
+    ADD, SUB, MUL, DIV, MOD, INC, DEC, ASSIGN, ADD_ASSIGN, SUB_ASSIGN, MUL_ASSIGN, DIV_ASSIGN, MOD_ASSIGN,
+    EQUALS, GREATER_THAN, LESS_THAN, NOT_EQUALS, GREATER_THAN_OR_EQUALS, LESS_THAN_OR_EQUALS,
+    AND, OR, NOT, BIT_AND, BIT_OR, BIT_XOR, BIT_NOT, LSH, RSH,
+    COMMA, DOT, OPEN_PAREN, CLOSE_PAREN, OPEN_BRACE, CLOSE_BRACE, OPEN_BRACKET, CLOSE_BRACKET, SEMICOLON,
+    COUNT
+};
+
+static constexpr C_TOKEN FIRST_C_OPERATOR = C_TOKEN::ADD;
+
+static constexpr std::array<std::string_view, (size_t)C_TOKEN::COUNT> c_token_texts = {
+    "",
+    "break","bool","char","continue","do","else","float","for","goto","if","int","long","return","short","signed","unsigned","void","while",
+    "+","-","*","/","%","++","--","=","+=","-=","*=","/=","%=",
+    "==",">","<","!=",">=","<=",
+    "&&","||","!","&","|","^","~","<<",">>",
+    ",",".","(",")","{","}","[","]",";",
+};
+
+static std::string_view c_token_text(C_TOKEN kind) {
+    return c_token_texts[(size_t)kind];
+}
+
+//the keyword or operator spelled text, NONE for anything else
+static C_TOKEN c_token_kind(std::string_view text) {
+    static const std::unordered_map<std::string_view, C_TOKEN> kinds = [] {
+        std::unordered_map<std::string_view, C_TOKEN> map;
+        for (size_t kind = 1; kind < c_token_texts.size(); kind++) map.emplace(c_token_texts[kind], (C_TOKEN)kind);
+        return map;
+    }();
+    auto found = kinds.find(text);
+    return (found == kinds.end()) ? C_TOKEN::NONE : found->second;
+}
+
+//guards the source file names and the lexed file cache, the C front end can run on several threads
+static std::mutex& source_cache_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+//names of the files that were lexed, SOURCE_LOCATION keeps an index into it
+static std::deque<std::string>& source_file_names() {
+    static std::deque<std::string> names;
+    return names;
+}
+
+//the index of a file in source_file_names, a file that is lexed again keeps its index
+static uint16_t source_file_index(const std::string& path) {
+    static std::unordered_map<std::string, uint16_t> indices;
+    std::lock_guard<std::mutex> lock(source_cache_mutex());
+    auto found = indices.find(path);
+    if (found != indices.end()) return found->second;
+
+    if (source_file_names().size() > UINT16_MAX)
+        throw std::runtime_error("More than 65536 source files : " + path);
+    uint16_t index = (uint16_t)source_file_names().size();
+    source_file_names().push_back(path);
+    indices.emplace(path, index);
+    return index;
+}
+
+struct SOURCE_LOCATION {
+    uint32_t line = 0;
+    uint16_t column = 0;
+    uint16_t file = 0;
+
+    std::string str() const {
+        std::string filename = "?";
+        {
+            std::lock_guard<std::mutex> lock(source_cache_mutex());
+            if (file < source_file_names().size()) filename = source_file_names()[file];
+        }
+        return filename + ":" + std::to_string(line) + ":" + std::to_string(column);
+    }
+};
+
+//16 bytes, the text is interned in the string pool of the lexed file, or of the parse tree once it is tokenized
 struct TOKEN {
-    std::string value;
-    TOKEN_TYPE type;
+    str_id id = 0;
+    TOKEN_TYPE type = TOKEN_TYPE::IDENTIFIER;
+    C_TOKEN kind = C_TOKEN::NONE;
+    SOURCE_LOCATION location;
 
-    TOKEN(std::string value, TOKEN_TYPE type) :
-        value(value), type(type)
+    TOKEN(str_id id, TOKEN_TYPE type, C_TOKEN kind = C_TOKEN::NONE, SOURCE_LOCATION location = {}) :
+        id(id), type(type), kind(kind), location(location)
     {
     }
 };
+
+static_assert(sizeof(TOKEN) == 16);
@@ -1,362 +1,141 @@
 #pragma once
 #include <string>
-
-static bool try_parse_int(const std::string& str) {
-    if (str.empty()) return false;
-
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
-
-    for (int index = (int)str.length() - 1; index >= stop_index; index--) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57)) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-static bool try_parse_hex(const std::string& str) {
-    if (str.length() < 2) return false;
-    if (str[0] != '0' || str[1] != 'x') return false;
-
-    for (size_t index = str.length() - 1; index > 1; index--) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57) || !(c >= 65 && c <= 70) || !(c >= 97 && c <= 102)) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-static bool try_parse_dbl(const std::string& str) {
-    if (str.empty()) return false;
-
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
-
-    int dec_place_index = -1;
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == '.') {
-            dec_place_index = i;
-            break;
-        }
-    }
-
-    if (dec_place_index == -1) {
-        return try_parse_int(str);
-    }
-
-    for (int index = dec_place_index - 1; index >= stop_index; index--) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57)) {
-            return false;
-        }
-    }
-
-    for (int index = dec_place_index + 1; index < str.length(); index++) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57)) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-static bool try_parse_flt(const std::string& str) {
-    if (str.empty()) return false;
-    if (str.back() != 'f' && str.back() != 'F')
-        return false;
-
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
-
-    int dec_place_index = -1;
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == '.') {
-            dec_place_index = i;
-            break;
-        }
-    }
-
-    if (dec_place_index == -1) {
-        return try_parse_int(str);
-    }
-
-    for (int index = dec_place_index - 1; index >= stop_index; index--) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57)) {
-            return false;
-        }
-    }
-
-    for (int index = dec_place_index + 1; index < str.length() - 1; index++) {
-        char c = str[index];
-        if (!(c >= 48 && c <= 57)) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-static bool try_parse_bin(const std::string& str) {
-    if (str.length() < 2)
-        return false;
-    if (str[0] != '0' || str[1] != 'b')
-        return false;
-
-    for (size_t index = str.length() - 1; index > 1; index--) {
-        char c = str[index];
-        if (c != '1' && c != '0') {
-            return false;
-        }
-    }
-    return true;
-}
-
-
-
-static bool try_parse_int(const std::string& str, int* result) {
-    if (str.empty()) return false;
-
-    bool is_negative = false;
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        is_negative = true;
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
-    
-    int factor = 1;
-    *result = 0;
-
-    for (int index = (int)str.length()-1; index >= stop_index; index--) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 10;
-        }
-        else {
-            return false;
-        }
-    }
-
-    if (is_negative)
-        *result *= -1;
-
-    return true;
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+
+//
+//  Numeric literals
+//
+//  scan_numeric_literal classifies and converts a literal in one pass over its characters:
+//      INT     123  -7  +7  10u  10UL              decimal, leading zeros are decimal
+//      HEX     0x1F  0XffU
+//      BIN     0b1010  0B1u
+//      DBL     1.5  .5  1.  1e3  1.5E-3
+//      FLT     a DBL with an f or F suffix, 1.5f  1e3F
+//  Integers accept any combination of one u/U and up to two l/L suffixes. The digits are converted with
+//  std::from_chars, an integer whose magnitude does not fit in 32 bits and a real that does not fit its
+//  type set overflow instead of wrapping.
+//
+
+enum class numeric_kind : uint8_t {
+    NONE, INT, HEX, BIN, DBL, FLT
+};
+
+struct numeric_literal {
+    numeric_kind kind = numeric_kind::NONE;
+    bool is_unsigned = false;   //u or U suffix
+    bool overflow = false;
+    int64_t int_value = 0;      //INT, HEX and BIN, with the sign applied
+    double real_value = 0.0;    //DBL and FLT, a FLT is rounded to float
+
+    bool is_numeric() const { return kind != numeric_kind::NONE; }
+    bool is_integer() const { return kind == numeric_kind::INT || kind == numeric_kind::HEX || kind == numeric_kind::BIN; }
+    bool valid() const { return is_numeric() && !overflow; }
+
+    //the value fits a BatPU register as a signed or an unsigned byte
+    bool fits_register() const { return is_integer() && !overflow && int_value >= -128 && int_value <= 255; }
+};
+
+static bool is_decimal_digit(char c) {
+    return c >= '0' && c <= '9';
 }
 
-static bool try_parse_hex(const std::string& str, uint32_t* result) {
-    if (str.length() < 2) return false;
-    if (str[0] != '0' || str[1] != 'x') return false;
-
-    uint32_t factor = 1;
-    *result = 0;
-
-    for (size_t index = str.length()-1; index > 1; index--) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 16;
-        }
-        else if (c >= 65 && c <= 70) {
-            *result += (c - 55) * factor;
-            factor *= 16;
-        }
-        else if (c >= 97 && c <= 102) {
-            *result += (c - 87) * factor;
-            factor *= 16;
-        }
-        else {
-            return false;
-        }
-    }
-
-    return true;
+static bool is_digit_of_base(char c, int base) {
+    if (base == 2) return c == '0' || c == '1';
+    if (base == 16) return is_decimal_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    return is_decimal_digit(c);
 }
 
-static bool try_parse_dbl(const std::string& str, double* result) {
-    if (str.empty()) return false;
-
-    bool is_negative = false;
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        is_negative = true;
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
- 
-    int dec_place_index = -1;
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == '.') {
-            dec_place_index = i;
-            break;
-        }
-    }
-
-    if (dec_place_index == -1) {
-        int tmp_result = 0;
-        if (try_parse_int(str, &tmp_result)) {
-            *result = (double)tmp_result;
-            return true;
-        }
-        else {
-            return false;
-        }
-    }
-
-
-    double factor = 1.0;
-    *result = 0;
-
-    for (int index = dec_place_index - 1; index >= stop_index; index--) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 10.0;
-        }
-        else {
-            return false;
+//u, U, l, L, ul, lu, ull, llu ... at most one u and two l of the same case
+static bool is_integer_suffix(std::string_view suffix, bool& is_unsigned) {
+    size_t l_count = 0;
+    char l_char = 0;
+    for (char c : suffix) {
+        if (c == 'u' || c == 'U') {
+            if (is_unsigned) return false;
+            is_unsigned = true;
         }
-    }
-
-    factor = 0.1;
-    for (int index = dec_place_index + 1; index < str.length(); index++) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 0.1;
+        else if (c == 'l' || c == 'L') {
+            if (l_count == 2 || (l_count == 1 && c != l_char)) return false;
+            l_char = c;
+            l_count++;
         }
         else {
             return false;
         }
     }
-
-    if (is_negative)
-        *result *= -1;
-
     return true;
 }
 
-static bool try_parse_flt(const std::string& str, float* result) {
-    if (str.empty()) return false;
-    if (str.back() != 'f' && str.back()!='F')
-        return false;
+static numeric_literal scan_numeric_literal(std::string_view str) {
+    numeric_literal literal;
+    const char* first = str.data();
+    const char* last = str.data() + str.size();
 
     bool is_negative = false;
-    int stop_index = 0;
-
-    if (str[0] == '-') {
-        is_negative = true;
-        stop_index = 1;
-    }
-    else if (str[0] == '+') {
-        stop_index = 1;
-    }
-
-    int dec_place_index = -1;
-    for (int i = 0; i < str.length(); i++) {
-        if (str[i] == '.') {
-            dec_place_index = i;
-            break;
-        }
-    }
-
-    if (dec_place_index == -1) {
-        return try_parse_int(str);
-    }
-
-
-    float factor = 1.0f;
-    *result = 0;
-
-    for (int index = dec_place_index - 1; index >= stop_index; index--) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 10.0f;
-        }
-        else {
-            return false;
-        }
-    }
-
-    factor = 0.1f;
-    for (int index = dec_place_index + 1; index < str.length()-1; index++) {
-        char c = str[index];
-        if (c >= 48 && c <= 57) {
-            *result += (c - 48) * factor;
-            factor *= 0.1f;
+    if (first != last && (*first == '-' || *first == '+')) {
+        is_negative = *first == '-';
+        first++;
+    }
+    if (first == last) return literal;
+
+    //integer prefixes
+    int base = 10;
+    if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) base = 16;
+    else if (last - first > 2 && first[0] == '0' && (first[1] == 'b' || first[1] == 'B')) base = 2;
+    const char* digits = (base == 10) ? first : first + 2;
+
+    //mantissa digits, a fraction and an exponent are only allowed in decimal
+    const char* cursor = digits;
+    size_t digit_count = 0;
+    while (cursor != last && is_digit_of_base(*cursor, base)) { cursor++; digit_count++; }
+
+    bool is_real = false;
+    if (base == 10 && cursor != last && *cursor == '.') {
+        is_real = true;
+        cursor++;
+        while (cursor != last && is_decimal_digit(*cursor)) { cursor++; digit_count++; }
+    }
+    if (digit_count == 0) return literal;
+
+    if (base == 10 && cursor != last && (*cursor == 'e' || *cursor == 'E')) {
+        is_real = true;
+        cursor++;
+        if (cursor != last && (*cursor == '-' || *cursor == '+')) cursor++;
+        if (cursor == last || !is_decimal_digit(*cursor)) return literal;
+        while (cursor != last && is_decimal_digit(*cursor)) cursor++;
+    }
+
+    std::string_view suffix(cursor, last - cursor);
+    if (is_real) {
+        bool is_float = suffix == "f" || suffix == "F";
+        if (!suffix.empty() && !is_float) return literal;
+
+        //from_chars does not take a sign, the sign is applied afterwards
+        std::from_chars_result result;
+        if (is_float) {
+            float value = 0.0f;
+            result = std::from_chars(digits, cursor, value);
+            literal.real_value = value;
         }
         else {
-            return false;
+            result = std::from_chars(digits, cursor, literal.real_value);
         }
+        if (result.ptr != cursor) return literal;
+        literal.overflow = result.ec == std::errc::result_out_of_range;
+        if (is_negative) literal.real_value = -literal.real_value;
+        literal.kind = is_float ? numeric_kind::FLT : numeric_kind::DBL;
+        return literal;
     }
 
-    if (is_negative)
-        *result = -*result;;
-
-    return true;
-}
-
-static bool try_parse_bin(const std::string& str, uint32_t* result) {
-    if (str.length() < 2) 
-        return false;
-    if (str[0] != '0' || str[1] != 'b')
-        return false;
-
-    *result = 0;
-    int power = 0;
-
-    for (size_t index = str.length() - 1; index > 1; index--) {
-        char c = str[index];
-        if (c == '1') {
-            *result += 1 << power;
-        }
-        else if(c != '0') {
-            return false;
-        }
-        power++;
-    }
-    return true;
-}
-
-
+    if (!is_integer_suffix(suffix, literal.is_unsigned)) return literal;
 
-static bool is_numeric(const std::string& str) {
-    if (try_parse_int(str)) return true;
-    if (try_parse_dbl(str)) return true;
-    if (try_parse_flt(str)) return true;
-    if (try_parse_hex(str)) return true;
-    if (try_parse_bin(str)) return true;
-    return false;
+    uint64_t magnitude = 0;
+    std::from_chars_result result = std::from_chars(digits, cursor, magnitude, base);
+    if (result.ptr != cursor) return literal;
+    literal.overflow = result.ec == std::errc::result_out_of_range || magnitude > UINT32_MAX;
+    if (!literal.overflow) literal.int_value = is_negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    literal.kind = (base == 16) ? numeric_kind::HEX : (base == 2) ? numeric_kind::BIN : numeric_kind::INT;
+    return literal;
 }